@@ -0,0 +1,175 @@
+#ifndef AUX_BUFFERS_H
+#define AUX_BUFFERS_H
+
+// Auxiliary buffers: what the raymarcher knows about each pixel besides its
+// color, for compositing and for looking at where the steps go.
+//
+// The channels of a pixel are
+//   depth     distance along the camera axis (z in camera space),
+//             -1 for the background
+//   normal    x, y and z of the surface normal, 0 for the background
+//   steps     raymarching steps
+//   ao        ambient occlusion (1: none)
+//
+// They are written as 32-bit floats to a file with a header in the style of
+// PFM (text lines, then the data):
+//   AUX
+//   width height channels
+//   depth normal_x normal_y normal_z steps ao
+//   -1.0
+// The scale is -1.0 for little-endian floats and 1.0 for big-endian ones.
+// Pixels are interleaved, rows top first (unlike PFM), so rows can be
+// streamed to the file as they are rendered.
+//
+// On the GPU, the fragment shader compiled with AUX_BUFFERS writes the
+// channels into the first two textures of an AuxTarget and the color into
+// the third, in one pass.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <SDL/SDL_endian.h>
+#include "shader_procs.h"
+#include "encoders.h"
+
+enum { AUX_DEPTH, AUX_NORMAL_X, AUX_NORMAL_Y, AUX_NORMAL_Z, AUX_STEPS, AUX_AO, AUX_CHANNELS };
+
+static char const* const auxChannelNames[AUX_CHANNELS] = {
+  "depth", "normal_x", "normal_y", "normal_z", "steps", "ao"
+};
+
+
+////////////////////////////////////////////////////////////////
+// File format, an encoder whose rows have AUX_CHANNELS floats per pixel.
+
+int beginAuxFrame(Encoder* e) {
+  char header[256];
+  int i, n = sprintf(header, "AUX\n%d %d %d\n", e->width, e->height, AUX_CHANNELS);
+  for (i=0; i<AUX_CHANNELS; i++) n += sprintf(header + n, i ? " %s" : "%s", auxChannelNames[i]);
+  n += sprintf(header + n, "\n%s\n", SDL_BYTEORDER == SDL_LIL_ENDIAN ? "-1.0" : "1.0");
+  return encoderWrite(e, header, n);
+}
+
+int writeAuxRows(Encoder* e, unsigned char const* pixels, int rows) {
+  e->row += rows;
+  return encoderWrite(e, pixels, (size_t)rows * e->width * AUX_CHANNELS * sizeof(float));
+}
+
+int endAuxFrame(Encoder* e) {
+  return e->row == e->height;
+}
+
+// Not one of the image formats: it isn't chosen with --format, and its
+// frames aren't counted in the output statistics.
+ImageFormat const auxFormat = { "aux", "aux", 4, 0, 0, beginAuxFrame, writeAuxRows, endAuxFrame, freeEncoderState };
+
+// Write width x height pixels of auxiliary buffers (bottom row first) to
+// |file|. Return 0 on error.
+int writeAuxFile(char const* file, int width, int height, float const* aux) {
+  Encoder* e = openEncoder(file, &auxFormat, width, height, 0);
+  int ok = e && beginAuxFrame(e), y;
+
+  for (y=height-1; y>=0 && ok; y--) {
+    ok = writeAuxRows(e, (unsigned char const*)(aux + (size_t)y * width * AUX_CHANNELS), 1);
+  }
+  ok = ok && endAuxFrame(e);
+  return closeEncoder(e) && ok;
+}
+
+
+////////////////////////////////////////////////////////////////
+// Render target.
+
+typedef struct AuxTarget {
+  GLuint fbo, textures[3];  // depth, steps, ao; normal; color
+  int width, height;
+  float* pixels;            // for reading back
+} AuxTarget;
+
+void releaseAuxTarget(AuxTarget* t) {
+  if (t->fbo) glDeleteFramebuffers(1, &t->fbo);
+  if (t->textures[0]) glDeleteTextures(3, t->textures);
+  free(t->pixels);
+  memset(t, 0, sizeof(AuxTarget));
+}
+
+// Create a width x height target. Return 0 if it isn't supported (needs
+// framebuffer objects, float textures and three draw buffers).
+int initAuxTarget(AuxTarget* t, int width, int height) {
+  GLenum status;
+  GLint drawBuffers = 0;
+  int i;
+
+  memset(t, 0, sizeof(AuxTarget));
+  glGetIntegerv(GL_MAX_DRAW_BUFFERS, &drawBuffers);
+  if (!enableFramebufferProcs() || drawBuffers < 3) return 0;
+  t->width = width;
+  t->height = height;
+
+  // The color is clamped and rounded like in the window.
+  glGenTextures(3, t->textures);
+  glGenFramebuffers(1, &t->fbo);
+  glBindFramebuffer(GL_FRAMEBUFFER, t->fbo);
+  for (i=0; i<3; i++) {
+    glBindTexture(GL_TEXTURE_2D, t->textures[i]);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexImage2D(GL_TEXTURE_2D, 0, i < 2 ? GL_RGBA32F : GL_RGBA8, width, height, 0, GL_RGBA, GL_FLOAT, 0);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0 + i, GL_TEXTURE_2D, t->textures[i], 0);
+  }
+  glBindTexture(GL_TEXTURE_2D, 0);
+  status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+  glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+  if (status != GL_FRAMEBUFFER_COMPLETE || !(t->pixels = malloc((size_t)width * height * 4 * sizeof(float)))) {
+    releaseAuxTarget(t);
+    return 0;
+  }
+  return 1;
+}
+
+// Render into the textures of the target, the color into |color| if it
+// isn't 0 (a texture of the same size, like the HDR buffer's), or 0: into
+// the window.
+void bindAuxTarget(AuxTarget const* t, GLuint color) {
+  static GLenum const buffers[3] = { GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT0 + 1, GL_COLOR_ATTACHMENT0 + 2 };
+
+  glBindFramebuffer(GL_FRAMEBUFFER, t ? t->fbo : 0);
+  if (!t) return;
+  glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0 + 2, GL_TEXTURE_2D, color ? color : t->textures[2], 0);
+  glDrawBuffers(3, buffers);
+}
+
+// Read the color from the target's own texture next (at 0, 0).
+void readAuxColor(AuxTarget const* t) {
+  glBindFramebuffer(GL_FRAMEBUFFER, t->fbo);
+  glReadBuffer(GL_COLOR_ATTACHMENT0 + 2);
+}
+
+// Read the bottom left width x height pixels of the target into |aux|, rows
+// of AUX_CHANNELS floats per pixel |stride| pixels apart, bottom row first.
+void readAuxTarget(AuxTarget* t, int width, int height, float* aux, int stride) {
+  GLint rowLength;
+  int i, x, y;
+
+  glGetIntegerv(GL_PACK_ROW_LENGTH, &rowLength);
+  glPixelStorei(GL_PACK_ROW_LENGTH, 0);
+  glBindFramebuffer(GL_FRAMEBUFFER, t->fbo);
+  for (i=0; i<2; i++) {
+    glReadBuffer(GL_COLOR_ATTACHMENT0 + i);
+    glReadPixels(0, 0, width, height, GL_RGBA, GL_FLOAT, t->pixels);
+    for (y=0; y<height; y++) {
+      for (x=0; x<width; x++) {
+        float const* p = t->pixels + (y*width + x) * 4;
+        float* a = aux + ((size_t)y*stride + x) * AUX_CHANNELS;
+        if (i == 0) { a[AUX_DEPTH] = p[0]; a[AUX_STEPS] = p[1]; a[AUX_AO] = p[2]; }
+        else { a[AUX_NORMAL_X] = p[0]; a[AUX_NORMAL_Y] = p[1]; a[AUX_NORMAL_Z] = p[2]; }
+      }
+    }
+  }
+  glBindFramebuffer(GL_FRAMEBUFFER, 0);
+  glReadBuffer(GL_BACK);
+  glPixelStorei(GL_PACK_ROW_LENGTH, rowLength);
+}
+
+#endif  // AUX_BUFFERS_H
@@ -13,8 +13,33 @@
 #include <SDL/SDL_thread.h>
 
 #include "default_shaders.h"
+#include "cpu_mandelbox.h"
+#include "cpu_renderer.h"
+#include "frame_writer.h"
+#include "encoders.h"
+#include "capture.h"
+#include "hdr.h"
+#include "progressive.h"
+#include "distance_cache.h"
+#include "gbuffer.h"
+#include "temporal.h"
+#include "views.h"
+#include "deep_zoom.h"
+#include "aux_buffers.h"
+#include "program_cache.h"
+#include "shader_variants.h"
+#include "file_watch.h"
+#include "governor.h"
+#include "profiler.h"
+#include "input_log.h"
+#include "snapshot.h"
+#include "keyframes.h"
+#include "render_farm.h"
 
 #define DEFAULT_CONFIG_FILE  "boxplorer.cfg"
+#define DEFAULT_IMAGE_FILE   "boxplorer"
+#define DEFAULT_FORMAT       "tga"
+#define DEFAULT_FRAME_PREFIX "frame"
 #define VERTEX_SHADER_FILE   "vertex.glsl"
 #define FRAGMENT_SHADER_FILE "fragment.glsl"
 
@@ -27,18 +52,21 @@
 #define sign(x)     ( (x)<0 ? -1 : 1 )
 
 #define FPS_FRAMES_TO_AVERAGE 6
+#define FRAME_WRITER_QUEUE    4
+#define FRAME_WRITER_THREADS  2
+#define POSTER_BAND_BYTES     (64 << 20)  // memory for one band of poster tiles
 
 ////////////////////////////////////////////////////////////////
 // Helper functions
 
 // Compute the dot product of two vectors.
-float dot(float x[3], float y[3]) {
+double dot(double x[3], double y[3]) {
   return x[0]*y[0] + x[1]*y[1] + x[2]*y[2];
 }
 
 // Normalize a vector. If it was zero, return 0.
-int normalize(float x[3]) {
-  float len = dot(x, x); if (len == 0) return 0;
+int normalize(double x[3]) {
+  double len = dot(x, x); if (len == 0) return 0;
   len = 1/sqrt(len); x[0] *= len; x[1] *= len; x[2] *= len;
   return 1;
 }
@@ -105,9 +133,18 @@ float getFPS(void) {
 ////////////////////////////////////////////////////////////////
 // Current logical state of the program.
 
-// Camera.
+// The camera and the parameters are per thread: the simulation thread
+// changes its copy, the renderer gets a snapshot of it every frame.
+#ifdef _MSC_VER
+#define THREAD_LOCAL __declspec(thread)
+#else
+#define THREAD_LOCAL __thread
+#endif
+
+// Camera. It's in double precision, so it can move in the tiny steps of a
+// deep zoom (see deep_zoom.h).
 
-float camera[16] = {
+THREAD_LOCAL double camera[16] = {
   0,0,0, 0,
   0,1,0, 0,
   0,0,1, 0,
@@ -121,12 +158,12 @@ float camera[16] = {
 
 // Set the OpenGL modelview matrix to the camera matrix.
 void setCamera(void) {
-  glLoadMatrixf(camera);
+  glLoadMatrixd(camera);
 }
 
 // Orthogonalize the camera matrix.
 void orthogonalizeCamera(void) {
-  int i; float l;
+  int i; double l;
 
   if (!normalize(direction)) { direction[0]=direction[1]=0; direction[2]=1; }
 
@@ -158,7 +195,7 @@ void moveCamera(float x, float y, float z) {
 }
 
 // Move camera in the normalized absolute direction `dir` by `len` units.
-void moveCameraAbsolute(float* dir, float len) {
+void moveCameraAbsolute(double* dir, float len) {
   int i; for (i=0; i<3; i++) {
     position[i] += len * dir[i];
   }
@@ -168,14 +205,14 @@ void moveCameraAbsolute(float* dir, float len) {
 // Behaves like `glRotate` without normalizing the axis.
 void rotateCamera(float deg, float x, float y, float z) {
   int i, j;
-  float s = sin(deg*PI/180), c = cos(deg*PI/180), t = 1-c;
-  float r[3][3] = {
+  double s = sin(deg*PI/180), c = cos(deg*PI/180), t = 1-c;
+  double r[3][3] = {
     { x*x*t +   c, x*y*t + z*s, x*z*t - y*s },
     { y*x*t - z*s, y*y*t +   c, y*z*t + x*s },
     { z*x*t + y*s, z*y*t - x*s, z*z*t +   c }
   };
   for (i=0; i<3; i++) {
-    float c[3];
+    double c[3];
     for (j=0; j<3; j++) c[j] = camera[i+j*4];
     for (j=0; j<3; j++) camera[i+j*4] = dot(c, r[j]);
   }
@@ -184,7 +221,7 @@ void rotateCamera(float deg, float x, float y, float z) {
 
 // User parameters and their names (default: par0x, par0y, par1x, ...).
 // par0 is specialized for the Mandelbox
-float par[10][2] = { {0.25, -1.77} };
+THREAD_LOCAL float par[10][2] = { {0.25, -1.77} };
 char* parName[10][2];
 
 
@@ -207,13 +244,25 @@ char* parName[10][2];
   PROCESS(float, ao_eps, "ao_eps") \
   PROCESS(float, ao_strength, "ao_strength") \
   PROCESS(float, glow_strength, "glow_strength") \
-  PROCESS(float, dist_to_color, "dist_to_color")
+  PROCESS(float, dist_to_color, "dist_to_color") \
+  PROCESS(int, progressive, "progressive") \
+  PROCESS(int, progressive_samples, "progressive_samples") \
+  PROCESS(int, cone_size, "cone_size") \
+  PROCESS(float, distance_cache, "distance_cache") \
+  PROCESS(float, frame_budget, "frame_budget") \
+  PROCESS(int, deferred, "deferred") \
+  PROCESS(float, temporal, "temporal") \
+  PROCESS(int, views, "views") \
+  PROCESS(float, eye_separation, "eye_separation") \
+  PROCESS(int, hdr, "hdr") \
+  PROCESS(int, tone_map, "tone_map") \
+  PROCESS(float, exposure, "exposure")
 
 // Non-simple: position[3], direction[3], upDirection[3], par[10][2]
 
 // Define simple config parameters.
 
-#define PROCESS(type, name, nameString) type name = 0;
+#define PROCESS(type, name, nameString) THREAD_LOCAL type name = 0;
 PROCESS_CONFIG_PARAMS
 #undef PROCESS
 
@@ -253,6 +302,36 @@ void sanitizeParameters(void) {
   if (glow_strength <= 0) glow_strength = 0.5;
   if (dist_to_color <= 0) dist_to_color = 0.2;
 
+  // Progressive refinement: block size (< 2: off, negative: switched off with P).
+  if (progressive > PROGRESSIVE_MAX_SCALE) progressive = PROGRESSIVE_MAX_SCALE;
+  if (progressive < -PROGRESSIVE_MAX_SCALE) progressive = -PROGRESSIVE_MAX_SCALE;
+  if (progressive_samples < 1) progressive_samples = 16;
+
+  // Cone marching prepass: cell size (0 = off).
+  if (cone_size < 0) cone_size = 0;
+
+  // Distance cache: size of the cached cube in world units (0 = off).
+  if (distance_cache < 0) distance_cache = 0;
+
+  // Frame time governor: milliseconds per frame (0 = off).
+  if (frame_budget < 0) frame_budget = 0;
+
+  // Deferred rendering: ambient occlusion resolution divisor (0 = off).
+  if (deferred < 0) deferred = 0;
+
+  // Temporal reprojection: fraction of the distance that rays back off (0 = off).
+  if (temporal < 0) temporal = 0;
+  if (temporal > 1) temporal = 1;
+
+  // Multi-view: views side by side (1 = mono), eye_separation between the
+  // eyes of neighbouring views (negative: swapped, for cross-eyed viewing).
+  if (views < 1) views = 1;
+
+  // HDR: frames are drawn into a float buffer (0 = off) and shown through the
+  // tone_map operator (see hdr.h), exposure in stops.
+  if (hdr < 0) hdr = 0;
+  if (tone_map < 0 || tone_map >= TONE_MAP_OPERATORS) tone_map = TONE_MAP_CLAMP;
+
   orthogonalizeCamera();
 
   // Don't do anything with user parameters - they must be
@@ -274,9 +353,9 @@ void loadConfig(char const* configFile) {
       PROCESS_CONFIG_PARAMS
       #undef PROCESS
 
-      if (!strcmp(s, "position")) { fscanf(f, " %f %f %f", &position[0], &position[1], &position[2]); continue; }
-      if (!strcmp(s, "direction")) { fscanf(f, " %f %f %f", &direction[0], &direction[1], &direction[2]); continue; }
-      if (!strcmp(s, "upDirection")) { fscanf(f, " %f %f %f", &upDirection[0], &upDirection[1], &upDirection[2]); continue; }
+      if (!strcmp(s, "position")) { fscanf(f, " %lf %lf %lf", &position[0], &position[1], &position[2]); continue; }
+      if (!strcmp(s, "direction")) { fscanf(f, " %lf %lf %lf", &direction[0], &direction[1], &direction[2]); continue; }
+      if (!strcmp(s, "upDirection")) { fscanf(f, " %lf %lf %lf", &upDirection[0], &upDirection[1], &upDirection[2]); continue; }
       for (i=0; i<lengthof(par); i++) {
         char p[256];
         sprintf(p, "par%d", i); if (!strcmp(s, p)) { fscanf(f, " %f %f", &par[i][0], &par[i][1]); break; }
@@ -309,7 +388,7 @@ void saveConfig(char const* configFile) {
     PROCESS_CONFIG_PARAMS
     #undef PROCESS
 
-    fprintf(f, "position %.7g %.7g %.7g\n", position[0], position[1], position[2]);
+    fprintf(f, "position %.16g %.16g %.16g\n", position[0], position[1], position[2]);
     fprintf(f, "direction %.7g %.7g %.7g\n", direction[0], direction[1], direction[2]);
     fprintf(f, "upDirection %.7g %.7g %.7g\n", upDirection[0], upDirection[1], upDirection[2]);
     for (i=0; i<lengthof(par); i++) {
@@ -322,6 +401,89 @@ void saveConfig(char const* configFile) {
 }
 
 
+////////////////////////////////////////////////////////////////
+// Keyframes.
+
+// Snapshot of the camera and all parameters.
+typedef struct KeyFrame {
+  double camera[16];
+  float par[10][2];
+  #define PROCESS(type, name, nameString) type name;
+  PROCESS_CONFIG_PARAMS
+  #undef PROCESS
+} KeyFrame;
+
+// Store the current camera and parameters in a keyframe.
+void getKeyFrame(KeyFrame* k) {
+  memcpy(k->camera, camera, sizeof(camera));
+  memcpy(k->par, par, sizeof(par));
+  #define PROCESS(type, name, nameString) k->name = name;
+  PROCESS_CONFIG_PARAMS
+  #undef PROCESS
+}
+
+// Make the camera and parameters from a keyframe current.
+void setKeyFrame(KeyFrame const* k) {
+  memcpy(camera, k->camera, sizeof(camera));
+  memcpy(par, k->par, sizeof(par));
+  #define PROCESS(type, name, nameString) name = k->name;
+  PROCESS_CONFIG_PARAMS
+  #undef PROCESS
+}
+
+// Take the resolution and window settings of |out| from the first keyframe:
+// all frames of an animation (and of a stream) have the same size.
+void takeFirstResolution(KeyFrame const* keys, KeyFrame* out) {
+  out->width = keys[0].width;
+  out->height = keys[0].height;
+  out->fullscreen = keys[0].fullscreen;
+  out->multisamples = keys[0].multisamples;
+}
+
+// Interpolate between keyframes at time t (0 = first keyframe, n-1 = last).
+// Position follows a Catmull-Rom spline, orientation is slerped and the other
+// parameters follow a spline that doesn't overshoot. Resolution is taken from
+// the first keyframe.
+void interpolateKeyFrames(KeyFrame const* keys, int n, float t, KeyFrame* out) {
+  KeyFrame const *k0, *k1, *k2, *k3;
+  float q1[4], q2[4], q[4], u;
+  int i;
+
+  if (n == 1 || t <= 0) { *out = keys[0]; return; }
+  if (t >= n-1) { *out = keys[n-1]; takeFirstResolution(keys, out); return; }
+
+  i = (int)t; u = t - i;
+  k0 = &keys[i > 0 ? i-1 : 0];
+  k1 = &keys[i];
+  k2 = &keys[i+1];
+  k3 = &keys[i+2 < n ? i+2 : n-1];
+
+  *out = *k1;
+  for (i=12; i<15; i++) {
+    out->camera[i] = catmullRom(k0->camera[i], k1->camera[i], k2->camera[i], k3->camera[i], u);
+  }
+  cameraToQuaternion(k1->camera, q1);
+  cameraToQuaternion(k2->camera, q2);
+  slerp(q1, q2, u, q);
+  quaternionToCamera(q, out->camera);
+
+  for (i=0; i<lengthof(par); i++) {
+    out->par[i][0] = catmullRomClamped(k0->par[i][0], k1->par[i][0], k2->par[i][0], k3->par[i][0], u);
+    out->par[i][1] = catmullRomClamped(k0->par[i][1], k1->par[i][1], k2->par[i][1], k3->par[i][1], u);
+  }
+
+  // Integer parameters are rounded: (type)0.5 is 0 for them.
+  #define PROCESS(type, name, nameString) { \
+    float v = catmullRomClamped(k0->name, k1->name, k2->name, k3->name, u); \
+    out->name = (type)0.5 ? (type)v : (type)floor(v + 0.5); \
+  }
+  PROCESS_CONFIG_PARAMS
+  #undef PROCESS
+
+  takeFirstResolution(keys, out);
+}
+
+
 ////////////////////////////////////////////////////////////////
 // Controllers.
 
@@ -432,89 +594,616 @@ int viewportOffset[2];
 // Is the mouse and keyboard input grabbed?
 int grabbedInput = 1;
 
-void saveScreenshot(char const* tgaFile) {
-  FILE *f;
+// Float buffer shared by progressive refinement and the governor. Frames are
+// drawn into it if hdr > 0, or for 16-bit and float output.
+HdrBuffer hdrBuffer;
 
-  if ((f = fopen(tgaFile, "wb")) != 0) {
-    unsigned char header[18] = {
-      0,0,2,0,0,0,0,0,0,0,0,0,width%256,width/256,height%256,height/256,24,0
-    };
-    unsigned char* img = malloc(width * height * 3);
-    glPixelStorei(GL_PACK_ALIGNMENT, 1);
-    glReadBuffer(GL_FRONT);
-    glReadPixels(viewportOffset[0], viewportOffset[1], width, height, GL_BGR, GL_UNSIGNED_BYTE, img);
+// Refinement of the image over idle frames, if progressive > 1.
+Progressive refiner;
 
-    fwrite(header, 18, 1, f);
-    fwrite(img, 3, width*height, f);
+// Lower bounds of the distance to the fractal around the camera, if distance_cache > 0.
+DistanceCache distanceCache;
 
-    free(img);
-    fclose(f);
-  }
+// Quality control for a frame time of frame_budget, if > 0.
+Governor governor;
+
+// Render targets of the deferred passes, if deferred > 0.
+GBuffer gbuffer;
+
+// Reprojection of the last deferred frame, if temporal > 0.
+Temporal reprojection;
+
+// Starts of the views from the first view's rays, if views > 1.
+ViewStarts viewStarts;
+
+// Reference orbit of the camera for deep zoom, at min_dist < DEEP_ZOOM_MIN_DIST.
+DeepZoom deepZoom;
+
+// Show the raymarching steps per pixel (H).
+int heatmap;
+
+// Where the time of each frame goes.
+Profiler profiler;
+
+// Keyboard and mouse input, recorded with --record or replayed with --replay.
+InputLog inputLog;
+
+// The state of the last frame, to see whether anything has changed.
+KeyFrame frameKey;
+
+// Frames are read back asynchronously and written by background threads.
+Output* imageOutput;
+FrameWriter* frameWriter;
+Capture capture;
+
+// Format of new image files and video streams (--format).
+ImageFormat const* outputFormat;
+
+// Make the name of the output file for a frame of a series, or for a single
+// image if frame < 0. All frames of a stream format go into one file.
+void getOutputName(char* name, char const* base, int frame) {
+  if (frame >= 0 && !outputFormat->stream) sprintf(name, "%s%05d.%s", base, frame, outputFormat->extension);
+  else if (getFileFormat(base, 0) || !strcmp(base, "-") || base[0] == '|') strcpy(name, base);
+  else sprintf(name, "%s.%s", base, outputFormat->extension);
+}
+
+// Tone mapping of the frames in the float buffer: the identity unless they
+// are drawn into it (HDR mode). Float output keeps the colors linear.
+void getToneMap(ToneMap* t, int sampleBytes) {
+  t->op = !hdrBuffer.enabled ? TONE_MAP_CLAMP : sampleBytes == 4 ? TONE_MAP_LINEAR : tone_map;
+  t->exposure = hdrBuffer.enabled ? exposure : 0;
 }
 
+// How the frame that was just drawn gets into the window (see presentFrame).
+enum { PRESENT_WINDOW, PRESENT_HDR, PRESENT_GOVERNOR, PRESENT_PROGRESSIVE };
+int framePresent;
+
 // The shader program handle.
 int program;
 
+// Draw the frame that was just drawn tone mapped with |t| into |dest|, or
+// into the window if it is 0. Frames drawn into the window are already there.
+void presentFrame(RenderTarget const* dest, ToneMap const* t) {
+  switch (framePresent) {
+    case PRESENT_HDR: presentHdrFrame(&hdrBuffer, dest, viewportOffset[0], viewportOffset[1], t); break;
+    case PRESENT_GOVERNOR: presentGovernedFrame(&governor, dest, viewportOffset[0], viewportOffset[1], t); break;
+    case PRESENT_PROGRESSIVE: presentProgressive(&refiner, dest, viewportOffset[0], viewportOffset[1], t); break;
+  }
+}
+
+// Capture the frame that was just drawn (call before swapping buffers).
+// Frames that may be dropped are skipped if the writer can't keep up. For
+// 16-bit and float output, frames in the float buffer are presented again
+// into a float target and read from there.
+void saveScreenshot(char const* file, int mayDrop) {
+  RenderTarget const* output;
+
+  if (capture.sampleBytes > 1 && framePresent != PRESENT_WINDOW && (output = getHdrOutput(&hdrBuffer)) != 0) {
+    ToneMap t;
+    getToneMap(&t, capture.sampleBytes);
+    presentFrame(output, &t);
+    glReadBuffer(GL_COLOR_ATTACHMENT0);
+    captureFrame(&capture, 0, 0, file, mayDrop);
+    bindRenderTarget(0);
+    glViewport(viewportOffset[0], viewportOffset[1], width, height);
+    glUseProgram(program);
+  }
+  else {
+    glReadBuffer(GL_BACK);
+    captureFrame(&capture, viewportOffset[0], viewportOffset[1], file, mayDrop);
+  }
+}
+
+// Cone marching prepass: the fragment shader compiled with CONE_PREPASS
+// (0 if the shader has no prepass) and its result, one pixel per cell of
+// cone_size x cone_size pixels.
+int coneProgram;
+RenderTarget coneTarget;
+int coneStale;  // the result is not for the current state
+
+// Benchmark mode: vsync is off and the same shader with STEP_COUNT defined
+// renders the number of raymarching steps per pixel.
+int benchmarking;
+int stepProgram;
+
+// Auxiliary buffer export (--aux): the shader compiled with AUX_BUFFERS (0
+// if it has no such mode) and its target, the size of the window.
+int exportingAux;
+int auxProgram;
+AuxTarget auxTarget;
+
+// Multi-view: the shader compiled with VIEW_PREPASS (0 if it has no such
+// pass or views is 1), which marches the rays of the first view, and with
+// VIEW_STARTS, the main pass that shades it and starts the other views from it.
+int viewProgram, startsProgram;
+
+// Deferred rendering: the shader compiled with GBUFFER_MARCH, ... (0s if the
+// shader has no such passes or deferred is 0).
+int gbufferPrograms[GBUFFER_PASSES];
+
+// Deep zoom: the shader compiled with DEEP_ZOOM (0 if it has no such mode).
+// It replaces the main program when min_dist gets too small for floats.
+int deepProgram;
+
+// Whether frames are drawn with the deep zoom program.
+int isDeepZoom(void) {
+  return min_dist < DEEP_ZOOM_MIN_DIST && deepProgram && deepZoom.enabled;
+}
+
+// Switch to the deep zoom program if min_dist is small enough. Return the
+// program to switch back to.
+int useDeepZoom(void) {
+  int mainProgram = program;
+  if (isDeepZoom()) glUseProgram(program = deepProgram);
+  return mainProgram;
+}
+
+// Uniforms of the shader programs.
+enum {
+  UNIFORM_par, UNIFORM_fov_x, UNIFORM_fov_y, UNIFORM_max_steps, UNIFORM_min_dist,
+  UNIFORM_iters, UNIFORM_color_iters, UNIFORM_ao_eps, UNIFORM_ao_strength,
+  UNIFORM_glow_strength, UNIFORM_dist_to_color, UNIFORM_ao_samples, UNIFORM_heatmap,
+  UNIFORM_tile_scale, UNIFORM_tile_offset,
+  UNIFORM_views, UNIFORM_eye_separation, UNIFORM_eye_margin,
+  UNIFORM_cone, UNIFORM_cone_size, UNIFORM_cone_scale, UNIFORM_cone_margin,
+  UNIFORM_gbuffer, UNIFORM_gnormals, UNIFORM_gao,
+  UNIFORM_gbuffer_texel, UNIFORM_gao_texel, UNIFORM_gao_scale,
+  UNIFORM_starts, UNIFORM_start_backoff, UNIFORM_temporal_phase,
+  UNIFORM_cache,  // and the other DISTANCE_CACHE_UNIFORMS
+  UNIFORM_orbit = UNIFORM_cache + DISTANCE_CACHE_UNIFORM_COUNT,  // and the other DEEP_ZOOM_UNIFORMS
+  UNIFORMS = UNIFORM_orbit + DEEP_ZOOM_UNIFORM_COUNT
+};
+
+static char const* const uniformNames[UNIFORMS] = {
+  "par", "fov_x", "fov_y", "max_steps", "min_dist",
+  "iters", "color_iters", "ao_eps", "ao_strength",
+  "glow_strength", "dist_to_color", "ao_samples", "heatmap",
+  "tile_scale", "tile_offset",
+  "views", "eye_separation", "eye_margin",
+  "cone", "cone_size", "cone_scale", "cone_margin",
+  "gbuffer", "gnormals", "gao",
+  "gbuffer_texel", "gao_texel", "gao_scale",
+  "starts", "start_backoff", "temporal_phase",
+  DISTANCE_CACHE_UNIFORMS,
+  DEEP_ZOOM_UNIFORMS
+};
+
+// Locations and uploaded values of the uniforms of each program.
+UniformCache programUniforms, coneUniforms, stepUniforms, deepUniforms, auxUniforms, viewUniforms, startsUniforms;
+UniformCache gbufferUniforms[GBUFFER_PASSES];
+
+// Linked programs are stored in PROGRAM_CACHE_DIR, and loaded from there
+// the next time (at startup or when toggling fullscreen).
+ProgramCache programCache;
+
+// Variants of the main program specialized for the current parameters, and
+// the one in use (0 if the generic program is).
+ShaderVariants shaderVariants;
+ShaderVariant* shaderVariant;
+ShaderVariants viewVariants;    // of the view prepass, in use as shaderVariant
+ShaderVariants startsVariants;  // of the main pass with view starts, likewise
+int blockingVariants;  // --variants: compile them without parallel compile too
+
+// The programs made from one version of the shader files: the main program,
+// the cone marching prepass (the same shader with CONE_PREPASS defined, if it
+// has one), in benchmark mode the step counting variant (STEP_COUNT), the deep
+// zoom mode (DEEP_ZOOM), for exports the auxiliary buffers (AUX_BUFFERS), with
+// several views their prepass (VIEW_PREPASS) and the main pass that uses it
+// (VIEW_STARTS), and for deferred rendering the passes (GBUFFER_MARCH, ...).
+enum {
+  BUILD_MAIN, BUILD_CONE, BUILD_STEP, BUILD_DEEP, BUILD_AUX, BUILD_VIEW, BUILD_STARTS, BUILD_GBUFFER,
+  BUILD_PROGRAMS = BUILD_GBUFFER + GBUFFER_PASSES
+};
+
+typedef struct ShaderBuild {
+  char* vs;
+  char* fs;
+  char* sources[BUILD_PROGRAMS];      // fragment shaders, 0: not built
+  GLuint programs[BUILD_PROGRAMS];
+  GLuint shaders[BUILD_PROGRAMS][2];  // while compiling, see startCachedProgram()
+  int started;
+} ShaderBuild;
+
+// Read the shader files (or take the default shaders) and start compiling
+// the programs, or load them from the program cache.
+void startShaderBuild(ShaderBuild* b) {
+  static char const* const defines[BUILD_PROGRAMS] = {
+    "", "#define CONE_PREPASS\n", "#define STEP_COUNT\n", "#define DEEP_ZOOM\n", "#define AUX_BUFFERS\n",
+    "#define VIEW_PREPASS\n", "#define VIEW_STARTS\n",
+    "#define GBUFFER_MARCH\n", "#define GBUFFER_NORMALS\n", "#define GBUFFER_AO\n", "#define GBUFFER_SHADE\n"
+  };
+  int i;
+
+  memset(b, 0, sizeof(ShaderBuild));
+  if (!(b->vs = readFile(VERTEX_SHADER_FILE))) b->vs = strdup(default_vs);
+  if (!(b->fs = readFile(FRAGMENT_SHADER_FILE))) b->fs = strdup(default_fs);
+
+  for (i=0; i<BUILD_PROGRAMS; i++) {
+    if (i == BUILD_CONE && !strstr(b->fs, "CONE_PREPASS")) continue;
+    if (i == BUILD_STEP && !(benchmarking && strstr(b->fs, "STEP_COUNT"))) continue;
+    if (i == BUILD_DEEP && !strstr(b->fs, "DEEP_ZOOM")) continue;
+    if (i == BUILD_AUX && !(exportingAux && strstr(b->fs, "AUX_BUFFERS"))) continue;
+    if (i == BUILD_VIEW && !(views > 1 && strstr(b->fs, "VIEW_PREPASS"))) continue;
+    if (i == BUILD_STARTS && !(views > 1 && strstr(b->fs, "VIEW_STARTS"))) continue;
+    if (i >= BUILD_GBUFFER && !(deferred > 0 && strstr(b->fs, "GBUFFER_MARCH"))) continue;
+    if (!(b->sources[i] = addShaderDefines(defines[i], b->fs))) continue;
+    b->programs[i] = startCachedProgram(&programCache, b->vs, b->sources[i], b->shaders[i]);
+  }
+  b->started = 1;
+}
+
+// Whether finishShaderBuild() would wait for the driver.
+int isShaderBuildWaiting(ShaderBuild const* b) {
+  int i;
+  if (!hasParallelShaderCompile()) return 0;
+  for (i=0; i<BUILD_PROGRAMS; i++) {
+    GLint done = 1;
+    if (b->shaders[i][0]) glGetProgramiv(b->programs[i], GL_COMPLETION_STATUS_ARB, &done);
+    if (!done) return 1;
+  }
+  return 0;
+}
+
+// Finish compiling the programs. Return 0 if the main program has failed.
+// Compile errors go to stderr.
+int finishShaderBuild(ShaderBuild* b) {
+  int i;
+  for (i=0; i<BUILD_PROGRAMS; i++) {
+    if (!b->sources[i]) continue;
+    b->programs[i] = finishCachedProgram(&programCache, b->programs[i], b->shaders[i], b->vs, b->sources[i]);
+    b->shaders[i][0] = b->shaders[i][1] = 0;
+  }
+  return b->programs[BUILD_MAIN] != 0;
+}
+
+void releaseShaderBuild(ShaderBuild* b) {
+  int i;
+  for (i=0; i<BUILD_PROGRAMS; i++) free(b->sources[i]);
+  free(b->vs);
+  free(b->fs);
+  memset(b, 0, sizeof(ShaderBuild));
+}
+
+// Make the programs of a finished build the current ones, and activate the
+// main program.
+void useShaderBuild(ShaderBuild* b) {
+  int i;
+
+  program = b->programs[BUILD_MAIN];
+  coneProgram = b->programs[BUILD_CONE];
+  stepProgram = b->programs[BUILD_STEP];
+  deepProgram = b->programs[BUILD_DEEP];
+  auxProgram = b->programs[BUILD_AUX];
+  viewProgram = b->programs[BUILD_VIEW];
+  startsProgram = b->programs[BUILD_STARTS];
+  for (i=0; i<GBUFFER_PASSES; i++) gbufferPrograms[i] = b->programs[BUILD_GBUFFER + i];
+
+  // Specialized variants are compiled while rendering (see useShaderVariant()).
+  initShaderVariants(&shaderVariants, b->vs, b->fs, uniformNames, UNIFORMS, &programCache, blockingVariants);
+  if (b->sources[BUILD_VIEW]) {
+    initShaderVariants(&viewVariants, b->vs, b->sources[BUILD_VIEW], uniformNames, UNIFORMS, &programCache,
+                       blockingVariants);
+  }
+  if (b->sources[BUILD_STARTS]) {
+    initShaderVariants(&startsVariants, b->vs, b->sources[BUILD_STARTS], uniformNames, UNIFORMS, &programCache,
+                       blockingVariants);
+  }
+  shaderVariant = 0;
+
+  releaseUniformCache(&programUniforms);
+  releaseUniformCache(&coneUniforms);
+  releaseUniformCache(&stepUniforms);
+  releaseUniformCache(&deepUniforms);
+  releaseUniformCache(&auxUniforms);
+  releaseUniformCache(&viewUniforms);
+  releaseUniformCache(&startsUniforms);
+  initUniformCache(&programUniforms, program, uniformNames, UNIFORMS);
+  initUniformCache(&coneUniforms, coneProgram, uniformNames, UNIFORMS);
+  initUniformCache(&stepUniforms, stepProgram, uniformNames, UNIFORMS);
+  initUniformCache(&deepUniforms, deepProgram, uniformNames, UNIFORMS);
+  initUniformCache(&auxUniforms, auxProgram, uniformNames, UNIFORMS);
+  initUniformCache(&viewUniforms, viewProgram, uniformNames, UNIFORMS);
+  initUniformCache(&startsUniforms, startsProgram, uniformNames, UNIFORMS);
+  for (i=0; i<GBUFFER_PASSES; i++) {
+    releaseUniformCache(&gbufferUniforms[i]);
+    initUniformCache(&gbufferUniforms[i], gbufferPrograms[i], uniformNames, UNIFORMS);
+  }
+
+  glUseProgram(program);
+}
+
 // Compile and activate shader programs. Return the program handle.
 int setupShaders(void) {
-  char const* vs;
-  char const* fs;
-  GLuint v,f,p;
-  char log[2048]; int logLength;
+  ShaderBuild b;
 
-  (vs = readFile(VERTEX_SHADER_FILE)) || ( vs = default_vs );
-  (fs = readFile(FRAGMENT_SHADER_FILE)) || ( fs = default_fs );
+  startShaderBuild(&b);
+  if (finishShaderBuild(&b)) useShaderBuild(&b);
+  else program = 0;
+  releaseShaderBuild(&b);
+  return program;
+}
 
-  p = glCreateProgram();
+// Shader hot reload: when a shader file changes, the new programs are built
+// while rendering goes on with the old ones, which are replaced once the new
+// ones have linked. A shader that doesn't compile is reported and ignored.
+FileWatch shaderWatch;
+ShaderBuild shaderReload;
 
-  v = glCreateShader(GL_VERTEX_SHADER);
-  glShaderSource(v, 1, &vs, 0);
-  glCompileShader(v);
-  glGetShaderInfoLog(v, sizeof(log), &logLength, log);
-  if (logLength) fprintf(stderr, "[Vertex:]\n%s\n", log);
+static char const* const shaderFiles[] = { VERTEX_SHADER_FILE, FRAGMENT_SHADER_FILE };
 
-  f = glCreateShader(GL_FRAGMENT_SHADER);
-  glShaderSource(f, 1, &fs, 0);
-  glCompileShader(f);
-  glGetShaderInfoLog(f, sizeof(log), &logLength, log);
-  if (logLength) fprintf(stderr, "[Fragment:]\n%s\n", log);
+// Drop the programs being built for a reload.
+void cancelShaderReload(void) {
+  int i;
+  if (!shaderReload.started) return;
+  finishShaderBuild(&shaderReload);
+  for (i=0; i<BUILD_PROGRAMS; i++) if (shaderReload.programs[i]) glDeleteProgram(shaderReload.programs[i]);
+  releaseShaderBuild(&shaderReload);
+}
 
-  glAttachShader(p, v);
-  glAttachShader(p, f);
-  glLinkProgram(p);
+// Start building the shaders if the files have changed, or use the new
+// programs if they are ready. Call once per frame.
+void reloadShaders(void) {
+  int i;
 
-  glGetProgramInfoLog(p, sizeof(log), &logLength, log);
-  if (logLength) fprintf(stderr, "[Program:]\n%s\n", log);
+  if (checkFileWatch(&shaderWatch)) {
+    cancelShaderReload();
+    startShaderBuild(&shaderReload);
+  }
+  if (!shaderReload.started || isShaderBuildWaiting(&shaderReload)) return;
+
+  if (finishShaderBuild(&shaderReload)) {
+    glUseProgram(0);
+    glDeleteProgram(program);
+    if (coneProgram) glDeleteProgram(coneProgram);
+    if (stepProgram) glDeleteProgram(stepProgram);
+    if (deepProgram) glDeleteProgram(deepProgram);
+    if (auxProgram) glDeleteProgram(auxProgram);
+    if (viewProgram) glDeleteProgram(viewProgram);
+    if (startsProgram) glDeleteProgram(startsProgram);
+    for (i=0; i<GBUFFER_PASSES; i++) if (gbufferPrograms[i]) glDeleteProgram(gbufferPrograms[i]);
+    releaseShaderVariants(&shaderVariants);
+    releaseShaderVariants(&viewVariants);
+    releaseShaderVariants(&startsVariants);
+    useShaderBuild(&shaderReload);
+    if (!coneProgram) releaseRenderTarget(&coneTarget);
+    if (!viewProgram || !startsProgram) releaseViewStarts(&viewStarts);
+    memset(&frameKey, 0, sizeof(frameKey));  // draw the prepass, restart refinement
+    fprintf(stderr, "Shaders reloaded.\n");
+    releaseShaderBuild(&shaderReload);
+  }
+  else {
+    cancelShaderReload();
+    fprintf(stderr, "Shader reload failed, keeping the old shaders.\n");
+  }
+}
 
-  if (vs != default_vs) free((char*)vs);
-  if (fs != default_fs) free((char*)fs);
 
-  glUseProgram(p);
-  return p;
+// The uniforms of the program in use.
+UniformCache* getUniforms(void) {
+  int i;
+  if (program && program == coneProgram) return &coneUniforms;
+  if (program && program == stepProgram) return &stepUniforms;
+  if (program && program == deepProgram) return &deepUniforms;
+  if (program && program == auxProgram) return &auxUniforms;
+  if (program && program == viewProgram) return &viewUniforms;
+  if (program && program == startsProgram) return &startsUniforms;
+  if (shaderVariant && program == (int)shaderVariant->program) return &shaderVariant->uniforms;
+  for (i=0; i<GBUFFER_PASSES; i++) if (program && program == gbufferPrograms[i]) return &gbufferUniforms[i];
+  return &programUniforms;
 }
 
+// The part of the screen covered by the drawn rectangle (see setTileUniforms()).
+float tileScale[2] = { 1, 1 }, tileOffset[2];
 
-// Update shader parameters to their current values.
-#define glSetUniformf(name) \
-  glUniform1f(glGetUniformLocation(program, #name), name);
-#define glSetUniformv(name) \
-  glUniform2fv(glGetUniformLocation(program, #name), lengthof(name), (float*)name);
-#define glSetUniformi(name) \
-  glUniform1i(glGetUniformLocation(program, #name), name);
+// The number of views drawn by the program in use. The cone prepass is drawn
+// once, from the camera, for all views, the view prepass for the first view.
+int getViews(void) {
+  if (shaderVariant && program == (int)shaderVariant->program) {
+    return hasShaderVariant(&viewVariants, shaderVariant) ? 1 : views;
+  }
+  return program && (program == coneProgram || program == viewProgram) ? 1 : views;
+}
+
+// Draw the screen with the program in use, after uploading the uniforms
+// that have changed. With several views, the rectangle is split into a quad
+// per view, with the view number in z (see the vertex shader), all in one
+// draw.
+void drawRect(void) {
+  int n = getViews(), i;
+
+  flushUniforms(getUniforms());
+  if (n == 1) { glRects(-1,-1,1,1); return; }
+
+  glBegin(GL_QUADS);
+  for (i=0; i<n; i++) {
+    // The columns of the views on the screen, in rectangle coordinates.
+    float x0 = (-1 + 2.0f*i/n - tileOffset[0]) / tileScale[0];
+    float x1 = (-1 + 2.0f*(i+1)/n - tileOffset[0]) / tileScale[0];
+    if (x0 < -1) x0 = -1;
+    if (x1 > 1) x1 = 1;
+    if (x0 >= x1) continue;
+    glVertex3f(x0, -1, i); glVertex3f(x1, -1, i);
+    glVertex3f(x1, 1, i); glVertex3f(x0, 1, i);
+  }
+  glEnd();
+}
+
+// Set the part of the screen covered by the drawn rectangle (see the vertex shader).
+void setTileUniforms(float scaleX, float scaleY, float offsetX, float offsetY) {
+  tileScale[0] = scaleX; tileScale[1] = scaleY;
+  tileOffset[0] = offsetX; tileOffset[1] = offsetY;
+  setUniform2f(getUniforms(), UNIFORM_tile_scale, scaleX, scaleY);
+  setUniform2f(getUniforms(), UNIFORM_tile_offset, offsetX, offsetY);
+}
+
+// Update shader parameters to their current values. They are uploaded by
+// drawRect(), if they have changed.
+#define setUniformf(name) setUniform1f(u, UNIFORM_##name, name);
+#define setUniformi(name) setUniform1i(u, UNIFORM_##name, name);
 
 void setUniforms(void) {
-  glSetUniformv(par);
-  glSetUniformf(fov_x); glSetUniformf(fov_y);
-  glSetUniformi(max_steps); glSetUniformf(min_dist);
-  glSetUniformi(iters); glSetUniformi(color_iters);
-  glSetUniformf(ao_eps); glSetUniformf(ao_strength);
-  glSetUniformf(glow_strength); glSetUniformf(dist_to_color);
+  UniformCache* u = getUniforms();
+
+  setTileUniforms(1, 1, 0, 0);
+  setUniform2fv(u, UNIFORM_par, lengthof(par), (float*)par);
+  setUniformf(fov_x); setUniformf(fov_y);
+  setUniformi(max_steps); setUniformf(min_dist);
+  setUniformi(iters); setUniformi(color_iters);
+  setUniformf(ao_eps); setUniformf(ao_strength);
+  setUniformf(glow_strength); setUniformf(dist_to_color);
+  setUniform1i(u, UNIFORM_views, getViews());
+  setUniformf(eye_separation);
+  setUniform1f(u, UNIFORM_eye_margin, 0.5f * (views-1) * fabs(eye_separation));
+  setUniform1i(u, UNIFORM_ao_samples, 5);
+  setUniformi(heatmap);
+  setUniform1f(u, UNIFORM_cone_size, 0);  // see useConePrepass()
+  setUniform1i(u, UNIFORM_gbuffer, GBUFFER_TEXTURE_UNIT + GBUFFER_MARCH);
+  setUniform1i(u, UNIFORM_gnormals, GBUFFER_TEXTURE_UNIT + GBUFFER_NORMALS);
+  setUniform1i(u, UNIFORM_gao, GBUFFER_TEXTURE_UNIT + GBUFFER_AO);
+  setUniform1i(u, UNIFORM_starts, TEMPORAL_TEXTURE_UNIT);
+  setUniform1f(u, UNIFORM_start_backoff, 0);  // see drawDeferredFrame()
+
+  if (program && program == deepProgram) {
+    // The cache is in world coordinates, deep zoom positions are relative to the camera.
+    static DistanceCache const noCache;
+    updateDeepZoom(&deepZoom, position, par[0], iters, color_iters);
+    setDeepZoomUniforms(&deepZoom, u, UNIFORM_orbit);
+    setDistanceCacheUniforms(&noCache, u, UNIFORM_cache);
+  }
+  else setDistanceCacheUniforms(&distanceCache, u, UNIFORM_cache);
+}
+
+// Set the camera for a frame and bring the distance cache up to date for
+// it: bricks are invalidated and uploaded here, once per frame, and only
+// bound by setUniforms() in each pass.
+void beginFrameCamera(void) {
+  float eye[3] = { position[0], position[1], position[2] };
+
+  setCamera();
+  if (!isDeepZoom()) updateDistanceCache(&distanceCache, par[0], iters, min_dist, eye);
+}
+
+// Render the cone marching prepass for the current camera and parameters.
+// With several views, it has the cells of one view, which all views share.
+// Deep zoom has no prepass.
+void drawConePrepass(void) {
+  int mainProgram = program, viewWidth = width / views;
+  int cellsX = (viewWidth + cone_size-1) / cone_size;
+  float scaleX = (float)cone_size * cellsX / viewWidth;
+  float scaleY = (float)cone_size * coneTarget.height / height;
+
+  if (!coneTarget.fbo || isDeepZoom()) return;
+
+  // The pixel centers of the target are the cell centers.
+  glUseProgram(program = coneProgram);
+  setUniforms();
+  setTileUniforms(scaleX, scaleY, scaleX - 1, scaleY - 1);
+  setUniform1f(getUniforms(), UNIFORM_cone_margin, 0.5f * (cone_size + 1) / cone_size);
+  glBindTexture(GL_TEXTURE_2D, 0);
+
+  bindRenderTarget(&coneTarget);
+  glViewport(0, 0, cellsX, coneTarget.height);
+  drawRect();
+  bindRenderTarget(0);
+  glViewport(viewportOffset[0], viewportOffset[1], width, height);
+
+  glUseProgram(program = mainProgram);
+  coneStale = 0;
+}
+
+// Let the main pass start from the prepass result (call after setUniforms()).
+void useConePrepass(void) {
+  if (!coneTarget.fbo || isDeepZoom()) return;
+  glBindTexture(GL_TEXTURE_2D, coneTarget.texture);
+  setUniform1i(getUniforms(), UNIFORM_cone, 0);
+  setUniform1f(getUniforms(), UNIFORM_cone_size, cone_size);
+  setUniform2f(getUniforms(), UNIFORM_cone_scale,
+    (float)(width / views) / (cone_size * coneTarget.width), (float)height / (cone_size * coneTarget.height));
+}
+
+// Switch from the main program (or a multi-view one) to its variant in |v|
+// specialized for the current parameters and |steps| raymarching steps, if it
+// has been compiled.
+void useShaderVariant(ShaderVariants* v, int steps) {
+  ShaderVariantKey key;
+
+  key.iters = iters;
+  key.colorIters = color_iters;
+  key.maxSteps = steps;
+  key.par0[0] = par[0][0];
+  key.par0[1] = par[0][1];
+  shaderVariant = getShaderVariant(v, &key, 0);
+  if (shaderVariant) glUseProgram(program = shaderVariant->program);
+}
+
+// Whether the views of this frame can reuse the rays of the first view (see
+// views.h). Not for deep zoom, progressive refinement and the governor,
+// which march all views in full.
+int isViewStartsUsed(void) {
+  return viewStarts.enabled && !isDeepZoom() && !refiner.enabled && !governor.enabled;
+}
+
+// March the rays of the first view from the cone prepass and make the starts
+// of the other views from them (call after drawConePrepass()). They are valid
+// until anything changes.
+void drawViewPrepass(void) {
+  int mainProgram = program, i;
+  float c[16], eye[16];
+
+  if (!isViewStartsUsed()) return;
+
+  for (i=0; i<16; i++) c[i] = camera[i];
+  getViewCamera(eye, c, views, 0, eye_separation);
+  glPushMatrix();
+  glLoadMatrixf(eye);
+  glUseProgram(program = viewProgram);
+  useShaderVariant(&viewVariants, max_steps);
+  setUniforms();
+  useConePrepass();
+  bindRenderTarget(&viewStarts.march);
+  drawRect();
+  glBindTexture(GL_TEXTURE_2D, 0);
+  glPopMatrix();
+
+  splatViewStarts(&viewStarts, c, eye_separation, tan(fov_x * PI/180/2), tan(fov_y * PI/180/2));
+  glViewport(viewportOffset[0], viewportOffset[1], width, height);
+  glUseProgram(program = mainProgram);
+  shaderVariant = 0;
+  viewStarts.valid = 1;
+}
+
+// Let the main pass (the VIEW_STARTS program) take the first view from the
+// view prepass and start the others from it (call after setUniforms()).
+void useViewStarts(void) {
+  bindViewStarts(&viewStarts);
+  setUniform1f(getUniforms(), UNIFORM_start_backoff, VIEW_START_BACKOFF);
+  setUniform2f(getUniforms(), UNIFORM_gbuffer_texel, 1.0f / viewStarts.starts.width, 1.0f / viewStarts.starts.height);
 }
 
 
 // Initializes the video mode, OpenGL state, shaders, camera and shader parameters.
 // Exits the program if an error occurs.
 void initGraphics(void) {
+  int hdrMode, channelBits;
+
+  // Finish captures in progress: the OpenGL context may be lost.
+  releaseCapture(&capture);
+  releaseProgressive(&refiner);
+  releaseHdrBuffer(&hdrBuffer);
+  releaseRenderTarget(&coneTarget);
+  releaseShaderVariants(&shaderVariants);
+  releaseShaderVariants(&viewVariants);
+  releaseShaderVariants(&startsVariants);
+  cancelShaderReload();
+  releaseDistanceCache(&distanceCache);
+  releaseGovernor(&governor);
+  releaseGBuffer(&gbuffer);
+  releaseTemporal(&reprojection);
+  releaseViewStarts(&viewStarts);
+  releaseDeepZoom(&deepZoom);
+  releaseAuxTarget(&auxTarget);
+  releaseProfilerQueries(&profiler);
+
   // If not fullscreen, use the color depth of the current video mode.
   int bpp = 24;  // FSAA works reliably only in 24bit modes
   if (!fullscreen) {
@@ -522,10 +1211,13 @@ void initGraphics(void) {
     bpp = info->vfmt->BitsPerPixel;
   }
 
-  // Set attributes for the OpenGL window.
-  SDL_GL_SetAttribute(SDL_GL_RED_SIZE, 5);
-  SDL_GL_SetAttribute(SDL_GL_GREEN_SIZE, 5);
-  SDL_GL_SetAttribute(SDL_GL_BLUE_SIZE, 5);
+  // Set attributes for the OpenGL window. Tone mapped HDR frames need all
+  // the bits of a channel they can get.
+  hdrMode = hdr > 0 || outputFormat->sampleBytes > 1;
+  channelBits = hdrMode ? 8 : 5;
+  SDL_GL_SetAttribute(SDL_GL_RED_SIZE, channelBits);
+  SDL_GL_SetAttribute(SDL_GL_GREEN_SIZE, channelBits);
+  SDL_GL_SetAttribute(SDL_GL_BLUE_SIZE, channelBits);
   SDL_GL_SetAttribute(SDL_GL_DOUBLEBUFFER, 1);
   if (multisamples == 1) {
     SDL_GL_SetAttribute(SDL_GL_MULTISAMPLEBUFFERS, 0);
@@ -534,6 +1226,7 @@ void initGraphics(void) {
     SDL_GL_SetAttribute(SDL_GL_MULTISAMPLEBUFFERS, 1);
     SDL_GL_SetAttribute(SDL_GL_MULTISAMPLESAMPLES, multisamples);
   }
+  if (benchmarking) SDL_GL_SetAttribute(SDL_GL_SWAP_CONTROL, 0);
 
   // Set the video mode, hide the mouse and grab keyboard and mouse input.
   SDL_putenv("SDL_VIDEO_CENTERED=center");
@@ -558,160 +1251,1411 @@ void initGraphics(void) {
   // Enable shader functions and compile shaders.
   // Needs to be done after setting the video mode.
   enableShaderProcs() || die("This program needs support for GLSL shaders.\n");
+  initProgramCache(&programCache);
   (program = setupShaders()) || die("Error in GLSL shader compilation (see stderr.txt for details).\n");
+
+  initCapture(&capture, frameWriter, width, height, outputFormat->sampleBytes);
+  initProfilerQueries(&profiler);
+
+  if ((hdrMode || progressive > 1 || progressive < -1 || frame_budget > 0) &&
+      !initHdrBuffer(&hdrBuffer, width, height, hdrMode) && hdrMode) {
+    fprintf(stderr, "HDR rendering is not supported (needs framebuffer objects and float textures).\n");
+  }
+
+  if (progressive > 1 &&
+      !initProgressive(&refiner, width, height, progressive, progressive_samples, &hdrBuffer.buffer, hdrBuffer.enabled)) {
+    fprintf(stderr, "Progressive refinement is not supported (needs framebuffer objects and float textures).\n");
+  }
+
+  if (cone_size > 0 && coneProgram) {
+    if (!enableFramebufferProcs() ||
+        !initRenderTarget(&coneTarget, (width + cone_size-1) / cone_size, (height + cone_size-1) / cone_size,
+                          GL_RGBA32F, GL_NEAREST)) {
+      releaseRenderTarget(&coneTarget);
+      fprintf(stderr, "Cone marching is not supported (needs framebuffer objects and float textures).\n");
+    }
+  }
+  coneStale = 1;
+
+  if (frame_budget > 0 && !initGovernor(&governor, width, height, frame_budget, &hdrBuffer.buffer, hdrBuffer.enabled)) {
+    fprintf(stderr, "The frame time governor is not supported (needs framebuffer objects).\n");
+  }
+
+  if (deferred > 0 && gbufferPrograms[GBUFFER_MARCH] && !initGBuffer(&gbuffer, width, height, deferred)) {
+    fprintf(stderr, "Deferred rendering is not supported (needs framebuffer objects and float textures).\n");
+  }
+
+  if (temporal > 0 && gbuffer.enabled && !initTemporal(&reprojection, width, height)) {
+    fprintf(stderr, "Temporal reprojection is not supported (needs texture lookups in vertex shaders).\n");
+  }
+
+  if (views > 1 && viewProgram && startsProgram && !initViewStarts(&viewStarts, views, width / views, height)) {
+    fprintf(stderr, "Starting views from the first view is not supported (needs texture lookups in vertex shaders).\n");
+  }
+
+  if (distance_cache > 0 && !initDistanceCache(&distanceCache, distance_cache)) {
+    fprintf(stderr, "The distance cache is not supported (needs 3D float textures).\n");
+  }
+
+  if (deepProgram && !initDeepZoom(&deepZoom)) {
+    fprintf(stderr, "Deep zoom is not supported (needs float textures).\n");
+  }
+
+  if (auxProgram && !initAuxTarget(&auxTarget, width, height)) {
+    fprintf(stderr, "Auxiliary buffers are not supported (needs framebuffer objects and float textures).\n");
+  }
+}
+
+// Draw the frame in deferred passes (see gbuffer.h), with the generic
+// programs. Each pass is timed on the GPU. With temporal reprojection, rays
+// start from the surface seen in the last frame (see temporal.h). In HDR
+// mode, the shading pass draws into the float buffer.
+void drawDeferredFrame(void) {
+  static int const series[GBUFFER_PASSES] = {
+    PROFILE_GPU_MARCH, PROFILE_GPU_NORMALS, PROFILE_GPU_AO, PROFILE_GPU_SHADE
+  };
+  RenderTarget const* ao = &gbuffer.targets[GBUFFER_AO];
+  int i, s = gbuffer.aoScale, mainProgram = program;
+
+  if (reprojection.enabled) {
+    float c[16];
+    for (i=0; i<16; i++) c[i] = camera[i];
+    beginTemporal(&reprojection, gbuffer.targets[GBUFFER_MARCH].texture, c, tan(fov_x * PI/180/2), tan(fov_y * PI/180/2));
+  }
+  for (i=0; i<GBUFFER_PASSES; i++) {
+    glUseProgram(program = gbufferPrograms[i]);
+    setUniforms();
+    if (i == GBUFFER_MARCH) {
+      useConePrepass();
+      if (reprojection.enabled) {
+        setUniform1f(getUniforms(), UNIFORM_start_backoff, temporal);
+        setUniform1f(getUniforms(), UNIFORM_temporal_phase, getTemporalPhase(&reprojection));
+      }
+    }
+    if (i == GBUFFER_AO) {
+      // The AO texel centers are the first pixels of s x s blocks: ambient
+      // occlusion is sensitive to the point being right on the surface.
+      float scaleX = (float)s * ao->width / width, scaleY = (float)s * ao->height / height;
+      setTileUniforms(scaleX, scaleY, scaleX - 1 - (s - 1.0f) / width, scaleY - 1 - (s - 1.0f) / height);
+    }
+    setUniform2f(getUniforms(), UNIFORM_gbuffer_texel, 1.0f / width, 1.0f / height);
+    setUniform2f(getUniforms(), UNIFORM_gao_texel, 1.0f / ao->width, 1.0f / ao->height);
+    setUniform1f(getUniforms(), UNIFORM_gao_scale, s);
+
+    profileGpuPass(&profiler, series[i]);
+    beginGBufferPass(&gbuffer, i);
+    if (i == GBUFFER_SHADE && hdrBuffer.enabled) beginHdrFrame(&hdrBuffer);
+    else if (i == GBUFFER_SHADE) glViewport(viewportOffset[0], viewportOffset[1], width, height);
+    drawRect();
+    if (i == GBUFFER_MARCH && reprojection.enabled) endTemporal();
+  }
+  endGBufferPasses();
+  glUseProgram(program = mainProgram);
+}
+
+// Draw a frame. The cone marching prepass runs only if anything has changed.
+// The view prepass runs on the first frame that stays the same: while the
+// camera moves, the cone prepass shares most of the way with all views and
+// the reuse doesn't pay for itself.
+// In progressive mode, render one pass: it starts the image over if anything
+// has changed, otherwise it refines the image. Otherwise, the governor (if
+// any) sets the quality, or the frame is drawn in deferred passes (with one
+// view only). At small min_dist, the deep zoom program draws the frame in one
+// pass. Frames that aren't drawn straight into the window are presented,
+// tone mapped, at the end.
+void drawFrame(void) {
+  KeyFrame key;
+  ToneMap t;
+  float tile[4];
+  int changed, steps = max_steps, mainProgram = program, deep = isDeepZoom(), starts;
+  int useDeferred = !deep && views == 1 && !refiner.enabled && !governor.enabled && gbuffer.enabled &&
+    gbufferPrograms[GBUFFER_MARCH] && gbufferPrograms[GBUFFER_NORMALS] &&
+    gbufferPrograms[GBUFFER_AO] && gbufferPrograms[GBUFFER_SHADE];
+  GovernorLevel const* l = 0;
+
+  memset(&key, 0, sizeof(key));
+  getKeyFrame(&key);
+  changed = memcmp(&key, &frameKey, sizeof(key)) != 0;
+  if (changed) {
+    // Reprojection follows the camera, but nothing else.
+    memcpy(frameKey.camera, key.camera, sizeof(key.camera));
+    if (memcmp(&key, &frameKey, sizeof(key))) resetTemporal(&reprojection);
+  }
+  frameKey = key;
+
+  beginFrameCamera();
+  if (changed || coneStale) {
+    drawConePrepass();
+    viewStarts.valid = 0;
+  }
+  else if (!viewStarts.valid) drawViewPrepass();
+  starts = isViewStartsUsed() && viewStarts.valid;
+  profileStage(&profiler, PROFILE_UNIFORMS);
+  if (!refiner.enabled && governor.enabled) {
+    l = getGovernorLevel(&governor);
+    steps = (int)(max_steps * l->steps + 0.5f);
+  }
+  if (deep) glUseProgram(program = deepProgram);
+  else if (starts) {
+    glUseProgram(program = startsProgram);
+    useShaderVariant(&startsVariants, steps);
+  }
+  else if (!useDeferred) useShaderVariant(&shaderVariants, steps);
+  setUniforms();
+  useConePrepass();
+  profileStage(&profiler, PROFILE_DRAW);
+
+  framePresent = PRESENT_WINDOW;
+  if (l) {
+    setUniform1i(getUniforms(), UNIFORM_max_steps, steps);
+    setUniform1i(getUniforms(), UNIFORM_ao_samples, l->aoSamples);
+    beginGovernedFrame(&governor);
+    drawRect();
+    framePresent = PRESENT_GOVERNOR;
+  }
+  else if (useDeferred) {
+    drawDeferredFrame();
+    if (hdrBuffer.enabled) framePresent = PRESENT_HDR;
+  }
+  else if (!refiner.enabled) {
+    if (hdrBuffer.enabled) { beginHdrFrame(&hdrBuffer); framePresent = PRESENT_HDR; }
+    if (starts) useViewStarts();
+    drawRect();
+    if (starts) unbindViewStarts();
+  }
+  else {
+    if (changed) resetProgressive(&refiner);
+
+    if (!isProgressiveDone(&refiner)) {
+      beginProgressivePass(&refiner, tile);
+      setTileUniforms(tile[0], tile[1], tile[2], tile[3]);
+      drawRect();
+      endProgressivePass(&refiner);
+    }
+    framePresent = PRESENT_PROGRESSIVE;
+  }
+  getToneMap(&t, 1);
+  presentFrame(0, &t);
+  glUseProgram(program = mainProgram);
+  shaderVariant = 0;
 }
 
 
 ////////////////////////////////////////////////////////////////
-// Setup, input handling and drawing.
+// Headless rendering on the CPU.
+
+// Get the CPU renderer parameters from the current configuration.
+void getCpuRenderParams(CpuRenderParams* r) {
+  memcpy(r->camera, camera, sizeof(camera));
+  r->deepZoom = min_dist < DEEP_ZOOM_MIN_DIST;
+  r->fov_x = fov_x; r->fov_y = fov_y;
+  r->views = views; r->eye_separation = eye_separation;
+  r->tile_scale[0] = r->tile_scale[1] = 1;
+  r->tile_offset[0] = r->tile_offset[1] = 0;
+  r->min_dist = min_dist; r->max_steps = max_steps;
+  r->ao_eps = ao_eps; r->ao_strength = ao_strength;
+  r->glow_strength = glow_strength; r->dist_to_color = dist_to_color;
+  initMandelbox(&r->mb, par[0], iters, color_iters);
+  initMandelboxDouble(&r->mbDouble, par[0], iters, color_iters);
+}
 
-int main(int argc, char **argv) {
-  // Load configuration.
-  loadConfig(argc>=2 ? argv[1] : DEFAULT_CONFIG_FILE);
-  sanitizeParameters();
+// Render the current configuration on the CPU and save it, and its
+// auxiliary buffers to |auxFile| if it isn't 0. Return 0 on error.
+int renderCpuImage(char const* file, char const* auxFile, int threads) {
+  CpuRenderParams r;
+  CpuRenderStats stats;
+  ThreadPool* pool = createThreadPool(threads);
+  unsigned char* img = malloc((size_t)width * height * 3);
+  float* aux = auxFile ? malloc(sizeof(float) * AUX_CHANNELS * width * height) : 0;
+  int ok;
+
+  if (!img || (auxFile && !aux)) {
+    fprintf(stderr, "Out of memory for a %dx%d image\n", width, height);
+    free(img);
+    free(aux);
+    destroyThreadPool(pool);
+    return 0;
+  }
 
-  // Initialize SDL and OpenGL graphics.
-  SDL_Init(SDL_INIT_VIDEO) == 0 || die("SDL initialization failed: %s\n", SDL_GetError());
-  atexit(SDL_Quit);
+  getCpuRenderParams(&r);
+  renderCpuAux(pool, &r, width, height, img, aux, &stats);
+  ok = writeOutputFrame(imageOutput, file, width, height, img);
+  if (aux && !writeAuxFile(auxFile, width, height, aux)) {
+    fprintf(stderr, "Error writing %s\n", auxFile);
+    ok = 0;
+  }
 
-  // Set up the video mode, OpenGL state, shaders and shader parameters.
-  initGraphics();
-  initFPS(FPS_FRAMES_TO_AVERAGE);
+  fprintf(stderr, "%dx%d in %.3fs on %d threads: %.2f Mpixels/s, %.1f steps/pixel\n",
+    width, height, stats.milliseconds / 1000., pool->threads,
+    stats.pixels / 1000. / (stats.milliseconds ? stats.milliseconds : 1),
+    stats.steps / stats.pixels);
 
-  // Locked movement direction for mouse button movement.
-  int dirLocked = 0; float lockedDir[3];
+  free(img);
+  free(aux);
+  destroyThreadPool(pool);
+  return ok;
+}
 
-  // Main loop.
-  Controller ctl = CTL_CAM;  // the default controller is camera rotation
-  int consecutiveChanges = 0;
-  int done = 0;
 
-  while (!done) {
-    int ctlXChanged = 0, ctlYChanged = 0;
+////////////////////////////////////////////////////////////////
+// Keyframe animation.
 
-    // Raytrace a frame and tell it to the FPS structure.
-    setCamera();
+// Load keyframes from configuration files. Return the number of keyframes.
+int loadKeyFrames(char const** files, int n, KeyFrame** keys) {
+  int i;
+  *keys = malloc(sizeof(KeyFrame) * n);
+  for (i=0; i<n; i++) {
+    loadConfig(files[i]);
+    sanitizeParameters();
+    getKeyFrame(&(*keys)[i]);
+  }
+  return n;
+}
+
+// Render |frames| frames interpolated between keyframes to prefix00000.tga, ...
+// (or into one video stream).
+// The GPU (or CPU) renders the next frame while the previous one is written
+// to disk by writer threads. Return 0 on error.
+int renderAnimation(KeyFrame const* keys, int n, int frames, char const* prefix,
+                    int useCpu, int threads) {
+  ThreadPool* pool = 0;
+  Uint32 start = SDL_GetTicks();
+  int k, ok = 1;
+
+  setKeyFrame(&keys[0]);
+  if (useCpu) pool = createThreadPool(threads);
+  else initGraphics();
+
+  for (k=0; k<frames; k++) {
+    KeyFrame key;
+    char filename[256];
+    float t = frames > 1 ? easeInOut((float)k / (frames-1)) * (n-1) : 0;
+
+    interpolateKeyFrames(keys, n, t, &key);
+    setKeyFrame(&key);
+    orthogonalizeCamera();
+    getOutputName(filename, prefix, k);
+
+    if (useCpu) {
+      CpuRenderParams r;
+      unsigned char* img = malloc((size_t)width * height * 3);
+      if (!img) {
+        fprintf(stderr, "Out of memory for frame %d\n", k);
+        ok = 0;
+        frames = k;
+        break;
+      }
+      getCpuRenderParams(&r);
+      renderCpu(pool, &r, width, height, img, 0);
+      queueFrame(frameWriter, filename, width, height, img);
+    }
+    else {
+      SDL_Event event;
+      char caption[256];
+      ToneMap toneMap;
+      int mainProgram;
+
+      beginFrameCamera();
+      drawConePrepass();
+      mainProgram = useDeepZoom();
+      setUniforms();
+      useConePrepass();
+      framePresent = hdrBuffer.enabled ? PRESENT_HDR : PRESENT_WINDOW;
+      if (hdrBuffer.enabled) beginHdrFrame(&hdrBuffer);
+      drawRect();
+      getToneMap(&toneMap, 1);
+      presentFrame(0, &toneMap);
+      glUseProgram(program = mainProgram);
+      updateCapture(&capture);
+      saveScreenshot(filename, 0);
+      SDL_GL_SwapBuffers();
+
+      sprintf(caption, "Frame %d/%d", k+1, frames);
+      SDL_WM_SetCaption(caption, 0);
+      while (SDL_PollEvent(&event)) {
+        if (event.type == SDL_QUIT || (event.type == SDL_KEYDOWN && event.key.keysym.sym == SDLK_ESCAPE)) frames = k+1;
+      }
+    }
+  }
+
+  if (!useCpu) releaseCapture(&capture);
+  destroyThreadPool(pool);
+  fprintf(stderr, "%d frames in %.3fs\n", frames, (SDL_GetTicks() - start) / 1000.);
+  return ok;
+}
+
+
+////////////////////////////////////////////////////////////////
+// Posters.
+
+// Render a posterWidth x posterHeight image of the current configuration and
+// stream it to |file|, and its auxiliary buffers to |auxFile| if it isn't 0.
+// The image is rendered in bands from top to bottom; on the GPU, a band is a
+// row of tiles of at most width x height pixels, each drawn separately so no
+// draw call takes long. Only one band is in memory. In HDR mode, tiles are
+// drawn into the float buffer and tone mapped into the window, or into a
+// float target for 16-bit and float output. Return 0 on error.
+int renderPoster(char const* file, char const* auxFile, int posterWidth, int posterHeight, int useCpu,
+                 int threads) {
+  ImageFormat const* format = getFileFormat(file, outputFormat);
+  int sampleBytes = format->sampleBytes;
+  GLenum type = sampleBytes == 4 ? GL_FLOAT : sampleBytes == 2 ? GL_UNSIGNED_SHORT : GL_UNSIGNED_BYTE;
+  RenderTarget const* output = 0;  // of tone mapped tiles, 0: the window
+  ToneMap toneMap;
+  int pixelBytes = 3 * sampleBytes + (auxFile ? AUX_CHANNELS * sizeof(float) : 0);
+  int bandHeight = POSTER_BAND_BYTES / (posterWidth * pixelBytes);
+  int bands, band = 0, tiles = 0, ok, y0, y1, y;
+  Uint32 start = SDL_GetTicks(), encoding = 0;
+  ThreadPool* pool = 0;
+  unsigned char* rgb;
+  float* aux = 0;
+  Encoder* e;
+  Encoder* auxEncoder = 0;
+  int mainProgram = 0, colorProgram = 0;
+
+  if (bandHeight > height) bandHeight = height;
+  if (bandHeight < 1) bandHeight = 1;
+  bands = (posterHeight + bandHeight-1) / bandHeight;
+
+  if (format->wholeFrame) {
+    fprintf(stderr, "Posters can't be written as %s, it keeps the whole image in memory.\n", format->name);
+    return 0;
+  }
+  if (!(e = openEncoder(file, format, posterWidth, posterHeight, imageOutput->pool))) return 0;
+  if (auxFile && !(auxEncoder = openEncoder(auxFile, &auxFormat, posterWidth, posterHeight, 0))) {
+    closeEncoder(e);
+    return 0;
+  }
+  rgb = malloc((size_t)posterWidth * bandHeight * 3 * sampleBytes);
+  if (auxFile) aux = malloc((size_t)posterWidth * bandHeight * AUX_CHANNELS * sizeof(float));
+  if (!rgb || (auxFile && !aux)) fprintf(stderr, "Out of memory for a poster band of %d rows\n", bandHeight);
+  ok = rgb && (!auxFile || aux) && format->beginFrame(e) && (!auxEncoder || beginAuxFrame(auxEncoder));
+
+  if (useCpu) pool = createThreadPool(threads);
+  else {
+    initGraphics();
+    beginFrameCamera();
+    mainProgram = useDeepZoom();
     setUniforms();
+    colorProgram = program;
+    getToneMap(&toneMap, sampleBytes);
+    if (hdrBuffer.enabled && sampleBytes > 1 && !(output = getHdrOutput(&hdrBuffer))) {
+      fprintf(stderr, "16-bit and float output is not supported (needs float textures).\n");
+      ok = 0;
+    }
+    if (auxFile) {
+      // Tiles are drawn with the auxiliary buffers program, which writes the
+      // color too.
+      if (!auxProgram || !auxTarget.fbo || isDeepZoom()) {
+        fprintf(stderr, "Auxiliary buffers can't be drawn on the GPU%s, use --cpu.\n",
+          isDeepZoom() ? " in deep zoom mode" : "");
+        ok = 0;
+      }
+      else {
+        glUseProgram(program = auxProgram);
+        setUniforms();
+        colorProgram = program;
+      }
+    }
+    glPixelStorei(GL_PACK_ALIGNMENT, 1);
+    glPixelStorei(GL_PACK_ROW_LENGTH, posterWidth);  // tiles go straight into the band
+  }
 
-    glRects(-1,-1,1,1);
+  for (y1=posterHeight; y1>0 && ok; y1=y0, band++) {
+    int h;
+    Uint32 t;
 
-    SDL_GL_SwapBuffers();
-    updateFPS();
+    y0 = y1 > bandHeight ? y1 - bandHeight : 0;
+    h = y1 - y0;
 
-    // Show position and fps in the caption.
-    char caption[2048], controllerStr[256];
+    if (useCpu) {
+      CpuRenderParams r;
+      getCpuRenderParams(&r);
+      r.tile_scale[1] = (float)h / posterHeight;
+      r.tile_offset[1] = (float)(y0 + y1) / posterHeight - 1;
+      renderCpuAux(pool, &r, posterWidth, h, rgb, aux, 0);
+      tiles++;
+    }
+    else {
+      SDL_Event event;
+      char caption[256];
+      int x0;
+
+      for (x0=0; x0<posterWidth; x0+=width, tiles++) {
+        int w = posterWidth - x0 < width ? posterWidth - x0 : width;
+        int offscreen = hdrBuffer.enabled || aux, fromTarget = output || (aux && !hdrBuffer.enabled);
+        if (aux) bindAuxTarget(&auxTarget, hdrBuffer.enabled ? hdrBuffer.buffer.texture : 0);
+        else if (hdrBuffer.enabled) beginHdrFrame(&hdrBuffer);
+        glViewport(offscreen ? 0 : viewportOffset[0], offscreen ? 0 : viewportOffset[1], w, h);
+        setTileUniforms((float)w / posterWidth, (float)h / posterHeight,
+                        (float)(2*x0 + w) / posterWidth - 1, (float)(y0 + y1) / posterHeight - 1);
+        drawRect();
+        if (aux) readAuxTarget(&auxTarget, w, h, aux + x0*AUX_CHANNELS, posterWidth);
+
+        if (hdrBuffer.enabled) {
+          presentHdrFrame(&hdrBuffer, output, viewportOffset[0], viewportOffset[1], &toneMap);
+          glUseProgram(program = colorProgram);
+        }
+        if (aux && !hdrBuffer.enabled) readAuxColor(&auxTarget);
+        else glReadBuffer(output ? GL_COLOR_ATTACHMENT0 : GL_BACK);
+        glReadPixels(fromTarget ? 0 : viewportOffset[0], fromTarget ? 0 : viewportOffset[1], w, h, GL_RGB, type,
+                     rgb + x0*3*sampleBytes);
+        bindRenderTarget(0);
+      }
 
-    sprintf(caption, "%s %.2ffps [%.3f %.3f %.3f] %dms",
-      printController(controllerStr, ctl),
-      getFPS(), position[0], position[1], position[2], getLastFrameDuration()
-    );
-    SDL_WM_SetCaption(caption, 0);
+      sprintf(caption, "Poster band %d/%d", band+1, bands);
+      SDL_WM_SetCaption(caption, 0);
+      while (SDL_PollEvent(&event)) {
+        if (event.type == SDL_QUIT || (event.type == SDL_KEYDOWN && event.key.keysym.sym == SDLK_ESCAPE)) {
+          fprintf(stderr, "Poster cancelled\n");
+          ok = 0;
+        }
+      }
+    }
+
+    // Rows are bottom first, the encoder wants the top row first.
+    t = SDL_GetTicks();
+    for (y=h-1; y>=0 && ok; y--) ok = format->writeRows(e, rgb + (size_t)y * posterWidth * 3 * sampleBytes, 1);
+    for (y=h-1; y>=0 && ok && aux; y--) {
+      ok = writeAuxRows(auxEncoder, (unsigned char const*)(aux + (size_t)y * posterWidth * AUX_CHANNELS), 1);
+    }
+    encoding += SDL_GetTicks() - t;
+  }
+
+  ok = ok && format->endFrame(e) && (!auxEncoder || endAuxFrame(auxEncoder));
+  countOutputFrame(imageOutput, format, (double)posterWidth * posterHeight * 3 * sampleBytes, e->bytes, encoding);
+  ok = closeEncoder(e) && ok;
+  ok = closeEncoder(auxEncoder) && ok;
+
+  if (!useCpu) {
+    glPixelStorei(GL_PACK_ROW_LENGTH, 0);
+    glViewport(viewportOffset[0], viewportOffset[1], width, height);
+    glUseProgram(program = mainProgram);
+  }
+  destroyThreadPool(pool);
+  free(rgb);
+  free(aux);
+
+  fprintf(stderr, "%dx%d poster in %d tiles (%d bands) in %.3fs\n",
+    posterWidth, posterHeight, tiles, bands, (SDL_GetTicks() - start) / 1000.);
+  return ok;
+}
+
+
+////////////////////////////////////////////////////////////////
+// Render farm (see render_farm.h).
+
+// A coordinator job: frames interpolated between keyframes as for --animate,
+// or one image of the first keyframe.
+typedef struct FarmJob {
+  KeyFrame const* keys;
+  int n, frames;
+  int animation;
+  char const* output;
+  KeyFrame key;  // of the last unit handed out
+} FarmJob;
+
+// The unit data of a frame is its keyframe.
+void getFarmKeyFrame(void* context, int frame, void const** data) {
+  FarmJob* job = context;
+  float t = job->frames > 1 ? easeInOut((float)frame / (job->frames-1)) * (job->n-1) : 0;
+
+  interpolateKeyFrames(job->keys, job->n, t, &job->key);
+  setKeyFrame(&job->key);
+  orthogonalizeCamera();
+  getKeyFrame(&job->key);
+  *data = &job->key;
+}
+
+int writeFarmFrame(void* context, int frame, int width, int height, unsigned char* rgb) {
+  FarmJob* job = context;
+  char filename[256];
 
-    // Process events.
+  getOutputName(filename, job->output, job->animation ? frame : -1);
+  queueFrame(frameWriter, filename, width, height, rgb);
+  return 1;
+}
+
+// Render |frames| frames interpolated between keyframes (or one image of the
+// first keyframe if |frames| is 0) on the workers that connect to |port|.
+// Return 0 on error.
+int runCoordinator(KeyFrame const* keys, int n, int frames, char const* output, int port) {
+  FarmJob job;
+
+  memset(&job, 0, sizeof(job));
+  job.keys = keys;
+  job.n = n;
+  job.frames = frames > 0 ? frames : 1;
+  job.animation = frames > 0;
+  job.output = output;
+  return runFarmCoordinator(port, job.frames, keys[0].width, keys[0].height, sizeof(KeyFrame),
+                            getFarmKeyFrame, writeFarmFrame, &job);
+}
+
+// A worker renders on the CPU with |pool|, or on the GPU in a window of the
+// frame size.
+typedef struct FarmNode {
+  ThreadPool* pool;
+  int windowWidth, windowHeight;
+} FarmNode;
+
+int renderFarmTile(void* context, FarmTile const* t, void const* data, unsigned char* rgb) {
+  FarmNode* node = context;
+  float scaleX = (float)t->width / t->frameWidth, scaleY = (float)t->height / t->frameHeight;
+  float offsetX = (float)(2*t->x + t->width) / t->frameWidth - 1;
+  float offsetY = (float)(2*t->y + t->height) / t->frameHeight - 1;
+
+  setKeyFrame(data);
+  if (width != t->frameWidth || height != t->frameHeight) return 0;
+
+  if (node->pool) {
+    CpuRenderParams r;
+    getCpuRenderParams(&r);
+    r.tile_scale[0] = scaleX; r.tile_scale[1] = scaleY;
+    r.tile_offset[0] = offsetX; r.tile_offset[1] = offsetY;
+    renderCpu(node->pool, &r, t->width, t->height, rgb, 0);
+  }
+  else {
     SDL_Event event;
+    ToneMap tm;
+    int mainProgram;
+
+    if (width != node->windowWidth || height != node->windowHeight) {
+      initGraphics();
+      node->windowWidth = width;
+      node->windowHeight = height;
+    }
+    beginFrameCamera();
+    mainProgram = useDeepZoom();
+    setUniforms();
+    if (hdrBuffer.enabled) beginHdrFrame(&hdrBuffer);
+    glViewport(hdrBuffer.enabled ? 0 : viewportOffset[0], hdrBuffer.enabled ? 0 : viewportOffset[1],
+               t->width, t->height);
+    setTileUniforms(scaleX, scaleY, offsetX, offsetY);
+    drawRect();
+    getToneMap(&tm, 1);
+    if (hdrBuffer.enabled) presentHdrFrame(&hdrBuffer, 0, viewportOffset[0], viewportOffset[1], &tm);
+    glPixelStorei(GL_PACK_ALIGNMENT, 1);
+    glReadPixels(viewportOffset[0], viewportOffset[1], t->width, t->height, GL_RGB, GL_UNSIGNED_BYTE, rgb);
+    glViewport(viewportOffset[0], viewportOffset[1], width, height);
+    glUseProgram(program = mainProgram);
+
+    // ESC leaves the job; the coordinator gives the tiles to other workers.
     while (SDL_PollEvent(&event)) {
-      switch (event.type) {
-        case SDL_QUIT: done |= 1; break;
+      if (event.type == SDL_QUIT || (event.type == SDL_KEYDOWN && event.key.keysym.sym == SDLK_ESCAPE)) return -1;
+    }
+  }
+  return 1;
+}
 
-        case SDL_MOUSEBUTTONDOWN: {
-          if (!grabbedInput) { grabbedInput = 1; SDL_ShowCursor(SDL_DISABLE); SDL_WM_GrabInput(SDL_GRAB_ON); }
-        } break;
+// Render tiles for the coordinator at |address| until it is done. Return 0 on error.
+int runWorker(char const* address, int useCpu, int threads) {
+  FarmNode node;
+  int ok;
 
-        case SDL_KEYDOWN: switch (event.key.keysym.sym) {
-          case SDLK_ESCAPE: {
-            if (grabbedInput && !fullscreen) { grabbedInput = 0; SDL_ShowCursor(SDL_ENABLE); SDL_WM_GrabInput(SDL_GRAB_OFF); }
-            else done |= 1;
-          } break;
-
-          // Switch fullscreen mode (loses the whole OpenGL context in Windows).
-          case SDLK_RETURN: case SDLK_KP_ENTER: {
-            fullscreen ^= 1; grabbedInput = 1; initGraphics();
-          } break;
-
-          // Save config and screenshot (filename = current time).
-          case SDLK_SPACE: {
-            time_t t = time(0);
-            struct tm* ptm = localtime(&t);
-            char filename[256];
-            strftime(filename, 256, "%Y%m%d_%H%M%S.cfg", ptm); saveConfig(filename);
-            strftime(filename, 256, "%Y%m%d_%H%M%S.tga", ptm); saveScreenshot(filename);
-          } break;
-
-          // Change movement speed.
-          case SDLK_LSHIFT: case SDLK_RSHIFT: speed *= 2; break;
-          case SDLK_LCTRL:  case SDLK_RCTRL:  speed /= 2; break;
-
-          // Resolve controller value changes that happened during rendering.
-          case SDLK_LEFT:  ctlXChanged = 1; updateControllerX(ctl, -(consecutiveChanges=1)); break;
-          case SDLK_RIGHT: ctlXChanged = 1; updateControllerX(ctl,  (consecutiveChanges=1)); break;
-          case SDLK_DOWN:  ctlYChanged = 1; updateControllerY(ctl, -(consecutiveChanges=1)); break;
-          case SDLK_UP:    ctlYChanged = 1; updateControllerY(ctl,  (consecutiveChanges=1)); break;
-
-          // Otherwise see whether the active controller has changed.
-          default: {
-            Controller oldCtl = ctl;
-            changeController(event.key.keysym.sym, &ctl);
-            if (ctl != oldCtl) { consecutiveChanges = 0; }
-          } break;
-        }
-        break;
+  memset(&node, 0, sizeof(node));
+  if (useCpu) node.pool = createThreadPool(threads);
+  ok = runFarmWorker(address, sizeof(KeyFrame), renderFarmTile, &node);
+  destroyThreadPool(node.pool);
+  return ok;
+}
+
+
+////////////////////////////////////////////////////////////////
+// Benchmarks.
+
+#define BENCHMARK_MAX_KEYS 64
+
+// Write |s| as a JSON string.
+void writeJsonString(FILE* f, char const* s) {
+  fputc('"', f);
+  for (; *s; s++) {
+    if (*s == '"' || *s == '\\') fprintf(f, "\\%c", *s);
+    else if ((unsigned char)*s < 32) fprintf(f, "\\u%04x", *s);
+    else fputc(*s, f);
+  }
+  fputc('"', f);
+}
+
+// Write the mean, minimum, percentiles and maximum of a profiler series.
+void writeBenchmarkSeries(FILE* f, Profiler const* p, int series, char const* name) {
+  double sum = 0;
+  float lo = 0, hi = 0, pc[3];
+  int i, n = getProfilePercentiles(p, series, 0, pc);
+
+  if (!n) return;
+  for (i=getFirstProfileFrame(p); i<p->frameCount; i++) {
+    float v = getProfileFrame(p, i)->values[series];
+    if (v < 0) continue;
+    if (sum == 0 || v < lo) lo = v;
+    if (sum == 0 || v > hi) hi = v;
+    sum += v;
+  }
+  fprintf(f, ",\n      \"%s\": {\"mean\": %.3f, \"min\": %.3f, \"p50\": %.3f, \"p95\": %.3f, \"p99\": %.3f, \"max\": %.3f}",
+    name, sum / n, lo, pc[0], pc[1], pc[2], hi);
+}
+
+// Render the current frame again with the step counting shader and return
+// the sum of the steps of all pixels. |rgb| has room for the frame.
+double countGpuSteps(unsigned char* rgb) {
+  int mainProgram = program, i;
+  double steps = 0;
+
+  glUseProgram(program = stepProgram);
+  setUniforms();
+  useConePrepass();
+  drawRect();
+
+  glReadBuffer(GL_BACK);
+  glPixelStorei(GL_PACK_ALIGNMENT, 1);
+  glReadPixels(viewportOffset[0], viewportOffset[1], width, height, GL_RGB, GL_UNSIGNED_BYTE, rgb);
+  for (i=0; i<width*height; i++) steps += rgb[3*i] * 256 + rgb[3*i+1];
+
+  glUseProgram(program = mainProgram);
+  return steps;
+}
+
+// Play the camera path of one scene back: |frames| frames interpolated
+// between the keyframes, as for --animate. Needs initGraphics() for the first
+// keyframe, unless rendering on the CPU. The frame time is measured without
+// the step counting pass, which runs after it. Write the results as a JSON
+// object. Return 0 if the run was cancelled or has failed.
+int runBenchmarkScene(FILE* out, char const* name, KeyFrame const* keys, int n, int frames,
+                      ThreadPool* pool) {
+  Profiler p;
+  unsigned char* rgb;
+  double steps = 0, pixels = 0, milliseconds = 0;
+  int k, ok = 1;
+
+  if (!(rgb = malloc((size_t)width * height * 3))) {
+    fprintf(stderr, "Out of memory for a %dx%d frame\n", width, height);
+    ok = 0;
+  }
+  initProfiler(&p, 1);
+
+  if (!pool) {
+    initProfilerQueries(&p);
+    if (!stepProgram) fprintf(stderr, "The shader has no STEP_COUNT variant, steps are not counted.\n");
+
+    // Warm up: the driver may finish compiling the shaders on the first draw.
+    beginFrameCamera();
+    drawConePrepass();
+    setUniforms();
+    useConePrepass();
+    drawRect();
+    glFinish();
+  }
+
+  for (k=0; k<frames && ok; k++) {
+    KeyFrame key;
+    float t = frames > 1 ? easeInOut((float)k / (frames-1)) * (n-1) : 0;
+
+    interpolateKeyFrames(keys, n, t, &key);
+    setKeyFrame(&key);
+    orthogonalizeCamera();
+
+    beginProfileFrame(&p, PROFILE_DRAW);
+    if (pool) {
+      CpuRenderParams r;
+      CpuRenderStats stats;
+      getCpuRenderParams(&r);
+      renderCpu(pool, &r, width, height, rgb, &stats);
+      endProfileFrame(&p);
+      steps += stats.steps;
+    }
+    else {
+      SDL_Event event;
+      char caption[256];
+
+      beginGpuProfile(&p);
+      beginFrameCamera();
+      drawConePrepass();
+      setUniforms();
+      useConePrepass();
+      drawRect();
+      endGpuProfile(&p);
+      glFinish();
+      endProfileFrame(&p);
+
+      if (stepProgram) steps += countGpuSteps(rgb);
+      SDL_GL_SwapBuffers();
+
+      sprintf(caption, "Benchmark %s: frame %d/%d", name, k+1, frames);
+      SDL_WM_SetCaption(caption, 0);
+      while (SDL_PollEvent(&event)) {
+        if (event.type == SDL_QUIT || (event.type == SDL_KEYDOWN && event.key.keysym.sym == SDLK_ESCAPE)) ok = 0;
+      }
+    }
+    pixels += width * height;
+    if (p.frameCount) milliseconds += getProfileFrame(&p, p.frameCount-1)->values[PROFILE_TOTAL];
+  }
+  collectProfilerQueries(&p);
+
+  fprintf(out, "    {\n      \"name\": ");
+  writeJsonString(out, name);
+  fprintf(out, ",\n      \"width\": %d, \"height\": %d, \"frames\": %d", width, height, p.frameCount);
+  writeBenchmarkSeries(out, &p, PROFILE_TOTAL, "frame_ms");
+  writeBenchmarkSeries(out, &p, PROFILE_GPU, "gpu_ms");
+  fprintf(out, ",\n      \"rays_per_second\": %.0f", milliseconds > 0 ? pixels * 1000 / milliseconds : 0);
+  if (pool || stepProgram) fprintf(out, ",\n      \"steps_per_pixel\": %.3f", pixels > 0 ? steps / pixels : 0);
+  fprintf(out, "\n    }");
+
+  fprintf(stderr, "%-16s %4dx%-4d %3d frames, %8.2fms/frame, %6.2f Mrays/s, %.1f steps/pixel\n",
+    name, width, height, p.frameCount, p.frameCount ? milliseconds / p.frameCount : 0,
+    milliseconds > 0 ? pixels / 1000 / milliseconds : 0, pixels > 0 ? steps / pixels : 0);
+
+  releaseProfilerQueries(&p);
+  releaseProfiler(&p);
+  free(rgb);
+  return ok;
+}
+
+// Run the scenes listed in |sceneFile| and write the results as JSON to
+// |out|. Each line of the file is "name frames keyframe.cfg ...", with paths
+// relative to the file; '#' starts a comment. On the CPU, |threads| render
+// threads are used (0: one per core). Return 0 on error.
+int runBenchmark(char const* sceneFile, FILE* out, int useCpu, int threads) {
+  char line[4096], dir[256], paths[BENCHMARK_MAX_KEYS][512];
+  char const* files[BENCHMARK_MAX_KEYS];
+  char const* slash;
+  ThreadPool* pool = 0;
+  FILE* f;
+  int scenes = 0, ok = 1, i;
+
+  if (!(f = fopen(sceneFile, "r"))) { fprintf(stderr, "Can't open %s\n", sceneFile); return 0; }
+
+  // Paths in the file are relative to its directory.
+  slash = strrchr(sceneFile, '/');
+  if (!slash) slash = strrchr(sceneFile, '\\');
+  i = slash ? slash + 1 - sceneFile : 0;
+  if (i >= (int)sizeof(dir)) i = 0;
+  memcpy(dir, sceneFile, i);
+  dir[i] = 0;
+
+  if (useCpu) pool = createThreadPool(threads);
+  benchmarking = 1;
+
+  while (ok && fgets(line, sizeof(line), f)) {
+    char name[256];
+    char* token;
+    KeyFrame* keys;
+    int frames, n = 0;
+
+    if ((token = strchr(line, '#'))) *token = 0;
+    if (!(token = strtok(line, " \t\r\n"))) continue;
+    snprintf(name, sizeof(name), "%s", token);
+    if (!(token = strtok(0, " \t\r\n")) || (frames = atoi(token)) < 1) {
+      fprintf(stderr, "%s: scene %s needs a number of frames\n", sceneFile, name);
+      ok = 0;
+      break;
+    }
+    while ((token = strtok(0, " \t\r\n"))) {
+      n < BENCHMARK_MAX_KEYS ||
+        die("%s: scene %s has more than %d keyframes\n", sceneFile, name, BENCHMARK_MAX_KEYS);
+      snprintf(paths[n], sizeof(paths[n]), "%s%s", dir, token);
+      files[n] = paths[n];
+      n++;
+    }
+    if (!n) { fprintf(stderr, "%s: scene %s has no keyframes\n", sceneFile, name); ok = 0; break; }
+
+    // Non-interpolated parameters come from the last keyframe, as for --animate.
+    loadKeyFrames(files, n, &keys);
+    setKeyFrame(&keys[0]);
+    orthogonalizeCamera();
+    if (!useCpu) initGraphics();
+
+    if (!scenes++) {
+      fprintf(out, "{\n  \"renderer\": \"%s\",\n  \"device\": ", useCpu ? "cpu" : "gpu");
+      if (useCpu) fprintf(out, "\"%d threads\"", pool->threads);
+      else {
+        char const* renderer = (char const*)glGetString(GL_RENDERER);
+        writeJsonString(out, renderer ? renderer : "unknown");
       }
+      fprintf(out, ",\n  \"scenes\": [\n");
     }
+    else fprintf(out, ",\n");
+
+    ok = runBenchmarkScene(out, name, keys, n, frames, pool);
+    free(keys);
+  }
+  fclose(f);
+
+  if (scenes) fprintf(out, "\n  ]\n}\n");
+  else { fprintf(stderr, "%s: no scenes\n", sceneFile); ok = 0; }
+
+  if (!useCpu && scenes) releaseCapture(&capture);
+  destroyThreadPool(pool);
+  return ok;
+}
+
+
+////////////////////////////////////////////////////////////////
+// Simulation.
+
+// Input handling and camera movement run on their own thread at a fixed
+// rate, so movement is in units per tick instead of per frame, and controls
+// keep working while a frame renders. After every tick, the camera and
+// parameters of the simulation thread are published to the renderer.
+
+#define SIMULATION_HZ      30
+#define SIMULATION_MAX_LAG 0.25  // seconds of ticks to catch up, then skip them
+
+// What the renderer gets from the simulation.
+typedef struct SimulationState {
+  KeyFrame key;      // camera and parameters
+  Controller ctl;    // the active controller
+  int grabbedInput;  // should the mouse and keyboard be grabbed?
+  int screenshots;   // screenshots requested so far (Space)
+  int capturing;     // capture every frame (V)
+  int heatmap;       // show the raymarching steps (H)
+  int done;          // the user wants to quit
+  Uint32 inputTime;  // of the tick in the input log, milliseconds
+} SimulationState;
+
+typedef struct Simulation {
+  SimulationState state;
+  int consecutiveChanges;           // of the active controller
+  int dirLocked; double lockedDir[3];  // movement direction while a mouse button is held
+} Simulation;
+
+Snapshot simulationSnapshot;
+SDL_Thread* simulationThread;
+int volatile simulationQuit;  // set by the renderer on exit
+
+// Does SDL pump events on its own thread? Otherwise the renderer does it,
+// see waitForFrame().
+int eventThread;
+int useFrameFence;  // can waitForFrame() wait on a fence (ARB_sync)?
+
+// Without an event thread, wait for the GPU to finish the frame and pump the
+// events every tick meanwhile, so the simulation gets input at its own rate
+// however slow the frame is. Without fences, events are pumped once.
+void waitForFrame(void) {
+  GLsync fence;
+  if (useFrameFence && (fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0))) {
+    while (glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000 / SIMULATION_HZ) == GL_TIMEOUT_EXPIRED) {
+      SDL_PumpEvents();
+    }
+    glDeleteSync(fence);
+  }
+  SDL_PumpEvents();
+}
+
+// Handle the input of one tick.
+void updateSimulation(Simulation* sim) {
+  SimulationState* s = &sim->state;
+  int ctlXChanged = 0, ctlYChanged = 0;
 
-    // Get keyboard and mouse state.
-    Uint8* keystate = SDL_GetKeyState(0);
-    int mouse_dx, mouse_dy;
-    Uint8 mouse_buttons = SDL_GetRelativeMouseState(&mouse_dx, &mouse_dy);
-    int mouse_button_left = mouse_buttons & SDL_BUTTON(SDL_BUTTON_LEFT);
-    int mouse_button_right = mouse_buttons & SDL_BUTTON(SDL_BUTTON_RIGHT);
+  // Process events (the logged ones in a replay).
+  SDL_Event event;
+  while (pollInput(&inputLog, &event)) {
+    switch (event.type) {
+      case SDL_QUIT: s->done |= 1; break;
 
-    // Translate the camera.
-    if (mouse_button_left || mouse_button_right) {
-      if (!dirLocked) {
-        int i;
-        for (i=0; i<3; i++) lockedDir[i] = direction[i];
+      case SDL_MOUSEBUTTONDOWN: s->grabbedInput = 1; break;
+
+      case SDL_KEYDOWN: switch (event.key.keysym.sym) {
+        case SDLK_ESCAPE: {
+          if (s->grabbedInput && !fullscreen) s->grabbedInput = 0;
+          else s->done |= 1;
+        } break;
+
+        // Switch fullscreen mode (loses the whole OpenGL context in Windows).
+        case SDLK_RETURN: case SDLK_KP_ENTER: fullscreen ^= 1; s->grabbedInput = 1; break;
+
+        // Save config and screenshot of the next frame.
+        case SDLK_SPACE: s->screenshots++; break;
+
+        // Switch progressive refinement on/off.
+        case SDLK_p: progressive = progressive > 1 || progressive < -1 ? -progressive : 4; break;
+
+        // Start/stop capturing every frame (filename = start time + frame number).
+        case SDLK_v: s->capturing ^= 1; break;
+
+        // Switch the step count heatmap on/off.
+        case SDLK_h: s->heatmap ^= 1; break;
+
+        // Change movement speed.
+        case SDLK_LSHIFT: case SDLK_RSHIFT: speed *= 2; break;
+        case SDLK_LCTRL:  case SDLK_RCTRL:  speed /= 2; break;
+
+        // Resolve controller value changes that happened during the tick.
+        case SDLK_LEFT:  ctlXChanged = 1; updateControllerX(s->ctl, -(sim->consecutiveChanges=1)); break;
+        case SDLK_RIGHT: ctlXChanged = 1; updateControllerX(s->ctl,  (sim->consecutiveChanges=1)); break;
+        case SDLK_DOWN:  ctlYChanged = 1; updateControllerY(s->ctl, -(sim->consecutiveChanges=1)); break;
+        case SDLK_UP:    ctlYChanged = 1; updateControllerY(s->ctl,  (sim->consecutiveChanges=1)); break;
+
+        // Otherwise see whether the active controller has changed.
+        default: {
+          Controller oldCtl = s->ctl;
+          changeController(event.key.keysym.sym, &s->ctl);
+          if (s->ctl != oldCtl) { sim->consecutiveChanges = 0; }
+        } break;
       }
-      dirLocked = 1;
+      break;
+    }
+  }
+
+  // Get keyboard and mouse state.
+  Uint8* keystate = getInputKeyState(&inputLog);
+  int mouse_dx, mouse_dy;
+  Uint8 mouse_buttons = getInputMouseState(&inputLog, &mouse_dx, &mouse_dy);
+  int mouse_button_left = mouse_buttons & SDL_BUTTON(SDL_BUTTON_LEFT);
+  int mouse_button_right = mouse_buttons & SDL_BUTTON(SDL_BUTTON_RIGHT);
+
+  // Translate the camera.
+  if (mouse_button_left || mouse_button_right) {
+    if (!sim->dirLocked) {
+      int i;
+      for (i=0; i<3; i++) sim->lockedDir[i] = direction[i];
     }
-    else dirLocked = 0;
+    sim->dirLocked = 1;
+  }
+  else sim->dirLocked = 0;
 
-    if (mouse_button_left) moveCameraAbsolute(lockedDir, speed);
-    if (mouse_button_right) moveCameraAbsolute(lockedDir, -speed);
-    if (mouse_button_left && mouse_button_right) moveCameraAbsolute(lockedDir, speed/4);
+  if (mouse_button_left) moveCameraAbsolute(sim->lockedDir, speed);
+  if (mouse_button_right) moveCameraAbsolute(sim->lockedDir, -speed);
+  if (mouse_button_left && mouse_button_right) moveCameraAbsolute(sim->lockedDir, speed/4);
 
-    if (keystate[SDLK_LALT]) moveCamera(0, 0, speed);
+  if (keystate[SDLK_LALT]) moveCamera(0, 0, speed);
 
-    if (keystate[SDLK_w]) moveCamera(0, speed, 0);
-    if (keystate[SDLK_s]) moveCamera(0, -speed, 0);
-    if (keystate[SDLK_w] && keystate[SDLK_s]) moveCamera(0, 0, speed);
+  if (keystate[SDLK_w]) moveCamera(0, speed, 0);
+  if (keystate[SDLK_s]) moveCamera(0, -speed, 0);
+  if (keystate[SDLK_w] && keystate[SDLK_s]) moveCamera(0, 0, speed);
 
-    if (keystate[SDLK_a]) moveCamera(-speed, 0, 0);
-    if (keystate[SDLK_d]) moveCamera( speed, 0, 0);
-    if (keystate[SDLK_a] && keystate[SDLK_d]) moveCamera(0, 0, -speed);
+  if (keystate[SDLK_a]) moveCamera(-speed, 0, 0);
+  if (keystate[SDLK_d]) moveCamera( speed, 0, 0);
+  if (keystate[SDLK_a] && keystate[SDLK_d]) moveCamera(0, 0, -speed);
 
-    if ((keystate[SDLK_LALT] || (keystate[SDLK_w] && keystate[SDLK_s])) && (keystate[SDLK_a] && keystate[SDLK_d])) moveCamera(0, 0, speed/4);
+  if ((keystate[SDLK_LALT] || (keystate[SDLK_w] && keystate[SDLK_s])) && (keystate[SDLK_a] && keystate[SDLK_d])) moveCamera(0, 0, speed/4);
+
+  // Rotate the camera.
+  if (s->grabbedInput && (mouse_dx != 0 || mouse_dy != 0)) {
+    float len = sqrt(mouse_dx*mouse_dx + mouse_dy*mouse_dy);
+    rotateCamera(mouse_rot_speed * len, mouse_dy/len, mouse_dx/len, 0);
+  }
+  if (keystate[SDLK_q]) rotateCamera( keyb_rot_speed, 0, 0, 1);
+  if (keystate[SDLK_e]) rotateCamera(-keyb_rot_speed, 0, 0, 1);
+
+  // Change the value of the active controller.
+  if (!ctlXChanged) {
+    if (keystate[SDLK_LEFT])  { ctlXChanged = 1; updateControllerX(s->ctl, -++sim->consecutiveChanges); }
+    if (keystate[SDLK_RIGHT]) { ctlXChanged = 1; updateControllerX(s->ctl,  ++sim->consecutiveChanges); }
+  }
+  if (!ctlYChanged) {
+    if (keystate[SDLK_DOWN])  { ctlYChanged = 1; updateControllerY(s->ctl, -++sim->consecutiveChanges); }
+    if (keystate[SDLK_UP])    { ctlYChanged = 1; updateControllerY(s->ctl,  ++sim->consecutiveChanges); }
+  }
 
-    // Rotate the camera.
-    if (grabbedInput && (mouse_dx != 0 || mouse_dy != 0)) {
-      float len = sqrt(mouse_dx*mouse_dx + mouse_dy*mouse_dy);
-      rotateCamera(mouse_rot_speed * len, mouse_dy/len, mouse_dx/len, 0);
+  if (!(ctlXChanged || ctlYChanged)) sim->consecutiveChanges = 0;
+}
+
+// The simulation thread: starts from |start|, ticks at SIMULATION_HZ and
+// publishes its state after every tick, until the user or the renderer quits.
+int simulationMain(void* start) {
+  Simulation sim;
+  double next = getTimerSeconds();
+
+  memset(&sim, 0, sizeof(sim));
+  sim.state = *(SimulationState const*)start;
+  setKeyFrame(&sim.state.key);
+
+  while (!simulationQuit && !sim.state.done) {
+    double now = getTimerSeconds();
+    if (now < next) { SDL_Delay((Uint32)((next - now) * 1000)); continue; }
+    next = now - next > SIMULATION_MAX_LAG ? now : next + 1. / SIMULATION_HZ;
+
+    if (beginInputFrame(&inputLog)) {
+      updateSimulation(&sim);
+      endInputFrame(&inputLog);
     }
-    if (keystate[SDLK_q]) rotateCamera( keyb_rot_speed, 0, 0, 1);
-    if (keystate[SDLK_e]) rotateCamera(-keyb_rot_speed, 0, 0, 1);
+    else sim.state.done = 1;  // end of the replay
+
+    getKeyFrame(&sim.state.key);
+    sim.state.inputTime = inputLog.frame.time;
+    *(SimulationState*)getSnapshotBuffer(&simulationSnapshot) = sim.state;
+    publishSnapshot(&simulationSnapshot);
+  }
+  return 0;
+}
+
+// Start the simulation from the current camera and parameters.
+void startSimulation(void) {
+  static SimulationState start;
+
+  memset(&start, 0, sizeof(start));
+  getKeyFrame(&start.key);
+  start.ctl = CTL_CAM;  // the default controller is camera rotation
+  start.grabbedInput = grabbedInput;
+
+  initSnapshot(&simulationSnapshot, sizeof(SimulationState)) || die("Out of memory\n");
+  *(SimulationState*)getSnapshotBuffer(&simulationSnapshot) = start;
+  publishSnapshot(&simulationSnapshot);
+
+  simulationQuit = 0;
+  simulationThread = SDL_CreateThread(simulationMain, &start);
+}
+
+void stopSimulation(void) {
+  simulationQuit = 1;
+  SDL_WaitThread(simulationThread, 0);
+  releaseSnapshot(&simulationSnapshot);
+}
+
+
+////////////////////////////////////////////////////////////////
+// Setup and drawing.
 
-    // Change the value of the active controller.
-    if (!ctlXChanged) {
-      if (keystate[SDLK_LEFT])  { ctlXChanged = 1; updateControllerX(ctl, -++consecutiveChanges); }
-      if (keystate[SDLK_RIGHT]) { ctlXChanged = 1; updateControllerX(ctl,  ++consecutiveChanges); }
+int main(int argc, char **argv) {
+  char const* configFile = DEFAULT_CONFIG_FILE;
+  char const* output = 0;
+  char const* format = DEFAULT_FORMAT;
+  char const* profileFile = 0;
+  char const* benchmarkFile = 0;
+  char const* recordFile = 0;
+  char const* replayFile = 0;
+  char const* workerAddress = 0;
+  char const* auxFile = 0;
+  char const** files = malloc(sizeof(char*) * argc);
+  int fileCount = 0;
+  int benchDistance = 0, useCpu = 0, threads = 0, frames = 0;
+  int posterWidth = 0, posterHeight = 0;
+  int coordinatorPort = 0;
+  int i;
+
+  // Parse command line options. Anything else is a configuration file
+  // (or a keyframe for animations).
+  for (i=1; i<argc; i++) {
+    if (!strcmp(argv[i], "--bench-de")) benchDistance = 1;
+    else if (!strcmp(argv[i], "--cpu")) useCpu = 1;
+    else if (!strcmp(argv[i], "--threads") && i+1 < argc) threads = atoi(argv[++i]);
+    else if (!strcmp(argv[i], "--animate") && i+1 < argc) frames = atoi(argv[++i]);
+    else if (!strcmp(argv[i], "--out") && i+1 < argc) output = argv[++i];
+    else if (!strcmp(argv[i], "--format") && i+1 < argc) format = argv[++i];
+    else if (!strcmp(argv[i], "--profile") && i+1 < argc) profileFile = argv[++i];
+    else if (!strcmp(argv[i], "--benchmark") && i+1 < argc) benchmarkFile = argv[++i];
+    else if (!strcmp(argv[i], "--record") && i+1 < argc) recordFile = argv[++i];
+    else if (!strcmp(argv[i], "--replay") && i+1 < argc) replayFile = argv[++i];
+    else if (!strcmp(argv[i], "--poster") && i+1 < argc) sscanf(argv[++i], "%dx%d", &posterWidth, &posterHeight);
+    else if (!strcmp(argv[i], "--coordinator") && i+1 < argc) coordinatorPort = atoi(argv[++i]);
+    else if (!strcmp(argv[i], "--worker") && i+1 < argc) workerAddress = argv[++i];
+    else if (!strcmp(argv[i], "--aux") && i+1 < argc) auxFile = argv[++i];
+    else if (!strcmp(argv[i], "--variants")) blockingVariants = 1;
+    else files[fileCount++] = argv[i];
+  }
+  if (fileCount) configFile = files[0];
+  exportingAux = auxFile != 0;
+  (outputFormat = getImageFormat(format)) != 0 || die("Unknown format: %s\n", format);
+  (outputFormat->sampleBytes == 1 || (!useCpu && !coordinatorPort)) ||
+    die("The %s format needs the GPU and can't be rendered with --cpu or --coordinator.\n", outputFormat->name);
+  (!auxFile || ((useCpu || (posterWidth > 0 && posterHeight > 0)) && !frames && !coordinatorPort &&
+                !workerAddress && !benchmarkFile && !benchDistance)) ||
+    die("--aux only works for an image rendered with --cpu or --poster.\n");
+
+  // Run the benchmark scenes and exit.
+  if (benchmarkFile) {
+    FILE* out = stdout;
+    int ok;
+    output && strcmp(output, "-") && !(out = fopen(output, "w")) && die("Can't open %s\n", output);
+    SDL_Init(useCpu ? SDL_INIT_TIMER : SDL_INIT_VIDEO) == 0 || die("SDL initialization failed: %s\n", SDL_GetError());
+    atexit(SDL_Quit);
+    ok = runBenchmark(benchmarkFile, out, useCpu, threads);
+    if (out != stdout) fclose(out);
+    return ok ? 0 : -1;
+  }
+
+  // Hand out the frames (or the image) of the job to workers and exit.
+  if (coordinatorPort > 0) {
+    KeyFrame* keys;
+    int n, ok;
+    if (!fileCount) files[fileCount++] = configFile;
+    n = loadKeyFrames(files, fileCount, &keys);
+    SDL_Init(SDL_INIT_TIMER) == 0 || die("SDL initialization failed: %s\n", SDL_GetError());
+    atexit(SDL_Quit);
+    (imageOutput = createOutput(outputFormat, threads)) || die("Out of memory\n");
+    frameWriter = createFrameWriter(writeOutputFrame, imageOutput, FRAME_WRITER_QUEUE,
+                                    outputFormat->stream ? 1 : FRAME_WRITER_THREADS);
+    ok = runCoordinator(keys, n, frames, output ? output : frames > 0 ? DEFAULT_FRAME_PREFIX : DEFAULT_IMAGE_FILE,
+                        coordinatorPort);
+    destroyFrameWriter(frameWriter);
+    printOutputStats(imageOutput, stderr);
+    destroyOutput(imageOutput);
+    return ok ? 0 : -1;
+  }
+
+  // Render tiles for a coordinator until its job is done and exit.
+  if (workerAddress) {
+    int ok;
+    SDL_Init(useCpu ? SDL_INIT_TIMER : SDL_INIT_VIDEO) == 0 || die("SDL initialization failed: %s\n", SDL_GetError());
+    atexit(SDL_Quit);
+    ok = runWorker(workerAddress, useCpu, threads);
+    return ok ? 0 : -1;
+  }
+
+  // Render frames interpolated between keyframes and exit.
+  if (frames > 0) {
+    KeyFrame* keys;
+    int n, ok;
+    if (!fileCount) files[fileCount++] = configFile;
+    n = loadKeyFrames(files, fileCount, &keys);
+    SDL_Init(useCpu ? SDL_INIT_TIMER : SDL_INIT_VIDEO) == 0 || die("SDL initialization failed: %s\n", SDL_GetError());
+    atexit(SDL_Quit);
+    (imageOutput = createOutput(outputFormat, threads)) || die("Out of memory\n");
+    frameWriter = createFrameWriter(writeOutputFrame, imageOutput, FRAME_WRITER_QUEUE,
+                                    outputFormat->stream ? 1 : FRAME_WRITER_THREADS);
+    ok = renderAnimation(keys, n, frames, output ? output : DEFAULT_FRAME_PREFIX, useCpu, threads);
+    destroyFrameWriter(frameWriter);
+    printOutputStats(imageOutput, stderr);
+    destroyOutput(imageOutput);
+    return ok ? 0 : -1;
+  }
+
+  // Load configuration.
+  loadConfig(configFile);
+  sanitizeParameters();
+
+  // Measure the CPU distance estimator and exit.
+  if (benchDistance) {
+    Mandelbox mb;
+    initMandelbox(&mb, par[0], iters, color_iters);
+    benchmarkMandelbox(&mb, stdout);
+    return 0;
+  }
+
+  // Render a poster in tiles and exit.
+  if (posterWidth > 0 && posterHeight > 0) {
+    char filename[256];
+    int ok;
+    SDL_Init(useCpu ? SDL_INIT_TIMER : SDL_INIT_VIDEO) == 0 || die("SDL initialization failed: %s\n", SDL_GetError());
+    atexit(SDL_Quit);
+    (imageOutput = createOutput(outputFormat, threads)) || die("Out of memory\n");
+    getOutputName(filename, output ? output : DEFAULT_IMAGE_FILE, -1);
+    ok = renderPoster(filename, auxFile, posterWidth, posterHeight, useCpu, threads);
+    printOutputStats(imageOutput, stderr);
+    destroyOutput(imageOutput);
+    return ok ? 0 : -1;
+  }
+
+  // Render an image on the CPU without opening a window and exit.
+  if (useCpu) {
+    SDL_Init(SDL_INIT_TIMER) == 0 || die("SDL initialization failed: %s\n", SDL_GetError());
+    atexit(SDL_Quit);
+    char filename[256];
+    int ok;
+    (imageOutput = createOutput(outputFormat, threads)) || die("Out of memory\n");
+    getOutputName(filename, output ? output : DEFAULT_IMAGE_FILE, -1);
+    ok = renderCpuImage(filename, auxFile, threads);
+    printOutputStats(imageOutput, stderr);
+    destroyOutput(imageOutput);
+    return ok ? 0 : -1;
+  }
+
+  // Initialize SDL and OpenGL graphics. Where SDL can pump events on its own
+  // thread, the simulation gets input while a frame is rendered.
+  eventThread = SDL_Init(SDL_INIT_VIDEO | SDL_INIT_EVENTTHREAD) == 0;
+  eventThread || SDL_Init(SDL_INIT_VIDEO) == 0 || die("SDL initialization failed: %s\n", SDL_GetError());
+  atexit(SDL_Quit);
+
+  // Record the input from the current state, or replay a session from its state.
+  if (recordFile) {
+    KeyFrame k;
+    memset(&k, 0, sizeof(k));
+    getKeyFrame(&k);
+    startInputRecording(&inputLog, recordFile, &k, sizeof(k)) || die("Can't write %s\n", recordFile);
+  }
+  else if (replayFile) {
+    KeyFrame k;
+    startInputReplay(&inputLog, replayFile, &k, sizeof(k)) || die("Can't replay %s (not an input log of this version)\n", replayFile);
+    setKeyFrame(&k);
+  }
+
+  // Set up the video mode, OpenGL state, shaders and shader parameters.
+  (imageOutput = createOutput(outputFormat, threads)) || die("Out of memory\n");
+  frameWriter = createFrameWriter(writeOutputFrame, imageOutput, FRAME_WRITER_QUEUE,
+                                  outputFormat->stream ? 1 : FRAME_WRITER_THREADS);
+  initProfiler(&profiler, profileFile != 0);
+  initGraphics();
+  initFPS(FPS_FRAMES_TO_AVERAGE);
+  if (!eventThread) {
+    char const* extensions = (char const*)glGetString(GL_EXTENSIONS);
+    useFrameFence = extensions && strstr(extensions, "GL_ARB_sync") && enableSyncProcs();
+  }
+  initFileWatch(&shaderWatch, shaderFiles, lengthof(shaderFiles));
+
+  // Input is handled and the camera moved on the simulation thread.
+  startSimulation();
+
+  // Main loop.
+  Controller ctl = CTL_CAM;
+  int screenshots = 0;
+
+  // Screenshot requested, video capture (frame counter, -1 = off).
+  int screenshot = 0, captureFrames = -1;
+  char captureName[64];
+
+  for (;;) {
+    // Take the camera and parameters of the last simulation tick.
+    SimulationState const* s = readSnapshot(&simulationSnapshot);
+    int fullscreenChanged = s->key.fullscreen != fullscreen;
+    int progressiveChanged = s->key.progressive != progressive;
+
+    if (s->done) break;
+    setKeyFrame(&s->key);
+    ctl = s->ctl;
+
+    if (s->grabbedInput != grabbedInput) {
+      grabbedInput = s->grabbedInput;
+      if (grabbedInput) { SDL_ShowCursor(SDL_DISABLE); SDL_WM_GrabInput(SDL_GRAB_ON); }  // order is important
+      else { SDL_ShowCursor(SDL_ENABLE); SDL_WM_GrabInput(SDL_GRAB_OFF); }
     }
-    if (!ctlYChanged) {
-      if (keystate[SDLK_DOWN])  { ctlYChanged = 1; updateControllerY(ctl, -++consecutiveChanges); }
-      if (keystate[SDLK_UP])    { ctlYChanged = 1; updateControllerY(ctl,  ++consecutiveChanges); }
+    if (fullscreenChanged) initGraphics();
+    reloadShaders();
+    if (progressiveChanged) {
+      releaseProgressive(&refiner);
+      if (progressive > 1 && !hdrBuffer.buffer.fbo) initHdrBuffer(&hdrBuffer, width, height, 0);
+      if (progressive > 1 &&
+          !initProgressive(&refiner, width, height, progressive, progressive_samples, &hdrBuffer.buffer, hdrBuffer.enabled)) {
+        fprintf(stderr, "Progressive refinement is not supported.\n");
+      }
+    }
+    if (s->screenshots != screenshots) { screenshots = s->screenshots; screenshot = 1; }
+    if (s->capturing && captureFrames < 0) {
+      time_t t = time(0);
+      strftime(captureName, sizeof(captureName), "%Y%m%d_%H%M%S", localtime(&t));
+      captureFrames = 0;
+    }
+    else if (!s->capturing) captureFrames = -1;
+    if (s->heatmap != heatmap) {
+      heatmap = s->heatmap;
+      memset(&frameKey, 0, sizeof(frameKey));  // restart refinement
     }
 
-    if (!(ctlXChanged || ctlYChanged)) consecutiveChanges = 0;
+    // Raytrace a frame and tell it to the FPS structure.
+    beginProfileFrame(&profiler, PROFILE_DRAW);
+    beginGpuProfile(&profiler);
+    drawFrame();
+    endGpuProfile(&profiler);
+    if (!eventThread) waitForFrame();
+
+    // Save config and screenshot (filename = current time) or a video frame.
+    profileStage(&profiler, PROFILE_CAPTURE);
+    updateCapture(&capture);
+    if (screenshot) {
+      time_t t = time(0);
+      struct tm* ptm = localtime(&t);
+      char filename[256];
+      strftime(filename, 256, "%Y%m%d_%H%M%S.cfg", ptm); saveConfig(filename);
+      strftime(filename, 256, "%Y%m%d_%H%M%S.", ptm);
+      strcat(filename, outputFormat->stream ? "png" : outputFormat->extension);  // a still image
+      saveScreenshot(filename, 0);
+      screenshot = 0;
+    }
+    if (captureFrames >= 0) {
+      char filename[256];
+      if (outputFormat->stream) getOutputName(filename, captureName, -1);
+      else sprintf(filename, "%s_%05d.%s", captureName, captureFrames, outputFormat->extension);
+      saveScreenshot(filename, 1);
+      captureFrames++;
+    }
+
+    profileStage(&profiler, PROFILE_SWAP);
+    SDL_GL_SwapBuffers();
+    updateFPS();
+    if (governor.enabled && !refiner.enabled) updateGovernor(&governor, getLastFrameDuration());
+    profileStage(&profiler, PROFILE_EVENTS);
+
+    // Show position and fps in the caption.
+    char caption[2048], controllerStr[256];
+
+    sprintf(caption, "%s %.2ffps [%.3f %.3f %.3f] %dms",
+      printController(controllerStr, ctl),
+      getFPS(), position[0], position[1], position[2], getLastFrameDuration()
+    );
+    if (refiner.enabled) {
+      sprintf(caption + strlen(caption), " %d/%dspp", getProgressiveSamples(&refiner), refiner.maxSamples);
+    }
+    else if (governor.enabled) {
+      sprintf(caption + strlen(caption), " quality %d/%d", GOVERNOR_LEVELS-1 - governor.level, GOVERNOR_LEVELS-1);
+    }
+    {
+      // Percentiles of the recent GPU times, or of the CPU times without timer queries.
+      float pc[3];
+      int series = profiler.useQueries ? PROFILE_GPU : PROFILE_TOTAL;
+      if (getProfilePercentiles(&profiler, series, PROFILER_WINDOW, pc)) {
+        sprintf(caption + strlen(caption), " %s p50/95/99 %.1f/%.1f/%.1fms",
+          profileSeriesNames[series], pc[0], pc[1], pc[2]);
+      }
+    }
+    if (inputLog.f) {
+      sprintf(caption + strlen(caption), " %s %.1fs", inputLog.replaying ? "replay" : "rec", s->inputTime / 1000.);
+    }
+    if (captureFrames >= 0) {
+      int written, dropped, backlog;
+      getFrameWriterStats(frameWriter, &written, &dropped, &backlog);
+      sprintf(caption + strlen(caption), " capture %d written %d dropped %d backlog %d",
+        captureFrames, written, dropped, backlog);
+    }
+    SDL_WM_SetCaption(caption, 0);
+
+    endProfileFrame(&profiler);
   }
+  stopSimulation();
 
   saveConfig("last.cfg");  // Save a config file on exit, just in case.
+
+  if (inputLog.f) {
+    int replaying = inputLog.replaying, cancelled = inputLog.cancelled;
+    Uint32 recorded = inputLog.last, elapsed = SDL_GetTicks() - inputLog.start;
+    int frames = stopInputLog(&inputLog);
+    if (!replaying) fprintf(stderr, "Recorded %d ticks in %.3fs to %s\n", frames, elapsed / 1000., recordFile);
+    else fprintf(stderr, "Replayed %d ticks of a %.3fs session in %.3fs%s\n", frames, recorded / 1000., elapsed / 1000.,
+      cancelled ? " (cancelled)" : "");
+  }
+
+  // Write the captured frames that are still in flight.
+  releaseCapture(&capture);
+  releaseProgressive(&refiner);
+  releaseHdrBuffer(&hdrBuffer);
+  releaseDistanceCache(&distanceCache);
+  releaseGovernor(&governor);
+  releaseGBuffer(&gbuffer);
+  releaseTemporal(&reprojection);
+  releaseViewStarts(&viewStarts);
+  releaseDeepZoom(&deepZoom);
+  releaseAuxTarget(&auxTarget);
+  releaseProfilerQueries(&profiler);
+  releaseUniformCache(&programUniforms);
+  releaseUniformCache(&coneUniforms);
+  releaseUniformCache(&stepUniforms);
+  releaseUniformCache(&deepUniforms);
+  releaseUniformCache(&auxUniforms);
+  releaseUniformCache(&viewUniforms);
+  releaseUniformCache(&startsUniforms);
+  for (i=0; i<GBUFFER_PASSES; i++) releaseUniformCache(&gbufferUniforms[i]);
+  destroyFrameWriter(frameWriter);
+  printOutputStats(imageOutput, stderr);
+  destroyOutput(imageOutput);
+
+  printProfileSummary(&profiler, stderr);
+  if (profiler.frameCount) {
+    fprintf(stderr, "Uniforms: %.1f uploads per frame, %d location lookups\n",
+      (double)uniformUploads / profiler.frameCount, uniformLookups);
+  }
+  if (shaderVariants.compiled + viewVariants.compiled + startsVariants.compiled) {
+    fprintf(stderr, "Shader variants: %d compiled%s\n",
+      shaderVariants.compiled + viewVariants.compiled + startsVariants.compiled,
+      shaderVariants.parallel ? " in the background" : "");
+  }
+  releaseShaderVariants(&shaderVariants);
+  releaseShaderVariants(&viewVariants);
+  releaseShaderVariants(&startsVariants);
+  cancelShaderReload();
+  releaseFileWatch(&shaderWatch);
+  if (programCache.loaded + programCache.compiled) {
+    fprintf(stderr, "Shader programs: %d loaded from the cache, %d compiled, %d rejected, %.3fs\n",
+      programCache.loaded, programCache.compiled, programCache.rejected, programCache.milliseconds / 1000.);
+  }
+  if (profileFile && !writeProfile(&profiler, profileFile)) fprintf(stderr, "Error writing %s\n", profileFile);
+  releaseProfiler(&profiler);
   return 0;
 }
@@ -0,0 +1,132 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+// Asynchronous frame capture.
+//
+// glReadPixels() into a pixel buffer object returns immediately. The buffer is
+// mapped a few frames later, when the GPU has surely finished the transfer,
+// and the pixels go to a FrameWriter which writes them on its own threads.
+// Without pixel buffer objects, the pixels are read synchronously.
+// Samples are bytes, 16-bit integers or floats (sampleBytes 1, 2 or 4).
+
+#include <stdlib.h>
+#include <string.h>
+#include "frame_writer.h"
+
+#define CAPTURE_BUFFERS 3
+
+typedef struct CaptureSlot {
+  GLuint pbo;
+  int pending;  // waiting to be mapped
+  int frame;    // frame in which the transfer started
+  int mayDrop;  // the frame can be dropped if the writer can't keep up
+  char file[256];
+} CaptureSlot;
+
+typedef struct Capture {
+  CaptureSlot slots[CAPTURE_BUFFERS];
+  int next;   // slot for the next capture
+  int frame;  // frame counter, advanced by updateCapture()
+  int width, height;
+  int sampleBytes;
+  GLenum type;  // of the samples for glReadPixels
+  int usePbo;
+  FrameWriter* writer;
+} Capture;
+
+// Create the pixel buffers for width x height RGB frames with |sampleBytes|
+// bytes per sample. Must be called with a current OpenGL context.
+void initCapture(Capture* c, FrameWriter* writer, int width, int height, int sampleBytes) {
+  int i;
+
+  memset(c, 0, sizeof(Capture));
+  c->writer = writer;
+  c->width = width;
+  c->height = height;
+  c->sampleBytes = sampleBytes;
+  c->type = sampleBytes == 4 ? GL_FLOAT : sampleBytes == 2 ? GL_UNSIGNED_SHORT : GL_UNSIGNED_BYTE;
+  c->usePbo = enableBufferProcs();
+  if (!c->usePbo) return;
+
+  for (i=0; i<CAPTURE_BUFFERS; i++) {
+    glGenBuffers(1, &c->slots[i].pbo);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, c->slots[i].pbo);
+    glBufferData(GL_PIXEL_PACK_BUFFER, width * height * 3 * sampleBytes, 0, GL_STREAM_READ);
+  }
+  glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+}
+
+// Map a slot's pixel buffer and hand the pixels to the writer. Without
+// memory for them, the frame is counted as dropped.
+void finishCaptureSlot(Capture* c, CaptureSlot* s) {
+  size_t size = (size_t)c->width * c->height * 3 * c->sampleBytes;
+  unsigned char* img = malloc(size);
+  void* pixels = 0;
+
+  glBindBuffer(GL_PIXEL_PACK_BUFFER, s->pbo);
+  if (img && (pixels = glMapBuffer(GL_PIXEL_PACK_BUFFER, GL_READ_ONLY)) != 0) {
+    memcpy(img, pixels, size);
+    glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+  }
+  glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+  s->pending = 0;
+
+  if (!img) countDroppedFrame(c->writer);
+  if (!pixels) { free(img); return; }
+  if (s->mayDrop) tryQueueFrame(c->writer, s->file, c->width, c->height, img);
+  else queueFrame(c->writer, s->file, c->width, c->height, img);
+}
+
+// Start reading the current read buffer at (x, y) and write it to |file| later.
+// If |mayDrop| is set, the frame is dropped when the writer is busy.
+void captureFrame(Capture* c, int x, int y, char const* file, int mayDrop) {
+  CaptureSlot* s = &c->slots[c->next];
+
+  glPixelStorei(GL_PACK_ALIGNMENT, 1);
+  if (!c->usePbo) {
+    unsigned char* img = malloc((size_t)c->width * c->height * 3 * c->sampleBytes);
+    if (!img) { countDroppedFrame(c->writer); return; }
+    glReadPixels(x, y, c->width, c->height, GL_RGB, c->type, img);
+    if (mayDrop) tryQueueFrame(c->writer, file, c->width, c->height, img);
+    else queueFrame(c->writer, file, c->width, c->height, img);
+    return;
+  }
+
+  if (s->pending) finishCaptureSlot(c, s);
+
+  glBindBuffer(GL_PIXEL_PACK_BUFFER, s->pbo);
+  glReadPixels(x, y, c->width, c->height, GL_RGB, c->type, 0);
+  glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+  s->pending = 1;
+  s->frame = c->frame;
+  s->mayDrop = mayDrop;
+  strncpy(s->file, file, sizeof(s->file)-1);
+  s->file[sizeof(s->file)-1] = 0;
+  c->next = (c->next + 1) % CAPTURE_BUFFERS;
+}
+
+// Call once per frame. Hands over the frames whose transfers are old enough.
+void updateCapture(Capture* c) {
+  int i;
+  c->frame++;
+  for (i=0; i<CAPTURE_BUFFERS; i++) {
+    CaptureSlot* s = &c->slots[(c->next + i) % CAPTURE_BUFFERS];
+    if (s->pending && c->frame - s->frame >= CAPTURE_BUFFERS-1) finishCaptureSlot(c, s);
+  }
+}
+
+// Hand over all pending frames (in order) and delete the pixel buffers.
+void releaseCapture(Capture* c) {
+  int i;
+  if (!c->usePbo) return;
+
+  for (i=0; i<CAPTURE_BUFFERS; i++) {
+    CaptureSlot* s = &c->slots[(c->next + i) % CAPTURE_BUFFERS];
+    if (s->pending) finishCaptureSlot(c, s);
+    glDeleteBuffers(1, &s->pbo);
+  }
+  c->usePbo = 0;
+}
+
+#endif  // CAPTURE_H
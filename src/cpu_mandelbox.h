@@ -0,0 +1,407 @@
+#ifndef CPU_MANDELBOX_H
+#define CPU_MANDELBOX_H
+
+// CPU port of the distance estimator, coloring, normal and ambient occlusion
+// functions from shaders/fragment_mandelbox.glsl.
+//
+// The scalar functions follow the shader operation by operation, so they can be
+// used as a reference for it. mandelboxDistanceBatch() evaluates many points at
+// once using 4 (SSE), 8 (AVX2) or 16 (AVX-512) lanes when the CPU supports them,
+// and gives exactly the same results as the scalar mandelboxDistance()
+// (unless the scalar code gets compiled with FMA, e.g. by -march=native).
+//
+// For deep zoom, where floats can't tell nearby points apart, there are
+// scalar double precision versions of the functions.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <time.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+  #define MANDELBOX_SIMD
+  #include <immintrin.h>
+#endif
+
+#define MANDELBOX_DIST_MULTIPLIER 1.0f
+#define MANDELBOX_MAX_DIST 4.0f
+#define MANDELBOX_NORMAL_EPS 0.00001f
+
+// Colors. Same as in the shader.
+static float const mandelboxSurfaceColor1[3] = { 0.95, 0.64, 0.1 };
+static float const mandelboxSurfaceColor2[3] = { 0.89, 0.95, 0.75 };
+static float const mandelboxSurfaceColor3[3] = { 0.55, 0.06, 0.03 };
+
+// Fractal parameters with precomputed constants.
+typedef struct Mandelbox {
+  float minRad2;
+  float scale[4];  // .w is used for the distance estimate
+  float absScalem1;
+  float absScaleRaisedTo1mIters;
+  int iters, color_iters;
+} Mandelbox;
+
+// Precompute constants from par0 (minRadius2, scale) and iteration counts.
+void initMandelbox(Mandelbox* mb, float const par0[2], int iters, int color_iters) {
+  float minRad2 = par0[0], scale = par0[1];
+  if (minRad2 < 1.0e-9f) minRad2 = 1.0e-9f;
+  if (minRad2 > 1.0f) minRad2 = 1.0f;
+
+  mb->minRad2 = minRad2;
+  mb->scale[0] = mb->scale[1] = mb->scale[2] = scale / minRad2;
+  mb->scale[3] = fabsf(scale) / minRad2;
+  mb->absScalem1 = fabsf(scale - 1.0f);
+  mb->absScaleRaisedTo1mIters = (float)pow(fabsf(scale), (float)(1-iters));
+  mb->iters = iters;
+  mb->color_iters = color_iters;
+}
+
+// GLSL max() and clamp(). If |x| is NaN, the result is the other operand.
+static float mandelboxMax(float x, float y) { return x > y ? x : y; }
+static float mandelboxClamp(float x, float lo, float hi) {
+  x = x > lo ? x : lo;
+  return x < hi ? x : hi;
+}
+
+// Compute the distance from |pos| to the Mandelbox.
+float mandelboxDistance(Mandelbox const* mb, float const pos[3]) {
+  float p[4] = { pos[0], pos[1], pos[2], 1 }, p0[4] = { pos[0], pos[1], pos[2], 1 };
+  int i, j;
+
+  for (i=0; i<mb->iters; i++) {
+    // box folding
+    for (j=0; j<3; j++) p[j] = mandelboxClamp(p[j], -1.0f, 1.0f) * 2.0f - p[j];
+
+    // sphere folding
+    float r2 = p[0]*p[0] + p[1]*p[1] + p[2]*p[2];
+    float f = mandelboxClamp(mandelboxMax(mb->minRad2/r2, mb->minRad2), 0.0f, 1.0f);
+    for (j=0; j<4; j++) p[j] *= f;
+
+    // scale, translate
+    for (j=0; j<4; j++) p[j] = p[j]*mb->scale[j] + p0[j];
+  }
+  return ((sqrtf(p[0]*p[0] + p[1]*p[1] + p[2]*p[2]) - mb->absScalem1) / p[3]
+    - mb->absScaleRaisedTo1mIters) * MANDELBOX_DIST_MULTIPLIER;
+}
+
+// Compute the color at |pos|.
+void mandelboxColor(Mandelbox const* mb, float const pos[3], float col[3]) {
+  float p[3] = { pos[0], pos[1], pos[2] };
+  float trap = 1.0f, c[2];
+  int i, j;
+
+  for (i=0; i<mb->color_iters; i++) {
+    for (j=0; j<3; j++) p[j] = mandelboxClamp(p[j], -1.0f, 1.0f) * 2.0f - p[j];
+    float r2 = p[0]*p[0] + p[1]*p[1] + p[2]*p[2];
+    float f = mandelboxClamp(mandelboxMax(mb->minRad2/r2, mb->minRad2), 0.0f, 1.0f);
+    for (j=0; j<3; j++) p[j] = p[j]*f*mb->scale[j] + pos[j];
+    if (r2 < trap) trap = r2;
+  }
+  // c[0]: log final distance (fractional iteration count)
+  // c[1]: spherical orbit trap at (0,0,0)
+  c[0] = mandelboxClamp(0.33f*logf(p[0]*p[0] + p[1]*p[1] + p[2]*p[2]) - 1.0f, 0.0f, 1.0f);
+  c[1] = mandelboxClamp(sqrtf(trap), 0.0f, 1.0f);
+
+  for (j=0; j<3; j++) {
+    float m = mandelboxSurfaceColor1[j] + (mandelboxSurfaceColor2[j] - mandelboxSurfaceColor1[j]) * c[1];
+    col[j] = m + (mandelboxSurfaceColor3[j] - m) * c[0];
+  }
+}
+
+// Compute the normal at |pos| using 3-tap central differences.
+void mandelboxNormal(Mandelbox const* mb, float const pos[3], float n[3]) {
+  int i, j;
+  for (i=0; i<3; i++) {
+    float a[3], b[3];
+    for (j=0; j<3; j++) a[j] = b[j] = pos[j];
+    a[i] -= MANDELBOX_NORMAL_EPS; b[i] += MANDELBOX_NORMAL_EPS;
+    n[i] = -mandelboxDistance(mb, a) + mandelboxDistance(mb, b);
+  }
+  float len = sqrtf(n[0]*n[0] + n[1]*n[1] + n[2]*n[2]);
+  if (len > 0) for (j=0; j<3; j++) n[j] /= len;
+}
+
+// Ambient occlusion approximation at |p| with normal |n|.
+float mandelboxAmbientOcclusion(Mandelbox const* mb, float const p[3], float const n[3],
+                                float ao_eps, float ao_strength) {
+  float ao = 1.0f, w = ao_strength/ao_eps;
+  float dist = 2.0f * ao_eps;
+  int i, j;
+
+  for (i=0; i<5; i++) {
+    float q[3];
+    for (j=0; j<3; j++) q[j] = p[j] + n[j]*dist;
+    ao -= (dist - mandelboxDistance(mb, q)) * w;
+    w *= 0.5f;
+    dist = dist*2.0f - ao_eps;  // 2,3,5,9,17
+  }
+  return mandelboxClamp(ao, 0.0f, 1.0f);
+}
+
+
+////////////////////////////////////////////////////////////////
+// Double precision.
+
+typedef struct MandelboxDouble {
+  double minRad2;
+  double scale[4];
+  double absScalem1;
+  double absScaleRaisedTo1mIters;
+  int iters, color_iters;
+} MandelboxDouble;
+
+void initMandelboxDouble(MandelboxDouble* mb, float const par0[2], int iters, int color_iters) {
+  double minRad2 = par0[0], scale = par0[1];
+  if (minRad2 < 1.0e-9) minRad2 = 1.0e-9;
+  if (minRad2 > 1.0) minRad2 = 1.0;
+
+  mb->minRad2 = minRad2;
+  mb->scale[0] = mb->scale[1] = mb->scale[2] = scale / minRad2;
+  mb->scale[3] = fabs(scale) / minRad2;
+  mb->absScalem1 = fabs(scale - 1.0);
+  mb->absScaleRaisedTo1mIters = pow(fabs(scale), 1-iters);
+  mb->iters = iters;
+  mb->color_iters = color_iters;
+}
+
+static double mandelboxClampDouble(double x, double lo, double hi) {
+  x = x > lo ? x : lo;
+  return x < hi ? x : hi;
+}
+
+// Compute the distance from |pos| to the Mandelbox.
+double mandelboxDistanceDouble(MandelboxDouble const* mb, double const pos[3]) {
+  double p[4] = { pos[0], pos[1], pos[2], 1 }, p0[4] = { pos[0], pos[1], pos[2], 1 };
+  int i, j;
+
+  for (i=0; i<mb->iters; i++) {
+    for (j=0; j<3; j++) p[j] = mandelboxClampDouble(p[j], -1, 1) * 2 - p[j];
+    double r2 = p[0]*p[0] + p[1]*p[1] + p[2]*p[2];
+    double f = mb->minRad2 / mandelboxClampDouble(r2, mb->minRad2, 1);
+    for (j=0; j<4; j++) p[j] = p[j]*f*mb->scale[j] + p0[j];
+  }
+  return ((sqrt(p[0]*p[0] + p[1]*p[1] + p[2]*p[2]) - mb->absScalem1) / p[3]
+    - mb->absScaleRaisedTo1mIters) * MANDELBOX_DIST_MULTIPLIER;
+}
+
+// Compute the color at |pos|.
+void mandelboxColorDouble(MandelboxDouble const* mb, double const pos[3], float col[3]) {
+  double p[3] = { pos[0], pos[1], pos[2] };
+  double trap = 1;
+  float c[2];
+  int i, j;
+
+  for (i=0; i<mb->color_iters; i++) {
+    for (j=0; j<3; j++) p[j] = mandelboxClampDouble(p[j], -1, 1) * 2 - p[j];
+    double r2 = p[0]*p[0] + p[1]*p[1] + p[2]*p[2];
+    double f = mb->minRad2 / mandelboxClampDouble(r2, mb->minRad2, 1);
+    for (j=0; j<3; j++) p[j] = p[j]*f*mb->scale[j] + pos[j];
+    if (r2 < trap) trap = r2;
+  }
+  c[0] = mandelboxClamp(0.33f*logf(p[0]*p[0] + p[1]*p[1] + p[2]*p[2]) - 1.0f, 0.0f, 1.0f);
+  c[1] = mandelboxClamp(sqrtf(trap), 0.0f, 1.0f);
+
+  for (j=0; j<3; j++) {
+    float m = mandelboxSurfaceColor1[j] + (mandelboxSurfaceColor2[j] - mandelboxSurfaceColor1[j]) * c[1];
+    col[j] = m + (mandelboxSurfaceColor3[j] - m) * c[0];
+  }
+}
+
+// Compute the normal at |pos| using 3-tap central differences |eps| apart
+// (scale it with the zoom).
+void mandelboxNormalDouble(MandelboxDouble const* mb, double const pos[3], double eps, float n[3]) {
+  double d[3], len;
+  int i, j;
+  for (i=0; i<3; i++) {
+    double a[3], b[3];
+    for (j=0; j<3; j++) a[j] = b[j] = pos[j];
+    a[i] -= eps; b[i] += eps;
+    d[i] = -mandelboxDistanceDouble(mb, a) + mandelboxDistanceDouble(mb, b);
+  }
+  len = sqrt(d[0]*d[0] + d[1]*d[1] + d[2]*d[2]);
+  for (j=0; j<3; j++) n[j] = len > 0 ? d[j] / len : d[j];
+}
+
+// Ambient occlusion approximation at |p| with normal |n|.
+float mandelboxAmbientOcclusionDouble(MandelboxDouble const* mb, double const p[3], float const n[3],
+                                      double ao_eps, float ao_strength) {
+  double ao = 1, w = ao_strength/ao_eps;
+  double dist = 2 * ao_eps;
+  int i, j;
+
+  for (i=0; i<5; i++) {
+    double q[3];
+    for (j=0; j<3; j++) q[j] = p[j] + n[j]*dist;
+    ao -= (dist - mandelboxDistanceDouble(mb, q)) * w;
+    w *= 0.5;
+    dist = dist*2 - ao_eps;
+  }
+  return mandelboxClamp(ao, 0.0f, 1.0f);
+}
+
+
+////////////////////////////////////////////////////////////////
+// Batched distance estimation.
+//
+// Points are passed as separate x, y, z arrays (structure of arrays).
+
+typedef void (*MandelboxBatchFunc)(Mandelbox const* mb, int n,
+  float const* x, float const* y, float const* z, float* d);
+
+void mandelboxDistanceBatchScalar(Mandelbox const* mb, int n,
+    float const* x, float const* y, float const* z, float* d) {
+  int i;
+  for (i=0; i<n; i++) {
+    float p[3] = { x[i], y[i], z[i] };
+    d[i] = mandelboxDistance(mb, p);
+  }
+}
+
+#ifdef MANDELBOX_SIMD
+
+// Generate a batch kernel for one instruction set. Every lane does exactly
+// the same operations as mandelboxDistance(). The tail is done by the scalar code.
+#define MANDELBOX_SIMD_KERNEL(name, isa, width, vec, load, store, set1, \
+                              add, sub, mul, div, min, max, sqrt) \
+__attribute__((target(isa))) \
+void name(Mandelbox const* mb, int n, \
+    float const* x, float const* y, float const* z, float* d) { \
+  vec const one = set1(1.0f), mone = set1(-1.0f), two = set1(2.0f), zero = set1(0.0f); \
+  vec const minRad2 = set1(mb->minRad2); \
+  vec const s0 = set1(mb->scale[0]), s1 = set1(mb->scale[1]); \
+  vec const s2 = set1(mb->scale[2]), s3 = set1(mb->scale[3]); \
+  vec const absScalem1 = set1(mb->absScalem1); \
+  vec const absScaleRaisedTo1mIters = set1(mb->absScaleRaisedTo1mIters); \
+  vec const distMultiplier = set1(MANDELBOX_DIST_MULTIPLIER); \
+  int i, k; \
+  for (i=0; i+width<=n; i+=width) { \
+    vec x0 = load(x+i), y0 = load(y+i), z0 = load(z+i); \
+    vec px = x0, py = y0, pz = z0, pw = one; \
+    for (k=0; k<mb->iters; k++) { \
+      px = sub(mul(min(max(px, mone), one), two), px); \
+      py = sub(mul(min(max(py, mone), one), two), py); \
+      pz = sub(mul(min(max(pz, mone), one), two), pz); \
+      vec r2 = add(add(mul(px, px), mul(py, py)), mul(pz, pz)); \
+      vec f = min(max(max(div(minRad2, r2), minRad2), zero), one); \
+      px = add(mul(mul(px, f), s0), x0); \
+      py = add(mul(mul(py, f), s1), y0); \
+      pz = add(mul(mul(pz, f), s2), z0); \
+      pw = add(mul(mul(pw, f), s3), one); \
+    } \
+    vec len = sqrt(add(add(mul(px, px), mul(py, py)), mul(pz, pz))); \
+    store(d+i, mul(sub(div(sub(len, absScalem1), pw), absScaleRaisedTo1mIters), distMultiplier)); \
+  } \
+  mandelboxDistanceBatchScalar(mb, n-i, x+i, y+i, z+i, d+i); \
+}
+
+// The min/max instructions return the second operand if the first is NaN,
+// just like mandelboxMax() and mandelboxClamp() in the scalar code.
+MANDELBOX_SIMD_KERNEL(mandelboxDistanceBatchSSE, "sse2", 4, __m128,
+  _mm_loadu_ps, _mm_storeu_ps, _mm_set1_ps,
+  _mm_add_ps, _mm_sub_ps, _mm_mul_ps, _mm_div_ps, _mm_min_ps, _mm_max_ps, _mm_sqrt_ps)
+
+MANDELBOX_SIMD_KERNEL(mandelboxDistanceBatchAVX2, "avx2", 8, __m256,
+  _mm256_loadu_ps, _mm256_storeu_ps, _mm256_set1_ps,
+  _mm256_add_ps, _mm256_sub_ps, _mm256_mul_ps, _mm256_div_ps, _mm256_min_ps, _mm256_max_ps, _mm256_sqrt_ps)
+
+// AVX-512 implies FMA, so the compiler would be free to fuse multiplies and adds.
+// Instructions with explicit rounding are never fused.
+#define MANDELBOX_ROUND (_MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC)
+#define mandelboxAdd512(a, b) _mm512_add_round_ps(a, b, MANDELBOX_ROUND)
+#define mandelboxSub512(a, b) _mm512_sub_round_ps(a, b, MANDELBOX_ROUND)
+#define mandelboxMul512(a, b) _mm512_mul_round_ps(a, b, MANDELBOX_ROUND)
+#define mandelboxDiv512(a, b) _mm512_div_round_ps(a, b, MANDELBOX_ROUND)
+#define mandelboxSqrt512(a) _mm512_sqrt_round_ps(a, MANDELBOX_ROUND)
+
+MANDELBOX_SIMD_KERNEL(mandelboxDistanceBatchAVX512, "avx512f", 16, __m512,
+  _mm512_loadu_ps, _mm512_storeu_ps, _mm512_set1_ps,
+  mandelboxAdd512, mandelboxSub512, mandelboxMul512, mandelboxDiv512,
+  _mm512_min_ps, _mm512_max_ps, mandelboxSqrt512)
+
+#undef MANDELBOX_ROUND
+#undef mandelboxAdd512
+#undef mandelboxSub512
+#undef mandelboxMul512
+#undef mandelboxDiv512
+#undef mandelboxSqrt512
+
+#undef MANDELBOX_SIMD_KERNEL
+
+#endif  // MANDELBOX_SIMD
+
+
+// Batch kernels by lane count, for benchmarking.
+typedef struct MandelboxKernel {
+  char const* name;
+  int lanes;
+  MandelboxBatchFunc func;
+} MandelboxKernel;
+
+// Return the kernels supported by this CPU, the widest one first.
+int getMandelboxKernels(MandelboxKernel kernels[4]) {
+  int n = 0;
+#ifdef MANDELBOX_SIMD
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f")) {
+    kernels[n].name = "AVX-512"; kernels[n].lanes = 16; kernels[n++].func = mandelboxDistanceBatchAVX512;
+  }
+  if (__builtin_cpu_supports("avx2")) {
+    kernels[n].name = "AVX2"; kernels[n].lanes = 8; kernels[n++].func = mandelboxDistanceBatchAVX2;
+  }
+  if (__builtin_cpu_supports("sse2")) {
+    kernels[n].name = "SSE"; kernels[n].lanes = 4; kernels[n++].func = mandelboxDistanceBatchSSE;
+  }
+#endif
+  kernels[n].name = "scalar"; kernels[n].lanes = 1; kernels[n++].func = mandelboxDistanceBatchScalar;
+  return n;
+}
+
+MandelboxBatchFunc mandelboxBatchFunc = 0;
+
+// Compute the distances from n points to the Mandelbox with the widest kernel available.
+void mandelboxDistanceBatch(Mandelbox const* mb, int n,
+    float const* x, float const* y, float const* z, float* d) {
+  if (!mandelboxBatchFunc) {
+    MandelboxKernel kernels[4];
+    getMandelboxKernels(kernels);
+    mandelboxBatchFunc = kernels[0].func;
+  }
+  mandelboxBatchFunc(mb, n, x, y, z, d);
+}
+
+
+// Measure the throughput of all batch kernels in points per second and check
+// that they agree with the scalar code. Points are random in [-2,2]^3.
+void benchmarkMandelbox(Mandelbox const* mb, FILE* out) {
+  enum { N = 1<<14 };
+  float* x = malloc(sizeof(float) * N * 5);
+  float* y = x + N, *z = y + N, *d = z + N, *ref = d + N;
+  MandelboxKernel kernels[4];
+  int i, k, nk = getMandelboxKernels(kernels);
+
+  srand(1);
+  for (i=0; i<N; i++) {
+    x[i] = rand() * 4.0f / RAND_MAX - 2.0f;
+    y[i] = rand() * 4.0f / RAND_MAX - 2.0f;
+    z[i] = rand() * 4.0f / RAND_MAX - 2.0f;
+  }
+  mandelboxDistanceBatchScalar(mb, N, x, y, z, ref);
+
+  fprintf(out, "Mandelbox distance estimator, %d iterations:\n", mb->iters);
+  for (k=0; k<nk; k++) {
+    int runs = 0, mismatches = 0;
+    clock_t start = clock(), elapsed;
+    do {
+      kernels[k].func(mb, N, x, y, z, d);
+      runs++;
+    } while ((elapsed = clock() - start) < CLOCKS_PER_SEC/2);
+
+    for (i=0; i<N; i++) mismatches += (d[i] != ref[i]);
+    fprintf(out, "  %-8s %2d lanes  %8.2f Mpoints/s  %d mismatches\n",
+      kernels[k].name, kernels[k].lanes,
+      (double)runs * N / ((double)elapsed / CLOCKS_PER_SEC) / 1e6, mismatches);
+  }
+  free(x);
+}
+
+#endif  // CPU_MANDELBOX_H
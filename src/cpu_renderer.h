@@ -0,0 +1,376 @@
+#ifndef CPU_RENDERER_H
+#define CPU_RENDERER_H
+
+// Headless CPU raymarcher. It does the same as shaders/vertex_pinhole_camera.glsl
+// and shaders/fragment_mandelbox.glsl, so it produces the same image as the GPU.
+//
+// The image is split into tiles that are rendered by a thread pool. Inside a tile,
+// rays are marched in packets, so the distance estimator can use SIMD lanes.
+// In deep zoom mode, each ray is marched and shaded in double precision.
+
+#include <string.h>
+#include <math.h>
+#include "cpu_mandelbox.h"
+#include "thread_pool.h"
+#include "aux_buffers.h"
+
+#define CPU_TILE_SIZE 16
+#define CPU_PACKET_SIZE CPU_TILE_SIZE
+#define CPU_RADIANS 0.0174532925f
+
+// Colors. Same as in the shader.
+static float const cpuBackgroundColor[3] = { 0.07, 0.06, 0.16 };
+static float const cpuSpecularColor[3] = { 1.0, 0.8, 0.4 };
+static float const cpuGlowColor[3] = { 0.03, 0.4, 0.4 };
+static float const cpuAoColor[3] = { 0, 0, 0 };
+
+// Everything the shaders get as uniforms.
+typedef struct CpuRenderParams {
+  double camera[16];  // same layout as the OpenGL modelview matrix
+  float fov_x, fov_y;
+  float tile_scale[2], tile_offset[2];  // part of the screen covered by the image
+  int views;                            // side by side, see the vertex shader
+  float eye_separation;
+  float min_dist;
+  int max_steps;
+  float ao_eps, ao_strength, glow_strength, dist_to_color;
+  Mandelbox mb;
+  MandelboxDouble mbDouble;
+  int deepZoom;  // march and shade in double precision with mbDouble
+} CpuRenderParams;
+
+// Rendering statistics.
+typedef struct CpuRenderStats {
+  double steps;      // raymarching steps, summed over all pixels
+  double pixels;
+  Uint32 milliseconds;
+} CpuRenderStats;
+
+typedef struct CpuRenderJob {
+  CpuRenderParams const* params;
+  int width, height;
+  int tilesX, tilesY;
+  unsigned char* rgb;
+  float* aux;  // can be 0
+  double* tileSteps;
+} CpuRenderJob;
+
+
+static float cpuDot(float const x[3], float const y[3]) {
+  return x[0]*y[0] + x[1]*y[1] + x[2]*y[2];
+}
+
+static void cpuNormalize(float x[3]) {
+  float len = sqrtf(cpuDot(x, x));
+  if (len > 0) { x[0] /= len; x[1] /= len; x[2] /= len; }
+}
+
+static float cpuMix(float x, float y, float a) {
+  return x + (y - x) * a;
+}
+
+// Multi-view: make the x coordinate of a point of the screen its position in
+// its view, and return how far the eye of the view is from the camera along
+// the x axis of the camera. Same as the vertex shader.
+static double getCpuView(CpuRenderParams const* r, double* x) {
+  int view = (int)floor((*x + 1) * 0.5 * r->views);
+
+  if (view < 0) view = 0;
+  if (view > r->views-1) view = r->views-1;
+  *x = (*x + 1) * r->views - 2*view - 1;
+  return (view - 0.5 * (r->views-1)) * r->eye_separation;
+}
+
+// Compute the view ray through a point of the screen (-1..1 in both coordinates).
+// Same as the vertex shader.
+void getCpuRay(CpuRenderParams const* r, float x, float y, float eye[3], float dir[3]) {
+  float v[3], offset = 0;
+  int i;
+
+  if (r->views > 1) {
+    double vx = x;
+    offset = getCpuView(r, &vx);
+    x = vx;
+  }
+  v[0] = tanf(r->fov_x/2.0f * CPU_RADIANS) * x;
+  v[1] = tanf(r->fov_y/2.0f * CPU_RADIANS) * y;
+  v[2] = 1;
+  for (i=0; i<3; i++) {
+    eye[i] = r->camera[12+i];
+    if (offset) eye[i] += (float)r->camera[i] * offset;
+    dir[i] = (float)r->camera[i]*v[0] + (float)r->camera[4+i]*v[1] + (float)r->camera[8+i]*v[2];
+  }
+  cpuNormalize(dir);
+}
+
+// Shade a surface point with normal |n| and ambient occlusion |ao| seen from
+// |eye| along |dp|. |col| has its color.
+static void shadeCpuSurface(CpuRenderParams const* r, float const eye[3], float const dp[3],
+                            float const n[3], float ao, float D, float col[3]) {
+  float view[3], light[3], halfLV[3];
+  int i;
+
+  // Blinn-Phong shading with rim lighting.
+  for (i=0; i<3; i++) { view[i] = -dp[i]; light[i] = eye[i] + (i==1) + dp[i]; }
+  cpuNormalize(light);
+  for (i=0; i<3; i++) halfLV[i] = light[i] + view[i];
+  cpuNormalize(halfLV);
+  {
+    float spe = powf(mandelboxMax(cpuDot(n, halfLV), 0.0f), 32.0f);
+    float dif = cpuDot(n, light) * 0.5f + 0.75f;
+    for (i=0; i<3; i++) col[i] = dif*col[i] + spe*cpuSpecularColor[i];
+  }
+
+  for (i=0; i<3; i++) col[i] = cpuMix(cpuAoColor[i], col[i], ao);
+
+  // We've gone through all steps, but we haven't hit anything.
+  // Mix in the background color.
+  if (D > r->min_dist) {
+    float a = mandelboxClamp(logf(D/r->min_dist) * r->dist_to_color, 0.0f, 1.0f);
+    for (i=0; i<3; i++) col[i] = cpuMix(col[i], cpuBackgroundColor[i], a);
+  }
+}
+
+// Fill the auxiliary channels of a pixel (see aux_buffers.h) whose ray along
+// |dp| has stopped at |totalD|, on a surface with normal |n| if |hit|.
+static void setCpuAux(CpuRenderParams const* r, double const dp[3], double totalD, int hit,
+                      float const n[3], int steps, float ao, float* aux) {
+  aux[AUX_DEPTH] = hit ? totalD * (dp[0]*r->camera[8] + dp[1]*r->camera[9] + dp[2]*r->camera[10]) : -1;
+  aux[AUX_NORMAL_X] = hit ? n[0] : 0;
+  aux[AUX_NORMAL_Y] = hit ? n[1] : 0;
+  aux[AUX_NORMAL_Z] = hit ? n[2] : 0;
+  aux[AUX_STEPS] = steps;
+  aux[AUX_AO] = ao;
+}
+
+// Glow is based on the number of steps.
+static void glowCpuPixel(CpuRenderParams const* r, int steps, float col[3]) {
+  int i;
+  for (i=0; i<3; i++) {
+    col[i] = cpuMix(col[i], cpuGlowColor[i], (float)steps/(float)r->max_steps * r->glow_strength);
+  }
+}
+
+// Shade a pixel. Same as the end of main() in the fragment shader.
+// |aux| gets the auxiliary channels, if it isn't 0.
+void shadeCpuPixel(CpuRenderParams const* r, float const eye[3], float const dp[3],
+                   float totalD, float D, int steps, float col[3], float* aux) {
+  float p[3], n[3] = { 0, 0, 0 }, ao = 1;
+  int i;
+
+  for (i=0; i<3; i++) { p[i] = eye[i] + totalD * dp[i]; col[i] = cpuBackgroundColor[i]; }
+
+  // We've got a hit or we're not sure.
+  if (D < MANDELBOX_MAX_DIST) {
+    mandelboxNormal(&r->mb, p, n);
+    mandelboxColor(&r->mb, p, col);
+    ao = mandelboxAmbientOcclusion(&r->mb, p, n, r->ao_eps, r->ao_strength);
+    shadeCpuSurface(r, eye, dp, n, ao, D, col);
+  }
+  glowCpuPixel(r, steps, col);
+  if (aux) {
+    double dpd[3] = { dp[0], dp[1], dp[2] };
+    setCpuAux(r, dpd, totalD, D < MANDELBOX_MAX_DIST, n, steps, ao, aux);
+  }
+}
+
+// Deep zoom: march the ray from |eye| along |dp| and shade it like
+// shadeCpuPixel(), all in double precision.
+void renderCpuPixelDouble(CpuRenderParams const* r, double const eye[3], double const dp[3],
+                          int* steps, float col[3], float* aux) {
+  double totalD = 0, D = 3.4e38, extraD = 0, lastD, p[3];
+  float eyef[3], dpf[3], n[3] = { 0, 0, 0 }, ao = 1;
+  int i;
+
+  for (*steps=0; *steps<r->max_steps; ++*steps) {
+    lastD = D;
+    for (i=0; i<3; i++) p[i] = eye[i] + totalD * dp[i];
+    D = mandelboxDistanceDouble(&r->mbDouble, p);
+
+    // Overstepping: have we jumped too far? Cancel last step.
+    if (extraD > 0 && D < extraD) {
+      totalD -= extraD;
+      extraD = 0;
+      D = 3.4e38;
+      --*steps;
+      continue;
+    }
+    if (D < r->min_dist || D > MANDELBOX_MAX_DIST) break;
+
+    totalD += D;
+
+    // Overstepping is based on the optimal length of the last step.
+    totalD += extraD = 0.096 * D*(D+extraD)/lastD;
+  }
+
+  for (i=0; i<3; i++) {
+    p[i] = eye[i] + totalD * dp[i];
+    eyef[i] = eye[i]; dpf[i] = dp[i];
+    col[i] = cpuBackgroundColor[i];
+  }
+  if (D < MANDELBOX_MAX_DIST) {
+    // Normals and ambient occlusion over the same distances as on the GPU,
+    // where the precision goes with the distance to the camera.
+    mandelboxNormalDouble(&r->mbDouble, p, fmax(10.0 * r->min_dist, 1.0e-4 * totalD), n);
+    mandelboxColorDouble(&r->mbDouble, p, col);
+    ao = mandelboxAmbientOcclusionDouble(&r->mbDouble, p, n, fmax(r->ao_eps, 1.0e-4 * totalD), r->ao_strength);
+    shadeCpuSurface(r, eyef, dpf, n, ao, D, col);
+  }
+  glowCpuPixel(r, *steps, col);
+  if (aux) setCpuAux(r, dp, totalD, D < MANDELBOX_MAX_DIST, n, *steps, ao, aux);
+}
+
+// Raymarch a packet of n rays. Every ray does the same steps as in the fragment
+// shader, but the distance estimates of all unfinished rays are computed together.
+void marchCpuPacket(CpuRenderParams const* r, int n, float const (*eye)[3], float const (*dp)[3],
+                    float* totalD, float* D, int* steps) {
+  float extraD[CPU_PACKET_SIZE], lastD[CPU_PACKET_SIZE];
+  float x[CPU_PACKET_SIZE], y[CPU_PACKET_SIZE], z[CPU_PACKET_SIZE], d[CPU_PACKET_SIZE];
+  int active[CPU_PACKET_SIZE], nActive = 0;
+  int i, j;
+
+  for (i=0; i<n; i++) {
+    totalD[i] = 0; D[i] = 3.4e38f; extraD[i] = 0; steps[i] = 0;
+    if (r->max_steps > 0) active[nActive++] = i;
+  }
+
+  while (nActive > 0) {
+    for (j=0; j<nActive; j++) {
+      i = active[j];
+      x[j] = eye[i][0] + totalD[i] * dp[i][0];
+      y[j] = eye[i][1] + totalD[i] * dp[i][1];
+      z[j] = eye[i][2] + totalD[i] * dp[i][2];
+    }
+    mandelboxDistanceBatch(&r->mb, nActive, x, y, z, d);
+
+    for (j=0; j<nActive; ) {
+      int done = 0;
+      i = active[j];
+      lastD[i] = D[i];
+      D[i] = d[j];
+
+      // Overstepping: have we jumped too far? Cancel last step.
+      if (extraD[i] > 0 && D[i] < extraD[i]) {
+        totalD[i] -= extraD[i];
+        extraD[i] = 0;
+        D[i] = 3.4e38f;
+      }
+      else if (D[i] < r->min_dist || D[i] > MANDELBOX_MAX_DIST) done = 1;
+      else {
+        totalD[i] += D[i];
+
+        // Overstepping is based on the optimal length of the last step.
+        totalD[i] += extraD[i] = 0.096f * D[i]*(D[i]+extraD[i])/lastD[i];
+        if (++steps[i] >= r->max_steps) done = 1;
+      }
+
+      if (done) active[j] = active[--nActive];
+      else j++;
+    }
+  }
+}
+
+void renderCpuTile(void* context, int tile, int worker) {
+  CpuRenderJob* job = context;
+  CpuRenderParams const* r = job->params;
+  int tx = tile % job->tilesX, ty = tile / job->tilesX;
+  int x0 = tx * CPU_TILE_SIZE, y0 = ty * CPU_TILE_SIZE;
+  int x1 = x0 + CPU_TILE_SIZE, y1 = y0 + CPU_TILE_SIZE;
+  double tileSteps = 0;
+  int y, i, j;
+
+  if (x1 > job->width) x1 = job->width;
+  if (y1 > job->height) y1 = job->height;
+
+  // Deep zoom: one ray at a time, in double precision.
+  if (r->deepZoom) {
+    for (y=y0; y<y1; y++) {
+      for (i=x0; i<x1; i++) {
+        double eye[3], dp[3], v[3], len, offset = 0;
+        double x = ((i+0.5) * 2 / job->width - 1) * r->tile_scale[0] + r->tile_offset[0];
+        float col[3];
+        unsigned char* out = job->rgb + ((size_t)y * job->width + i) * 3;
+        float* aux = job->aux ? job->aux + ((size_t)y * job->width + i) * AUX_CHANNELS : 0;
+        int steps;
+
+        if (r->views > 1) offset = getCpuView(r, &x);
+        v[0] = tan(r->fov_x/2.0 * CPU_RADIANS) * x;
+        v[1] = tan(r->fov_y/2.0 * CPU_RADIANS) * (((y+0.5) * 2 / job->height - 1) * r->tile_scale[1] + r->tile_offset[1]);
+        v[2] = 1;
+        for (j=0; j<3; j++) {
+          eye[j] = r->camera[12+j] + r->camera[j] * offset;
+          dp[j] = r->camera[j]*v[0] + r->camera[4+j]*v[1] + r->camera[8+j]*v[2];
+        }
+        len = sqrt(dp[0]*dp[0] + dp[1]*dp[1] + dp[2]*dp[2]);
+        for (j=0; j<3; j++) dp[j] /= len;
+
+        renderCpuPixelDouble(r, eye, dp, &steps, col, aux);
+        for (j=0; j<3; j++) out[j] = (unsigned char)(mandelboxClamp(col[j], 0.0f, 1.0f) * 255 + 0.5f);
+        tileSteps += steps;
+      }
+    }
+    if (job->tileSteps) job->tileSteps[tile] = tileSteps;
+    return;
+  }
+
+  // One packet is one row of the tile.
+  for (y=y0; y<y1; y++) {
+    float eye[CPU_PACKET_SIZE][3], dp[CPU_PACKET_SIZE][3];
+    float totalD[CPU_PACKET_SIZE], D[CPU_PACKET_SIZE];
+    int steps[CPU_PACKET_SIZE], n = x1 - x0;
+
+    for (i=0; i<n; i++) {
+      // Pixel centers, like the interpolated varyings in the fragment shader.
+      getCpuRay(r, ((x0+i+0.5f) * 2.0f / job->width - 1) * r->tile_scale[0] + r->tile_offset[0],
+                   ((y+0.5f) * 2.0f / job->height - 1) * r->tile_scale[1] + r->tile_offset[1],
+                eye[i], dp[i]);
+    }
+    marchCpuPacket(r, n, (float const (*)[3])eye, (float const (*)[3])dp, totalD, D, steps);
+
+    for (i=0; i<n; i++) {
+      float col[3];
+      unsigned char* out = job->rgb + ((size_t)y * job->width + x0 + i) * 3;
+      float* aux = job->aux ? job->aux + ((size_t)y * job->width + x0 + i) * AUX_CHANNELS : 0;
+      shadeCpuPixel(r, eye[i], dp[i], totalD[i], D[i], steps[i], col, aux);
+      for (j=0; j<3; j++) out[j] = (unsigned char)(mandelboxClamp(col[j], 0.0f, 1.0f) * 255 + 0.5f);
+      tileSteps += steps[i];
+    }
+  }
+  if (job->tileSteps) job->tileSteps[tile] = tileSteps;
+}
+
+// Render a width x height image. |rgb| gets 3 bytes per pixel, bottom row first
+// (the same layout as glReadPixels), and |aux| (if it isn't 0) AUX_CHANNELS
+// floats per pixel in the same order. |stats| can be 0.
+void renderCpuAux(ThreadPool* pool, CpuRenderParams const* params, int width, int height,
+                  unsigned char* rgb, float* aux, CpuRenderStats* stats) {
+  CpuRenderJob job;
+  Uint32 start = SDL_GetTicks();
+  int i, tiles;
+
+  job.params = params;
+  job.width = width; job.height = height;
+  job.tilesX = (width + CPU_TILE_SIZE-1) / CPU_TILE_SIZE;
+  job.tilesY = (height + CPU_TILE_SIZE-1) / CPU_TILE_SIZE;
+  job.rgb = rgb;
+  job.aux = aux;
+  tiles = job.tilesX * job.tilesY;
+  job.tileSteps = calloc(tiles, sizeof(double));  // for the statistics only, can be 0
+
+  runThreadPool(pool, tiles, renderCpuTile, &job);
+
+  if (stats) {
+    stats->steps = 0;
+    for (i=0; i<tiles && job.tileSteps; i++) stats->steps += job.tileSteps[i];
+    stats->pixels = (double)width * height;
+    stats->milliseconds = SDL_GetTicks() - start;
+  }
+  free(job.tileSteps);
+}
+
+void renderCpu(ThreadPool* pool, CpuRenderParams const* params, int width, int height,
+               unsigned char* rgb, CpuRenderStats* stats) {
+  renderCpuAux(pool, params, width, height, rgb, 0, stats);
+}
+
+#endif  // CPU_RENDERER_H
@@ -0,0 +1,168 @@
+#ifndef DEEP_ZOOM_H
+#define DEEP_ZOOM_H
+
+// Deep zoom: the distance estimator evaluated by perturbation.
+//
+// Floats resolve about 1e-7 around the Mandelbox, so below that, positions
+// along the rays collapse and the surface dissolves into noise. For small
+// min_dist, the fragment shader is compiled with DEEP_ZOOM: positions are
+// relative to the camera, whose position is kept in double precision on the
+// CPU. The orbit of the camera position under the Mandelbox iteration (the
+// reference orbit) is computed in double precision here, and the shader only
+// iterates the small difference between the orbit of its point and the
+// reference orbit, which floats hold accurately at any scale.
+//
+// The folds are piecewise: where a point and the reference are in different
+// pieces, the difference is computed from how far the reference is from the
+// edge of its piece, which is stored along with the orbit.
+//
+// Orbit texture, one column per iteration i (the last one, after all
+// iterations, only has row 0 and 5):
+//   0: z before iteration i (w: derivative)
+//   1, 2: z + 1, z - 1 before the box fold
+//   3: z after the box fold
+//   4: r2 - minRad2, r2 - 1, clamp(r2, minRad2, 1) and r2 after the box fold
+//   5: column 0 only: distance estimate, |z| - |scale - 1|, |z| and w after
+//      iters iterations
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include "shader_procs.h"
+#include "uniforms.h"
+
+#define DEEP_ZOOM_MIN_DIST 1e-6f  // below this min_dist, the camera zooms deep
+#define DEEP_ZOOM_ROWS 6
+
+// The orbit texture is bound to this unit, after the ones of deferred
+// rendering and temporal reprojection.
+#define DEEP_ZOOM_TEXTURE_UNIT 6
+
+#define DEEP_ZOOM_UNIFORMS "orbit", "orbit_texel", "deep_eye"
+#define DEEP_ZOOM_UNIFORM_COUNT 3
+
+typedef struct DeepZoom {
+  int enabled;
+  GLuint texture;
+  int columns;
+  double position[3];  // of the reference orbit in the texture
+  float par0[2];
+  int iters, colorIters;
+} DeepZoom;
+
+// Return 0 if it isn't supported (needs float textures).
+int initDeepZoom(DeepZoom* z) {
+  memset(z, 0, sizeof(DeepZoom));
+  if (!enableFramebufferProcs()) return 0;  // for multitexturing
+
+  while (glGetError() != GL_NO_ERROR);
+  glGenTextures(1, &z->texture);
+  glBindTexture(GL_TEXTURE_2D, z->texture);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+  glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, 1, DEEP_ZOOM_ROWS, 0, GL_RGBA, GL_FLOAT, 0);
+  glBindTexture(GL_TEXTURE_2D, 0);
+  if (glGetError() != GL_NO_ERROR) {
+    glDeleteTextures(1, &z->texture);
+    return 0;
+  }
+  z->enabled = 1;
+  return 1;
+}
+
+void releaseDeepZoom(DeepZoom* z) {
+  if (z->texture) glDeleteTextures(1, &z->texture);
+  memset(z, 0, sizeof(DeepZoom));
+}
+
+static double clampDouble(double x, double lo, double hi) {
+  return x < lo ? lo : x > hi ? hi : x;
+}
+
+// Compute the reference orbit of |position| for columns - 1 iterations (the
+// more of iters and color_iters) into |t| (DEEP_ZOOM_ROWS rows of |columns|
+// RGBA texels), in the same steps as d() and color() in the shader.
+void computeReferenceOrbit(double const position[3], float const par0[2], int iters, int columns, float* t) {
+  double minRad2 = clampDouble(par0[0], 1e-9, 1), scale = par0[1];
+  double s[4] = { scale / minRad2, scale / minRad2, scale / minRad2, fabs(scale) / minRad2 };
+  double p[4] = { position[0], position[1], position[2], 1 };
+  double p0[4] = { position[0], position[1], position[2], 1 };
+  double r2, f, len = 0, w = 1;
+  int i, j, n = columns - 1;
+
+  #define TEXEL(row, column) (t + ((row) * columns + (column)) * 4)
+  memset(t, 0, sizeof(float) * 4 * columns * DEEP_ZOOM_ROWS);
+  for (i=0; i<=n; i++) {
+    if (i == iters) {
+      len = sqrt(p[0]*p[0] + p[1]*p[1] + p[2]*p[2]);
+      w = p[3];
+    }
+    for (j=0; j<4; j++) TEXEL(0, i)[j] = p[j];
+    if (i == n) break;
+
+    // box folding
+    for (j=0; j<3; j++) {
+      TEXEL(1, i)[j] = p[j] + 1;
+      TEXEL(2, i)[j] = p[j] - 1;
+      p[j] = clampDouble(p[j], -1, 1) * 2 - p[j];
+    }
+    for (j=0; j<4; j++) TEXEL(3, i)[j] = p[j];
+
+    // sphere folding
+    r2 = p[0]*p[0] + p[1]*p[1] + p[2]*p[2];
+    TEXEL(4, i)[0] = r2 - minRad2;
+    TEXEL(4, i)[1] = r2 - 1;
+    TEXEL(4, i)[2] = clampDouble(r2, minRad2, 1);
+    TEXEL(4, i)[3] = r2;
+    f = minRad2 / clampDouble(r2, minRad2, 1);
+
+    // scale, translate
+    for (j=0; j<4; j++) p[j] = p[j]*f*s[j] + p0[j];
+  }
+  TEXEL(5, 0)[0] = (len - fabs(scale - 1)) / w - pow(fabs(scale), 1 - iters);
+  TEXEL(5, 0)[1] = len - fabs(scale - 1);
+  TEXEL(5, 0)[2] = len;
+  TEXEL(5, 0)[3] = w;
+  #undef TEXEL
+}
+
+// Make the reference orbit for the camera at |position| and the fractal
+// parameters, unless it's already there.
+void updateDeepZoom(DeepZoom* z, double const position[3], float const par0[2], int iters, int colorIters) {
+  int columns = (iters > colorIters ? iters : colorIters) + 1;
+  float* t;
+
+  if (!z->enabled) return;
+  if (!memcmp(z->position, position, sizeof(z->position)) && !memcmp(z->par0, par0, sizeof(z->par0)) &&
+      z->iters == iters && z->colorIters == colorIters) return;
+  memcpy(z->position, position, sizeof(z->position));
+  memcpy(z->par0, par0, sizeof(z->par0));
+  z->iters = iters;
+  z->colorIters = colorIters;
+  z->columns = columns;
+
+  t = malloc(sizeof(float) * 4 * columns * DEEP_ZOOM_ROWS);
+  computeReferenceOrbit(position, par0, iters, columns, t);
+  glBindTexture(GL_TEXTURE_2D, z->texture);
+  glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, columns, DEEP_ZOOM_ROWS, 0, GL_RGBA, GL_FLOAT, t);
+  glBindTexture(GL_TEXTURE_2D, 0);
+  free(t);
+}
+
+// Bind the orbit texture to DEEP_ZOOM_TEXTURE_UNIT and set the uniforms,
+// which are uniform |first| and the following ones of |u|.
+void setDeepZoomUniforms(DeepZoom const* z, UniformCache* u, int first) {
+  float eye[3] = { z->position[0], z->position[1], z->position[2] };
+
+  glActiveTexture(GL_TEXTURE0 + DEEP_ZOOM_TEXTURE_UNIT);
+  glBindTexture(GL_TEXTURE_2D, z->texture);
+  glActiveTexture(GL_TEXTURE0);
+
+  setUniform1i(u, first, DEEP_ZOOM_TEXTURE_UNIT);
+  setUniform2f(u, first+1, 1.0f / z->columns, 1.0f / DEEP_ZOOM_ROWS);
+  setUniform3fv(u, first+2, eye);
+}
+
+#endif  // DEEP_ZOOM_H
@@ -1,12 +1,25 @@
 const char default_vs[] = 
   "varying vec3 eye,dir;"
+  "varying vec3 eye_offset;"
+  "varying vec2 screen;"
+  "varying float view;"
   "uniform float fov_x,fov_y;"
+  "uniform vec2 tile_scale,tile_offset;"
+  "uniform int views;"
+  "uniform float eye_separation;"
   "float fov2scale(float fov){return tan(radians(fov/2.0));}"
   "void main(){"
-    "gl_Position=gl_Vertex;"
-    "eye=vec3(gl_ModelViewMatrix[3]);"
+    "screen=gl_Vertex.xy*tile_scale+tile_offset;"
+    "gl_Position=vec4(gl_Vertex.xy,0,1);"
+    "eye_offset=vec3(0);"
+    "view=gl_Vertex.z;"
+    "if(views>1){"
+      "screen.x=(screen.x+1.0)*float(views)-2.0*gl_Vertex.z-1.0;"
+      "eye_offset=vec3(gl_ModelViewMatrix[0])*(gl_Vertex.z-0.5*float(views-1))*eye_separation;"
+    "}"
+    "eye=vec3(gl_ModelViewMatrix[3])+eye_offset;"
     "dir=vec3(gl_ModelViewMatrix*vec4("
-      "fov2scale(fov_x)*gl_Vertex.x,fov2scale(fov_y)*gl_Vertex.y,1,0));"
+      "fov2scale(fov_x)*screen.x,fov2scale(fov_y)*screen.y,1,0));"
   "}";
 
 const char default_fs[] = 
@@ -16,6 +29,11 @@ const char default_fs[] =
   "#define DIST_MULTIPLIER 1.0\n"
   "#define MAX_DIST 4.0\n"
   "varying vec3 eye,dir;"
+  "varying vec2 screen;"
+  "varying float view;"
+  "uniform int views;"
+  "uniform float eye_separation;"
+  "uniform float fov_x;"
   "uniform vec2 par[10];"
   "uniform float"
    " min_dist,"
@@ -23,9 +41,37 @@ const char default_fs[] =
     "ao_strength,"
     "glow_strength,"
     "dist_to_color;"
+  "\n#ifdef SPECIALIZED\n"
+  "const int iters=ITERS,color_iters=COLOR_ITERS,max_steps=MAX_STEPS;"
+  "\n#else\n"
   "uniform int iters,"
     "color_iters,"
     "max_steps;"
+  "\n#endif\n"
+  "uniform int ao_samples;"
+  "uniform int heatmap;"
+  "uniform sampler2D cone;"
+  "uniform vec2 cone_scale;"
+  "uniform float cone_size,"
+    "cone_margin,"
+    "eye_margin;"
+  "uniform sampler3D cache;"
+  "uniform vec3 cache_min;"
+  "uniform float cache_size,"
+    "cache_voxel;"
+  "uniform sampler2D gbuffer,gnormals,gao;"
+  "uniform vec2 gbuffer_texel,"
+    "gao_texel;"
+  "uniform float gao_scale;"
+  "uniform sampler2D starts;"
+  "uniform float start_backoff;"
+  "uniform float temporal_phase;"
+  "\n#ifdef DEEP_ZOOM\n"
+  "uniform sampler2D orbit;"
+  "uniform vec2 orbit_texel;"
+  "uniform vec3 deep_eye;"
+  "varying vec3 eye_offset;"
+  "\n#define eye eye_offset\n#endif\n"
   "vec3 backgroundColor=vec3(0.07,0.06,0.16),"
     "surfaceColor1=vec3(0.95,0.64,0.1),"
     "surfaceColor2=vec3(0.89,0.95,0.75),"
@@ -33,10 +79,18 @@ const char default_fs[] =
     "specularColor=vec3(1.0,0.8,0.4),"
     "glowColor=vec3(0.03,0.4,0.4),"
     "aoColor=vec3(0,0,0);"
+  "\n#ifdef SPECIALIZED\n"
+  "const float minRad2=MIN_RAD2;"
+  "const vec4 scale=SCALE_VEC;"
+  "const float absScalem1=ABS_SCALE_M1;"
+  "const float AbsScaleRaisedTo1mIters=ABS_SCALE_RAISED_TO_1M_ITERS;"
+  "\n#else\n"
   "float minRad2=clamp(MINRAD2,1.0e-9,1.0);"
   "vec4 scale=vec4(SCALE,SCALE,SCALE,abs(SCALE))/minRad2;"
   "float absScalem1=abs(SCALE-1.0);"
   "float AbsScaleRaisedTo1mIters=pow(abs(SCALE),float(1-iters));"
+  "\n#endif\n"
+  "\n#ifndef DEEP_ZOOM\n"
   "float d(vec3 pos){"
     "vec4 p=vec4(pos,1),p0=p;"
     "for(int i=0;i<iters;i++){"
@@ -61,7 +115,48 @@ const char default_fs[] =
     "return mix(mix(surfaceColor1,surfaceColor2,c.y),surfaceColor3,c.x);"
   "}"
   "float normal_eps=0.00001;"
+  "\n#else\n"
+  "vec4 orbit_at(int i,float row){"
+    "return texture2D(orbit,(vec2(float(i),row)+0.5)*orbit_texel);"
+  "}"
+  "float ramp(float a,float d){"
+    "return a>=0.0?max(d,-a):max(a+d,0.0);"
+  "}"
+  "vec3 ramp(vec3 a,vec3 d){"
+    "return mix(max(a+d,0.0),max(d,-a),step(0.0,a));"
+  "}"
+  "vec4 iterate(int i,vec4 dz,vec3 pos,out float r2){"
+    "dz.xyz=2.0*(ramp(orbit_at(i,1.0).xyz,dz.xyz)-ramp(orbit_at(i,2.0).xyz,dz.xyz))-dz.xyz;"
+    "vec4 Z=orbit_at(i,3.0),R=orbit_at(i,4.0);"
+    "float D2=dot(2.0*Z.xyz+dz.xyz,dz.xyz),dS=ramp(R.x,D2)-ramp(R.y,D2);"
+    "r2=R.w+D2;"
+    "dz=minRad2*(dz-dS/R.z*Z)/(R.z+dS);"
+    "return dz*scale+vec4(pos,0);"
+  "}"
+  "float d(vec3 pos){"
+    "vec4 dz=vec4(pos,0);"
+    "float r2;"
+    "for(int i=0;i<iters;i++)dz=iterate(i,dz,pos,r2);"
+    "vec4 Z=orbit_at(iters,0.0),F=orbit_at(0,5.0);"
+    "float D2=dot(2.0*Z.xyz+dz.xyz,dz.xyz),dlen=D2/(sqrt(F.z*F.z+D2)+F.z);"
+    "return(F.x-F.y*dz.w/(F.w*(F.w+dz.w))+dlen/(F.w+dz.w))*DIST_MULTIPLIER;"
+  "}"
+  "vec3 color(vec3 pos){"
+    "vec4 dz=vec4(pos,0);"
+    "float trap=1.0,r2;"
+    "for(int i=0;i<color_iters;i++){"
+      "dz=iterate(i,dz,pos,r2);"
+      "trap=min(trap,r2);"
+    "}"
+    "vec3 p=orbit_at(color_iters,0.0).xyz+dz.xyz;"
+    "vec2 c=clamp(vec2(0.33*log(dot(p,p))-1.0,sqrt(trap)),0.0,1.0);"
+    "return mix(mix(surfaceColor1,surfaceColor2,c.y),surfaceColor3,c.x);"
+  "}"
+  "\n#endif\n"
   "vec3 normal(vec3 pos,float d_pos){"
+    "\n#ifdef DEEP_ZOOM\n"
+    "float normal_eps=max(10.0*min_dist,1.0e-4*length(pos));"
+    "\n#endif\n"
     "vec4 Eps=vec4(0,normal_eps,2.0*normal_eps,3.0*normal_eps);"
     "return normalize(vec3("
       "-d(pos-Eps.yxx)+d(pos+Eps.yxx),"
@@ -76,23 +171,69 @@ const char default_fs[] =
     "return dif*diffuseColor+spe*specularColor;"
   "}"
   "float ambient_occlusion(vec3 p,vec3 n){"
-    "float ao=1.0,w=ao_strength/ao_eps;"
-    "float dist=2.0*ao_eps;"
+    "\n#ifdef DEEP_ZOOM\n"
+    "float eps=max(ao_eps,1.0e-4*length(p));"
+    "\n#else\n"
+    "float eps=ao_eps;"
+    "\n#endif\n"
+    "float ao=1.0,w=ao_strength/eps;"
+    "float dist=2.0*eps;"
     "for(int i=0;i<5;i++){"
+      "if(i>=ao_samples)break;"
       "float D=d(p+n*dist);"
       "ao-=(dist-D)*w;"
       "w*=0.5;"
-      "dist=dist*2.0-ao_eps;"
+      "dist=dist*2.0-eps;"
     "}"
     "return clamp(ao,0.0,1.0);"
   "}"
+  "float cached_d(vec3 p){"
+    "vec3 q=p-cache_min;"
+    "if(cache_size==0.0||any(lessThan(q,vec3(0)))||any(greaterThanEqual(q,vec3(cache_size))))return 0.0;"
+    "return texture3D(cache,p/cache_size).x;"
+  "}"
+  "\n#ifdef CONE_PREPASS\n"
   "void main(){"
-    "vec3 p=eye,dp=normalize(dir);"
-    "float totalD=0.0,D=3.4e38,extraD=0.0,lastD;"
+    "vec3 dp=normalize(dir);"
+    "vec3 dx=dFdx(dir)*cone_margin,dy=dFdy(dir)*cone_margin;"
+    "float spread=max("
+      "max(length(normalize(dir+dx+dy)-dp),length(normalize(dir+dx-dy)-dp)),"
+      "max(length(normalize(dir-dx+dy)-dp),length(normalize(dir-dx-dy)-dp)));"
+    "float totalD=0.0,D,r;"
     "int steps;"
     "for(steps=0;steps<max_steps;steps++){"
+      "D=d(eye+totalD*dp);"
+      "r=totalD*spread+eye_margin;"
+      "if(D<2.0*r+min_dist||D>MAX_DIST)break;"
+      "totalD+=D-r-min_dist;"
+    "}"
+    "gl_FragColor=vec4(totalD,float(steps),D-r>MAX_DIST?1.0:0.0,1);"
+  "}"
+  "\n#else\n"
+  "vec3 cone_start(){"
+    "return cone_size>0.0?texture2D(cone,(screen*0.5+0.5)*cone_scale).xyz:vec3(0);"
+  "}"
+  "\n#if defined GBUFFER_MARCH\n"
+  "float march_mark=0.0;"
+  "int mark_steps=0;"
+  "\n#endif\n"
+  "float march(vec3 dp,vec2 start,out float D,out int steps){"
+    "float totalD=start.x,extraD=0.0,lastD;"
+    "D=3.4e38;"
+    "for(steps=int(start.y);steps<max_steps;steps++){"
       "lastD=D;"
-      "D=d(p+totalD*dp);"
+      "\n#if defined GBUFFER_MARCH\n"
+      "if(totalD<march_mark)mark_steps=steps+1;"
+      "\n#endif\n"
+      "float C=cached_d(eye+totalD*dp);"
+      "if(C>cache_voxel){"
+        "D=C;"
+        "if(D>MAX_DIST)break;"
+        "totalD+=D;"
+        "extraD=0.0;"
+        "continue;"
+      "}"
+      "D=d(eye+totalD*dp);"
       "if(extraD>0.0&&D<extraD){"
         "totalD-=extraD;"
         "extraD=0.0;"
@@ -104,18 +245,167 @@ const char default_fs[] =
       "totalD+=D;"
       "totalD+=extraD=0.096*D*(D+extraD)/lastD;"
     "}"
-    "p+=totalD*dp;"
+    "return totalD;"
+  "}"
+  "vec3 surface(vec3 p,vec3 dp,vec3 n,float D,float ao){"
+    "vec3 col=color(p);"
+    "\n#ifdef DEEP_ZOOM\n"
+    "col=blinn_phong(n,-dp,normalize(deep_eye+vec3(0,1,0)+dp),col);"
+    "\n#else\n"
+    "col=blinn_phong(n,-dp,normalize(eye+vec3(0,1,0)+dp),col);"
+    "\n#endif\n"
+    "col=mix(aoColor,col,ao);"
+    "if(D>min_dist){"
+      "col=mix(col,backgroundColor,clamp(log(D/min_dist)*dist_to_color,0.0,1.0));"
+    "}"
+    "return col;"
+  "}"
+  "vec3 glow(vec3 col,float steps){"
+    "return mix(col,glowColor,steps/float(max_steps)*glow_strength);"
+  "}"
+  "vec3 heat(float steps){"
+    "float t=3.0*steps/float(max_steps);"
+    "return clamp(vec3(t,t-1.0,t-2.0),0.0,1.0);"
+  "}"
+  "bool first_view_sees(float start){"
+    "float offset=view*eye_separation;"
+    "float edge=tan(radians(fov_x/2.0))-sign(offset)*dot(dir,vec3(gl_ModelViewMatrix[0]));"
+    "return edge>0.0&&start*edge>=abs(offset)*length(dir);"
+  "}"
+  "vec2 reprojected_start(vec2 uv){"
+    "vec4 s=vec4(0);"
+    "for(int y=-1;y<=1;y++){"
+      "for(int x=-1;x<=1;x++){"
+        "vec4 n=texture2D(starts,uv+vec2(float(x),float(y))*gbuffer_texel);"
+        "if(n.x>s.x)s=n;"
+      "}"
+    "}"
+    "return s.x>0.0?vec2((1.0/s.x-1.0)*(1.0-start_backoff),s.y):vec2(0);"
+  "}"
+  "\n#if defined GBUFFER_MARCH\n"
+  "void main(){"
+    "vec3 dp=normalize(dir);"
+    "vec2 start=cone_start().xy;"
+    "float approach=start.y;"
+    "if(start_backoff>0.0){"
+      "vec2 r=reprojected_start(screen*0.5+0.5);"
+      "if(r.x>start.x&&d(eye+r.x*dp)>0.0){"
+        "if(mod(floor(gl_FragCoord.x)+3.0*floor(gl_FragCoord.y),8.0)==temporal_phase){"
+          "march_mark=r.x;"
+        "}"
+        "else{"
+          "start=vec2(r.x,0);"
+          "approach=r.y;"
+        "}"
+      "}"
+    "}"
+    "float D;"
+    "int steps;"
+    "float totalD=march(dp,start,D,steps);"
+    "float marched=float(steps)-start.y;"
+    "if(march_mark>0.0){"
+      "approach=float(mark_steps);"
+      "marched=float(steps-mark_steps);"
+    "}"
+    "gl_FragColor=vec4(totalD,approach+marched,D,marched);"
+  "}"
+  "\n#elif defined VIEW_PREPASS\n"
+  "void main(){"
+    "vec3 dp=normalize(dir);"
+    "vec3 cone=cone_start();"
+    "float D=3.4e38;"
+    "int steps=int(cone.y);"
+    "float totalD=cone.x;"
+    "if(cone.z==0.0)totalD=march(dp,cone.xy,D,steps);"
+    "gl_FragColor=vec4(totalD,float(steps),D,0);"
+  "}"
+  "\n#elif defined GBUFFER_NORMALS\n"
+  "void main(){"
+    "vec3 dp=normalize(dir);"
+    "vec4 g=texture2D(gbuffer,screen*0.5+0.5);"
+    "gl_FragColor=vec4(0);"
+    "if(g.z<MAX_DIST)gl_FragColor=vec4(normal(eye+g.x*dp,g.z),1);"
+  "}"
+  "\n#elif defined GBUFFER_AO\n"
+  "void main(){"
+    "vec2 uv=screen*0.5+0.5;"
+    "vec4 g=texture2D(gbuffer,uv);"
+    "gl_FragColor=vec4(1,g.x,0,1);"
+    "if(g.z<MAX_DIST){"
+      "vec3 n=texture2D(gnormals,uv).xyz;"
+      "gl_FragColor.x=ambient_occlusion(eye+g.x*normalize(dir),n);"
+    "}"
+  "}"
+  "\n#elif defined GBUFFER_SHADE\n"
+  "float upsampled_ao(vec2 uv,float depth){"
+    "vec2 t=(uv/gbuffer_texel-0.5)/gao_scale,f=fract(t);"
+    "vec2 base=(floor(t)+0.5)*gao_texel;"
+    "vec4 a00=texture2D(gao,base),"
+      "a10=texture2D(gao,base+vec2(gao_texel.x,0)),"
+      "a01=texture2D(gao,base+vec2(0,gao_texel.y)),"
+      "a11=texture2D(gao,base+gao_texel);"
+    "vec4 w=vec4((1.0-f.x)*(1.0-f.y),f.x*(1.0-f.y),(1.0-f.x)*f.y,f.x*f.y)/"
+      "(abs(vec4(a00.y,a10.y,a01.y,a11.y)-depth)/depth+0.002);"
+    "return dot(w,vec4(a00.x,a10.x,a01.x,a11.x))/dot(w,vec4(1));"
+  "}"
+  "void main(){"
+    "vec2 uv=screen*0.5+0.5;"
+    "vec4 g=texture2D(gbuffer,uv);"
     "vec3 col=backgroundColor;"
-    "if(D<MAX_DIST){"
-      "vec3 n=normal(p,D);"
-      "col=color(p);"
-      "col=blinn_phong(n,-dp,normalize(eye+vec3(0,1,0)+dp),col);"
-      "col=mix(aoColor,col,ambient_occlusion(p,n));"
-      "if(D>min_dist){"
-        "col=mix(col,backgroundColor,clamp(log(D/min_dist)*dist_to_color,0.0,1.0));"
+    "if(g.z<MAX_DIST){"
+      "vec3 dp=normalize(dir);"
+      "col=surface(eye+g.x*dp,dp,texture2D(gnormals,uv).xyz,g.z,upsampled_ao(uv,g.x));"
+    "}"
+    "gl_FragColor=vec4(glow(col,g.y),1);"
+    "if(heatmap!=0)gl_FragColor=vec4(heat(g.w),1);"
+  "}"
+  "\n#else\n"
+  "void main(){"
+    "vec3 dp=normalize(dir);"
+    "vec3 cone=cone_start();"
+    "vec2 start=cone.xy;"
+    "float D=3.4e38;"
+    "int steps=int(start.y);"
+    "float totalD=start.x;"
+    "\n#if defined VIEW_STARTS\n"
+    "if(view<0.5){"
+      "vec4 g=texture2D(gbuffer,screen*0.5+0.5);"
+      "totalD=g.x;"
+      "steps=int(g.y);"
+      "D=g.z;"
+    "}"
+    "else if(cone.z==0.0){"
+      "if(first_view_sees(start.x)){"
+        "vec2 r=reprojected_start(vec2((screen.x*0.5+0.5+view)/float(views),screen.y*0.5+0.5));"
+        "if(r.x>start.x&&d(eye+r.x*dp)>0.0)start=r;"
       "}"
+      "totalD=march(dp,start,D,steps);"
     "}"
-    "col=mix(col,glowColor,float(steps)/float(max_steps)*glow_strength);"
-    "gl_FragColor=vec4(col,1);"
-  "}";
-
+    "\n#else\n"
+    "if(cone.z==0.0)totalD=march(dp,start,D,steps);"
+    "\n#endif\n"
+    "vec3 p=eye+totalD*dp;"
+    "vec3 col=backgroundColor;"
+    "vec3 n=vec3(0);"
+    "float ao=1.0;"
+    "if(D<MAX_DIST){"
+      "n=normal(p,D);"
+      "ao=ambient_occlusion(p,n);"
+      "col=surface(p,dp,n,D,ao);"
+    "}"
+    "vec4 color=vec4(glow(col,float(steps)),1);"
+    "if(heatmap!=0)color=vec4(heat(float(steps)-start.y),1);"
+  "\n#ifdef AUX_BUFFERS\n"
+    "float depth=D<MAX_DIST?totalD*dot(dp,vec3(gl_ModelViewMatrix[2])):-1.0;"
+    "gl_FragData[0]=vec4(depth,float(steps),ao,0);"
+    "gl_FragData[1]=vec4(n,0);"
+    "gl_FragData[2]=color;"
+  "\n#else\n"
+    "gl_FragColor=color;"
+  "\n#ifdef STEP_COUNT\n"
+    "gl_FragColor=vec4(floor(float(steps)/256.0)/255.0,mod(float(steps),256.0)/255.0,0,1);"
+  "\n#endif\n"
+  "\n#endif\n"
+  "}"
+  "\n#endif\n"
+  "\n#endif\n";
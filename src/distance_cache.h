@@ -0,0 +1,306 @@
+#ifndef DISTANCE_CACHE_H
+#define DISTANCE_CACHE_H
+
+// Distance cache.
+//
+// A cube of space around the camera is divided into bricks of
+// DISTANCE_CACHE_BRICK^3 voxels. Every voxel holds a lower bound of the
+// distance from any point inside it to the Mandelbox, so the raymarcher can
+// step through empty space without evaluating d(). 0 means unknown.
+//
+// A background thread fills the bricks, the nearest to the camera first, with
+// the CPU distance estimator. A brick far from the surface costs one distance
+// evaluation at its center; only bricks near the surface are evaluated voxel
+// by voxel. The main thread uploads finished bricks into a 3D texture.
+//
+// The cube moves with the camera in whole bricks. World brick (x, y, z) is
+// stored at (x, y, z) modulo the number of bricks per axis, and the texture
+// repeats, so when the camera moves only the bricks entering the cube are
+// cleared and refilled. When the fractal parameters change, all bricks are.
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <SDL/SDL.h>
+#include <SDL/SDL_thread.h>
+#include "shader_procs.h"
+#include "uniforms.h"
+#include "cpu_mandelbox.h"
+
+#define DISTANCE_CACHE_BRICK   8   // voxels per brick and axis
+#define DISTANCE_CACHE_BRICKS  16  // bricks per axis
+#define DISTANCE_CACHE_VOXELS  (DISTANCE_CACHE_BRICK * DISTANCE_CACHE_BRICK * DISTANCE_CACHE_BRICK)
+#define DISTANCE_CACHE_SLOTS   (DISTANCE_CACHE_BRICKS * DISTANCE_CACHE_BRICKS * DISTANCE_CACHE_BRICKS)
+#define DISTANCE_CACHE_UPLOADS 64    // bricks uploaded per frame at most
+#define DISTANCE_CACHE_SAFETY  0.9f  // the estimator isn't exactly a distance
+
+enum { BRICK_EMPTY, BRICK_FILLING, BRICK_READY, BRICK_UPLOADED };
+
+typedef struct CacheBrick {
+  int coord[3];  // brick in the world, in bricks
+  int state;     // BRICK_*
+} CacheBrick;
+
+typedef struct DistanceCache {
+  int enabled;
+  float size;                 // of the cube, in world units
+  float brickSize, voxelSize;
+  GLuint texture;
+
+  // Shared with the filling thread.
+  SDL_mutex* lock;
+  SDL_cond* changed;
+  SDL_Thread* thread;
+  int quit;
+  CacheBrick bricks[DISTANCE_CACHE_SLOTS];
+  float* voxels;              // DISTANCE_CACHE_VOXELS per brick
+  Mandelbox mb;
+  int origin[3];              // first brick of the cube
+  float eye[3];               // bricks near the camera are filled first
+  int filled, dense;          // bricks filled, and evaluated voxel by voxel
+
+  // Parameters the cache is for.
+  float par0[2], min_dist;
+  int iters;
+  int valid;
+} DistanceCache;
+
+// Brick coordinate modulo the number of bricks.
+static int cacheSlotCoord(int x) {
+  x %= DISTANCE_CACHE_BRICKS;
+  return x < 0 ? x + DISTANCE_CACHE_BRICKS : x;
+}
+
+// Compute the lower bounds for the voxels of a brick.
+static void fillCacheBrick(DistanceCache* c, Mandelbox const* mb, int const coord[3],
+                           float* voxels, int* dense) {
+  float x[DISTANCE_CACHE_VOXELS], y[DISTANCE_CACHE_VOXELS], z[DISTANCE_CACHE_VOXELS];
+  float center[3], d0;
+  float voxelRadius = c->voxelSize * 0.8660254f;  // half the diagonal
+  float brickRadius = c->brickSize * 0.8660254f;
+  int i, j;
+
+  for (j=0; j<3; j++) center[j] = (coord[j] + 0.5f) * c->brickSize;
+  for (i=0; i<DISTANCE_CACHE_VOXELS; i++) {
+    x[i] = (coord[0] * DISTANCE_CACHE_BRICK + i % DISTANCE_CACHE_BRICK + 0.5f) * c->voxelSize;
+    y[i] = (coord[1] * DISTANCE_CACHE_BRICK + i / DISTANCE_CACHE_BRICK % DISTANCE_CACHE_BRICK + 0.5f) * c->voxelSize;
+    z[i] = (coord[2] * DISTANCE_CACHE_BRICK + i / (DISTANCE_CACHE_BRICK*DISTANCE_CACHE_BRICK) + 0.5f) * c->voxelSize;
+  }
+
+  // Far from the surface, the distance at the center bounds the whole brick.
+  d0 = mandelboxDistance(mb, center);
+  *dense = d0 < 2 * brickRadius;
+  if (*dense) {
+    mandelboxDistanceBatch(mb, DISTANCE_CACHE_VOXELS, x, y, z, voxels);
+  } else {
+    for (i=0; i<DISTANCE_CACHE_VOXELS; i++) {
+      float dx = x[i] - center[0], dy = y[i] - center[1], dz = z[i] - center[2];
+      voxels[i] = d0 - sqrtf(dx*dx + dy*dy + dz*dz);
+    }
+  }
+
+  for (i=0; i<DISTANCE_CACHE_VOXELS; i++) {
+    float d = (voxels[i] - voxelRadius) * DISTANCE_CACHE_SAFETY;
+    voxels[i] = d > 0 ? d : 0;
+  }
+}
+
+// Find the brick in |state| nearest to the camera. Return -1 if there is none.
+static int findCacheBrick(DistanceCache* c, int state) {
+  int i, j, best = -1;
+  float bestDistance = 0;
+
+  for (i=0; i<DISTANCE_CACHE_SLOTS; i++) {
+    float distance = 0;
+    if (c->bricks[i].state != state) continue;
+    for (j=0; j<3; j++) {
+      float d = (c->bricks[i].coord[j] + 0.5f) * c->brickSize - c->eye[j];
+      distance += d*d;
+    }
+    if (best < 0 || distance < bestDistance) { best = i; bestDistance = distance; }
+  }
+  return best;
+}
+
+int distanceCacheMain(void* arg) {
+  DistanceCache* c = arg;
+  float voxels[DISTANCE_CACHE_VOXELS];
+
+  SDL_LockMutex(c->lock);
+  for (;;) {
+    int slot, coord[3], dense;
+    Mandelbox mb;
+
+    while (!c->quit && (!c->valid || (slot = findCacheBrick(c, BRICK_EMPTY)) < 0)) SDL_CondWait(c->changed, c->lock);
+    if (c->quit) break;
+
+    c->bricks[slot].state = BRICK_FILLING;
+    memcpy(coord, c->bricks[slot].coord, sizeof(coord));
+    mb = c->mb;
+    SDL_UnlockMutex(c->lock);
+
+    fillCacheBrick(c, &mb, coord, voxels, &dense);
+
+    SDL_LockMutex(c->lock);
+    // The brick is empty again if it has been invalidated meanwhile.
+    if (c->bricks[slot].state == BRICK_FILLING) {
+      memcpy(c->voxels + slot * DISTANCE_CACHE_VOXELS, voxels, sizeof(voxels));
+      c->bricks[slot].state = BRICK_READY;
+      c->filled++;
+      c->dense += dense;
+    }
+  }
+  SDL_UnlockMutex(c->lock);
+  return 0;
+}
+
+// Stop the thread and delete the texture.
+void releaseDistanceCache(DistanceCache* c) {
+  if (!c->enabled) return;
+
+  SDL_LockMutex(c->lock);
+  c->quit = 1;
+  SDL_CondSignal(c->changed);
+  SDL_UnlockMutex(c->lock);
+  SDL_WaitThread(c->thread, 0);
+
+  fprintf(stderr, "Distance cache: %d bricks filled, %d of them voxel by voxel.\n",
+    c->filled, c->dense);
+
+  SDL_DestroyCond(c->changed);
+  SDL_DestroyMutex(c->lock);
+  glDeleteTextures(1, &c->texture);
+  free(c->voxels);
+  memset(c, 0, sizeof(DistanceCache));
+}
+
+// Set up a cache for a cube of |size| world units around the camera.
+// Must be called with a current OpenGL context. Return 0 if it isn't
+// supported (needs 3D float textures).
+int initDistanceCache(DistanceCache* c, float size) {
+  int n = DISTANCE_CACHE_BRICK * DISTANCE_CACHE_BRICKS;
+
+  memset(c, 0, sizeof(DistanceCache));
+  if (size <= 0 || !enableTexture3DProcs()) return 0;
+
+  c->size = size;
+  c->brickSize = size / DISTANCE_CACHE_BRICKS;
+  c->voxelSize = c->brickSize / DISTANCE_CACHE_BRICK;
+  c->voxels = calloc(DISTANCE_CACHE_SLOTS, sizeof(float) * DISTANCE_CACHE_VOXELS);
+
+  // Start with unknown distances everywhere.
+  while (glGetError() != GL_NO_ERROR);
+  glGenTextures(1, &c->texture);
+  glBindTexture(GL_TEXTURE_3D, c->texture);
+  glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+  glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+  glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+  glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+  glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_R, GL_REPEAT);
+  glTexImage3D(GL_TEXTURE_3D, 0, GL_R32F, n, n, n, 0, GL_RED, GL_FLOAT, c->voxels);
+  glBindTexture(GL_TEXTURE_3D, 0);
+  if (glGetError() != GL_NO_ERROR) {
+    glDeleteTextures(1, &c->texture);
+    free(c->voxels);
+    return 0;
+  }
+
+  c->enabled = 1;
+  c->lock = SDL_CreateMutex();
+  c->changed = SDL_CreateCond();
+  c->thread = SDL_CreateThread(distanceCacheMain, c);
+  return 1;
+}
+
+// Call before rendering with the current fractal parameters and camera
+// position. Invalidates the bricks that are out of date and uploads the
+// bricks that have been filled.
+void updateDistanceCache(DistanceCache* c, float const par0[2], int iters, float min_dist,
+                         float const eye[3]) {
+  static float const zeros[DISTANCE_CACHE_VOXELS];
+  int origin[3], reset, i, j, uploads = 0;
+
+  if (!c->enabled) return;
+
+  for (j=0; j<3; j++) origin[j] = (int)floorf(eye[j] / c->brickSize) - DISTANCE_CACHE_BRICKS/2;
+  reset = !c->valid || c->par0[0] != par0[0] || c->par0[1] != par0[1] ||
+    c->iters != iters || c->min_dist != min_dist;
+
+  SDL_LockMutex(c->lock);
+  memcpy(c->eye, eye, sizeof(c->eye));
+
+  if (reset || memcmp(origin, c->origin, sizeof(origin))) {
+    if (reset) {
+      initMandelbox(&c->mb, par0, iters, 0);
+      c->par0[0] = par0[0]; c->par0[1] = par0[1];
+      c->iters = iters;
+      c->min_dist = min_dist;
+      c->valid = 1;
+    }
+    memcpy(c->origin, origin, sizeof(origin));
+
+    // Empty the bricks that are out of date, or have moved out of the cube.
+    glBindTexture(GL_TEXTURE_3D, c->texture);
+    for (i=0; i<DISTANCE_CACHE_SLOTS; i++) {
+      CacheBrick* b = &c->bricks[i];
+      int slot[3] = { i % DISTANCE_CACHE_BRICKS, i / DISTANCE_CACHE_BRICKS % DISTANCE_CACHE_BRICKS,
+                      i / (DISTANCE_CACHE_BRICKS*DISTANCE_CACHE_BRICKS) };
+      int coord[3];
+
+      for (j=0; j<3; j++) coord[j] = origin[j] + cacheSlotCoord(slot[j] - origin[j]);
+      if (!reset && !memcmp(coord, b->coord, sizeof(coord))) continue;
+
+      if (b->state == BRICK_UPLOADED) {
+        glTexSubImage3D(GL_TEXTURE_3D, 0, slot[0] * DISTANCE_CACHE_BRICK, slot[1] * DISTANCE_CACHE_BRICK,
+          slot[2] * DISTANCE_CACHE_BRICK, DISTANCE_CACHE_BRICK, DISTANCE_CACHE_BRICK, DISTANCE_CACHE_BRICK,
+          GL_RED, GL_FLOAT, zeros);
+      }
+      memcpy(b->coord, coord, sizeof(coord));
+      b->state = BRICK_EMPTY;
+    }
+    glBindTexture(GL_TEXTURE_3D, 0);
+    SDL_CondSignal(c->changed);
+  }
+
+  // Upload the bricks that have been filled, the nearest first.
+  glBindTexture(GL_TEXTURE_3D, c->texture);
+  for (; uploads < DISTANCE_CACHE_UPLOADS && (i = findCacheBrick(c, BRICK_READY)) >= 0; uploads++) {
+    CacheBrick* b = &c->bricks[i];
+    glTexSubImage3D(GL_TEXTURE_3D, 0,
+      cacheSlotCoord(b->coord[0]) * DISTANCE_CACHE_BRICK, cacheSlotCoord(b->coord[1]) * DISTANCE_CACHE_BRICK,
+      cacheSlotCoord(b->coord[2]) * DISTANCE_CACHE_BRICK, DISTANCE_CACHE_BRICK, DISTANCE_CACHE_BRICK, DISTANCE_CACHE_BRICK,
+      GL_RED, GL_FLOAT, c->voxels + i * DISTANCE_CACHE_VOXELS);
+    b->state = BRICK_UPLOADED;
+  }
+  glBindTexture(GL_TEXTURE_3D, 0);
+  SDL_UnlockMutex(c->lock);
+}
+
+// Names of the uniforms set by setDistanceCacheUniforms(), in this order.
+#define DISTANCE_CACHE_UNIFORMS "cache", "cache_min", "cache_size", "cache_voxel"
+#define DISTANCE_CACHE_UNIFORM_COUNT 4
+
+// Bind the cache texture to texture unit 1 and set the uniforms, which are
+// uniform |first| and the following ones of |u|. Without a cache, set
+// cache_size to 0.
+void setDistanceCacheUniforms(DistanceCache const* c, UniformCache* u, int first) {
+  float origin[3];
+  int j;
+
+  // Samplers of different types must not share a texture unit, even unused.
+  setUniform1i(u, first, 1);
+  if (!c->enabled) {
+    setUniform1f(u, first+2, 0);
+    return;
+  }
+  for (j=0; j<3; j++) origin[j] = c->origin[j] * c->brickSize;
+
+  glActiveTexture(GL_TEXTURE1);
+  glBindTexture(GL_TEXTURE_3D, c->texture);
+  glActiveTexture(GL_TEXTURE0);
+  setUniform3fv(u, first+1, origin);
+  setUniform1f(u, first+2, c->size);
+  setUniform1f(u, first+3, c->voxelSize);
+}
+
+#endif  // DISTANCE_CACHE_H
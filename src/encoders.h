@@ -0,0 +1,635 @@
+#ifndef ENCODERS_H
+#define ENCODERS_H
+
+// Image and video output encoders.
+//
+// An encoder gets the rows of a frame from top to bottom, so a frame never
+// has to be in memory in the output format. Supported formats:
+//   tga  uncompressed 24-bit TGA, one file per frame
+//   png    PNG, one file per frame. DEFLATE runs on a thread pool: the rows are
+//          cut into strips which are compressed in parallel, each with the end of
+//          the previous strip as dictionary (like pigz), and joined into one stream.
+//   y4m    YUV4MPEG2 (4:4:4) video stream, all frames in one file
+//   rgb    raw RGB24 video stream, all frames in one file
+//   png16  48-bit PNG (extension .png), one file per frame
+//   pfm    PFM, 32-bit float RGB, one file per frame
+// The file "-" is stdout and "|command" is a pipe to a command, for example
+//   --format y4m --out "|ffmpeg -i - video.mp4"
+//
+// The samples of the rows a format gets are bytes, or 16-bit integers or
+// floats in native byte order (sampleBytes 2 or 4).
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+#include <SDL/SDL.h>
+#include <SDL/SDL_endian.h>
+#include "thread_pool.h"
+
+#if (defined __WIN32__)
+  #include <io.h>
+  #include <fcntl.h>
+  #define popen _popen
+  #define pclose _pclose
+  #define PIPE_MODE "wb"
+#else
+  #define PIPE_MODE "w"
+#endif
+
+#define PNG_LEVEL 6            // zlib compression level
+#define PNG_STRIP_SIZE 131072  // uncompressed bytes per strip, at least PNG_WINDOW
+#define PNG_WINDOW 32768       // DEFLATE dictionary size
+#define Y4M_FPS 30
+
+struct ImageFormat;
+
+typedef struct Encoder {
+  struct ImageFormat const* format;
+  char file[256];
+  FILE* f;
+  int isPipe;
+  int width, height;
+  int row;           // rows of the current frame written so far
+  int frames;        // frames finished
+  double bytes;      // bytes written
+  ThreadPool* pool;  // for parallel compression, can be 0
+  void* state;       // format specific
+} Encoder;
+
+typedef struct ImageFormat {
+  char const* name;
+  char const* extension;
+  int sampleBytes;   // 1, 2 (16-bit) or 4 (float)
+  int stream;        // all frames go into one file (or pipe)
+  int wholeFrame;    // keeps (most of) a frame in memory until its end
+  int (*beginFrame)(Encoder* e);
+  int (*writeRows)(Encoder* e, unsigned char const* rgb, int rows);  // top row first, advances row
+  int (*endFrame)(Encoder* e);
+  void (*freeState)(Encoder* e);
+} ImageFormat;
+
+// Write to the encoder's file and count the bytes. Return 0 on error.
+int encoderWrite(Encoder* e, void const* data, size_t size) {
+  e->bytes += size;
+  return fwrite(data, 1, size, e->f) == size;
+}
+
+void freeEncoderState(Encoder* e) {
+  free(e->state);
+}
+
+// Run jobs on the pool, or on this thread if there is no pool.
+void runEncoderJobs(Encoder* e, int jobs, ThreadPoolJob job, void* context) {
+  int i;
+  if (e->pool) runThreadPool(e->pool, jobs, job, context);
+  else for (i=0; i<jobs; i++) job(context, i, 0);
+}
+
+
+////////////////////////////////////////////////////////////////
+// TGA.
+
+int beginTgaFrame(Encoder* e) {
+  unsigned char header[18] = {
+    0,0,2,0,0,0,0,0,0,0,0,0,e->width%256,e->width/256,e->height%256,e->height/256,24,
+    0x20  // top row first
+  };
+  if (e->width > 65535 || e->height > 65535) {
+    fprintf(stderr, "TGA images can't be larger than 65535 x 65535\n");
+    return 0;
+  }
+  if (!e->state && !(e->state = malloc(e->width * 3))) return 0;
+  return encoderWrite(e, header, 18);
+}
+
+int writeTgaRows(Encoder* e, unsigned char const* rgb, int rows) {
+  unsigned char* bgr = e->state;
+  int ok = 1, i, x;
+
+  for (i=0; i<rows; i++, rgb += e->width * 3) {
+    for (x=0; x<e->width; x++) {
+      bgr[x*3+0] = rgb[x*3+2]; bgr[x*3+1] = rgb[x*3+1]; bgr[x*3+2] = rgb[x*3+0];
+    }
+    ok &= encoderWrite(e, bgr, e->width * 3);
+  }
+  e->row += rows;
+  return ok;
+}
+
+int endTgaFrame(Encoder* e) {
+  return 1;
+}
+
+
+////////////////////////////////////////////////////////////////
+// PNG.
+
+typedef struct PngStrip {
+  unsigned char const* in;  // filtered rows
+  size_t inSize;
+  unsigned char const* dict;
+  size_t dictSize;
+  unsigned char* out;       // 2 bytes of zlib header, deflate data, 4 bytes of Adler-32
+  size_t outSize;
+  uLong adler;
+  int last, failed;
+} PngStrip;
+
+typedef struct PngState {
+  int rowSize;            // RGB bytes per row
+  int pixelSize;          // bytes per pixel
+  int stripRows, strips;  // rows per strip, strips per batch
+  int rows;               // rows in the batch
+  unsigned char* raw;     // the row above the batch, then the rows of the batch
+  unsigned char* filtered;
+  PngStrip* strip;
+  size_t outCapacity;
+  unsigned char window[PNG_WINDOW];  // dictionary for the first strip of the next batch
+  size_t windowSize;
+  uLong adler;
+} PngState;
+
+void putPngInt(unsigned char* p, uLong x) {
+  p[0] = x >> 24; p[1] = x >> 16; p[2] = x >> 8; p[3] = x;
+}
+
+int writePngChunk(Encoder* e, char const* type, unsigned char const* data, size_t size) {
+  unsigned char buf[4];
+  uLong crc = crc32(crc32(0, Z_NULL, 0), (Bytef const*)type, 4);
+  int ok;
+
+  if (size) crc = crc32(crc, data, size);
+  putPngInt(buf, size);
+  ok = encoderWrite(e, buf, 4) && encoderWrite(e, type, 4);
+  if (size) ok &= encoderWrite(e, data, size);
+  putPngInt(buf, crc);
+  return ok && encoderWrite(e, buf, 4);
+}
+
+static unsigned char pngPaeth(int a, int b, int c) {
+  int p = a + b - c, pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+  return pa <= pb && pa <= pc ? a : pb <= pc ? b : c;
+}
+
+// Filter a row with the filter that gives the smallest sum of absolute
+// differences, the heuristic recommended by the PNG specification.
+// |out| gets the filter type and the filtered bytes. Pixels are |bpp| bytes.
+void filterPngRow(unsigned char const* prev, unsigned char const* cur, int size, int bpp, unsigned char* out) {
+  unsigned sum[5] = { 0, 0, 0, 0, 0 };
+  int i, f, best = 0;
+
+  for (i=0; i<size; i++) {
+    int a = i >= bpp ? cur[i-bpp] : 0, b = prev[i], c = i >= bpp ? prev[i-bpp] : 0, x = cur[i];
+    sum[0] += abs((signed char)x);
+    sum[1] += abs((signed char)(x - a));
+    sum[2] += abs((signed char)(x - b));
+    sum[3] += abs((signed char)(x - (a + b) / 2));
+    sum[4] += abs((signed char)(x - pngPaeth(a, b, c)));
+  }
+  for (f=1; f<5; f++) if (sum[f] < sum[best]) best = f;
+
+  out[0] = best;
+  for (i=0; i<size; i++) {
+    int a = i >= bpp ? cur[i-bpp] : 0, b = prev[i], c = i >= bpp ? prev[i-bpp] : 0, x = cur[i];
+    switch (best) {
+      case 0: out[i+1] = x; break;
+      case 1: out[i+1] = x - a; break;
+      case 2: out[i+1] = x - b; break;
+      case 3: out[i+1] = x - (a + b) / 2; break;
+      case 4: out[i+1] = x - pngPaeth(a, b, c); break;
+    }
+  }
+}
+
+void filterPngStrip(void* context, int job, int worker) {
+  PngState* p = context;
+  int first = job * p->stripRows, last = first + p->stripRows, y;
+
+  if (last > p->rows) last = p->rows;
+  for (y=first; y<last; y++) {
+    filterPngRow(p->raw + (size_t)y * p->rowSize, p->raw + (size_t)(y+1) * p->rowSize, p->rowSize, p->pixelSize,
+                 p->filtered + (size_t)y * (p->rowSize + 1));
+  }
+}
+
+void compressPngStrip(void* context, int job, int worker) {
+  PngState* p = context;
+  PngStrip* s = &p->strip[job];
+  z_stream z;
+  int status;
+
+  memset(&z, 0, sizeof(z));
+  s->failed = deflateInit2(&z, PNG_LEVEL, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK;
+  if (s->failed) return;
+  if (s->dictSize) deflateSetDictionary(&z, s->dict, s->dictSize);
+
+  // A sync flush ends the strip on a byte boundary, so the strips can be joined.
+  z.next_in = (Bytef*)s->in;
+  z.avail_in = s->inSize;
+  z.next_out = s->out + 2;
+  z.avail_out = p->outCapacity;
+  status = deflate(&z, s->last ? Z_FINISH : Z_SYNC_FLUSH);
+  s->failed = z.avail_in != 0 || (s->last ? status != Z_STREAM_END : status != Z_OK);
+  s->outSize = p->outCapacity - z.avail_out;
+  deflateEnd(&z);
+
+  s->adler = adler32(adler32(0, Z_NULL, 0), s->in, s->inSize);
+}
+
+// Compress the rows of the batch in parallel and write them as IDAT chunks.
+int flushPngBatch(Encoder* e, int last) {
+  PngState* p = e->state;
+  size_t stripSize = (size_t)p->stripRows * (p->rowSize + 1), batchSize;
+  int n = (p->rows + p->stripRows-1) / p->stripRows, ok = 1, j;
+
+  runEncoderJobs(e, n, filterPngStrip, p);
+
+  batchSize = (size_t)p->rows * (p->rowSize + 1);
+  for (j=0; j<n; j++) {
+    PngStrip* s = &p->strip[j];
+    s->in = p->filtered + j * stripSize;
+    s->inSize = (j == n-1 ? batchSize - j * stripSize : stripSize);
+    if (j == 0) { s->dict = p->window; s->dictSize = p->windowSize; }
+    else { s->dict = s->in - PNG_WINDOW; s->dictSize = PNG_WINDOW; }
+    s->last = last && j == n-1;
+  }
+  runEncoderJobs(e, n, compressPngStrip, p);
+
+  for (j=0; j<n && ok; j++) {
+    PngStrip* s = &p->strip[j];
+    unsigned char* data = s->out + 2;
+    size_t size = s->outSize;
+
+    if (s->failed) return 0;
+    p->adler = adler32_combine(p->adler, s->adler, s->inSize);
+    if (e->row == p->rows && j == 0) {  // first strip of the frame
+      data -= 2; size += 2;
+      data[0] = 0x78; data[1] = 0x9c;
+    }
+    if (s->last) { putPngInt(data + size, p->adler); size += 4; }
+    ok = writePngChunk(e, "IDAT", data, size);
+  }
+
+  // The end of this batch is the dictionary of the next one.
+  p->windowSize = batchSize < PNG_WINDOW ? batchSize : PNG_WINDOW;
+  memcpy(p->window, p->filtered + batchSize - p->windowSize, p->windowSize);
+  memcpy(p->raw, p->raw + (size_t)p->rows * p->rowSize, p->rowSize);
+  p->rows = 0;
+  return ok;
+}
+
+void freePngState(Encoder* e) {
+  PngState* p = e->state;
+  int j;
+  if (!p) return;
+  for (j=0; j<p->strips && p->strip; j++) free(p->strip[j].out);
+  free(p->strip);
+  free(p->filtered);
+  free(p->raw);
+  free(p);
+}
+
+int beginPngFrame(Encoder* e) {
+  static unsigned char const signature[8] = { 137, 80, 78, 71, 13, 10, 26, 10 };
+  unsigned char ihdr[13] = { 0,0,0,0, 0,0,0,0, 8, 2, 0, 0, 0 };  // 8 or 16-bit RGB
+  PngState* p = e->state;
+  int j;
+
+  if (!p) {
+    if (!(p = e->state = calloc(1, sizeof(PngState)))) return 0;
+    p->pixelSize = 3 * e->format->sampleBytes;
+    p->rowSize = e->width * p->pixelSize;
+    p->stripRows = (PNG_STRIP_SIZE + p->rowSize) / (p->rowSize + 1);
+    p->strips = e->pool ? e->pool->threads : 1;
+    p->raw = malloc(((size_t)p->strips * p->stripRows + 1) * p->rowSize);
+    p->filtered = malloc((size_t)p->strips * p->stripRows * (p->rowSize + 1));
+    p->strip = calloc(p->strips, sizeof(PngStrip));
+    p->outCapacity = compressBound((size_t)p->stripRows * (p->rowSize + 1)) + 64;
+    for (j=0; j<p->strips && p->strip; j++) {
+      if (!(p->strip[j].out = malloc(p->outCapacity + 6))) break;
+    }
+    if (!p->raw || !p->filtered || !p->strip || j < p->strips) {
+      freePngState(e);
+      e->state = 0;
+      return 0;
+    }
+  }
+  memset(p->raw, 0, p->rowSize);  // the row above the image
+  p->rows = 0;
+  p->windowSize = 0;
+  p->adler = adler32(0, Z_NULL, 0);
+
+  putPngInt(ihdr, e->width);
+  putPngInt(ihdr + 4, e->height);
+  ihdr[8] = 8 * e->format->sampleBytes;
+  return encoderWrite(e, signature, 8) && writePngChunk(e, "IHDR", ihdr, 13);
+}
+
+int writePngRows(Encoder* e, unsigned char const* rgb, int rows) {
+  PngState* p = e->state;
+  int ok = 1, i;
+
+  for (i=0; i<rows && ok; i++, rgb += p->rowSize) {
+    unsigned char* row = p->raw + (size_t)(p->rows + 1) * p->rowSize;
+    memcpy(row, rgb, p->rowSize);
+    if (e->format->sampleBytes == 2 && SDL_BYTEORDER == SDL_LIL_ENDIAN) {
+      int x;
+      for (x=0; x<p->rowSize; x+=2) { unsigned char t = row[x]; row[x] = row[x+1]; row[x+1] = t; }  // big-endian
+    }
+    p->rows++;
+    e->row++;
+    if (p->rows == p->strips * p->stripRows || e->row == e->height) ok = flushPngBatch(e, e->row == e->height);
+  }
+  return ok;
+}
+
+int endPngFrame(Encoder* e) {
+  return e->row == e->height && writePngChunk(e, "IEND", 0, 0);
+}
+
+
+////////////////////////////////////////////////////////////////
+// YUV4MPEG2 stream, 4:4:4 with BT.601 studio range colors.
+
+int beginY4mFrame(Encoder* e) {
+  char header[256];
+  int ok = 1;
+
+  if (!e->state && !(e->state = malloc((size_t)e->width * e->height * 2 + e->width))) return 0;
+  if (e->frames == 0) {
+    sprintf(header, "YUV4MPEG2 W%d H%d F%d:1 Ip A1:1 C444\n", e->width, e->height, Y4M_FPS);
+    ok = encoderWrite(e, header, strlen(header));
+  }
+  return ok && encoderWrite(e, "FRAME\n", 6);
+}
+
+// The Y plane is written right away, U and V are kept until the end of the frame.
+int writeY4mRows(Encoder* e, unsigned char const* rgb, int rows) {
+  size_t plane = (size_t)e->width * e->height;
+  unsigned char* yRow = (unsigned char*)e->state + 2 * plane;
+  int ok = 1, i, x;
+
+  for (i=0; i<rows; i++, rgb += e->width * 3) {
+    unsigned char* u = (unsigned char*)e->state + (size_t)(e->row + i) * e->width;
+    unsigned char* v = u + plane;
+    for (x=0; x<e->width; x++) {
+      int r = rgb[x*3+0], g = rgb[x*3+1], b = rgb[x*3+2];
+      yRow[x] = ((66*r + 129*g + 25*b + 128) >> 8) + 16;
+      u[x] = ((-38*r - 74*g + 112*b + 128) >> 8) + 128;
+      v[x] = ((112*r - 94*g - 18*b + 128) >> 8) + 128;
+    }
+    ok &= encoderWrite(e, yRow, e->width);
+  }
+  e->row += rows;
+  return ok;
+}
+
+int endY4mFrame(Encoder* e) {
+  return e->row == e->height && encoderWrite(e, e->state, (size_t)e->width * e->height * 2);
+}
+
+
+////////////////////////////////////////////////////////////////
+// Raw RGB24 stream.
+
+int beginRgbFrame(Encoder* e) {
+  return 1;
+}
+
+int writeRgbRows(Encoder* e, unsigned char const* rgb, int rows) {
+  e->row += rows;
+  return encoderWrite(e, rgb, (size_t)rows * e->width * 3);
+}
+
+int endRgbFrame(Encoder* e) {
+  return 1;
+}
+
+
+////////////////////////////////////////////////////////////////
+// PFM, float RGB. PFM rows are bottom first, so the frame is kept until its
+// end.
+
+int beginPfmFrame(Encoder* e) {
+  char header[256];
+  if (!e->state && !(e->state = malloc((size_t)e->width * e->height * 3 * sizeof(float)))) return 0;
+  sprintf(header, "PF\n%d %d\n%s\n", e->width, e->height, SDL_BYTEORDER == SDL_LIL_ENDIAN ? "-1.0" : "1.0");
+  return encoderWrite(e, header, strlen(header));
+}
+
+int writePfmRows(Encoder* e, unsigned char const* rgb, int rows) {
+  size_t rowSize = (size_t)e->width * 3 * sizeof(float);
+  int i;
+  for (i=0; i<rows; i++, rgb += rowSize) {
+    memcpy((unsigned char*)e->state + (size_t)(e->height-1 - e->row - i) * rowSize, rgb, rowSize);
+  }
+  e->row += rows;
+  return 1;
+}
+
+int endPfmFrame(Encoder* e) {
+  return e->row == e->height && encoderWrite(e, e->state, (size_t)e->width * e->height * 3 * sizeof(float));
+}
+
+
+////////////////////////////////////////////////////////////////
+// Encoders.
+
+#define IMAGE_FORMATS 6
+
+ImageFormat const imageFormats[IMAGE_FORMATS] = {
+  { "tga", "tga", 1, 0, 0, beginTgaFrame, writeTgaRows, endTgaFrame, freeEncoderState },
+  { "png", "png", 1, 0, 0, beginPngFrame, writePngRows, endPngFrame, freePngState },
+  { "y4m", "y4m", 1, 1, 1, beginY4mFrame, writeY4mRows, endY4mFrame, freeEncoderState },
+  { "rgb", "rgb", 1, 1, 0, beginRgbFrame, writeRgbRows, endRgbFrame, freeEncoderState },
+  { "png16", "png", 2, 0, 0, beginPngFrame, writePngRows, endPngFrame, freePngState },
+  { "pfm", "pfm", 4, 0, 1, beginPfmFrame, writePfmRows, endPfmFrame, freeEncoderState },
+};
+
+// Return the format with the given name, or 0.
+ImageFormat const* getImageFormat(char const* name) {
+  int i;
+  for (i=0; i<IMAGE_FORMATS; i++) if (!strcasecmp(name, imageFormats[i].name)) return &imageFormats[i];
+  return 0;
+}
+
+// Return the format for the extension of |file|. Return |fallback| for unknown
+// extensions, stdout and pipes. Frames are in the sample size of |fallback|
+// (if any), so only formats of that size are chosen by extension.
+ImageFormat const* getFileFormat(char const* file, ImageFormat const* fallback) {
+  char const* ext = strrchr(file, '.');
+  ImageFormat const* format = 0;
+  int i;
+
+  if (!ext || file[0] == '|' || strchr(ext, '/') || strchr(ext, '\\')) return fallback;
+  if (fallback && !strcasecmp(ext + 1, fallback->extension)) return fallback;
+  for (i=0; i<IMAGE_FORMATS && !format; i++) {
+    if (!strcasecmp(ext + 1, imageFormats[i].extension) &&
+        (!fallback || imageFormats[i].sampleBytes == fallback->sampleBytes)) format = &imageFormats[i];
+  }
+  return format ? format : fallback;
+}
+
+// Open an encoder for width x height frames. Return 0 on error.
+// |pool| is used for parallel compression and can be 0.
+Encoder* openEncoder(char const* file, ImageFormat const* format, int width, int height, ThreadPool* pool) {
+  Encoder* e = calloc(1, sizeof(Encoder));
+
+  if (!e) return 0;
+  if (!strcmp(file, "-")) {
+    e->f = stdout;
+#if (defined __WIN32__)
+    _setmode(_fileno(stdout), _O_BINARY);
+#endif
+  }
+  else if (file[0] == '|') { e->f = popen(file + 1, PIPE_MODE); e->isPipe = 1; }
+  else e->f = fopen(file, "wb");
+  if (!e->f) { free(e); return 0; }
+
+  strncpy(e->file, file, sizeof(e->file)-1);
+  e->format = format;
+  e->width = width;
+  e->height = height;
+  e->pool = pool;
+  return e;
+}
+
+// Encode an RGB image (bottom row first, like glReadPixels). Return 0 on error.
+int encodeFrame(Encoder* e, unsigned char const* rgb) {
+  size_t rowSize = (size_t)e->width * 3 * e->format->sampleBytes;
+  int ok, y;
+
+  e->row = 0;
+  ok = e->format->beginFrame(e);
+  for (y=e->height-1; y>=0 && ok; y--) ok = e->format->writeRows(e, rgb + y * rowSize, 1);
+  ok = ok && e->format->endFrame(e);
+  e->frames++;
+  return ok;
+}
+
+// Close the file and free the encoder. Return 0 on error.
+int closeEncoder(Encoder* e) {
+  int ok;
+  if (!e) return 1;
+
+  e->format->freeState(e);
+  if (e->f == stdout) ok = fflush(stdout) == 0;
+  else if (e->isPipe) ok = pclose(e->f) == 0;
+  else ok = fclose(e->f) == 0;
+  free(e);
+  return ok;
+}
+
+
+////////////////////////////////////////////////////////////////
+// Output of frames in any format, with throughput statistics.
+
+typedef struct OutputStats {
+  int frames;
+  double rawBytes, bytes;
+  Uint32 milliseconds;  // time spent encoding and writing
+} OutputStats;
+
+typedef struct Output {
+  ImageFormat const* format;  // for unknown extensions, stdout and pipes
+  ThreadPool* pool;
+  SDL_mutex* lock;            // for the statistics
+  SDL_mutex* streamLock;
+  Encoder* stream;            // the open stream, if any
+  OutputStats stats[IMAGE_FORMATS];
+} Output;
+
+// Count a frame written in |format| in the statistics.
+void countOutputFrame(Output* o, ImageFormat const* format, double rawBytes, double bytes,
+                      Uint32 milliseconds) {
+  OutputStats* stats = &o->stats[format - imageFormats];
+  SDL_LockMutex(o->lock);
+  stats->frames++;
+  stats->rawBytes += rawBytes;
+  stats->bytes += bytes;
+  stats->milliseconds += milliseconds;
+  SDL_UnlockMutex(o->lock);
+}
+
+// Close the open stream and free the output.
+void destroyOutput(Output* o) {
+  if (!o) return;
+  if (o->stream) {
+    char file[256];
+    strcpy(file, o->stream->file);
+    if (!closeEncoder(o->stream)) fprintf(stderr, "Error closing %s\n", file);
+  }
+  destroyThreadPool(o->pool);
+  SDL_DestroyMutex(o->streamLock);
+  SDL_DestroyMutex(o->lock);
+  free(o);
+}
+
+// Create an output with |threads| compression threads (< 1: one per processor).
+// Return 0 on error.
+Output* createOutput(ImageFormat const* format, int threads) {
+  Output* o = calloc(1, sizeof(Output));
+  if (!o) return 0;
+  o->format = format;
+  o->pool = createThreadPool(threads);
+  o->lock = SDL_CreateMutex();
+  o->streamLock = SDL_CreateMutex();
+  if (!o->lock || !o->streamLock) {
+    destroyOutput(o);
+    return 0;
+  }
+  return o;
+}
+
+// Write an RGB image (bottom row first, samples of the size of the output
+// format) to |file|, a FrameWriteFunc.
+// Frames of stream formats are appended to the open stream while the file
+// name stays the same. Return 0 on error.
+int writeOutputFrame(void* context, char const* file, int width, int height, unsigned char const* rgb) {
+  Output* o = context;
+  ImageFormat const* format = getFileFormat(file, o->format);
+  Uint32 start = SDL_GetTicks();
+  double bytes;
+  int ok;
+
+  if (format->stream) {
+    SDL_LockMutex(o->streamLock);
+    if (o->stream && (strcmp(o->stream->file, file) || o->stream->format != format ||
+                      o->stream->width != width || o->stream->height != height)) {
+      closeEncoder(o->stream);
+      o->stream = 0;
+    }
+    if (!o->stream && (o->stream = openEncoder(file, format, width, height, o->pool)) != 0) {
+      fprintf(stderr, "Writing %dx%d %s stream to %s\n", width, height, format->name, file);
+    }
+    bytes = o->stream ? o->stream->bytes : 0;
+    ok = o->stream && encodeFrame(o->stream, rgb);
+    if (o->stream) bytes = o->stream->bytes - bytes;
+    SDL_UnlockMutex(o->streamLock);
+  }
+  else {
+    Encoder* e = openEncoder(file, format, width, height, o->pool);
+    ok = e && encodeFrame(e, rgb);
+    bytes = e ? e->bytes : 0;
+    ok = closeEncoder(e) && ok;
+  }
+
+  countOutputFrame(o, format, (double)width * height * 3 * format->sampleBytes, bytes, SDL_GetTicks() - start);
+  return ok;
+}
+
+// Print the throughput of every format that was used.
+void printOutputStats(Output* o, FILE* f) {
+  int i;
+  for (i=0; i<IMAGE_FORMATS; i++) {
+    OutputStats* s = &o->stats[i];
+    double seconds = (s->milliseconds ? s->milliseconds : 1) / 1000.;
+    if (!s->frames) continue;
+    fprintf(f, "%s: %d frames, %.1f MB (%.0f%% of raw) in %.3fs: %.1f MB/s, %.1f MB/s raw, %.2f frames/s\n",
+      imageFormats[i].name, s->frames, s->bytes / 1e6, 100 * s->bytes / s->rawBytes, seconds,
+      s->bytes / 1e6 / seconds, s->rawBytes / 1e6 / seconds, s->frames / seconds);
+  }
+}
+
+#endif  // ENCODERS_H
@@ -0,0 +1,98 @@
+#ifndef FILE_WATCH_H
+#define FILE_WATCH_H
+
+// Watching files in the current directory for changes.
+//
+// On Linux, inotify reports writes to the directory; files that are replaced
+// (as many editors save them) are seen too. Elsewhere, the modification times
+// are polled every FILE_WATCH_POLL milliseconds.
+
+#include <string.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <SDL/SDL.h>
+
+#if (defined __linux__)
+  #include <sys/inotify.h>
+  #include <unistd.h>
+  #define USE_INOTIFY
+#endif
+
+#define FILE_WATCH_FILES 4
+#define FILE_WATCH_POLL 500
+
+typedef struct FileWatch {
+  int files;
+  char const* file[FILE_WATCH_FILES];
+  time_t mtime[FILE_WATCH_FILES];  // polling: last seen, 0 if missing
+  Uint32 lastPoll;
+  int fd;                          // inotify, -1 if polling
+} FileWatch;
+
+static time_t getFileTime(char const* file) {
+  struct stat st;
+  return stat(file, &st) ? 0 : st.st_mtime;
+}
+
+// Watch |n| files (names in the current directory, kept by the caller).
+void initFileWatch(FileWatch* w, char const* const* files, int n) {
+  int i;
+
+  memset(w, 0, sizeof(FileWatch));
+  w->files = n < FILE_WATCH_FILES ? n : FILE_WATCH_FILES;
+  for (i=0; i<w->files; i++) {
+    w->file[i] = files[i];
+    w->mtime[i] = getFileTime(files[i]);
+  }
+  w->lastPoll = SDL_GetTicks();
+
+  w->fd = -1;
+#ifdef USE_INOTIFY
+  if ((w->fd = inotify_init1(IN_NONBLOCK)) >= 0 &&
+      inotify_add_watch(w->fd, ".", IN_CLOSE_WRITE | IN_MOVED_TO | IN_DELETE) < 0) {
+    close(w->fd);
+    w->fd = -1;
+  }
+#endif
+}
+
+void releaseFileWatch(FileWatch* w) {
+#ifdef USE_INOTIFY
+  if (w->fd >= 0) close(w->fd);
+#endif
+  w->fd = -1;
+}
+
+// Return 1 if any of the files has been written, created or deleted since
+// the last call. Doesn't block.
+int checkFileWatch(FileWatch* w) {
+  int i, changed = 0;
+
+#ifdef USE_INOTIFY
+  if (w->fd >= 0) {
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t len;
+    while ((len = read(w->fd, buf, sizeof(buf))) > 0) {
+      char* p;
+      for (p = buf; p < buf + len; p += sizeof(struct inotify_event) + ((struct inotify_event*)p)->len) {
+        struct inotify_event const* e = (struct inotify_event const*)p;
+        for (i=0; i<w->files; i++) {
+          if (e->len && !strcmp(e->name, w->file[i])) changed = 1;
+        }
+      }
+    }
+    return changed;
+  }
+#endif
+
+  if (SDL_GetTicks() - w->lastPoll < FILE_WATCH_POLL) return 0;
+  w->lastPoll = SDL_GetTicks();
+  for (i=0; i<w->files; i++) {
+    time_t t = getFileTime(w->file[i]);
+    if (t != w->mtime[i]) changed = 1;
+    w->mtime[i] = t;
+  }
+  return changed;
+}
+
+#endif  // FILE_WATCH_H
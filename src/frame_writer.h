@@ -0,0 +1,165 @@
+#ifndef FRAME_WRITER_H
+#define FRAME_WRITER_H
+
+// Background image writing.
+//
+// Rendered frames are put into a bounded queue and written to disk by worker
+// threads, so the renderer can continue with the next frame immediately.
+
+#include <stdlib.h>
+#include <string.h>
+#include <SDL/SDL.h>
+#include <SDL/SDL_thread.h>
+
+// Write an RGB image (bottom row first) to a file. Return 0 on error. The
+// size of the samples is up to the function.
+typedef int (*FrameWriteFunc)(void* context, char const* file, int width, int height,
+                              unsigned char const* rgb);
+
+typedef struct Frame {
+  char file[256];
+  int width, height;
+  unsigned char* rgb;
+} Frame;
+
+typedef struct FrameWriter {
+  FrameWriteFunc write;
+  void* context;
+
+  SDL_mutex* lock;
+  SDL_cond* notEmpty;
+  SDL_cond* notFull;
+  Frame* queue;
+  int capacity, head, count;
+  int busy;  // frames being written right now
+  int quit;
+
+  SDL_Thread** threads;
+  int threadCount;
+
+  int written, failed;
+  int dropped;  // frames not queued because the queue was full or out of memory
+} FrameWriter;
+
+int frameWriterMain(void* arg) {
+  FrameWriter* fw = arg;
+
+  for (;;) {
+    Frame frame;
+    int ok;
+
+    SDL_LockMutex(fw->lock);
+    while (!fw->count && !fw->quit) SDL_CondWait(fw->notEmpty, fw->lock);
+    if (!fw->count) { SDL_UnlockMutex(fw->lock); break; }  // quit and nothing left
+    frame = fw->queue[fw->head];
+    fw->head = (fw->head + 1) % fw->capacity;
+    fw->count--;
+    fw->busy++;
+    SDL_CondSignal(fw->notFull);
+    SDL_UnlockMutex(fw->lock);
+
+    ok = fw->write(fw->context, frame.file, frame.width, frame.height, frame.rgb);
+    if (!ok) fprintf(stderr, "Error writing %s\n", frame.file);
+    free(frame.rgb);
+
+    SDL_LockMutex(fw->lock);
+    fw->busy--;
+    if (ok) fw->written++; else fw->failed++;
+    SDL_CondBroadcast(fw->notFull);
+    SDL_UnlockMutex(fw->lock);
+  }
+  return 0;
+}
+
+// Start |threads| writer threads with a queue of |capacity| frames.
+// Frames are written with write(context, ...). With more than one thread,
+// frames can be finished out of order.
+FrameWriter* createFrameWriter(FrameWriteFunc write, void* context, int capacity, int threads) {
+  FrameWriter* fw = calloc(1, sizeof(FrameWriter));
+  int i;
+
+  if (capacity < 1) capacity = 1;
+  if (threads < 1) threads = 1;
+  fw->write = write;
+  fw->context = context;
+  fw->lock = SDL_CreateMutex();
+  fw->notEmpty = SDL_CreateCond();
+  fw->notFull = SDL_CreateCond();
+  fw->queue = calloc(capacity, sizeof(Frame));
+  fw->capacity = capacity;
+  fw->threads = calloc(threads, sizeof(SDL_Thread*));
+  fw->threadCount = threads;
+  for (i=0; i<threads; i++) fw->threads[i] = SDL_CreateThread(frameWriterMain, fw);
+  return fw;
+}
+
+// Queue a frame for writing. Takes ownership of |rgb| (allocated by malloc).
+// Waits while the queue is full.
+void queueFrame(FrameWriter* fw, char const* file, int width, int height, unsigned char* rgb) {
+  Frame* frame;
+
+  SDL_LockMutex(fw->lock);
+  while (fw->count == fw->capacity) SDL_CondWait(fw->notFull, fw->lock);
+  frame = &fw->queue[(fw->head + fw->count) % fw->capacity];
+  strncpy(frame->file, file, sizeof(frame->file)-1);
+  frame->file[sizeof(frame->file)-1] = 0;
+  frame->width = width;
+  frame->height = height;
+  frame->rgb = rgb;
+  fw->count++;
+  SDL_CondSignal(fw->notEmpty);
+  SDL_UnlockMutex(fw->lock);
+}
+
+// Queue a frame for writing if there is room in the queue. Takes ownership
+// of |rgb| either way. Return 0 if the frame was dropped.
+int tryQueueFrame(FrameWriter* fw, char const* file, int width, int height, unsigned char* rgb) {
+  int full;
+
+  SDL_LockMutex(fw->lock);
+  full = (fw->count == fw->capacity);
+  if (full) fw->dropped++;
+  SDL_UnlockMutex(fw->lock);
+
+  if (full) { free(rgb); return 0; }
+  queueFrame(fw, file, width, height, rgb);  // only this thread adds frames
+  return 1;
+}
+
+// Count a frame that couldn't be queued because there was no memory for it.
+void countDroppedFrame(FrameWriter* fw) {
+  SDL_LockMutex(fw->lock);
+  fw->dropped++;
+  SDL_UnlockMutex(fw->lock);
+}
+
+// Get the number of frames written and dropped so far, and the number of
+// frames queued or being written (the backlog).
+void getFrameWriterStats(FrameWriter* fw, int* written, int* dropped, int* backlog) {
+  SDL_LockMutex(fw->lock);
+  *written = fw->written;
+  *dropped = fw->dropped;
+  *backlog = fw->count + fw->busy;
+  SDL_UnlockMutex(fw->lock);
+}
+
+// Write all queued frames, stop the threads and free the writer.
+void destroyFrameWriter(FrameWriter* fw) {
+  int i;
+  if (!fw) return;
+
+  SDL_LockMutex(fw->lock);
+  fw->quit = 1;
+  SDL_CondBroadcast(fw->notEmpty);
+  SDL_UnlockMutex(fw->lock);
+
+  for (i=0; i<fw->threadCount; i++) SDL_WaitThread(fw->threads[i], 0);
+  SDL_DestroyCond(fw->notFull);
+  SDL_DestroyCond(fw->notEmpty);
+  SDL_DestroyMutex(fw->lock);
+  free(fw->threads);
+  free(fw->queue);
+  free(fw);
+}
+
+#endif  // FRAME_WRITER_H
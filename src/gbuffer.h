@@ -0,0 +1,81 @@
+#ifndef GBUFFER_H
+#define GBUFFER_H
+
+// Deferred rendering.
+//
+// The fragment shader is drawn in passes, each a program made from the
+// shader with one of GBUFFER_MARCH, GBUFFER_NORMALS, GBUFFER_AO and
+// GBUFFER_SHADE defined. Marching writes the G-buffer: the distance along
+// the ray, the number of steps and the last distance estimate of each pixel.
+// The normals and ambient occlusion passes read it, and the shading pass
+// puts everything together in the window. Pixels that show the background
+// are skipped by all passes after marching.
+//
+// Ambient occlusion varies slowly over a surface, so it can be computed at
+// 1/aoScale of the resolution. The shading pass upsamples it, preferring AO
+// texels at the distance of the pixel so it doesn't bleed across edges.
+
+#include <string.h>
+#include "shader_procs.h"
+#include "render_target.h"
+
+enum { GBUFFER_MARCH, GBUFFER_NORMALS, GBUFFER_AO, GBUFFER_SHADE, GBUFFER_PASSES };
+
+// The target of pass i is bound to texture unit GBUFFER_TEXTURE_UNIT + i for
+// the passes after it. Units 0 and 1 have the cone prepass and the cache.
+#define GBUFFER_TEXTURE_UNIT 2
+
+typedef struct GBuffer {
+  int enabled;
+  int aoScale;
+  RenderTarget targets[GBUFFER_SHADE];  // one per pass, but shading
+} GBuffer;
+
+void releaseGBuffer(GBuffer* g) {
+  int i;
+  for (i=0; i<GBUFFER_SHADE; i++) releaseRenderTarget(&g->targets[i]);
+  memset(g, 0, sizeof(GBuffer));
+}
+
+// Set up deferred rendering of a width x height image, with ambient occlusion
+// at 1/aoScale of the resolution. Return 0 if it isn't supported (needs
+// framebuffer objects and float textures).
+int initGBuffer(GBuffer* g, int width, int height, int aoScale) {
+  memset(g, 0, sizeof(GBuffer));
+  if (aoScale < 1) return 0;
+  if (!enableFramebufferProcs()) return 0;
+
+  if (!initRenderTarget(&g->targets[GBUFFER_MARCH], width, height, GL_RGBA32F, GL_NEAREST) ||
+      !initRenderTarget(&g->targets[GBUFFER_NORMALS], width, height, GL_RGBA32F, GL_NEAREST) ||
+      !initRenderTarget(&g->targets[GBUFFER_AO], (width + aoScale-1) / aoScale, (height + aoScale-1) / aoScale,
+                        GL_RGBA32F, GL_NEAREST)) {
+    releaseGBuffer(g);
+    return 0;
+  }
+  g->enabled = 1;
+  g->aoScale = aoScale;
+  return 1;
+}
+
+// Render |pass| into its target, or the shading pass into the window (then
+// set the viewport). The targets of the passes before it are bound.
+void beginGBufferPass(GBuffer const* g, int pass) {
+  if (pass > GBUFFER_MARCH) {
+    glActiveTexture(GL_TEXTURE0 + GBUFFER_TEXTURE_UNIT + pass-1);
+    glBindTexture(GL_TEXTURE_2D, g->targets[pass-1].texture);
+    glActiveTexture(GL_TEXTURE0);
+  }
+  bindRenderTarget(pass < GBUFFER_SHADE ? &g->targets[pass] : 0);
+}
+
+// Unbind the targets after the shading pass.
+void endGBufferPasses(void) {
+  int i;
+  for (i=0; i<GBUFFER_SHADE; i++) {
+    glActiveTexture(GL_TEXTURE0 + GBUFFER_TEXTURE_UNIT + i);
+    glBindTexture(GL_TEXTURE_2D, 0);
+  }
+  glActiveTexture(GL_TEXTURE0);
+}
+
+#endif  // GBUFFER_H
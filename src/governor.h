@@ -0,0 +1,193 @@
+#ifndef GOVERNOR_H
+#define GOVERNOR_H
+
+// Frame time governor.
+//
+// Keeps the frame time near a budget by trading quality for speed. The
+// quality levels lower, in this order, the number of ambient occlusion
+// samples, the maximum raymarching steps and the resolution. Below full
+// resolution (or always in HDR mode), the frame is rendered into a corner of
+// the float buffer of hdr.h and scaled up to the window, tone mapped. Without
+// float textures (and HDR), the governor uses an 8-bit buffer of its own.
+//
+// The frame time is smoothed with an exponential moving average. Quality goes
+// down when the average has been over budget for a few frames, and up only
+// when the average, scaled by the estimated cost of the better level, has
+// been well under budget for a longer time, so the levels don't oscillate.
+
+#include <stdio.h>
+#include "shader_procs.h"
+#include "render_target.h"
+#include "hdr.h"
+
+#define GOVERNOR_SMOOTHING  0.25f  // weight of the last frame in the average
+#define GOVERNOR_OVER       1.1f   // go down when the average is above budget * this
+#define GOVERNOR_UNDER      0.8f   // go up when the estimate is below budget * this
+#define GOVERNOR_DOWN_FRAMES 3     // for this many frames in a row
+#define GOVERNOR_UP_FRAMES   30
+
+typedef struct GovernorLevel {
+  float scale;     // resolution
+  float steps;     // fraction of max_steps
+  int aoSamples;   // ambient occlusion samples, 5 at full quality
+} GovernorLevel;
+
+static GovernorLevel const governorLevels[] = {
+  { 1.0f,  1.0f,  5 },
+  { 1.0f,  1.0f,  3 },
+  { 1.0f,  0.75f, 3 },
+  { 0.75f, 0.75f, 3 },
+  { 0.75f, 0.5f,  2 },
+  { 0.5f,  0.5f,  2 },
+  { 0.5f,  0.35f, 1 },
+  { 0.35f, 0.35f, 1 },
+  { 0.25f, 0.25f, 1 },
+};
+#define GOVERNOR_LEVELS ((int)(sizeof(governorLevels) / sizeof(governorLevels[0])))
+
+static char const governor_vs[] =
+  "void main(){gl_Position=gl_Vertex;}";
+
+// Scale the used part of the offscreen buffer up to the viewport.
+static char const governor_present_fs[] =
+  HDR_TONE_MAP_FS
+  "uniform sampler2D image;"
+  "uniform vec2 offset,size;"  // of the viewport in the window
+  "uniform vec2 scale,limit;"  // used part of the image, in texture coordinates
+  "void main(){"
+    "vec2 p=(gl_FragCoord.xy-offset)/size*scale;"
+    "gl_FragColor=vec4(tone_map(texture2D(image,min(p,limit)).rgb),1.0);"
+  "}";
+
+typedef struct Governor {
+  int enabled;
+  float budget;         // milliseconds per frame
+  float average;        // smoothed frame time
+  int level;            // in governorLevels
+  int over, under;      // frames in a row above / below the thresholds
+  int width, height;    // of the window
+  int renderWidth, renderHeight;
+  RenderTarget const* target;  // the float buffer, or fallback
+  RenderTarget fallback;       // 8-bit, if there is no float buffer
+  int hdr;                     // render into it even at full resolution
+  GLuint present;
+} Governor;
+
+// Relative cost of rendering a frame at a level.
+static float getGovernorCost(int level) {
+  GovernorLevel const* l = &governorLevels[level];
+  return l->scale * l->scale * l->steps * (0.8f + 0.04f * l->aoSamples);
+}
+
+static void setGovernorLevel(Governor* g, int level) {
+  g->average *= getGovernorCost(level) / getGovernorCost(g->level);  // expected
+  g->level = level;
+  g->over = g->under = 0;
+  g->renderWidth = (int)(g->width * governorLevels[level].scale + 0.5f);
+  g->renderHeight = (int)(g->height * governorLevels[level].scale + 0.5f);
+  if (g->renderWidth < 1) g->renderWidth = 1;
+  if (g->renderHeight < 1) g->renderHeight = 1;
+}
+
+void releaseGovernor(Governor* g) {
+  if (!g->enabled) return;
+  glDeleteProgram(g->present);
+  releaseRenderTarget(&g->fallback);
+  memset(g, 0, sizeof(Governor));
+}
+
+// Govern a width x height window to |budget| milliseconds per frame, with
+// |target| (the float buffer of hdr.h, or 0 if there is none) for lower
+// resolutions and |hdr| mode. Return 0 if it isn't supported (needs
+// framebuffer objects, and float textures in HDR mode).
+int initGovernor(Governor* g, int width, int height, float budget, RenderTarget const* target, int hdr) {
+  memset(g, 0, sizeof(Governor));
+  if (budget <= 0 || !enableFramebufferProcs()) return 0;
+  if (!target || !target->fbo) {
+    if (hdr || !initRenderTarget(&g->fallback, width, height, GL_RGBA8, GL_LINEAR)) {
+      releaseRenderTarget(&g->fallback);
+      return 0;
+    }
+    target = &g->fallback;
+  }
+
+  g->enabled = 1;
+  g->budget = budget;
+  g->average = budget;
+  g->width = width;
+  g->height = height;
+  g->target = target;
+  g->hdr = hdr;
+  setGovernorLevel(g, 0);
+
+  if (!(g->present = compileProgram(governor_vs, governor_present_fs))) {
+    releaseGovernor(g);
+    return 0;
+  }
+  return 1;
+}
+
+GovernorLevel const* getGovernorLevel(Governor const* g) {
+  return &governorLevels[g->level];
+}
+
+// Tell the governor the duration of the last frame. Changes the quality level
+// if needed and logs the change to stderr. Return 1 if the level has changed.
+int updateGovernor(Governor* g, float milliseconds) {
+  int level = g->level;
+  GovernorLevel const* l;
+
+  g->average += (milliseconds - g->average) * GOVERNOR_SMOOTHING;
+
+  if (g->average > g->budget * GOVERNOR_OVER) g->over++; else g->over = 0;
+  if (level > 0 && g->average * getGovernorCost(level-1) / getGovernorCost(level) <
+      g->budget * GOVERNOR_UNDER) g->under++; else g->under = 0;
+
+  if (g->over >= GOVERNOR_DOWN_FRAMES && level < GOVERNOR_LEVELS-1) level++;
+  else if (g->under >= GOVERNOR_UP_FRAMES) level--;
+  if (level == g->level) return 0;
+
+  l = &governorLevels[level];
+  fprintf(stderr, "Frame time %.1fms, budget %.1fms: quality level %d -> %d "
+    "(resolution %d%%, %d%% steps, %d AO samples)\n", g->average, g->budget, g->level, level,
+    (int)(l->scale * 100 + 0.5f), (int)(l->steps * 100 + 0.5f), l->aoSamples);
+  setGovernorLevel(g, level);
+  return 1;
+}
+
+// Is the frame drawn straight into the window?
+static int isGovernedFrameDirect(Governor const* g) {
+  return !g->hdr && g->renderWidth == g->width && g->renderHeight == g->height;
+}
+
+// Start rendering a frame: below full resolution or in HDR mode, into the
+// float buffer.
+void beginGovernedFrame(Governor* g) {
+  if (isGovernedFrameDirect(g)) return;
+  bindRenderTarget(g->target);
+  glViewport(0, 0, g->renderWidth, g->renderHeight);
+}
+
+// Scale the frame up and tone map it into |dest|, or into the window at
+// viewport offset (x, y) if it is 0.
+void presentGovernedFrame(Governor* g, RenderTarget const* dest, int x, int y, ToneMap const* t) {
+  if (isGovernedFrameDirect(g)) return;
+  bindRenderTarget(dest);
+  if (!dest) glViewport(x, y, g->width, g->height);
+  else x = y = 0;
+
+  glUseProgram(g->present);
+  glBindTexture(GL_TEXTURE_2D, g->target->texture);
+  glUniform1i(glGetUniformLocation(g->present, "image"), 0);
+  glUniform2f(glGetUniformLocation(g->present, "offset"), x, y);
+  glUniform2f(glGetUniformLocation(g->present, "size"), g->width, g->height);
+  glUniform2f(glGetUniformLocation(g->present, "scale"),
+    (float)g->renderWidth / g->target->width, (float)g->renderHeight / g->target->height);
+  glUniform2f(glGetUniformLocation(g->present, "limit"),
+    (g->renderWidth - 0.5f) / g->target->width, (g->renderHeight - 0.5f) / g->target->height);
+  setToneMapUniforms(g->present, t);
+  glRects(-1,-1,1,1);
+  glBindTexture(GL_TEXTURE_2D, 0);
+}
+
+#endif  // GOVERNOR_H
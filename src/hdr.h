@@ -0,0 +1,130 @@
+#ifndef HDR_H
+#define HDR_H
+
+// High dynamic range rendering.
+//
+// The float buffer is shared by the ways of drawing a frame that don't draw
+// straight into the window: progressive refinement sums its samples in it,
+// the frame time governor draws into a corner of it below full resolution,
+// and in HDR mode, every other frame (and the shading pass of deferred
+// rendering) is drawn into it. Colors brighter than white then survive until
+// a tone mapping pass brings them into the range of the display: they are
+// scaled by 2^exposure and mapped with one of the operators
+//   0  clamp     what drawing into the window does
+//   1  Reinhard  c / (1 + c)
+//   2  filmic    Narkowicz's fit of the ACES curve, with a toe and a shoulder
+// For float output, the linear colors (scaled by 2^exposure) are kept.
+//
+// Progressive refinement sums samples in rgb and counts them in alpha; the
+// others draw colors. Without HDR mode, tone mapping is the identity and the
+// image is the same as before.
+
+#include <math.h>
+#include <string.h>
+#include "shader_procs.h"
+#include "render_target.h"
+
+enum { TONE_MAP_LINEAR = -1, TONE_MAP_CLAMP, TONE_MAP_REINHARD, TONE_MAP_FILMIC, TONE_MAP_OPERATORS };
+
+typedef struct ToneMap {
+  int op;          // TONE_MAP_*
+  float exposure;  // in stops
+} ToneMap;
+
+// Tone mapping for the fragment shaders that present the buffer.
+#define HDR_TONE_MAP_FS \
+  "uniform float exposure;"    /* 2^stops */ \
+  "uniform int tone_operator;" \
+  "vec3 tone_map(vec3 c){" \
+    "c*=exposure;" \
+    "if(tone_operator<0)return c;" \
+    "if(tone_operator==1)c=c/(1.0+c);" \
+    "if(tone_operator==2)c=c*(2.51*c+0.03)/(c*(2.43*c+0.59)+0.14);" \
+    "return clamp(c,0.0,1.0);" \
+  "}"
+
+// Set the tone mapping uniforms of |program|, which is in use.
+void setToneMapUniforms(GLuint program, ToneMap const* t) {
+  glUniform1f(glGetUniformLocation(program, "exposure"), pow(2, t->exposure));
+  glUniform1i(glGetUniformLocation(program, "tone_operator"), t->op);
+}
+
+static char const hdr_vs[] =
+  "void main(){gl_Position=gl_Vertex;}";
+
+// Tone map a frame drawn into the buffer.
+static char const hdr_present_fs[] =
+  HDR_TONE_MAP_FS
+  "uniform sampler2D image;"
+  "uniform vec2 offset,size;"  // of the viewport in the window
+  "void main(){"
+    "gl_FragColor=vec4(tone_map(texture2D(image,(gl_FragCoord.xy-offset)/size).rgb),1.0);"
+  "}";
+
+typedef struct HdrBuffer {
+  int enabled;          // frames are drawn into the buffer (HDR mode)
+  int width, height;
+  RenderTarget buffer;
+  RenderTarget output;  // for 16-bit and float captures, made when needed
+  GLuint present;
+} HdrBuffer;
+
+void releaseHdrBuffer(HdrBuffer* h) {
+  releaseRenderTarget(&h->buffer);
+  releaseRenderTarget(&h->output);
+  if (h->present) glDeleteProgram(h->present);
+  memset(h, 0, sizeof(HdrBuffer));
+}
+
+// Make a width x height buffer; frames are drawn into it if |enabled|.
+// Return 0 if it isn't supported (needs framebuffer objects and float
+// textures).
+int initHdrBuffer(HdrBuffer* h, int width, int height, int enabled) {
+  memset(h, 0, sizeof(HdrBuffer));
+  if (!enableFramebufferProcs()) return 0;
+
+  h->width = width;
+  h->height = height;
+  // Filtered for the governor, which scales up a corner of it.
+  if (!initRenderTarget(&h->buffer, width, height, GL_RGBA32F, GL_LINEAR) ||
+      !(h->present = compileProgram(hdr_vs, hdr_present_fs))) {
+    releaseHdrBuffer(h);
+    return 0;
+  }
+  h->enabled = enabled;
+  return 1;
+}
+
+// Draw the next frame into the buffer instead of the window.
+void beginHdrFrame(HdrBuffer* h) {
+  bindRenderTarget(&h->buffer);
+  glViewport(0, 0, h->width, h->height);
+}
+
+// Tone map the frame in the buffer into |dest|, or into the window at
+// viewport offset (x, y) if it is 0.
+void presentHdrFrame(HdrBuffer* h, RenderTarget const* dest, int x, int y, ToneMap const* t) {
+  bindRenderTarget(dest);
+  if (!dest) glViewport(x, y, h->width, h->height);
+  else x = y = 0;
+
+  glUseProgram(h->present);
+  glBindTexture(GL_TEXTURE_2D, h->buffer.texture);
+  glUniform1i(glGetUniformLocation(h->present, "image"), 0);
+  glUniform2f(glGetUniformLocation(h->present, "offset"), x, y);
+  glUniform2f(glGetUniformLocation(h->present, "size"), h->width, h->height);
+  setToneMapUniforms(h->present, t);
+  glRects(-1,-1,1,1);
+  glBindTexture(GL_TEXTURE_2D, 0);
+}
+
+// The target that 16-bit and float captures read from (0 if it can't be made).
+RenderTarget const* getHdrOutput(HdrBuffer* h) {
+  if (!h->output.fbo && !initRenderTarget(&h->output, h->width, h->height, GL_RGBA32F, GL_NEAREST)) {
+    releaseRenderTarget(&h->output);
+    return 0;
+  }
+  return &h->output;
+}
+
+#endif  // HDR_H
@@ -0,0 +1,233 @@
+#ifndef INPUT_LOG_H
+#define INPUT_LOG_H
+
+// Input recording and replay.
+//
+// The simulation moves the camera and changes controllers once per tick, from
+// the key presses and the keyboard and mouse state of that tick. The recorder
+// logs exactly these inputs for every tick (a "frame" of the log), with a
+// timestamp. Replaying the log feeds the same inputs to the same code tick by
+// tick, so a session takes the same path however fast it is rendered.
+//
+// Events are taken from the queue without pumping it (SDL_PeepEvents()), so
+// this can run on another thread than the video thread.
+//
+// Log format. Integers are LEB128 varints, signed ones zigzag encoded.
+//   header: "BXIN", version byte, state size, the state at the start
+//   frame:  milliseconds since the last frame, key bitmask (inputKeys),
+//           mouse dx, dy (signed), mouse buttons, number of presses,
+//           the pressed keys (0: a mouse button)
+// The state is stored as it is in memory, so a log replays only with a build
+// that has the same parameters.
+
+#include <stdio.h>
+#include <string.h>
+#include <SDL/SDL.h>
+
+#define INPUT_LOG_VERSION 2
+#define INPUT_MAX_PRESSES 32  // per frame, more are dropped
+
+// Keys whose state is used (not only their presses).
+static SDLKey const inputKeys[] = {
+  SDLK_LALT, SDLK_w, SDLK_s, SDLK_a, SDLK_d, SDLK_q, SDLK_e,
+  SDLK_LEFT, SDLK_RIGHT, SDLK_DOWN, SDLK_UP,
+};
+#define INPUT_KEYS ((int)(sizeof(inputKeys) / sizeof(inputKeys[0])))
+
+typedef struct InputFrame {
+  Uint32 time;              // milliseconds since the start
+  unsigned keys;            // bit i: inputKeys[i] is down
+  int mouseX, mouseY;       // relative mouse motion
+  Uint8 buttons;
+  int presses;
+  int press[INPUT_MAX_PRESSES];
+} InputFrame;
+
+typedef struct InputLog {
+  FILE* f;                  // 0: live input, not recorded
+  int replaying;
+  int cancelled;            // the replay was stopped by the user
+  Uint32 start, last;       // time of the start and of the last frame
+  int frames;
+  InputFrame frame;         // the current frame
+  int nextPress;            // replay: next press of the frame to return
+  Uint8 keystate[SDLK_LAST];
+} InputLog;
+
+static void writeVarint(FILE* f, unsigned x) {
+  for (; x >= 0x80; x >>= 7) fputc((x & 0x7f) | 0x80, f);
+  fputc(x, f);
+}
+
+static void writeSignedVarint(FILE* f, int x) {
+  writeVarint(f, x < 0 ? ~((unsigned)x << 1) : (unsigned)x << 1);
+}
+
+// Return 0 at the end of the file.
+static int readVarint(FILE* f, unsigned* x) {
+  int c, shift = 0;
+  *x = 0;
+  do {
+    if ((c = fgetc(f)) == EOF || shift > 28) return 0;
+    *x |= (unsigned)(c & 0x7f) << shift;
+    shift += 7;
+  } while (c & 0x80);
+  return 1;
+}
+
+static int readSignedVarint(FILE* f, int* x) {
+  unsigned u;
+  if (!readVarint(f, &u)) return 0;
+  *x = u & 1 ? (int)~(u >> 1) : (int)(u >> 1);
+  return 1;
+}
+
+// Record the input of the session to |file|, after the state at the start
+// (size bytes). Return 0 if the file can't be written.
+int startInputRecording(InputLog* l, char const* file, void const* state, int size) {
+  memset(l, 0, sizeof(InputLog));
+  if (!(l->f = fopen(file, "wb"))) return 0;
+  fwrite("BXIN", 4, 1, l->f);
+  fputc(INPUT_LOG_VERSION, l->f);
+  writeVarint(l->f, size);
+  fwrite(state, size, 1, l->f);
+  l->start = SDL_GetTicks();
+  return 1;
+}
+
+// Replay the input logged in |file|, and restore the state at the start
+// (size bytes). Return 0 if the file can't be read or is from another build.
+int startInputReplay(InputLog* l, char const* file, void* state, int size) {
+  char magic[5];
+  unsigned logSize;
+
+  memset(l, 0, sizeof(InputLog));
+  if (!(l->f = fopen(file, "rb"))) return 0;
+  if (fread(magic, 5, 1, l->f) != 1 || memcmp(magic, "BXIN", 4) || magic[4] != INPUT_LOG_VERSION ||
+      !readVarint(l->f, &logSize) || (int)logSize != size || fread(state, size, 1, l->f) != 1) {
+    fclose(l->f);
+    l->f = 0;
+    return 0;
+  }
+  l->replaying = 1;
+  l->start = SDL_GetTicks();
+  return 1;
+}
+
+// Stop recording or replaying. Return the number of frames.
+int stopInputLog(InputLog* l) {
+  int frames = l->frames;
+  if (l->f) fclose(l->f);
+  memset(l, 0, sizeof(InputLog));
+  return frames;
+}
+
+// Start the input of a frame. Return 0 at the end of a replay.
+int beginInputFrame(InputLog* l) {
+  InputFrame* fr = &l->frame;
+  unsigned delta, x;
+  int i;
+
+  if (!l->replaying) {
+    memset(fr, 0, sizeof(InputFrame));
+    fr->time = SDL_GetTicks() - l->start;
+    return 1;
+  }
+
+  if (l->cancelled || !readVarint(l->f, &delta)) return 0;
+  fr->time = l->last += delta;
+  if (!readVarint(l->f, &fr->keys) || !readSignedVarint(l->f, &fr->mouseX) ||
+      !readSignedVarint(l->f, &fr->mouseY) || !readVarint(l->f, &x)) return 0;
+  fr->buttons = x;
+  if (!readVarint(l->f, &x) || x > INPUT_MAX_PRESSES) return 0;
+  fr->presses = x;
+  for (i=0; i<fr->presses; i++) {
+    if (!readVarint(l->f, &x)) return 0;
+    fr->press[i] = x;
+  }
+  l->nextPress = 0;
+
+  memset(l->keystate, 0, sizeof(l->keystate));
+  for (i=0; i<INPUT_KEYS; i++) l->keystate[inputKeys[i]] = (fr->keys >> i) & 1;
+  return 1;
+}
+
+// Get the next event from the queue, like SDL_PollEvent() without pumping
+// events. Records key presses and mouse
+// clicks. In a replay, returns the logged ones; the user can only quit (an
+// SDL_QUIT event), with ESC or by closing the window.
+int pollInput(InputLog* l, SDL_Event* event) {
+  InputFrame* fr = &l->frame;
+
+  if (!l->replaying) {
+    if (SDL_PeepEvents(event, 1, SDL_GETEVENT, SDL_ALLEVENTS) <= 0) return 0;
+    if (l->f && fr->presses < INPUT_MAX_PRESSES) {
+      if (event->type == SDL_KEYDOWN) fr->press[fr->presses++] = event->key.keysym.sym;
+      else if (event->type == SDL_MOUSEBUTTONDOWN) fr->press[fr->presses++] = 0;
+    }
+    return 1;
+  }
+
+  while (SDL_PeepEvents(event, 1, SDL_GETEVENT, SDL_ALLEVENTS) > 0) {
+    if (event->type == SDL_QUIT || (event->type == SDL_KEYDOWN && event->key.keysym.sym == SDLK_ESCAPE)) {
+      l->cancelled = 1;
+      memset(event, 0, sizeof(SDL_Event));
+      event->type = SDL_QUIT;
+      return 1;
+    }
+  }
+  if (l->nextPress >= fr->presses) return 0;
+
+  memset(event, 0, sizeof(SDL_Event));
+  if (fr->press[l->nextPress]) {
+    event->type = SDL_KEYDOWN;
+    event->key.keysym.sym = (SDLKey)fr->press[l->nextPress];
+  }
+  else {
+    event->type = SDL_MOUSEBUTTONDOWN;
+    event->button.button = SDL_BUTTON_LEFT;
+  }
+  l->nextPress++;
+  return 1;
+}
+
+// Get the keyboard state, like SDL_GetKeyState(). In a replay, only the keys
+// in inputKeys are set.
+Uint8* getInputKeyState(InputLog* l) {
+  Uint8* keystate;
+  int i;
+
+  if (l->replaying) return l->keystate;
+  keystate = SDL_GetKeyState(0);
+  for (i=0; i<INPUT_KEYS; i++) if (keystate[inputKeys[i]]) l->frame.keys |= 1u << i;
+  return keystate;
+}
+
+// Get the mouse motion since the last frame and the buttons, like
+// SDL_GetRelativeMouseState().
+Uint8 getInputMouseState(InputLog* l, int* dx, int* dy) {
+  InputFrame* fr = &l->frame;
+  if (!l->replaying) fr->buttons = SDL_GetRelativeMouseState(&fr->mouseX, &fr->mouseY);
+  *dx = fr->mouseX;
+  *dy = fr->mouseY;
+  return fr->buttons;
+}
+
+// Finish the input of a frame: write it to the log.
+void endInputFrame(InputLog* l) {
+  InputFrame* fr = &l->frame;
+  int i;
+
+  l->frames++;
+  if (!l->f || l->replaying) return;
+  writeVarint(l->f, fr->time - l->last);
+  l->last = fr->time;
+  writeVarint(l->f, fr->keys);
+  writeSignedVarint(l->f, fr->mouseX);
+  writeSignedVarint(l->f, fr->mouseY);
+  writeVarint(l->f, fr->buttons);
+  writeVarint(l->f, fr->presses);
+  for (i=0; i<fr->presses; i++) writeVarint(l->f, fr->press[i]);
+}
+
+#endif  // INPUT_LOG_H
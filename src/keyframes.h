@@ -0,0 +1,94 @@
+#ifndef KEYFRAMES_H
+#define KEYFRAMES_H
+
+// Interpolation helpers for keyframe animation: Catmull-Rom splines for values
+// and spherical linear interpolation of camera orientations.
+
+#include <math.h>
+
+// Smooth ease-in/ease-out of t in [0,1].
+float easeInOut(float t) {
+  return t*t*(3 - 2*t);
+}
+
+// Catmull-Rom spline through p1 (t=0) and p2 (t=1). In double precision for
+// camera positions.
+double catmullRom(double p0, double p1, double p2, double p3, double t) {
+  return 0.5 * (2*p1 + (p2-p0)*t + (2*p0 - 5*p1 + 4*p2 - p3)*t*t + (3*p1 - p0 - 3*p2 + p3)*t*t*t);
+}
+
+// Catmull-Rom spline that doesn't overshoot the range of p1 and p2.
+// For parameters that must not leave the range set by the user.
+float catmullRomClamped(float p0, float p1, float p2, float p3, float t) {
+  float x = catmullRom(p0, p1, p2, p3, t);
+  float lo = p1 < p2 ? p1 : p2, hi = p1 < p2 ? p2 : p1;
+  return x < lo ? lo : x > hi ? hi : x;
+}
+
+// Convert the rotation part of a camera matrix to a unit quaternion (x, y, z, w).
+void cameraToQuaternion(double const camera[16], float q[4]) {
+  #define M(r, c) camera[(c)*4 + (r)]
+  double trace = M(0,0) + M(1,1) + M(2,2), s;
+
+  if (trace > 0) {
+    s = sqrt(trace + 1) * 2;
+    q[3] = s / 4;
+    q[0] = (M(2,1) - M(1,2)) / s;
+    q[1] = (M(0,2) - M(2,0)) / s;
+    q[2] = (M(1,0) - M(0,1)) / s;
+  }
+  else if (M(0,0) > M(1,1) && M(0,0) > M(2,2)) {
+    s = sqrt(1 + M(0,0) - M(1,1) - M(2,2)) * 2;
+    q[3] = (M(2,1) - M(1,2)) / s;
+    q[0] = s / 4;
+    q[1] = (M(0,1) + M(1,0)) / s;
+    q[2] = (M(0,2) + M(2,0)) / s;
+  }
+  else if (M(1,1) > M(2,2)) {
+    s = sqrt(1 + M(1,1) - M(0,0) - M(2,2)) * 2;
+    q[3] = (M(0,2) - M(2,0)) / s;
+    q[0] = (M(0,1) + M(1,0)) / s;
+    q[1] = s / 4;
+    q[2] = (M(1,2) + M(2,1)) / s;
+  }
+  else {
+    s = sqrt(1 + M(2,2) - M(0,0) - M(1,1)) * 2;
+    q[3] = (M(1,0) - M(0,1)) / s;
+    q[0] = (M(0,2) + M(2,0)) / s;
+    q[1] = (M(1,2) + M(2,1)) / s;
+    q[2] = s / 4;
+  }
+  #undef M
+}
+
+// Set the rotation part of a camera matrix from a unit quaternion (x, y, z, w).
+void quaternionToCamera(float const q[4], double camera[16]) {
+  float x = q[0], y = q[1], z = q[2], w = q[3];
+
+  camera[0] = 1 - 2*(y*y + z*z); camera[4] = 2*(x*y - w*z);     camera[8]  = 2*(x*z + w*y);
+  camera[1] = 2*(x*y + w*z);     camera[5] = 1 - 2*(x*x + z*z); camera[9]  = 2*(y*z - w*x);
+  camera[2] = 2*(x*z - w*y);     camera[6] = 2*(y*z + w*x);     camera[10] = 1 - 2*(x*x + y*y);
+}
+
+// Spherical linear interpolation between unit quaternions along the shorter arc.
+void slerp(float const a[4], float const b[4], float t, float q[4]) {
+  float d = a[0]*b[0] + a[1]*b[1] + a[2]*b[2] + a[3]*b[3];
+  float sign = 1, wa, wb, len;
+  int i;
+
+  if (d < 0) { d = -d; sign = -1; }
+  if (d > 0.9995f) {  // almost the same: lerp is precise enough
+    wa = 1 - t; wb = t;
+  }
+  else {
+    float angle = acosf(d), s = sinf(angle);
+    wa = sinf((1 - t) * angle) / s;
+    wb = sinf(t * angle) / s;
+  }
+  for (i=0; i<4; i++) q[i] = wa*a[i] + sign*wb*b[i];
+
+  len = sqrtf(q[0]*q[0] + q[1]*q[1] + q[2]*q[2] + q[3]*q[3]);
+  for (i=0; i<4; i++) q[i] /= len;
+}
+
+#endif  // KEYFRAMES_H
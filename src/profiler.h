@@ -0,0 +1,365 @@
+#ifndef PROFILER_H
+#define PROFILER_H
+
+// Frame profiler.
+//
+// The CPU time of each frame is split into stages with a high resolution
+// timer. The GPU time of the draw is measured with timer queries, and that of
+// each pass of a frame drawn in passes with timestamps. Query results are read
+// only when they are available, a few frames later, so the profiler never
+// waits for the GPU; a frame without a free query isn't measured on the GPU.
+//
+// The last PROFILER_WINDOW frames are kept in a ring, for percentiles. A
+// profiler that keeps the whole run, for a timeline written as CSV or as
+// Chrome trace JSON (chrome://tracing, Perfetto), also keeps the stretches of
+// each stage; if memory runs out it falls back to a ring of the frames it
+// has room for.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "shader_procs.h"
+#include "timer.h"
+
+#define PROFILER_QUERIES 4    // GPU timer queries in flight
+#define PROFILER_WINDOW  120  // recent frames for getProfilePercentiles()
+#define PROFILER_PASSES  4    // GPU passes timed per frame
+
+// Stages of a frame, and the other series of values per frame.
+enum {
+  PROFILE_EVENTS, PROFILE_UNIFORMS, PROFILE_DRAW, PROFILE_CAPTURE, PROFILE_SWAP,
+  PROFILE_STAGES,
+  PROFILE_TOTAL = PROFILE_STAGES,  // CPU time of the whole frame
+  PROFILE_GPU,                     // GPU time of the draw, < 0 if unknown
+  PROFILE_GPU_MARCH, PROFILE_GPU_NORMALS, PROFILE_GPU_AO, PROFILE_GPU_SHADE,  // deferred passes
+  PROFILE_SERIES
+};
+
+static char const* const profileSeriesNames[PROFILE_SERIES] = {
+  "events", "uniforms", "draw", "capture", "swap", "total", "gpu",
+  "gpu march", "gpu normals", "gpu ao", "gpu shade"
+};
+
+typedef struct ProfileFrame {
+  double start;                  // seconds since the profiler was started
+  double gpuStart;               // when the measured draw was submitted
+  float values[PROFILE_SERIES];  // milliseconds
+} ProfileFrame;
+
+// A stretch of time spent in one stage, for the timeline.
+typedef struct ProfileSegment {
+  int frame, stage;
+  double start, end;
+} ProfileSegment;
+
+typedef struct Profiler {
+  double origin;
+  double frameStart, stageStart;
+  int stage;
+
+  int keepAll;  // grow the frames instead of overwriting the oldest one
+
+  ProfileFrame* frames;              // frame i is at i % frameCapacity
+  int frameCount, frameCapacity;     // frames started, room in frames
+  ProfileSegment* segments;          // only when keeping the whole run
+  int segmentCount, segmentCapacity;
+
+  int useQueries;
+  GLuint queries[PROFILER_QUERIES];
+  int queryFrame[PROFILER_QUERIES];  // frame measured by a query, -1 if none
+  int nextQuery, activeQuery;
+
+  // Timestamps at the start of each pass and at the end of the last one.
+  GLuint timestamps[PROFILER_QUERIES][PROFILER_PASSES+1];
+  int passSeries[PROFILER_QUERIES][PROFILER_PASSES];
+  int passes[PROFILER_QUERIES];
+} Profiler;
+
+// Start a profiler that keeps the last PROFILER_WINDOW frames, or the
+// whole run if |keepAll|.
+void initProfiler(Profiler* p, int keepAll) {
+  memset(p, 0, sizeof(Profiler));
+  p->origin = getTimerSeconds();
+  p->activeQuery = -1;
+  p->keepAll = keepAll;
+}
+
+void releaseProfiler(Profiler* p) {
+  free(p->frames);
+  free(p->segments);
+  memset(p, 0, sizeof(Profiler));
+}
+
+// Create the timer queries. Must be called with a current OpenGL context,
+// and again after the context has been recreated.
+void initProfilerQueries(Profiler* p) {
+  char const* extensions = (char const*)glGetString(GL_EXTENSIONS);
+  int i;
+
+  p->useQueries = extensions && strstr(extensions, "GL_ARB_timer_query") && enableTimerQueryProcs();
+  if (!p->useQueries) return;
+
+  glGenQueries(PROFILER_QUERIES, p->queries);
+  glGenQueries(PROFILER_QUERIES * (PROFILER_PASSES+1), p->timestamps[0]);
+  for (i=0; i<PROFILER_QUERIES; i++) p->queryFrame[i] = -1;
+  p->nextQuery = 0;
+  p->activeQuery = -1;
+}
+
+// The record of frame |i|, or 0 if it has been overwritten.
+ProfileFrame* getProfileFrame(Profiler const* p, int i) {
+  if (i < 0 || i >= p->frameCount || p->frameCount - i > p->frameCapacity) return 0;
+  return &p->frames[i % p->frameCapacity];
+}
+
+// The oldest frame that is still kept.
+int getFirstProfileFrame(Profiler const* p) {
+  return p->frameCount > p->frameCapacity ? p->frameCount - p->frameCapacity : 0;
+}
+
+// Delete the timer queries. Results that aren't in yet are lost.
+void releaseProfilerQueries(Profiler* p) {
+  if (!p->useQueries) return;
+  if (p->activeQuery >= 0) glEndQuery(GL_TIME_ELAPSED);
+  glDeleteQueries(PROFILER_QUERIES, p->queries);
+  glDeleteQueries(PROFILER_QUERIES * (PROFILER_PASSES+1), p->timestamps[0]);
+  p->useQueries = 0;
+  p->activeQuery = -1;
+}
+
+// Collect the query results that are available. A result longer than the
+// time since the draw was submitted is bogus (some drivers return one for the
+// first query) and is dropped, with the pass times of the frame.
+static void pollProfilerQueries(Profiler* p) {
+  double now = getTimerSeconds() - p->origin;
+  int i, j;
+  for (i=0; i<PROFILER_QUERIES; i++) {
+    ProfileFrame* f;
+    GLint available = 0;
+    GLuint64 nanoseconds;
+    if (p->queryFrame[i] < 0) continue;
+    glGetQueryObjectiv(p->queries[i], GL_QUERY_RESULT_AVAILABLE, &available);
+    if (available && p->passes[i]) {
+      glGetQueryObjectiv(p->timestamps[i][p->passes[i]], GL_QUERY_RESULT_AVAILABLE, &available);
+    }
+    if (!available) continue;
+    glGetQueryObjectui64v(p->queries[i], GL_QUERY_RESULT, &nanoseconds);
+    f = getProfileFrame(p, p->queryFrame[i]);
+    p->queryFrame[i] = -1;
+    if (!f || nanoseconds * 1e-9 > now - f->gpuStart) continue;
+    f->values[PROFILE_GPU] = nanoseconds * 1e-6f;
+    for (j=0; j<p->passes[i]; j++) {
+      GLuint64 start, end;
+      glGetQueryObjectui64v(p->timestamps[i][j], GL_QUERY_RESULT, &start);
+      glGetQueryObjectui64v(p->timestamps[i][j+1], GL_QUERY_RESULT, &end);
+      f->values[p->passSeries[i][j]] = (end - start) * 1e-6f;
+    }
+  }
+}
+
+// Wait for the GPU and collect the results of all queries in flight, for
+// the last frames of a run.
+void collectProfilerQueries(Profiler* p) {
+  if (!p->useQueries) return;
+  glFinish();
+  pollProfilerQueries(p);
+}
+
+// Switch to another stage. The time since the last switch goes to the
+// current stage.
+void profileStage(Profiler* p, int stage) {
+  double now = getTimerSeconds();
+  ProfileSegment* s;
+
+  if (!p->frameCount) return;
+  getProfileFrame(p, p->frameCount-1)->values[p->stage] += (float)((now - p->stageStart) * 1000);
+
+  if (p->keepAll && p->segmentCount == p->segmentCapacity) {
+    int capacity = p->segmentCapacity ? 2 * p->segmentCapacity : 1024;
+    ProfileSegment* segments = realloc(p->segments, capacity * sizeof(ProfileSegment));
+    if (segments) {
+      p->segments = segments;
+      p->segmentCapacity = capacity;
+    }
+    else {
+      fprintf(stderr, "Out of memory for the profile, keeping the last %d frames\n", p->frameCapacity);
+      p->keepAll = 0;
+    }
+  }
+  if (p->keepAll) {
+    s = &p->segments[p->segmentCount++];
+    s->frame = p->frameCount-1;
+    s->stage = p->stage;
+    s->start = p->stageStart - p->origin;
+    s->end = now - p->origin;
+  }
+
+  p->stage = stage;
+  p->stageStart = now;
+}
+
+// Start a frame in |stage|. The frames grow only until they first wrap
+// around, so growing never reorders them.
+void beginProfileFrame(Profiler* p, int stage) {
+  ProfileFrame* f;
+  int i;
+
+  if (!p->frameCapacity || (p->keepAll && p->frameCount == p->frameCapacity)) {
+    int capacity = !p->frameCapacity ? (p->keepAll ? 256 : PROFILER_WINDOW) : 2 * p->frameCapacity;
+    ProfileFrame* frames = realloc(p->frames, capacity * sizeof(ProfileFrame));
+    if (frames) {
+      p->frames = frames;
+      p->frameCapacity = capacity;
+    }
+    else if (!p->frameCapacity) {
+      return;
+    }
+    else {
+      fprintf(stderr, "Out of memory for the profile, keeping the last %d frames\n", p->frameCapacity);
+      p->keepAll = 0;
+    }
+  }
+  f = &p->frames[p->frameCount++ % p->frameCapacity];
+  memset(f, 0, sizeof(ProfileFrame));
+  for (i=PROFILE_GPU; i<PROFILE_SERIES; i++) f->values[i] = -1;
+
+  p->frameStart = p->stageStart = getTimerSeconds();
+  f->start = p->frameStart - p->origin;
+  p->stage = stage;
+  if (p->useQueries) pollProfilerQueries(p);
+}
+
+// End the frame.
+void endProfileFrame(Profiler* p) {
+  if (!p->frameCount) return;
+  profileStage(p, p->stage);
+  getProfileFrame(p, p->frameCount-1)->values[PROFILE_TOTAL] = (float)((p->stageStart - p->frameStart) * 1000);
+}
+
+// Measure the GPU time of the drawing calls between these two calls, if a
+// query is free.
+void beginGpuProfile(Profiler* p) {
+  int q = p->nextQuery;
+  if (!p->useQueries || !p->frameCount || p->queryFrame[q] >= 0) return;
+  glBeginQuery(GL_TIME_ELAPSED, p->queries[q]);
+  p->activeQuery = q;
+  p->passes[q] = 0;
+  getProfileFrame(p, p->frameCount-1)->gpuStart = getTimerSeconds() - p->origin;
+}
+
+// Time the drawing calls from here to the next pass or to endGpuProfile() as
+// |series|, if the frame is measured.
+void profileGpuPass(Profiler* p, int series) {
+  int q = p->activeQuery;
+  if (q < 0 || p->passes[q] == PROFILER_PASSES) return;
+  glQueryCounter(p->timestamps[q][p->passes[q]], GL_TIMESTAMP);
+  p->passSeries[q][p->passes[q]++] = series;
+}
+
+void endGpuProfile(Profiler* p) {
+  int q = p->activeQuery;
+  if (q < 0) return;
+  if (p->passes[q]) glQueryCounter(p->timestamps[q][p->passes[q]], GL_TIMESTAMP);
+  glEndQuery(GL_TIME_ELAPSED);
+  p->queryFrame[p->activeQuery] = p->frameCount-1;
+  p->nextQuery = (p->activeQuery + 1) % PROFILER_QUERIES;
+  p->activeQuery = -1;
+}
+
+static int compareFloats(void const* a, void const* b) {
+  float x = *(float const*)a, y = *(float const*)b;
+  return x < y ? -1 : x > y;
+}
+
+// Compute the 50th, 95th and 99th percentile of a series over the last
+// |frames| frames (0: all that are kept). Return the number of frames with a
+// value, 0 if there is no memory to sort them.
+int getProfilePercentiles(Profiler const* p, int series, int frames, float percentiles[3]) {
+  static float const ranks[3] = { 0.50f, 0.95f, 0.99f };
+  float window[PROFILER_WINDOW], *values = window;
+  int first = getFirstProfileFrame(p), i, n = 0;
+
+  if (frames > 0 && p->frameCount - frames > first) first = p->frameCount - frames;
+  if (p->frameCount - first > PROFILER_WINDOW &&
+      !(values = malloc((p->frameCount - first) * sizeof(float)))) return 0;
+
+  for (i=first; i<p->frameCount; i++) {
+    float v = getProfileFrame(p, i)->values[series];
+    if (v >= 0) values[n++] = v;
+  }
+  qsort(values, n, sizeof(float), compareFloats);
+  for (i=0; i<3; i++) percentiles[i] = n ? values[(int)(ranks[i] * (n-1) + 0.5f)] : 0;
+  if (values != window) free(values);
+  return n;
+}
+
+// Print percentiles of all series over the frames that are kept.
+void printProfileSummary(Profiler const* p, FILE* out) {
+  int i, n = p->frameCount - getFirstProfileFrame(p);
+  if (n < 2) return;
+  fprintf(out, "Frame times over %s%d frames (ms):      p50      p95      p99\n",
+    n < p->frameCount ? "the last " : "", n);
+  for (i=0; i<PROFILE_SERIES; i++) {
+    float pc[3];
+    if (!getProfilePercentiles(p, i, 0, pc)) continue;
+    fprintf(out, "  %-33s %8.3f %8.3f %8.3f\n", profileSeriesNames[i], pc[0], pc[1], pc[2]);
+  }
+}
+
+// Write one line per frame with the time of each series in milliseconds.
+static void writeProfileCsv(Profiler const* p, FILE* f) {
+  int i, j;
+  fprintf(f, "frame,start");
+  for (j=0; j<PROFILE_SERIES; j++) fprintf(f, ",%s", profileSeriesNames[j]);
+  fprintf(f, "\n");
+  for (i=getFirstProfileFrame(p); i<p->frameCount; i++) {
+    ProfileFrame const* fr = getProfileFrame(p, i);
+    fprintf(f, "%d,%.3f", i, fr->start * 1000);
+    for (j=0; j<PROFILE_SERIES; j++) fprintf(f, ",%.3f", fr->values[j]);
+    fprintf(f, "\n");
+  }
+}
+
+// Write the timeline in the Chrome trace event format. CPU stages are on one
+// track; the GPU time of a frame is on another one, from when the draw was
+// submitted (the queries only measure durations).
+static void writeProfileTrace(Profiler const* p, FILE* f) {
+  int i;
+  fprintf(f, "{\"traceEvents\":[\n");
+  fprintf(f, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":1,\"args\":{\"name\":\"CPU\"}},\n");
+  fprintf(f, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":2,\"args\":{\"name\":\"GPU\"}}");
+  for (i=getFirstProfileFrame(p); i<p->frameCount; i++) {
+    ProfileFrame const* fr = getProfileFrame(p, i);
+    fprintf(f, ",\n{\"name\":\"frame %d\",\"ph\":\"X\",\"pid\":1,\"tid\":1,\"ts\":%.1f,\"dur\":%.1f}",
+      i, fr->start * 1e6, fr->values[PROFILE_TOTAL] * 1e3);
+  }
+  for (i=0; i<p->segmentCount; i++) {
+    ProfileSegment const* s = &p->segments[i];
+    if (s->frame < getFirstProfileFrame(p)) continue;
+    fprintf(f, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":1,\"ts\":%.1f,\"dur\":%.1f,\"args\":{\"frame\":%d}}",
+      profileSeriesNames[s->stage], s->start * 1e6, (s->end - s->start) * 1e6, s->frame);
+  }
+  for (i=getFirstProfileFrame(p); i<p->frameCount; i++) {
+    ProfileFrame const* fr = getProfileFrame(p, i);
+    if (fr->values[PROFILE_GPU] < 0) continue;
+    fprintf(f, ",\n{\"name\":\"draw\",\"ph\":\"X\",\"pid\":1,\"tid\":2,\"ts\":%.1f,\"dur\":%.1f,\"args\":{\"frame\":%d}}",
+      fr->gpuStart * 1e6, fr->values[PROFILE_GPU] * 1e3, i);
+  }
+  fprintf(f, "\n]}\n");
+}
+
+// Write the profile to |file|: Chrome trace JSON if the name ends with .json,
+// CSV otherwise. Return 0 on error.
+int writeProfile(Profiler const* p, char const* file) {
+  size_t len = strlen(file);
+  FILE* f;
+  int ok;
+
+  if (!(f = fopen(file, "w"))) return 0;
+  if (len > 5 && !strcmp(file + len - 5, ".json")) writeProfileTrace(p, f);
+  else writeProfileCsv(p, f);
+  ok = !ferror(f);
+  return fclose(f) == 0 && ok;
+}
+
+#endif  // PROFILER_H
@@ -0,0 +1,193 @@
+#ifndef PROGRAM_CACHE_H
+#define PROGRAM_CACHE_H
+
+// On-disk cache of linked shader programs (ARB_get_program_binary).
+//
+// A binary only loads with the driver that made it, so programs are stored
+// under a hash of the vendor, renderer and version strings and of the source
+// (with the #defines of the program variants). On a miss, or if the driver
+// rejects the binary (after an update, say), the program is compiled from
+// source and stored again. An index file lists the programs by last use; the
+// least recently used ones are deleted to keep PROGRAM_CACHE_MAX.
+//
+// File format: "BXPB", binary format, binary length (native ints), binary.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <SDL/SDL.h>
+#include "shader_procs.h"
+
+#if (defined __WIN32__)
+  #include <direct.h>
+  #define makeDirectory(name) _mkdir(name)
+#else
+  #include <sys/stat.h>
+  #define makeDirectory(name) mkdir(name, 0777)
+#endif
+
+#define PROGRAM_CACHE_DIR "shadercache"
+#define PROGRAM_CACHE_INDEX PROGRAM_CACHE_DIR "/index.txt"
+#define PROGRAM_CACHE_MAX 64  // programs kept
+
+typedef struct ProgramCache {
+  int enabled;
+  unsigned long long driverHash;
+  int loaded, compiled, rejected;  // statistics
+  Uint32 milliseconds;             // spent waiting for programs
+  char names[PROGRAM_CACHE_MAX][24];  // files in the index, least recently used first
+  int nameCount, indexRead;
+} ProgramCache;
+
+// 64-bit FNV-1a hash of a string and its terminating 0, continuing from |h|.
+static unsigned long long hashString(unsigned long long h, char const* s) {
+  do h = (h ^ (unsigned char)*s) * 0x100000001b3ULL; while (*s++);
+  return h;
+}
+
+// Use the cache if the driver supports program binaries. Needs an OpenGL
+// context; call again after it has been recreated.
+void initProgramCache(ProgramCache* c) {
+  static GLenum const driverStrings[3] = { GL_VENDOR, GL_RENDERER, GL_VERSION };
+  char const* extensions = (char const*)glGetString(GL_EXTENSIONS);
+  GLint formats = 0;
+  unsigned long long h = 0xcbf29ce484222325ULL;
+  int i;
+
+  c->enabled = extensions && strstr(extensions, "GL_ARB_get_program_binary") && enableProgramBinaryProcs();
+  if (c->enabled) glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+  c->enabled = formats > 0;
+
+  // Without the strings, binaries of another driver can't be told apart.
+  for (i=0; i<3; i++) {
+    char const* s = (char const*)glGetString(driverStrings[i]);
+    if (s) h = hashString(h, s);
+    else c->enabled = 0;
+  }
+  c->driverHash = h;
+}
+
+static void getProgramFile(ProgramCache const* c, char const* vs, char const* fs, char* file) {
+  unsigned long long h = hashString(hashString(c->driverHash, vs), fs);
+  sprintf(file, "%s/%08x%08x.bin", PROGRAM_CACHE_DIR, (unsigned)(h >> 32), (unsigned)h);
+}
+
+// Make |file| the most recently used program in the index, delete the least
+// recently used one if the index is full, and write the index.
+static void touchCachedProgram(ProgramCache* c, char const* file) {
+  char const* name = file + strlen(PROGRAM_CACHE_DIR "/");
+  int i;
+  FILE* f;
+
+  if (!c->indexRead) {
+    c->indexRead = 1;
+    if ((f = fopen(PROGRAM_CACHE_INDEX, "r"))) {
+      while (c->nameCount < PROGRAM_CACHE_MAX && fscanf(f, "%23s", c->names[c->nameCount]) == 1) {
+        // Only names of cache files, so nothing else is ever deleted.
+        char const* n = c->names[c->nameCount];
+        if (strspn(n, "0123456789abcdef") == 16 && !strcmp(n + 16, ".bin")) c->nameCount++;
+      }
+      fclose(f);
+    }
+  }
+
+  for (i=0; i<c->nameCount && strcmp(c->names[i], name); i++) {}
+  if (i == PROGRAM_CACHE_MAX) {
+    char old[256];
+    sprintf(old, "%s/%s", PROGRAM_CACHE_DIR, c->names[0]);
+    remove(old);
+    i = 0;
+  }
+  else if (i == c->nameCount) c->nameCount++;
+  memmove(c->names[i], c->names[i+1], (c->nameCount-1 - i) * sizeof(c->names[0]));
+  strcpy(c->names[c->nameCount-1], name);
+
+  if ((f = fopen(PROGRAM_CACHE_INDEX, "w"))) {
+    for (i=0; i<c->nameCount; i++) fprintf(f, "%s\n", c->names[i]);
+    fclose(f);
+  }
+}
+
+// Load the program for this source. Return 0 if it isn't in the cache or the
+// driver doesn't take it.
+GLuint loadCachedProgram(ProgramCache* c, char const* vs, char const* fs) {
+  char file[256], magic[4];
+  GLint format, length, linked = 0;
+  void* binary;
+  GLuint p = 0;
+  FILE* f;
+
+  if (!c->enabled) return 0;
+  getProgramFile(c, vs, fs, file);
+  if (!(f = fopen(file, "rb"))) return 0;
+
+  if (fread(magic, 4, 1, f) == 1 && !memcmp(magic, "BXPB", 4) &&
+      fread(&format, sizeof(format), 1, f) == 1 && fread(&length, sizeof(length), 1, f) == 1 &&
+      length > 0 && (binary = malloc(length))) {
+    if (fread(binary, length, 1, f) == 1) {
+      p = glCreateProgram();
+      glProgramBinary(p, format, binary, length);
+      glGetProgramiv(p, GL_LINK_STATUS, &linked);
+      if (!linked) { glDeleteProgram(p); p = 0; c->rejected++; }
+    }
+    free(binary);
+  }
+  fclose(f);
+  if (p) {
+    c->loaded++;
+    touchCachedProgram(c, file);
+  }
+  return p;
+}
+
+// Store a linked program made from this source.
+void saveCachedProgram(ProgramCache* c, GLuint p, char const* vs, char const* fs) {
+  char file[256];
+  GLint length = 0;
+  GLenum format;
+  void* binary;
+  FILE* f;
+
+  if (!c->enabled) return;
+  glGetProgramiv(p, GL_PROGRAM_BINARY_LENGTH, &length);
+  if (length <= 0 || !(binary = malloc(length))) return;
+  glGetProgramBinary(p, length, &length, &format, binary);
+
+  makeDirectory(PROGRAM_CACHE_DIR);
+  getProgramFile(c, vs, fs, file);
+  if ((f = fopen(file, "wb"))) {
+    GLint fmt = format;
+    int ok = fwrite("BXPB", 4, 1, f) == 1 && fwrite(&fmt, sizeof(fmt), 1, f) == 1 &&
+             fwrite(&length, sizeof(length), 1, f) == 1 && fwrite(binary, length, 1, f) == 1;
+    if (fclose(f) || !ok) remove(file);  // don't leave a truncated binary
+    else touchCachedProgram(c, file);
+  }
+  free(binary);
+}
+
+// Load a program from the cache, or start compiling it (see startProgram()).
+// |shaders| gets 0s if it was loaded.
+GLuint startCachedProgram(ProgramCache* c, char const* vs, char const* fs, GLuint shaders[2]) {
+  Uint32 start = SDL_GetTicks();
+  GLuint p = loadCachedProgram(c, vs, fs);
+
+  shaders[0] = shaders[1] = 0;
+  if (!p) p = startProgram(vs, fs, shaders, c->enabled);
+  c->milliseconds += SDL_GetTicks() - start;
+  return p;
+}
+
+// Finish a program started by startCachedProgram(), and store it if it was
+// compiled. Logs go to stderr. Return 0 on error.
+GLuint finishCachedProgram(ProgramCache* c, GLuint p, GLuint const shaders[2], char const* vs, char const* fs) {
+  Uint32 start = SDL_GetTicks();
+
+  if (shaders[0] && (p = finishProgram(p, shaders))) {
+    saveCachedProgram(c, p, vs, fs);
+    c->compiled++;
+  }
+  c->milliseconds += SDL_GetTicks() - start;
+  return p;
+}
+
+#endif  // PROGRAM_CACHE_H
@@ -0,0 +1,192 @@
+#ifndef PROGRESSIVE_H
+#define PROGRESSIVE_H
+
+// Progressive refinement.
+//
+// The screen is split into blocks of scale x scale pixels. Every frame, one
+// pass renders an image with one pixel per block, which costs 1/scale^2 of a
+// full frame. After a change, the first pass is shown scaled up. While nothing
+// changes, the following passes cover the other pixels of the blocks, then
+// add jittered samples inside the pixels for anti-aliasing. All passes are
+// summed in the float buffer of hdr.h; the screen shows the average, tone
+// mapped.
+
+#include "shader_procs.h"
+#include "render_target.h"
+#include "hdr.h"
+
+#define PROGRESSIVE_MAX_SCALE 8
+
+static char const progressive_vs[] =
+  "void main(){gl_Position=gl_Vertex;}";
+
+// Add the pixels of a pass to the accumulation buffer.
+static char const progressive_scatter_fs[] =
+  "uniform sampler2D image;"   // the pass, one pixel per block
+  "uniform vec2 image_size;"
+  "uniform vec2 slice;"        // pixel of the block covered by the pass
+  "uniform float scale;"
+  "void main(){"
+    "vec2 p=floor(gl_FragCoord.xy);"
+    "vec2 block=floor(p/scale);"
+    "if(any(notEqual(p-block*scale,slice)))discard;"
+    "gl_FragColor=vec4(texture2D(image,(block+0.5)/image_size).rgb,1.0);"
+  "}";
+
+// Show the average of the samples, or the last pass where there are none.
+static char const progressive_present_fs[] =
+  HDR_TONE_MAP_FS
+  "uniform sampler2D accum,image;"
+  "uniform vec2 size,image_size;"
+  "uniform vec2 offset;"       // of the viewport in the window
+  "uniform vec2 origin;"       // sample position of the last pass in its block
+  "uniform float scale;"
+  "void main(){"
+    "vec2 p=gl_FragCoord.xy-offset;"
+    "vec4 a=texture2D(accum,p/size);"
+    "if(a.a>0.0)gl_FragColor=vec4(tone_map(a.rgb/a.a),1.0);"
+    "else gl_FragColor=vec4(tone_map(texture2D(image,((p-origin)/scale+0.5)/image_size).rgb),1.0);"
+  "}";
+
+typedef struct Progressive {
+  int enabled;
+  int scale;            // block size
+  int maxSamples;       // samples per pixel, then the image is finished
+  int width, height;
+  RenderTarget image;   // the current pass
+  RenderTarget const* accum;  // sum of all passes (rgb) and sample count (alpha)
+  GLuint scatter, present;
+  int pass;             // passes since the last reset
+  float origin[2];      // sample position of the current pass in its block
+} Progressive;
+
+// Element |i| of the Halton sequence with the given base, in [0,1).
+float halton(int i, int base) {
+  float f = 1, r = 0;
+  for (; i>0; i/=base) { f /= base; r += f * (i % base); }
+  return r;
+}
+
+void releaseProgressive(Progressive* p) {
+  if (!p->enabled) return;
+  releaseRenderTarget(&p->image);
+  glDeleteProgram(p->scatter);
+  glDeleteProgram(p->present);
+  memset(p, 0, sizeof(Progressive));
+}
+
+// Set up refinement of a width x height image in blocks of scale x scale
+// pixels, summed in |accum| (the float buffer of hdr.h, which nothing else
+// may draw into while refining). With |hdr|, passes are drawn in floats too.
+// Return 0 if it isn't supported (needs framebuffer objects and float
+// textures).
+int initProgressive(Progressive* p, int width, int height, int scale, int maxSamples,
+                    RenderTarget const* accum, int hdr) {
+  memset(p, 0, sizeof(Progressive));
+  if (scale < 2 || !accum || !accum->fbo) return 0;
+  if (scale > PROGRESSIVE_MAX_SCALE) scale = PROGRESSIVE_MAX_SCALE;
+  if (!enableFramebufferProcs()) return 0;
+
+  p->enabled = 1;
+  p->scale = scale;
+  p->maxSamples = maxSamples;
+  p->width = width;
+  p->height = height;
+  p->accum = accum;
+
+  if (!initRenderTarget(&p->image, (width + scale-1) / scale, (height + scale-1) / scale,
+                        hdr ? GL_RGBA16F : GL_RGBA8, GL_LINEAR) ||
+      !(p->scatter = compileProgram(progressive_vs, progressive_scatter_fs)) ||
+      !(p->present = compileProgram(progressive_vs, progressive_present_fs))) {
+    releaseProgressive(p);
+    return 0;
+  }
+  return 1;
+}
+
+// Start over, for example after the camera has moved.
+void resetProgressive(Progressive* p) {
+  p->pass = 0;
+}
+
+// Return the number of finished samples per pixel.
+int getProgressiveSamples(Progressive const* p) {
+  return p->pass / (p->scale * p->scale);
+}
+
+// Is the image finished?
+int isProgressiveDone(Progressive const* p) {
+  return getProgressiveSamples(p) >= p->maxSamples;
+}
+
+// Start the next pass: render into the pass image. Returns the part of the
+// screen to render, in the order of setTileUniforms(): scale x, y, offset x, y.
+void beginProgressivePass(Progressive* p, float tile[4]) {
+  int slice = p->pass % (p->scale * p->scale), round = getProgressiveSamples(p), i;
+
+  // The first sample is at the pixel center, the others are jittered.
+  p->origin[0] = slice % p->scale + (round ? halton(round, 2) : 0.5f);
+  p->origin[1] = slice / p->scale + (round ? halton(round, 3) : 0.5f);
+
+  // Map the pixel centers of the pass to the sample positions in the blocks.
+  for (i=0; i<2; i++) {
+    int size = i ? p->height : p->width, passSize = i ? p->image.height : p->image.width;
+    tile[i] = (float)p->scale * passSize / size;
+    tile[2+i] = (p->scale * passSize - p->scale + 2 * p->origin[i]) / size - 1;
+  }
+  bindRenderTarget(&p->image);
+}
+
+// Add the pass to the accumulation buffer.
+void endProgressivePass(Progressive* p) {
+  int slice = p->pass % (p->scale * p->scale);
+
+  bindRenderTarget(p->accum);
+  if (p->pass == 0) { glClearColor(0, 0, 0, 0); glClear(GL_COLOR_BUFFER_BIT); }
+
+  glUseProgram(p->scatter);
+  glBindTexture(GL_TEXTURE_2D, p->image.texture);
+  glUniform1i(glGetUniformLocation(p->scatter, "image"), 0);
+  glUniform2f(glGetUniformLocation(p->scatter, "image_size"), p->image.width, p->image.height);
+  glUniform2f(glGetUniformLocation(p->scatter, "slice"), slice % p->scale, slice / p->scale);
+  glUniform1f(glGetUniformLocation(p->scatter, "scale"), p->scale);
+
+  glEnable(GL_BLEND);
+  glBlendFunc(GL_ONE, GL_ONE);
+  glRects(-1,-1,1,1);
+  glDisable(GL_BLEND);
+  glBindTexture(GL_TEXTURE_2D, 0);
+
+  p->pass++;
+}
+
+// Draw the image tone mapped into |dest|, or into the window at viewport
+// offset (x, y) if it is 0.
+void presentProgressive(Progressive* p, RenderTarget const* dest, int x, int y, ToneMap const* t) {
+  bindRenderTarget(dest);
+  if (!dest) glViewport(x, y, p->width, p->height);
+  else x = y = 0;
+
+  glUseProgram(p->present);
+  glActiveTexture(GL_TEXTURE1);
+  glBindTexture(GL_TEXTURE_2D, p->image.texture);
+  glActiveTexture(GL_TEXTURE0);
+  glBindTexture(GL_TEXTURE_2D, p->accum->texture);
+  glUniform1i(glGetUniformLocation(p->present, "accum"), 0);
+  glUniform1i(glGetUniformLocation(p->present, "image"), 1);
+  glUniform2f(glGetUniformLocation(p->present, "size"), p->width, p->height);
+  glUniform2f(glGetUniformLocation(p->present, "image_size"), p->image.width, p->image.height);
+  glUniform2f(glGetUniformLocation(p->present, "offset"), x, y);
+  glUniform2f(glGetUniformLocation(p->present, "origin"), p->origin[0], p->origin[1]);
+  glUniform1f(glGetUniformLocation(p->present, "scale"), p->scale);
+  setToneMapUniforms(p->present, t);
+
+  glRects(-1,-1,1,1);
+
+  glActiveTexture(GL_TEXTURE1);
+  glBindTexture(GL_TEXTURE_2D, 0);
+  glActiveTexture(GL_TEXTURE0);
+  glBindTexture(GL_TEXTURE_2D, 0);
+}
+
+#endif  // PROGRESSIVE_H
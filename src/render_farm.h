@@ -0,0 +1,577 @@
+#ifndef RENDER_FARM_H
+#define RENDER_FARM_H
+
+// Distributed rendering over TCP.
+//
+// A coordinator splits the frames of a job into tiles of at most
+// FARM_TILE_SIZE x FARM_TILE_SIZE pixels (units) and hands them out to worker
+// processes, which render them and send the pixels back. Workers connect to
+// the coordinator, so they can join at any time. Every worker has up to
+// FARM_UNITS_PER_WORKER units at once: it starts the next one while the
+// pixels of the last one are on the way back.
+//
+// A worker that disconnects, sends garbage or doesn't answer for FARM_TIMEOUT
+// seconds is dropped, and its units go to the others. While it renders, a
+// worker says so every FARM_HEARTBEAT seconds, so a slow tile isn't taken for
+// a lost worker. A worker that can't render a unit says so; the unit goes to
+// another worker. A unit that has been lost or failed FARM_MAX_TRIES times
+// stops the job. Frames are finished in order as soon as all their tiles are
+// in; units are only handed out for the next FARM_FRAMES_IN_FLIGHT frames,
+// which are the only ones in memory.
+//
+// Messages are 32-bit integers in network byte order and a payload:
+//   hello  (worker):      "BXRF", size of the unit data
+//   unit   (coordinator): unit number, frame width and height, tile x, y,
+//                         width and height; the unit data
+//   result (worker):      unit number, 1; the tile as RGB, bottom row first
+//                         or: unit number, 0 if it can't be rendered
+//   busy   (worker):      -1, while rendering
+// The unit data (the camera and parameters of the frame) is sent as it is in
+// memory, so all nodes must run the same build on the same kind of machine.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <SDL/SDL.h>
+
+#if (defined __WIN32__)
+  #include <winsock2.h>
+  #include <ws2tcpip.h>
+  typedef SOCKET FarmSocket;
+  #define FARM_NO_SOCKET INVALID_SOCKET
+  #define closeSocket(s) closesocket(s)
+#else
+  #include <sys/types.h>
+  #include <sys/socket.h>
+  #include <sys/select.h>
+  #include <sys/time.h>
+  #include <netinet/in.h>
+  #include <netinet/tcp.h>
+  #include <arpa/inet.h>
+  #include <netdb.h>
+  #include <unistd.h>
+  typedef int FarmSocket;
+  #define FARM_NO_SOCKET (-1)
+  #define closeSocket(s) close(s)
+#endif
+
+#ifdef MSG_NOSIGNAL
+  #define FARM_SEND_FLAGS MSG_NOSIGNAL  // a lost peer is an error, not SIGPIPE
+#else
+  #define FARM_SEND_FLAGS 0
+#endif
+
+#define FARM_TILE_SIZE        128
+#define FARM_UNITS_PER_WORKER 2
+#define FARM_FRAMES_IN_FLIGHT 4
+#define FARM_TIMEOUT          120  // seconds
+#define FARM_HEARTBEAT        10   // seconds
+#define FARM_MAX_TRIES        3
+#define FARM_MAX_WORKERS      64
+#define FARM_CONNECT_TRIES    30   // a second apart, so workers can start first
+
+// A tile of a frame. Rows are counted from the bottom.
+typedef struct FarmTile {
+  int frameWidth, frameHeight;
+  int x, y, width, height;
+} FarmTile;
+
+// Point |data| at what a worker needs to render |frame|. It stays valid
+// until the next call.
+typedef void (*FarmDataFunc)(void* context, int frame, void const** data);
+
+// All tiles of |frame| are in |rgb| (bottom row first). Takes ownership of
+// |rgb| (allocated by malloc). Return 0 on error.
+typedef int (*FarmFrameFunc)(void* context, int frame, int width, int height, unsigned char* rgb);
+
+// Render |tile| of the frame described by |data| into |rgb| (bottom row
+// first). Return 1 on success, 0 if the tile can't be rendered here and -1
+// to leave the job.
+typedef int (*FarmRenderFunc)(void* context, FarmTile const* tile, void const* data, unsigned char* rgb);
+
+// Start using sockets. Return 0 on error.
+int initSockets(void) {
+#if (defined __WIN32__)
+  WSADATA wsa;
+  return WSAStartup(MAKEWORD(2, 2), &wsa) == 0;
+#else
+  return 1;
+#endif
+}
+
+// Give up on sends and receives after |seconds|, and send small messages
+// right away.
+static void setFarmSocketOptions(FarmSocket s, int seconds) {
+#if (defined __WIN32__)
+  DWORD t = seconds * 1000;
+#else
+  struct timeval t = { seconds, 0 };
+#endif
+  int one = 1;
+  setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, (char const*)&t, sizeof(t));
+  setsockopt(s, SOL_SOCKET, SO_SNDTIMEO, (char const*)&t, sizeof(t));
+  setsockopt(s, IPPROTO_TCP, TCP_NODELAY, (char const*)&one, sizeof(one));
+}
+
+// Send or receive exactly |n| bytes. Return 0 on error or if the connection
+// has been closed.
+static int sendAll(FarmSocket s, void const* buffer, int n) {
+  char const* p = buffer;
+  while (n > 0) {
+    int k = send(s, p, n, FARM_SEND_FLAGS);
+    if (k <= 0) return 0;
+    p += k; n -= k;
+  }
+  return 1;
+}
+
+static int recvAll(FarmSocket s, void* buffer, int n) {
+  char* p = buffer;
+  while (n > 0) {
+    int k = recv(s, p, n, 0);
+    if (k <= 0) return 0;
+    p += k; n -= k;
+  }
+  return 1;
+}
+
+// Send or receive up to 8 integers.
+static int sendInts(FarmSocket s, int const* x, int n) {
+  Uint32 b[8];
+  int i;
+  for (i=0; i<n; i++) b[i] = htonl((Uint32)x[i]);
+  return sendAll(s, b, n * 4);
+}
+
+static int recvInts(FarmSocket s, int* x, int n) {
+  Uint32 b[8];
+  int i;
+  if (!recvAll(s, b, n * 4)) return 0;
+  for (i=0; i<n; i++) x[i] = (int)ntohl(b[i]);
+  return 1;
+}
+
+
+////////////////////////////////////////////////////////////////
+// Coordinator.
+
+typedef struct FarmUnit {
+  FarmTile tile;
+  int frame;
+  int assigned;  // sent to a worker, not back yet
+  int done;
+  int tries;
+  int failedOn;  // id of the last worker that couldn't render it, 0 if none
+} FarmUnit;
+
+typedef struct FarmWorker {
+  FarmSocket s;
+  int id;                            // > 0
+  char name[64];
+  int units[FARM_UNITS_PER_WORKER];  // sent, oldest first
+  int queued;
+  Uint32 heard;                      // last message, or the first unit sent when idle
+  int tiles, failed;
+} FarmWorker;
+
+typedef struct RenderFarm {
+  FarmSocket listener;
+  FarmWorker workers[FARM_MAX_WORKERS];
+  int workerCount;
+
+  FarmUnit* units;
+  int frames, tilesPerFrame;
+  int width, height;
+  int nextFrame;  // the frames before it are finished
+  unsigned char* images[FARM_FRAMES_IN_FLIGHT];
+  int tilesDone[FARM_FRAMES_IN_FLIGHT];
+  unsigned char* tile;  // a received tile
+
+  int dataSize;
+  FarmDataFunc getData;
+  FarmFrameFunc finishFrame;
+  void* context;
+
+  int failed;
+  int joined, dropped, retried;  // statistics
+} RenderFarm;
+
+static FarmSocket listenFarm(int port) {
+  struct sockaddr_in addr;
+  FarmSocket s = socket(AF_INET, SOCK_STREAM, 0);
+  int one = 1;
+
+  if (s == FARM_NO_SOCKET) return s;
+  setsockopt(s, SOL_SOCKET, SO_REUSEADDR, (char const*)&one, sizeof(one));
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_ANY);
+  addr.sin_port = htons(port);
+  if (bind(s, (struct sockaddr*)&addr, sizeof(addr)) || listen(s, FARM_MAX_WORKERS)) {
+    closeSocket(s);
+    return FARM_NO_SOCKET;
+  }
+  return s;
+}
+
+// Take a new worker if it says hello with the same unit data size.
+static void acceptFarmWorker(RenderFarm* f) {
+  struct sockaddr_in addr;
+  socklen_t length = sizeof(addr);
+  FarmSocket s = accept(f->listener, (struct sockaddr*)&addr, &length);
+  FarmWorker* w;
+  char magic[4];
+  int dataSize;
+
+  if (s == FARM_NO_SOCKET) return;
+  setFarmSocketOptions(s, FARM_TIMEOUT);
+  if (f->workerCount == FARM_MAX_WORKERS || !recvAll(s, magic, 4) || memcmp(magic, "BXRF", 4) ||
+      !recvInts(s, &dataSize, 1) || dataSize != f->dataSize) {
+    fprintf(stderr, "Worker from %s refused (too many workers or not the same version)\n", inet_ntoa(addr.sin_addr));
+    closeSocket(s);
+    return;
+  }
+  w = &f->workers[f->workerCount++];
+  memset(w, 0, sizeof(FarmWorker));
+  w->s = s;
+  w->id = f->joined + 1;
+  sprintf(w->name, "%s:%d", inet_ntoa(addr.sin_addr), ntohs(addr.sin_port));
+  f->joined++;
+  fprintf(stderr, "Worker %s joined\n", w->name);
+}
+
+// Drop worker |i|; its units go back to the others.
+static void dropFarmWorker(RenderFarm* f, int i, char const* why) {
+  FarmWorker* w = &f->workers[i];
+  int j;
+
+  fprintf(stderr, "Worker %s dropped (%s) after %d tiles\n", w->name, why, w->tiles);
+  for (j=0; j<w->queued; j++) {
+    FarmUnit* u = &f->units[w->units[j]];
+    u->assigned = 0;
+    f->retried++;
+    if (u->tries >= FARM_MAX_TRIES) {
+      fprintf(stderr, "Tile %d,%d of frame %d was lost %d times\n", u->tile.x, u->tile.y, u->frame, u->tries);
+      f->failed = 1;
+    }
+  }
+  closeSocket(w->s);
+  f->dropped++;
+  *w = f->workers[--f->workerCount];
+}
+
+// Return the next unit to hand out to |w|, or -1 if there is none. A unit
+// isn't given back to the worker that has just failed to render it, unless
+// there is no other one.
+static int nextFarmUnit(RenderFarm const* f, FarmWorker const* w) {
+  int end = f->nextFrame + FARM_FRAMES_IN_FLIGHT, i;
+  if (end > f->frames) end = f->frames;
+  for (i=f->nextFrame * f->tilesPerFrame; i<end * f->tilesPerFrame; i++) {
+    FarmUnit const* u = &f->units[i];
+    if (!u->done && !u->assigned && (u->failedOn != w->id || f->workerCount == 1)) return i;
+  }
+  return -1;
+}
+
+static int sendFarmUnit(RenderFarm* f, FarmWorker* w, int i) {
+  FarmUnit* u = &f->units[i];
+  FarmTile const* t = &u->tile;
+  int header[7] = { i, t->frameWidth, t->frameHeight, t->x, t->y, t->width, t->height };
+  void const* data;
+
+  f->getData(f->context, u->frame, &data);
+  if (!w->queued) w->heard = SDL_GetTicks();
+  w->units[w->queued++] = i;
+  u->assigned = 1;
+  u->tries++;
+  return sendInts(w->s, header, 7) && sendAll(w->s, data, f->dataSize);
+}
+
+// Receive a message of a worker: the result of its oldest unit, which is put
+// into its frame, or that it's still busy. Finish the frames that are
+// complete. Return 0 if the worker has to be dropped.
+static int receiveFarmResult(RenderFarm* f, FarmWorker* w) {
+  FarmUnit* u;
+  FarmTile const* t;
+  unsigned char** image;
+  int result[2], y;
+
+  if (!recvInts(w->s, result, 1)) return 0;
+  w->heard = SDL_GetTicks();
+  if (result[0] == -1) return 1;
+  if (!w->queued || result[0] != w->units[0] || !recvInts(w->s, result + 1, 1)) return 0;
+  u = &f->units[result[0]];
+  t = &u->tile;
+  if (result[1] && !recvAll(w->s, f->tile, t->width * t->height * 3)) return 0;
+
+  w->queued--;
+  memmove(w->units, w->units + 1, w->queued * sizeof(int));
+  u->assigned = 0;
+
+  // A unit the worker can't render goes to another one.
+  if (!result[1]) {
+    w->failed++;
+    u->failedOn = w->id;
+    f->retried++;
+    if (u->tries >= FARM_MAX_TRIES) {
+      fprintf(stderr, "Tile %d,%d of frame %d failed %d times\n", t->x, t->y, u->frame, u->tries);
+      f->failed = 1;
+    }
+    return 1;
+  }
+  w->tiles++;
+  u->done = 1;
+
+  image = &f->images[u->frame % FARM_FRAMES_IN_FLIGHT];
+  if (!*image && !(*image = malloc((size_t)f->width * f->height * 3))) {
+    fprintf(stderr, "Out of memory for frame %d\n", u->frame);
+    f->failed = 1;
+    return 1;
+  }
+  for (y=0; y<t->height; y++) {
+    memcpy(*image + ((size_t)(t->y + y) * f->width + t->x) * 3, f->tile + (size_t)y * t->width * 3, t->width * 3);
+  }
+  f->tilesDone[u->frame % FARM_FRAMES_IN_FLIGHT]++;
+
+  while (f->nextFrame < f->frames && f->tilesDone[f->nextFrame % FARM_FRAMES_IN_FLIGHT] == f->tilesPerFrame) {
+    int k = f->nextFrame % FARM_FRAMES_IN_FLIGHT;
+    if (!f->finishFrame(f->context, f->nextFrame, f->width, f->height, f->images[k])) f->failed = 1;
+    f->images[k] = 0;
+    f->tilesDone[k] = 0;
+    f->nextFrame++;
+  }
+  return 1;
+}
+
+// Render |frames| width x height frames on the workers that connect to
+// |port|. |getData| makes the unit data (dataSize bytes) of a frame, and
+// |finishFrame| gets the frames in order. Return 0 on error.
+int runFarmCoordinator(int port, int frames, int width, int height, int dataSize,
+                       FarmDataFunc getData, FarmFrameFunc finishFrame, void* context) {
+  RenderFarm f;
+  Uint32 start = SDL_GetTicks();
+  int tilesX = (width + FARM_TILE_SIZE-1) / FARM_TILE_SIZE;
+  int tilesY = (height + FARM_TILE_SIZE-1) / FARM_TILE_SIZE;
+  int waiting = 0, i, x, y;
+
+  memset(&f, 0, sizeof(f));
+  if (!initSockets() || (f.listener = listenFarm(port)) == FARM_NO_SOCKET) {
+    fprintf(stderr, "Can't listen on port %d\n", port);
+    return 0;
+  }
+  f.frames = frames;
+  f.width = width; f.height = height;
+  f.tilesPerFrame = tilesX * tilesY;
+  f.units = calloc((size_t)frames * f.tilesPerFrame, sizeof(FarmUnit));
+  f.tile = malloc(FARM_TILE_SIZE * FARM_TILE_SIZE * 3);
+  if (!f.units || !f.tile) {
+    fprintf(stderr, "Out of memory for %d frames of %d tiles\n", frames, f.tilesPerFrame);
+    closeSocket(f.listener);
+    free(f.units);
+    free(f.tile);
+    return 0;
+  }
+  f.dataSize = dataSize;
+  f.getData = getData;
+  f.finishFrame = finishFrame;
+  f.context = context;
+
+  for (i=0; i<frames; i++) {
+    for (y=0; y<tilesY; y++) {
+      for (x=0; x<tilesX; x++) {
+        FarmUnit* u = &f.units[(i * tilesY + y) * tilesX + x];
+        u->frame = i;
+        u->tile.frameWidth = width; u->tile.frameHeight = height;
+        u->tile.x = x * FARM_TILE_SIZE; u->tile.y = y * FARM_TILE_SIZE;
+        u->tile.width = width - u->tile.x < FARM_TILE_SIZE ? width - u->tile.x : FARM_TILE_SIZE;
+        u->tile.height = height - u->tile.y < FARM_TILE_SIZE ? height - u->tile.y : FARM_TILE_SIZE;
+      }
+    }
+  }
+
+  while (f.nextFrame < frames && !f.failed) {
+    struct timeval timeout = { 1, 0 };
+    FarmSocket last = f.listener;
+    fd_set ready;
+    Uint32 now;
+
+    if (!f.workerCount && !waiting) fprintf(stderr, "Waiting for workers on port %d\n", port);
+    waiting = !f.workerCount;
+
+    FD_ZERO(&ready);
+    FD_SET(f.listener, &ready);
+    for (i=0; i<f.workerCount; i++) {
+      FD_SET(f.workers[i].s, &ready);
+      if (f.workers[i].s > last) last = f.workers[i].s;
+    }
+    if (select((int)last + 1, &ready, 0, 0, &timeout) < 0) continue;
+
+    // Results first: dropped sockets can be reused by accept().
+    now = SDL_GetTicks();
+    for (i=f.workerCount-1; i>=0; i--) {
+      FarmWorker* w = &f.workers[i];
+      if (FD_ISSET(w->s, &ready)) { if (!receiveFarmResult(&f, w)) dropFarmWorker(&f, i, "lost"); }
+      else if (w->queued && now - w->heard > FARM_TIMEOUT * 1000) dropFarmWorker(&f, i, "timed out");
+    }
+    if (FD_ISSET(f.listener, &ready)) acceptFarmWorker(&f);
+
+    for (i=f.workerCount-1; i>=0; i--) {
+      int u;
+      while (f.workers[i].queued < FARM_UNITS_PER_WORKER && (u = nextFarmUnit(&f, &f.workers[i])) >= 0) {
+        if (!sendFarmUnit(&f, &f.workers[i], u)) { dropFarmWorker(&f, i, "lost"); break; }
+      }
+    }
+  }
+
+  // Closing the connections tells the workers that the job is done.
+  for (i=0; i<f.workerCount; i++) {
+    fprintf(stderr, "Worker %s: %d tiles, %d failed\n", f.workers[i].name, f.workers[i].tiles, f.workers[i].failed);
+    closeSocket(f.workers[i].s);
+  }
+  closeSocket(f.listener);
+  for (i=0; i<FARM_FRAMES_IN_FLIGHT; i++) free(f.images[i]);
+  free(f.units);
+  free(f.tile);
+
+  fprintf(stderr, "%d frames (%d tiles) in %.3fs on %d workers, %d dropped, %d tiles retried\n",
+    f.nextFrame, f.nextFrame * f.tilesPerFrame, (SDL_GetTicks() - start) / 1000.,
+    f.joined, f.dropped, f.retried);
+  return !f.failed;
+}
+
+
+////////////////////////////////////////////////////////////////
+// Worker.
+
+static FarmSocket connectFarm(char const* address) {
+  char host[256], *port;
+  struct addrinfo hints, *list, *a;
+  FarmSocket s = FARM_NO_SOCKET;
+  int i;
+
+  strncpy(host, address, sizeof(host)-1);
+  host[sizeof(host)-1] = 0;
+  if (!(port = strrchr(host, ':'))) return s;
+  *port++ = 0;
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  for (i=0; i<FARM_CONNECT_TRIES && s == FARM_NO_SOCKET; i++) {
+    if (i) SDL_Delay(1000);
+    if (getaddrinfo(host, port, &hints, &list)) continue;
+    for (a=list; a && s == FARM_NO_SOCKET; a=a->ai_next) {
+      if ((s = socket(a->ai_family, a->ai_socktype, a->ai_protocol)) == FARM_NO_SOCKET) continue;
+      if (connect(s, a->ai_addr, a->ai_addrlen)) { closeSocket(s); s = FARM_NO_SOCKET; }
+    }
+    freeaddrinfo(list);
+  }
+  return s;
+}
+
+// Sends busy messages while the worker renders. Messages are sent with the
+// lock held.
+typedef struct FarmHeartbeat {
+  FarmSocket s;
+  SDL_mutex* lock;
+  SDL_cond* changed;
+  int busy, quit;
+  int ok;  // no send has failed
+} FarmHeartbeat;
+
+static int farmHeartbeatMain(void* arg) {
+  FarmHeartbeat* h = arg;
+  int busy = -1;
+
+  SDL_LockMutex(h->lock);
+  while (!h->quit) {
+    if (SDL_CondWaitTimeout(h->changed, h->lock, FARM_HEARTBEAT * 1000) == SDL_MUTEX_TIMEDOUT &&
+        h->busy && h->ok) {
+      h->ok = sendInts(h->s, &busy, 1);
+    }
+  }
+  SDL_UnlockMutex(h->lock);
+  return 0;
+}
+
+// Connect to the coordinator at |address| (host:port) and render its units
+// with |render| until it is done. |dataSize| is the size of the unit data.
+// Return 0 on error.
+int runFarmWorker(char const* address, int dataSize, FarmRenderFunc render, void* context) {
+  Uint32 start = SDL_GetTicks();
+  unsigned char* rgb = malloc(FARM_TILE_SIZE * FARM_TILE_SIZE * 3);
+  void* data = malloc(dataSize);
+  FarmHeartbeat h;
+  SDL_Thread* heartbeat;
+  int tiles = 0, failed = 0, ok = 1;
+  FarmSocket s;
+
+  if (!rgb || !data) {
+    fprintf(stderr, "Out of memory\n");
+    free(rgb); free(data);
+    return 0;
+  }
+  if (!initSockets() || (s = connectFarm(address)) == FARM_NO_SOCKET) {
+    fprintf(stderr, "Can't connect to %s\n", address);
+    free(rgb); free(data);
+    return 0;
+  }
+  setFarmSocketOptions(s, FARM_TIMEOUT);
+  ok = sendAll(s, "BXRF", 4) && sendInts(s, &dataSize, 1);
+
+  memset(&h, 0, sizeof(h));
+  h.s = s;
+  h.ok = 1;
+  h.lock = SDL_CreateMutex();
+  h.changed = SDL_CreateCond();
+  heartbeat = SDL_CreateThread(farmHeartbeatMain, &h);
+
+  // The coordinator closes the connection at the end of the job.
+  while (ok) {
+    int unit[7], result;
+    FarmTile t;
+
+    // Waiting for work isn't a timeout.
+    {
+      fd_set ready;
+      FD_ZERO(&ready);
+      FD_SET(s, &ready);
+      if (select((int)s + 1, &ready, 0, 0, 0) < 0) continue;
+    }
+    if (!recvInts(s, unit, 7)) break;
+    t.frameWidth = unit[1]; t.frameHeight = unit[2];
+    t.x = unit[3]; t.y = unit[4]; t.width = unit[5]; t.height = unit[6];
+    if (!(ok = t.width > 0 && t.width <= FARM_TILE_SIZE && t.height > 0 && t.height <= FARM_TILE_SIZE &&
+               recvAll(s, data, dataSize))) break;
+
+    SDL_LockMutex(h.lock);
+    h.busy = 1;
+    SDL_UnlockMutex(h.lock);
+    result = render(context, &t, data, rgb);
+
+    SDL_LockMutex(h.lock);
+    h.busy = 0;
+    unit[1] = result > 0;
+    ok = result >= 0 && h.ok && sendInts(s, unit, 2) && (!unit[1] || sendAll(s, rgb, t.width * t.height * 3));
+    SDL_UnlockMutex(h.lock);
+    tiles += ok && result > 0;
+    failed += ok && !result;
+  }
+
+  SDL_LockMutex(h.lock);
+  h.quit = 1;
+  SDL_CondSignal(h.changed);
+  SDL_UnlockMutex(h.lock);
+  SDL_WaitThread(heartbeat, 0);
+  SDL_DestroyCond(h.changed);
+  SDL_DestroyMutex(h.lock);
+
+  closeSocket(s);
+  free(rgb);
+  free(data);
+  fprintf(stderr, "%d tiles, %d failed, in %.3fs%s\n", tiles, failed, (SDL_GetTicks() - start) / 1000.,
+    ok ? "" : " (failed)");
+  return ok;
+}
+
+#endif  // RENDER_FARM_H
@@ -0,0 +1,54 @@
+#ifndef RENDER_TARGET_H
+#define RENDER_TARGET_H
+
+// Offscreen render targets: a texture attached to a framebuffer object.
+// Needs enableFramebufferProcs().
+
+#include <string.h>
+#include "shader_procs.h"
+
+typedef struct RenderTarget {
+  GLuint fbo, texture;
+  int width, height;
+} RenderTarget;
+
+// Create a width x height target with a texture of the given internal format
+// (GL_RGBA8, GL_RGBA32F, ...) and filter. Return 0 if it can't be rendered to.
+int initRenderTarget(RenderTarget* t, int width, int height, GLint format, GLint filter) {
+  GLenum status;
+
+  memset(t, 0, sizeof(RenderTarget));
+  t->width = width;
+  t->height = height;
+
+  glGenTextures(1, &t->texture);
+  glBindTexture(GL_TEXTURE_2D, t->texture);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, filter);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, filter);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+  glTexImage2D(GL_TEXTURE_2D, 0, format, width, height, 0, GL_RGBA, GL_FLOAT, 0);
+  glBindTexture(GL_TEXTURE_2D, 0);
+
+  glGenFramebuffers(1, &t->fbo);
+  glBindFramebuffer(GL_FRAMEBUFFER, t->fbo);
+  glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, t->texture, 0);
+  status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+  glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+  return status == GL_FRAMEBUFFER_COMPLETE;
+}
+
+// Render into the target (0: into the window).
+void bindRenderTarget(RenderTarget const* t) {
+  glBindFramebuffer(GL_FRAMEBUFFER, t ? t->fbo : 0);
+  if (t) glViewport(0, 0, t->width, t->height);
+}
+
+void releaseRenderTarget(RenderTarget* t) {
+  if (t->fbo) glDeleteFramebuffers(1, &t->fbo);
+  if (t->texture) glDeleteTextures(1, &t->texture);
+  memset(t, 0, sizeof(RenderTarget));
+}
+
+#endif  // RENDER_TARGET_H
@@ -4,8 +4,31 @@
 // Enable OpenGL 2.0 shader functions. Return 0 on error.
 int enableShaderProcs(void);
 
+// Enable OpenGL 1.5 buffer object functions (for pixel buffers). Return 0 on error.
+int enableBufferProcs(void);
+
+// Enable framebuffer object functions (ARB_framebuffer_object, OpenGL 3.0),
+// multitexturing, blend equations and multiple draw buffers. Return 0 on error.
+int enableFramebufferProcs(void);
+
+// Enable 3D texture functions (OpenGL 1.2) and multitexturing. Return 0 on error.
+int enableTexture3DProcs(void);
+
+// Enable query objects with GL_TIME_ELAPSED (ARB_timer_query, OpenGL 3.3).
+// Return 0 on error.
+int enableTimerQueryProcs(void);
+
+// Enable program binaries (ARB_get_program_binary, OpenGL 4.1). Return 0 on error.
+int enableProgramBinaryProcs(void);
+
+// Enable fences (ARB_sync, OpenGL 3.2). Return 0 on error.
+int enableSyncProcs(void);
+
 ////////////////////////////////
 
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #define NO_SDL_GLEXT
 #include <SDL/SDL_opengl.h>
 #include <SDL/SDL.h>
@@ -14,6 +37,12 @@ int enableShaderProcs(void);
   #include <OpenGL/glu.h>
   #include <OpenGL/glext.h>
   int enableShaderProcs(void) { return 1; }
+  int enableBufferProcs(void) { return 1; }
+  int enableFramebufferProcs(void) { return 1; }
+  int enableTexture3DProcs(void) { return 1; }
+  int enableTimerQueryProcs(void) { return 1; }
+  int enableProgramBinaryProcs(void) { return 1; }
+  int enableSyncProcs(void) { return 0; }  // not in the legacy headers
 #elif (defined __WIN32__)
   #define GL_IMPORT_NEEDED
 #elif (defined __linux__)
@@ -22,6 +51,12 @@ int enableShaderProcs(void);
   #define GL_IMPORT_NEEDED
 #else
   int enableShaderProcs(void) { return 0; }
+  int enableBufferProcs(void) { return 0; }
+  int enableFramebufferProcs(void) { return 0; }
+  int enableTexture3DProcs(void) { return 0; }
+  int enableTimerQueryProcs(void) { return 0; }
+  int enableProgramBinaryProcs(void) { return 0; }
+  int enableSyncProcs(void) { return 0; }
 #endif
 
 
@@ -41,12 +76,18 @@ DECLARE_GL_PROC(PFNGLCOMPILESHADERPROC, glCompileShader);
 DECLARE_GL_PROC(PFNGLATTACHSHADERPROC, glAttachShader);
 DECLARE_GL_PROC(PFNGLLINKPROGRAMPROC, glLinkProgram);
 DECLARE_GL_PROC(PFNGLUSEPROGRAMPROC, glUseProgram);
+DECLARE_GL_PROC(PFNGLDELETEPROGRAMPROC, glDeleteProgram);
+DECLARE_GL_PROC(PFNGLDELETESHADERPROC, glDeleteShader);
 DECLARE_GL_PROC(PFNGLGETSHADERINFOLOGPROC, glGetShaderInfoLog);
 DECLARE_GL_PROC(PFNGLGETPROGRAMINFOLOGPROC, glGetProgramInfoLog);
+DECLARE_GL_PROC(PFNGLGETPROGRAMIVPROC, glGetProgramiv);
 DECLARE_GL_PROC(PFNGLGETUNIFORMLOCATIONPROC, glGetUniformLocation);
 DECLARE_GL_PROC(PFNGLUNIFORM1FPROC, glUniform1f);
 DECLARE_GL_PROC(PFNGLUNIFORM1IPROC, glUniform1i);
+DECLARE_GL_PROC(PFNGLUNIFORM2FPROC, glUniform2f);
 DECLARE_GL_PROC(PFNGLUNIFORM2FVPROC, glUniform2fv);
+DECLARE_GL_PROC(PFNGLUNIFORM3FVPROC, glUniform3fv);
+DECLARE_GL_PROC(PFNGLUNIFORMMATRIX4FVPROC, glUniformMatrix4fv);
 
 int enableShaderProcs(void) {
   IMPORT_GL_PROC(PFNGLCREATEPROGRAMPROC, glCreateProgram);
@@ -56,12 +97,115 @@ int enableShaderProcs(void) {
   IMPORT_GL_PROC(PFNGLATTACHSHADERPROC, glAttachShader);
   IMPORT_GL_PROC(PFNGLLINKPROGRAMPROC, glLinkProgram);
   IMPORT_GL_PROC(PFNGLUSEPROGRAMPROC, glUseProgram);
+  IMPORT_GL_PROC(PFNGLDELETEPROGRAMPROC, glDeleteProgram);
+  IMPORT_GL_PROC(PFNGLDELETESHADERPROC, glDeleteShader);
   IMPORT_GL_PROC(PFNGLGETSHADERINFOLOGPROC, glGetShaderInfoLog);
   IMPORT_GL_PROC(PFNGLGETPROGRAMINFOLOGPROC, glGetProgramInfoLog);
+  IMPORT_GL_PROC(PFNGLGETPROGRAMIVPROC, glGetProgramiv);
   IMPORT_GL_PROC(PFNGLGETUNIFORMLOCATIONPROC, glGetUniformLocation);
   IMPORT_GL_PROC(PFNGLUNIFORM1FPROC, glUniform1f);
   IMPORT_GL_PROC(PFNGLUNIFORM1IPROC, glUniform1i);
+  IMPORT_GL_PROC(PFNGLUNIFORM2FPROC, glUniform2f);
   IMPORT_GL_PROC(PFNGLUNIFORM2FVPROC, glUniform2fv);
+  IMPORT_GL_PROC(PFNGLUNIFORM3FVPROC, glUniform3fv);
+  IMPORT_GL_PROC(PFNGLUNIFORMMATRIX4FVPROC, glUniformMatrix4fv);
+  return 1;
+}
+
+DECLARE_GL_PROC(PFNGLGENBUFFERSPROC, glGenBuffers);
+DECLARE_GL_PROC(PFNGLDELETEBUFFERSPROC, glDeleteBuffers);
+DECLARE_GL_PROC(PFNGLBINDBUFFERPROC, glBindBuffer);
+DECLARE_GL_PROC(PFNGLBUFFERDATAPROC, glBufferData);
+DECLARE_GL_PROC(PFNGLMAPBUFFERPROC, glMapBuffer);
+DECLARE_GL_PROC(PFNGLUNMAPBUFFERPROC, glUnmapBuffer);
+
+int enableBufferProcs(void) {
+  IMPORT_GL_PROC(PFNGLGENBUFFERSPROC, glGenBuffers);
+  IMPORT_GL_PROC(PFNGLDELETEBUFFERSPROC, glDeleteBuffers);
+  IMPORT_GL_PROC(PFNGLBINDBUFFERPROC, glBindBuffer);
+  IMPORT_GL_PROC(PFNGLBUFFERDATAPROC, glBufferData);
+  IMPORT_GL_PROC(PFNGLMAPBUFFERPROC, glMapBuffer);
+  IMPORT_GL_PROC(PFNGLUNMAPBUFFERPROC, glUnmapBuffer);
+  return 1;
+}
+
+DECLARE_GL_PROC(PFNGLGENFRAMEBUFFERSPROC, glGenFramebuffers);
+DECLARE_GL_PROC(PFNGLDELETEFRAMEBUFFERSPROC, glDeleteFramebuffers);
+DECLARE_GL_PROC(PFNGLBINDFRAMEBUFFERPROC, glBindFramebuffer);
+DECLARE_GL_PROC(PFNGLFRAMEBUFFERTEXTURE2DPROC, glFramebufferTexture2D);
+DECLARE_GL_PROC(PFNGLCHECKFRAMEBUFFERSTATUSPROC, glCheckFramebufferStatus);
+DECLARE_GL_PROC(PFNGLDRAWBUFFERSPROC, glDrawBuffers);
+#if (defined __WIN32__)  // OpenGL 1.3 and 1.4, not in the Windows headers
+DECLARE_GL_PROC(PFNGLACTIVETEXTUREPROC, glActiveTexture);
+DECLARE_GL_PROC(PFNGLBLENDEQUATIONPROC, glBlendEquation);
+#endif
+
+int enableFramebufferProcs(void) {
+  IMPORT_GL_PROC(PFNGLGENFRAMEBUFFERSPROC, glGenFramebuffers);
+  IMPORT_GL_PROC(PFNGLDELETEFRAMEBUFFERSPROC, glDeleteFramebuffers);
+  IMPORT_GL_PROC(PFNGLBINDFRAMEBUFFERPROC, glBindFramebuffer);
+  IMPORT_GL_PROC(PFNGLFRAMEBUFFERTEXTURE2DPROC, glFramebufferTexture2D);
+  IMPORT_GL_PROC(PFNGLCHECKFRAMEBUFFERSTATUSPROC, glCheckFramebufferStatus);
+  IMPORT_GL_PROC(PFNGLDRAWBUFFERSPROC, glDrawBuffers);
+#if (defined __WIN32__)
+  IMPORT_GL_PROC(PFNGLACTIVETEXTUREPROC, glActiveTexture);
+  IMPORT_GL_PROC(PFNGLBLENDEQUATIONPROC, glBlendEquation);
+#endif
+  return 1;
+}
+
+#if (defined __WIN32__)  // OpenGL 1.2, not in the Windows headers
+DECLARE_GL_PROC(PFNGLTEXIMAGE3DPROC, glTexImage3D);
+DECLARE_GL_PROC(PFNGLTEXSUBIMAGE3DPROC, glTexSubImage3D);
+#endif
+
+int enableTexture3DProcs(void) {
+#if (defined __WIN32__)
+  IMPORT_GL_PROC(PFNGLTEXIMAGE3DPROC, glTexImage3D);
+  IMPORT_GL_PROC(PFNGLTEXSUBIMAGE3DPROC, glTexSubImage3D);
+  IMPORT_GL_PROC(PFNGLACTIVETEXTUREPROC, glActiveTexture);
+#endif
+  return 1;
+}
+
+DECLARE_GL_PROC(PFNGLGENQUERIESPROC, glGenQueries);
+DECLARE_GL_PROC(PFNGLDELETEQUERIESPROC, glDeleteQueries);
+DECLARE_GL_PROC(PFNGLBEGINQUERYPROC, glBeginQuery);
+DECLARE_GL_PROC(PFNGLENDQUERYPROC, glEndQuery);
+DECLARE_GL_PROC(PFNGLGETQUERYOBJECTIVPROC, glGetQueryObjectiv);
+DECLARE_GL_PROC(PFNGLGETQUERYOBJECTUI64VPROC, glGetQueryObjectui64v);
+DECLARE_GL_PROC(PFNGLQUERYCOUNTERPROC, glQueryCounter);
+
+int enableTimerQueryProcs(void) {
+  IMPORT_GL_PROC(PFNGLGENQUERIESPROC, glGenQueries);
+  IMPORT_GL_PROC(PFNGLDELETEQUERIESPROC, glDeleteQueries);
+  IMPORT_GL_PROC(PFNGLBEGINQUERYPROC, glBeginQuery);
+  IMPORT_GL_PROC(PFNGLENDQUERYPROC, glEndQuery);
+  IMPORT_GL_PROC(PFNGLGETQUERYOBJECTIVPROC, glGetQueryObjectiv);
+  IMPORT_GL_PROC(PFNGLGETQUERYOBJECTUI64VPROC, glGetQueryObjectui64v);
+  IMPORT_GL_PROC(PFNGLQUERYCOUNTERPROC, glQueryCounter);
+  return 1;
+}
+
+DECLARE_GL_PROC(PFNGLGETPROGRAMBINARYPROC, glGetProgramBinary);
+DECLARE_GL_PROC(PFNGLPROGRAMBINARYPROC, glProgramBinary);
+DECLARE_GL_PROC(PFNGLPROGRAMPARAMETERIPROC, glProgramParameteri);
+
+int enableProgramBinaryProcs(void) {
+  IMPORT_GL_PROC(PFNGLGETPROGRAMBINARYPROC, glGetProgramBinary);
+  IMPORT_GL_PROC(PFNGLPROGRAMBINARYPROC, glProgramBinary);
+  IMPORT_GL_PROC(PFNGLPROGRAMPARAMETERIPROC, glProgramParameteri);
+  return 1;
+}
+
+DECLARE_GL_PROC(PFNGLFENCESYNCPROC, glFenceSync);
+DECLARE_GL_PROC(PFNGLCLIENTWAITSYNCPROC, glClientWaitSync);
+DECLARE_GL_PROC(PFNGLDELETESYNCPROC, glDeleteSync);
+
+int enableSyncProcs(void) {
+  IMPORT_GL_PROC(PFNGLFENCESYNCPROC, glFenceSync);
+  IMPORT_GL_PROC(PFNGLCLIENTWAITSYNCPROC, glClientWaitSync);
+  IMPORT_GL_PROC(PFNGLDELETESYNCPROC, glDeleteSync);
   return 1;
 }
 
@@ -71,4 +215,94 @@ int enableShaderProcs(void) {
 
 #endif
 
+
+#ifndef GL_COMPLETION_STATUS_ARB
+#define GL_COMPLETION_STATUS_ARB 0x91B1
+#endif
+
+// Whether the driver compiles and links in the background
+// (ARB/KHR_parallel_shader_compile). Then GL_COMPLETION_STATUS_ARB of a
+// program tells whether finishProgram() would wait.
+int hasParallelShaderCompile(void) {
+  char const* extensions = (char const*)glGetString(GL_EXTENSIONS);
+  return extensions && (strstr(extensions, "GL_ARB_parallel_shader_compile") ||
+                        strstr(extensions, "GL_KHR_parallel_shader_compile"));
+}
+
+// Start compiling and linking a program from vertex and fragment shader
+// source. With ARB_parallel_shader_compile, the driver may do it in the
+// background until finishProgram() or GL_COMPLETION_STATUS_ARB is queried.
+// |shaders| gets the shader objects, which are deleted with the program.
+// If |retrievable|, the linked binary is to be read back (needs
+// enableProgramBinaryProcs()).
+GLuint startProgram(char const* vs, char const* fs, GLuint shaders[2], int retrievable) {
+  GLuint p = glCreateProgram();
+
+  shaders[0] = glCreateShader(GL_VERTEX_SHADER);
+  glShaderSource(shaders[0], 1, &vs, 0);
+  glCompileShader(shaders[0]);
+
+  shaders[1] = glCreateShader(GL_FRAGMENT_SHADER);
+  glShaderSource(shaders[1], 1, &fs, 0);
+  glCompileShader(shaders[1]);
+
+  glAttachShader(p, shaders[0]);
+  glAttachShader(p, shaders[1]);
+  glDeleteShader(shaders[0]);
+  glDeleteShader(shaders[1]);
+  if (retrievable) glProgramParameteri(p, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+  glLinkProgram(p);
+  return p;
+}
+
+// Wait for a program started by startProgram() to be linked.
+// Logs go to stderr. Return 0 on error, after deleting the program.
+GLuint finishProgram(GLuint p, GLuint const shaders[2]) {
+  GLint linked = 0;
+  char log[2048]; int logLength;
+
+  glGetShaderInfoLog(shaders[0], sizeof(log), &logLength, log);
+  if (logLength) fprintf(stderr, "[Vertex:]\n%s\n", log);
+
+  glGetShaderInfoLog(shaders[1], sizeof(log), &logLength, log);
+  if (logLength) fprintf(stderr, "[Fragment:]\n%s\n", log);
+
+  glGetProgramInfoLog(p, sizeof(log), &logLength, log);
+  if (logLength) fprintf(stderr, "[Program:]\n%s\n", log);
+
+  glGetProgramiv(p, GL_LINK_STATUS, &linked);
+  if (linked) return p;
+  glDeleteProgram(p);
+  return 0;
+}
+
+// Compile and link a program from vertex and fragment shader source.
+// Logs go to stderr. Return 0 on error.
+GLuint compileProgram(char const* vs, char const* fs) {
+  GLuint shaders[2];
+  GLuint p = startProgram(vs, fs, shaders, 0);
+  return finishProgram(p, shaders);
+}
+
+// Return a copy of shader |source| with |defines| (lines of #define) at the
+// top, after the #version line if it starts with one (it must come first).
+// Free the result. Return 0 if out of memory.
+char* addShaderDefines(char const* defines, char const* source) {
+  char const* start = source + strspn(source, " \t\r\n");
+  size_t head = 0;
+  char* s;
+
+  if (!strncmp(start, "#version", 8)) {
+    char const* end = strchr(start, '\n');
+    head = end ? end+1 - source : strlen(source);
+  }
+  if (!(s = malloc(strlen(source) + strlen(defines) + 2))) return 0;
+  memcpy(s, source, head);
+  s[head] = 0;
+  if (head && s[head-1] != '\n') strcat(s, "\n");
+  strcat(s, defines);
+  strcat(s, source + head);
+  return s;
+}
+
 #endif  // SHADER_PROCS_H
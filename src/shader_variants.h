@@ -0,0 +1,219 @@
+#ifndef SHADER_VARIANTS_H
+#define SHADER_VARIANTS_H
+
+// Specialized variants of the fragment shader.
+//
+// A variant is the shader compiled with SPECIALIZED and the iteration counts,
+// the number of raymarching steps and par[0] #defined, along with constants
+// derived from them. The compiler can unroll its loops and fold the
+// constants, so it's faster than the generic shader, which reads them from
+// uniforms. The generic shader is used while a variant is being compiled.
+//
+// Variants are compiled one at a time, once the parameters have been stable
+// for a moment (so dragging a parameter doesn't compile one per frame). With
+// ARB_parallel_shader_compile, the driver compiles them on its own threads and
+// the rendering doesn't stop. Without it, a compile would stop the rendering,
+// so variants are only loaded from the program cache, unless compiling them
+// anyway was asked for. The most recently used ones are kept, and linked
+// variants go to the program cache.
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <SDL/SDL.h>
+#include "shader_procs.h"
+#include "program_cache.h"
+#include "uniforms.h"
+
+#define SHADER_VARIANTS 8         // programs kept, the least recently used is replaced
+#define SHADER_VARIANT_DELAY 300  // milliseconds the parameters must be stable
+
+typedef struct ShaderVariantKey {
+  int iters, colorIters, maxSteps;
+  float par0[2];  // minRad2, scale
+} ShaderVariantKey;
+
+typedef struct ShaderVariant {
+  ShaderVariantKey key;
+  GLuint program;      // 0: free
+  GLuint shaders[2];   // 0s if it was loaded from the program cache
+  int ready;           // linked, not compiling any more
+  unsigned lastUsed;
+  UniformCache uniforms;
+} ShaderVariant;
+
+typedef struct ShaderVariants {
+  int enabled;         // the shader has a SPECIALIZED variant
+  int parallel;        // the driver compiles in the background
+  int blocking;        // compile variants even if not in the background
+  char* vs;
+  char* fs;
+  char const* const* uniformNames;
+  int uniformCount;
+  ProgramCache* cache;
+  ShaderVariant variants[SHADER_VARIANTS];
+  ShaderVariant* compiling;
+  char* compilingFs;   // its fragment shader source
+  unsigned clock;      // counts uses, for lastUsed
+  ShaderVariantKey wanted;
+  Uint32 wantedSince;  // when the parameters have changed to |wanted|
+  int wantedMissing;   // |wanted| isn't in the program cache, and won't be compiled
+  int compiled;        // statistics
+} ShaderVariants;
+
+// Prepare variants of a program. The sources are copied; variants have the
+// uniforms |names|, as the generic program. If |blocking|, variants are
+// compiled even when the driver can't do it in the background. Needs an
+// OpenGL context.
+void initShaderVariants(ShaderVariants* v, char const* vs, char const* fs,
+                        char const* const* names, int count, ProgramCache* cache, int blocking) {
+  memset(v, 0, sizeof(ShaderVariants));
+  v->enabled = strstr(fs, "SPECIALIZED") != 0;
+  v->parallel = hasParallelShaderCompile();
+  v->blocking = blocking;
+  v->vs = strdup(vs);
+  v->fs = strdup(fs);
+  v->uniformNames = names;
+  v->uniformCount = count;
+  v->cache = cache;
+}
+
+static void releaseShaderVariant(ShaderVariant* s) {
+  if (s->program) glDeleteProgram(s->program);
+  releaseUniformCache(&s->uniforms);
+  memset(s, 0, sizeof(ShaderVariant));
+}
+
+void releaseShaderVariants(ShaderVariants* v) {
+  int i;
+  for (i=0; i<SHADER_VARIANTS; i++) releaseShaderVariant(&v->variants[i]);
+  free(v->vs);
+  free(v->fs);
+  free(v->compilingFs);
+  memset(v, 0, sizeof(ShaderVariants));
+}
+
+// The fragment shader with the values of |key| #defined, 0 if out of memory.
+static char* getShaderVariantSource(ShaderVariants const* v, ShaderVariantKey const* key) {
+  float minRad2 = key->par0[0] < 1e-9f ? 1e-9f : key->par0[0] > 1 ? 1 : key->par0[0];
+  float scale = key->par0[1];
+  char defines[512];
+
+  // Exponent notation: GLSL 1.10 has no implicit int to float conversion.
+  sprintf(defines,
+    "#define SPECIALIZED\n"
+    "#define ITERS %d\n"
+    "#define COLOR_ITERS %d\n"
+    "#define MAX_STEPS %d\n"
+    "#define MIN_RAD2 %.9e\n"
+    "#define SCALE_VEC vec4(%.9e,%.9e,%.9e,%.9e)\n"
+    "#define ABS_SCALE_M1 %.9e\n"
+    "#define ABS_SCALE_RAISED_TO_1M_ITERS %.9e\n",
+    key->iters, key->colorIters, key->maxSteps, minRad2,
+    scale / minRad2, scale / minRad2, scale / minRad2, fabsf(scale) / minRad2,
+    fabsf(scale - 1), pow(fabsf(scale), 1 - key->iters));
+  return addShaderDefines(defines, v->fs);
+}
+
+// Load the variant for |key| from the program cache, or start compiling it.
+// With |cachedOnly|, only load it. Return 0 if it's neither loaded nor
+// compiling.
+static int startShaderVariant(ShaderVariants* v, ShaderVariant* s, ShaderVariantKey const* key,
+                              int cachedOnly) {
+  char* fs = getShaderVariantSource(v, key);
+  GLuint p;
+
+  if (!fs) return 0;
+  if (cachedOnly) {
+    if (!(p = loadCachedProgram(v->cache, v->vs, fs))) { free(fs); return 0; }
+    releaseShaderVariant(s);
+    s->program = p;
+  }
+  else {
+    releaseShaderVariant(s);
+    s->program = startCachedProgram(v->cache, v->vs, fs, s->shaders);
+  }
+  s->key = *key;
+  v->compiling = s;
+  v->compilingFs = fs;
+  return 1;
+}
+
+// Wait for the variant being compiled. If it failed, stop making variants.
+static void finishShaderVariant(ShaderVariants* v) {
+  ShaderVariant* s = v->compiling;
+
+  v->compiling = 0;
+  if ((s->program = finishCachedProgram(v->cache, s->program, s->shaders, v->vs, v->compilingFs))) {
+    initUniformCache(&s->uniforms, s->program, v->uniformNames, v->uniformCount);
+    s->ready = 1;
+    if (s->shaders[0]) v->compiled++;
+  }
+  else {
+    fprintf(stderr, "Specialized shader variant failed, using the generic shader.\n");
+    v->enabled = 0;
+  }
+  free(v->compilingFs);
+  v->compilingFs = 0;
+}
+
+// Whether |s| is one of the variants of |v|.
+int hasShaderVariant(ShaderVariants const* v, ShaderVariant const* s) {
+  return s >= v->variants && s < v->variants + SHADER_VARIANTS;
+}
+
+// Get the variant for |key|, or 0 if it isn't ready: then it's compiled,
+// unless another one is. If |wait|, compile it now.
+ShaderVariant* getShaderVariant(ShaderVariants* v, ShaderVariantKey const* key, int wait) {
+  ShaderVariant* s;
+  GLint done = 1;
+  int i;
+
+  if (!v->enabled) return 0;
+
+  // Compiling in the background: look whether it's done.
+  if (v->compiling) {
+    if (v->parallel && !wait && v->compiling->shaders[0]) {
+      glGetProgramiv(v->compiling->program, GL_COMPLETION_STATUS_ARB, &done);
+    }
+    if (done) finishShaderVariant(v);
+    if (!v->enabled) return 0;
+  }
+
+  for (i=0; i<SHADER_VARIANTS; i++) {
+    s = &v->variants[i];
+    if (s->ready && !memcmp(&s->key, key, sizeof(ShaderVariantKey))) {
+      s->lastUsed = ++v->clock;
+      return s;
+    }
+  }
+  if (v->compiling) return 0;
+
+  // Start compiling when the parameters have been stable for a moment.
+  if (!wait) {
+    Uint32 now = SDL_GetTicks();
+    if (memcmp(&v->wanted, key, sizeof(ShaderVariantKey))) {
+      v->wanted = *key;
+      v->wantedSince = now;
+      v->wantedMissing = 0;
+    }
+    if (now - v->wantedSince < SHADER_VARIANT_DELAY || v->wantedMissing) return 0;
+  }
+
+  // Replace the least recently used variant.
+  s = &v->variants[0];
+  for (i=1; i<SHADER_VARIANTS; i++) {
+    if (v->variants[i].lastUsed < s->lastUsed) s = &v->variants[i];
+  }
+  if (!startShaderVariant(v, s, key, !wait && !v->parallel && !v->blocking)) {
+    v->wantedMissing = 1;
+    return 0;
+  }
+  if (wait || !v->parallel || !s->shaders[0]) finishShaderVariant(v);
+  if (!s->ready) return 0;
+  s->lastUsed = ++v->clock;
+  return s;
+}
+
+#endif  // SHADER_VARIANTS_H
@@ -28,6 +28,11 @@ and the number of steps).
 
 // Camera position and direction.
 varying vec3 eye, dir;
+varying vec2 screen;  // Position on the screen (in the view), -1..1.
+varying float view;   // Number of the view, of |views| side by side.
+uniform int views;
+uniform float eye_separation;  // between the eyes of neighbouring views
+uniform float fov_x;
 
 // Interactive parameters.
 uniform vec2 par[10];
@@ -39,9 +44,66 @@ uniform float
   glow_strength,      // How much glow is applied after max_steps.
   dist_to_color;      // How is background mixed with the surface color after max_steps.
 
+#ifdef SPECIALIZED
+// A variant compiled for the current iteration counts and par[0]: loops can
+// be unrolled and constants folded. The values are #defined by the program.
+const int iters = ITERS, color_iters = COLOR_ITERS, max_steps = MAX_STEPS;
+#else
 uniform int iters,    // Number of fractal iterations.
   color_iters,        // Number of fractal iterations for coloring.
   max_steps;          // Maximum raymarching steps.
+#endif
+
+uniform int ao_samples;  // Ambient occlusion samples, up to 5.
+
+uniform int heatmap;  // Show the raymarching steps per pixel instead of the image.
+
+// Cone marching prepass: distance and steps where the rays of a screen cell
+// can start marching.
+uniform sampler2D cone;
+uniform vec2 cone_scale;  // Screen position to cone texture coordinates.
+uniform float cone_size,  // Cell size in pixels, 0 if there is no prepass.
+  cone_margin,            // Half the cell size (a bit more) in derivatives of dir.
+  eye_margin;             // Distance of the farthest eye from the camera (multi-view).
+
+// Distance cache: lower bounds of the distance to the surface in a cube of
+// space around the camera, 0 where unknown. The texture repeats every
+// cache_size world units.
+uniform sampler3D cache;
+uniform vec3 cache_min;    // Corner of the cube.
+uniform float cache_size,  // Size of the cube, 0 if there is no cache.
+  cache_voxel;             // Size of a voxel.
+
+// Deferred rendering (the GBUFFER_* passes): the G-buffer has the distance
+// along the ray, the steps for the glow, the last distance estimate and the
+// steps marched in this frame of each pixel, the AO texture the ambient
+// occlusion and the distance, at a lower resolution.
+uniform sampler2D gbuffer, gnormals, gao;
+uniform vec2 gbuffer_texel,  // Size of a pixel in texture coordinates.
+  gao_texel;                 // Size of an AO texel.
+uniform float gao_scale;     // AO texel i is at G-buffer pixel i*gao_scale.
+
+// Temporal reprojection: 1/(1 + distance along the ray) of the surface seen
+// in the last frame and the steps to get to it for the glow, 0 where none was
+// seen. With several views, the main pass compiled with VIEW_STARTS gets the
+// surface seen by the first view instead, the views side by side, the
+// G-buffer has the rays of the first view, and gbuffer_texel is the size of a
+// starts pixel (see views.h).
+uniform sampler2D starts;
+uniform float start_backoff;  // Rays start this fraction closer, 0 if there is no reprojection.
+uniform float temporal_phase;  // Pixels of this phase (0-7) are marched in full.
+
+#ifdef DEEP_ZOOM
+// Deep zoom, for min_dist too small for floats (see deep_zoom.h): positions
+// are relative to the camera, and the fractal is iterated as the difference
+// to the orbit of the camera position, which was computed in double
+// precision. Standard Mandelbox only.
+uniform sampler2D orbit;
+uniform vec2 orbit_texel;  // Size of a texel in texture coordinates.
+uniform vec3 deep_eye;     // Camera position, only precise enough for lighting.
+varying vec3 eye_offset;
+#define eye eye_offset
+#endif
 
 // Colors. Can be negative or >1 for interesting effects.
 vec3 backgroundColor = vec3(0.07, 0.06, 0.16),
@@ -53,10 +115,19 @@ vec3 backgroundColor = vec3(0.07, 0.06, 0.16),
   aoColor = vec3(0, 0, 0);
 
 // precomputed constants
+#ifdef SPECIALIZED
+const float minRad2 = MIN_RAD2;
+const vec4 scale = SCALE_VEC;
+const float absScalem1 = ABS_SCALE_M1;
+const float AbsScaleRaisedTo1mIters = ABS_SCALE_RAISED_TO_1M_ITERS;
+#else
 float minRad2 = clamp(MINRAD2, 1.0e-9, 1.0);
 vec4 scale = vec4(SCALE, SCALE, SCALE, abs(SCALE)) / minRad2;
 float absScalem1 = abs(SCALE - 1.0);
 float AbsScaleRaisedTo1mIters = pow(abs(SCALE), float(1-iters));
+#endif
+
+#ifndef DEEP_ZOOM
 
 // Compute the distance from |pos| to the Mandelbox.
 float d(vec3 pos) {
@@ -101,9 +172,75 @@ vec3 color(vec3 pos) {
 
 float normal_eps = 0.00001;
 
+#else
+
+// Texel |i| of |row| of the orbit texture.
+vec4 orbit_at(int i, float row) {
+  return texture2D(orbit, (vec2(float(i), row) + 0.5) * orbit_texel);
+}
+
+// max(a+d, 0) - max(a, 0): how a difference |d| to the reference changes in
+// a fold piece that starts -|a| from the reference.
+float ramp(float a, float d) {
+  return a >= 0.0 ? max(d, -a) : max(a+d, 0.0);
+}
+vec3 ramp(vec3 a, vec3 d) {
+  return mix(max(a+d, 0.0), max(d, -a), step(0.0, a));
+}
+
+// Iteration |i| of the difference |dz| to the reference orbit, for the point
+// |pos| from the camera. |r2| gets the squared length after the box fold.
+vec4 iterate(int i, vec4 dz, vec3 pos, out float r2) {
+  // box folding: the pieces are p < -1, -1..1 and p > 1
+  dz.xyz = 2.0*(ramp(orbit_at(i, 1.0).xyz, dz.xyz) - ramp(orbit_at(i, 2.0).xyz, dz.xyz)) - dz.xyz;
+
+  // sphere folding: p /= clamp(r2, minRad2, 1) (times minRad2)
+  vec4 Z = orbit_at(i, 3.0), R = orbit_at(i, 4.0);
+  float D2 = dot(2.0*Z.xyz + dz.xyz, dz.xyz), dS = ramp(R.x, D2) - ramp(R.y, D2);
+  r2 = R.w + D2;
+  dz = minRad2 * (dz - dS/R.z * Z) / (R.z + dS);
+
+  // scale, translate
+  return dz*scale + vec4(pos, 0);
+}
+
+// Compute the distance from the camera + |pos| to the Mandelbox: the distance
+// estimate of the reference plus the change made by the difference.
+float d(vec3 pos) {
+  vec4 dz = vec4(pos, 0);
+  float r2;
+
+  for (int i=0; i<iters; i++) dz = iterate(i, dz, pos, r2);
+
+  vec4 Z = orbit_at(iters, 0.0), F = orbit_at(0, 5.0);
+  float D2 = dot(2.0*Z.xyz + dz.xyz, dz.xyz), dlen = D2 / (sqrt(F.z*F.z + D2) + F.z);
+  return (F.x - F.y*dz.w / (F.w*(F.w + dz.w)) + dlen / (F.w + dz.w)) * DIST_MULTIPLIER;
+}
+
+// Compute the color at the camera + |pos|.
+vec3 color(vec3 pos) {
+  vec4 dz = vec4(pos, 0);
+  float trap = 1.0, r2;
+
+  for (int i=0; i<color_iters; i++) {
+    dz = iterate(i, dz, pos, r2);
+    trap = min(trap, r2);
+  }
+  vec3 p = orbit_at(color_iters, 0.0).xyz + dz.xyz;
+  vec2 c = clamp(vec2( 0.33*log(dot(p,p))-1.0, sqrt(trap) ), 0.0, 1.0);
+
+  return mix(mix(surfaceColor1, surfaceColor2, c.y), surfaceColor3, c.x);
+}
+
+#endif
+
 // Compute the normal at |pos|.
 // |d_pos| is the previously computed distance at |pos| (for forward differences).
 vec3 normal(vec3 pos, float d_pos) {
+#ifdef DEEP_ZOOM
+  // The differences to the camera lose precision with the distance.
+  float normal_eps = max(10.0*min_dist, 1.0e-4*length(pos));
+#endif
   vec4 Eps = vec4(0, normal_eps, 2.0*normal_eps, 3.0*normal_eps);
   return normalize(vec3(
   // 2-tap forward differences, error = O(eps)
@@ -141,29 +278,106 @@ vec3 blinn_phong(vec3 normal, vec3 view, vec3 light, vec3 diffuseColor) {
 
 // Ambient occlusion approximation.
 float ambient_occlusion(vec3 p, vec3 n) {
-  float ao = 1.0, w = ao_strength/ao_eps;
-  float dist = 2.0 * ao_eps;
+#ifdef DEEP_ZOOM
+  float eps = max(ao_eps, 1.0e-4*length(p));  // see normal()
+#else
+  float eps = ao_eps;
+#endif
+  float ao = 1.0, w = ao_strength/eps;
+  float dist = 2.0 * eps;
 
   for (int i=0; i<5; i++) {
+    if (i >= ao_samples) break;
     float D = d(p + n*dist);
     ao -= (dist-D) * w;
     w *= 0.5;
-    dist = dist*2.0 - ao_eps;  // 2,3,5,9,17
+    dist = dist*2.0 - eps;  // 2,3,5,9,17
   }
   return clamp(ao, 0.0, 1.0);
 }
 
 
-void main() {
-  vec3 p = eye, dp = normalize(dir);
+// Return a lower bound of the distance from p to the surface, or 0.
+float cached_d(vec3 p) {
+  vec3 q = p - cache_min;
+  if (cache_size == 0.0 || any(lessThan(q, vec3(0))) || any(greaterThanEqual(q, vec3(cache_size)))) return 0.0;
+  return texture3D(cache, p / cache_size).x;
+}
+
 
-  float totalD = 0.0, D = 3.4e38, extraD = 0.0, lastD;
+#ifdef CONE_PREPASS
 
-  // Intersect the view ray with the Mandelbox using raymarching.
+// Cone marching: march along the ray through the center of a cell while the
+// cone around all rays of the cell is empty. The distance at which the cone
+// touches the surface is a safe start for all rays of the cell. With several
+// views, the cone is widened by eye_margin, so it holds the rays of the cell
+// in all views. A ray of the cell moved by D - r from within r of the center
+// stays in the empty sphere of radius D around it; the steps keep a further
+// min_dist from the surface, where the main pass would stop, so no ray is
+// started past the point where it would have hit. When the whole cone has
+// left the fractal, all rays of the cell are background in every view.
+void main() {
+  vec3 dp = normalize(dir);
+
+  // Distance between the center ray and the corner rays at distance 1.
+  vec3 dx = dFdx(dir) * cone_margin, dy = dFdy(dir) * cone_margin;
+  float spread = max(
+    max(length(normalize(dir+dx+dy) - dp), length(normalize(dir+dx-dy) - dp)),
+    max(length(normalize(dir-dx+dy) - dp), length(normalize(dir-dx-dy) - dp)));
+
+  float totalD = 0.0, D, r;
   int steps;
   for (steps=0; steps<max_steps; steps++) {
+    D = d(eye + totalD * dp);
+    r = totalD * spread + eye_margin;
+
+    // Stop when the surface is close to the cone or far enough to give up.
+    if (D < 2.0*r + min_dist || D > MAX_DIST) break;
+
+    totalD += D - r - min_dist;
+  }
+
+  gl_FragColor = vec4(totalD, float(steps), D - r > MAX_DIST ? 1.0 : 0.0, 1);
+}
+
+#else
+
+// Where the cone marching prepass has stopped: distance, steps and 1 if the
+// pixel is background.
+vec3 cone_start() {
+  return cone_size > 0.0 ? texture2D(cone, (screen*0.5 + 0.5) * cone_scale).xyz : vec3(0);
+}
+
+#if defined GBUFFER_MARCH
+// march() counts the steps it takes to get to march_mark along the ray.
+float march_mark = 0.0;
+int mark_steps = 0;
+#endif
+
+// Intersect the view ray with the Mandelbox using raymarching, from |start|
+// (distance and steps). Return the distance along the ray; |D| gets the last
+// distance estimate.
+float march(vec3 dp, vec2 start, out float D, out int steps) {
+  float totalD = start.x, extraD = 0.0, lastD;
+  D = 3.4e38;
+
+  for (steps=int(start.y); steps<max_steps; steps++) {
     lastD = D;
-    D = d(p + totalD * dp);
+#if defined GBUFFER_MARCH
+    if (totalD < march_mark) mark_steps = steps + 1;
+#endif
+
+    // Skip empty space known from the distance cache.
+    float C = cached_d(eye + totalD * dp);
+    if (C > cache_voxel) {
+      D = C;
+      if (D > MAX_DIST) break;
+      totalD += D;
+      extraD = 0.0;
+      continue;
+    }
+
+    D = d(eye + totalD * dp);
 
     // Overstepping: have we jumped too far? Cancel last step.
     if (extraD > 0.0 && D < extraD) {
@@ -181,28 +395,230 @@ void main() {
     // Overstepping is based on the optimal length of the last step.
     totalD += extraD = 0.096 * D*(D+extraD)/lastD;
   }
+  return totalD;
+}
+
+// Color the surface at |p| with Blinn-Phong shading and ambient occlusion.
+vec3 surface(vec3 p, vec3 dp, vec3 n, float D, float ao) {
+  vec3 col = color(p);
+#ifdef DEEP_ZOOM
+  col = blinn_phong(n, -dp, normalize(deep_eye+vec3(0,1,0)+dp), col);
+#else
+  col = blinn_phong(n, -dp, normalize(eye+vec3(0,1,0)+dp), col);
+#endif
+  col = mix(aoColor, col, ao);
+
+  // We've gone through all steps, but we haven't hit anything.
+  // Mix in the background color.
+  if (D > min_dist) {
+    col = mix(col, backgroundColor, clamp(log(D/min_dist) * dist_to_color, 0.0, 1.0));
+  }
+  return col;
+}
+
+// Glow is based on the number of steps.
+vec3 glow(vec3 col, float steps) {
+  return mix(col, glowColor, steps/float(max_steps) * glow_strength);
+}
+
+// Step count heatmap: black, red, yellow, white at max_steps.
+vec3 heat(float steps) {
+  float t = 3.0 * steps/float(max_steps);
+  return clamp(vec3(t, t-1.0, t-2.0), 0.0, 1.0);
+}
+
+// Several views: whether the first view has seen the space along the ray
+// from |start| on. Near the eye, the ray is outside its field of vision, and
+// rays toward the side it doesn't see leave it for good.
+bool first_view_sees(float start) {
+  float offset = view * eye_separation;  // of the eye from the first one, along x
+  float edge = tan(radians(fov_x/2.0)) - sign(offset) * dot(dir, vec3(gl_ModelViewMatrix[0]));
+  return edge > 0.0 && start * edge >= abs(offset) * length(dir);
+}
+
+// Reprojection: where the ray can start (the nearest surface in the starts
+// texture around |uv|, backed off) and the steps it took to get there, for
+// the glow. 0 if none was seen (newly visible surface).
+vec2 reprojected_start(vec2 uv) {
+  vec4 s = vec4(0);
+  for (int y=-1; y<=1; y++) {
+    for (int x=-1; x<=1; x++) {
+      vec4 n = texture2D(starts, uv + vec2(float(x), float(y)) * gbuffer_texel);
+      if (n.x > s.x) s = n;
+    }
+  }
+  return s.x > 0.0 ? vec2((1.0/s.x - 1.0) * (1.0 - start_backoff), s.y) : vec2(0);
+}
+
+#if defined GBUFFER_MARCH
+
+void main() {
+  vec3 dp = normalize(dir);
+  vec2 start = cone_start().xy;
+  float approach = start.y;  // steps before the ones marched here, for the glow
+
+  // Start from the last frame, unless that's inside the fractal. The glow
+  // adds the steps it took to get there. One pixel in 8 is marched in full
+  // every frame, in turns, to find surfaces that came in front of the start;
+  // it counts the steps to the start again.
+  if (start_backoff > 0.0) {
+    vec2 r = reprojected_start(screen*0.5 + 0.5);
+    if (r.x > start.x && d(eye + r.x * dp) > 0.0) {
+      if (mod(floor(gl_FragCoord.x) + 3.0*floor(gl_FragCoord.y), 8.0) == temporal_phase) {
+        march_mark = r.x;
+      }
+      else {
+        start = vec2(r.x, 0);
+        approach = r.y;
+      }
+    }
+  }
+
+  float D;
+  int steps;
+  float totalD = march(dp, start, D, steps);
+  float marched = float(steps) - start.y;
+  if (march_mark > 0.0) {
+    approach = float(mark_steps);
+    marched = float(steps - mark_steps);
+  }
+  gl_FragColor = vec4(totalD, approach + marched, D, marched);
+}
+
+#elif defined VIEW_PREPASS
+
+// Multi-view: march the rays of the first view. The main pass shades it from
+// here, and the other views start from where it has stopped.
+void main() {
+  vec3 dp = normalize(dir);
+  vec3 cone = cone_start();
+  float D = 3.4e38;
+  int steps = int(cone.y);
+  float totalD = cone.x;
+
+  if (cone.z == 0.0) totalD = march(dp, cone.xy, D, steps);
+  gl_FragColor = vec4(totalD, float(steps), D, 0);
+}
+
+#elif defined GBUFFER_NORMALS
+
+void main() {
+  vec3 dp = normalize(dir);
+  vec4 g = texture2D(gbuffer, screen*0.5 + 0.5);
+  gl_FragColor = vec4(0);
+  if (g.z < MAX_DIST) gl_FragColor = vec4(normal(eye + g.x*dp, g.z), 1);
+}
+
+#elif defined GBUFFER_AO
+
+// Ambient occlusion of the G-buffer pixel at the AO texel (the tile uniforms
+// put it there), and its distance for the upsampling.
+void main() {
+  vec2 uv = screen*0.5 + 0.5;
+  vec4 g = texture2D(gbuffer, uv);
+  gl_FragColor = vec4(1, g.x, 0, 1);
+  if (g.z < MAX_DIST) {
+    vec3 n = texture2D(gnormals, uv).xyz;
+    gl_FragColor.x = ambient_occlusion(eye + g.x*normalize(dir), n);
+  }
+}
+
+#elif defined GBUFFER_SHADE
+
+// Depth-aware upsampling of the ambient occlusion: the four nearest AO texels
+// are interpolated, but those at another distance (across an edge) get
+// little weight.
+float upsampled_ao(vec2 uv, float depth) {
+  vec2 t = (uv / gbuffer_texel - 0.5) / gao_scale, f = fract(t);
+  vec2 base = (floor(t) + 0.5) * gao_texel;
+  vec4 a00 = texture2D(gao, base),
+    a10 = texture2D(gao, base + vec2(gao_texel.x, 0)),
+    a01 = texture2D(gao, base + vec2(0, gao_texel.y)),
+    a11 = texture2D(gao, base + gao_texel);
+  vec4 w = vec4((1.0-f.x)*(1.0-f.y), f.x*(1.0-f.y), (1.0-f.x)*f.y, f.x*f.y) /
+    (abs(vec4(a00.y, a10.y, a01.y, a11.y) - depth) / depth + 0.002);
+  return dot(w, vec4(a00.x, a10.x, a01.x, a11.x)) / dot(w, vec4(1));
+}
+
+void main() {
+  vec2 uv = screen*0.5 + 0.5;
+  vec4 g = texture2D(gbuffer, uv);
+  vec3 col = backgroundColor;
+
+  // Only pixels with a surface are shaded; the background just gets glow.
+  if (g.z < MAX_DIST) {
+    vec3 dp = normalize(dir);
+    col = surface(eye + g.x*dp, dp, texture2D(gnormals, uv).xyz, g.z, upsampled_ao(uv, g.x));
+  }
+  gl_FragColor = vec4(glow(col, g.y), 1);
+  if (heatmap != 0) gl_FragColor = vec4(heat(g.w), 1);
+}
 
-  p += totalD * dp;
+#else
+
+void main() {
+  vec3 dp = normalize(dir);
+  vec3 cone = cone_start();
+  vec2 start = cone.xy;
+  float D = 3.4e38;
+  int steps = int(start.y);
+  float totalD = start.x;
+
+#if defined VIEW_STARTS
+  // Several views: the first one has been marched by the view prepass. The
+  // others start from the surface it has seen, unless that's inside the
+  // fractal or the first view hasn't seen the way there from the cone start,
+  // and the glow adds the steps it took to get there.
+  if (view < 0.5) {
+    vec4 g = texture2D(gbuffer, screen*0.5 + 0.5);
+    totalD = g.x;
+    steps = int(g.y);
+    D = g.z;
+  }
+  else if (cone.z == 0.0) {
+    if (first_view_sees(start.x)) {
+      vec2 r = reprojected_start(vec2((screen.x*0.5 + 0.5 + view) / float(views), screen.y*0.5 + 0.5));
+      if (r.x > start.x && d(eye + r.x * dp) > 0.0) start = r;
+    }
+    totalD = march(dp, start, D, steps);
+  }
+#else
+  // Background pixels stop where the prepass has; march() would too.
+  if (cone.z == 0.0) totalD = march(dp, start, D, steps);
+#endif
+  vec3 p = eye + totalD * dp;
 
   // Color the surface with Blinn-Phong shading, ambient occlusion and glow.
   vec3 col = backgroundColor;
+  vec3 n = vec3(0);
+  float ao = 1.0;
 
   // We've got a hit or we're not sure.
   if (D < MAX_DIST) {
-    vec3 n = normal(p, D);
-    col = color(p);
-    col = blinn_phong(n, -dp, normalize(eye+vec3(0,1,0)+dp), col);
-    col = mix(aoColor, col, ambient_occlusion(p, n));
-
-    // We've gone through all steps, but we haven't hit anything.
-    // Mix in the background color.
-    if (D > min_dist) {
-      col = mix(col, backgroundColor, clamp(log(D/min_dist) * dist_to_color, 0.0, 1.0));
-    }
+    n = normal(p, D);
+    ao = ambient_occlusion(p, n);
+    col = surface(p, dp, n, D, ao);
   }
 
-  // Glow is based on the number of steps.
-  col = mix(col, glowColor, float(steps)/float(max_steps) * glow_strength);
+  vec4 color = vec4(glow(col, float(steps)), 1);
+  if (heatmap != 0) color = vec4(heat(float(steps) - start.y), 1);
+
+#ifdef AUX_BUFFERS
+  // Exports read back the depth (along the camera axis, -1 for the
+  // background), the steps, the ambient occlusion and the normal too.
+  float depth = D < MAX_DIST ? totalD * dot(dp, vec3(gl_ModelViewMatrix[2])) : -1.0;
+  gl_FragData[0] = vec4(depth, float(steps), ao, 0);
+  gl_FragData[1] = vec4(n, 0);
+  gl_FragData[2] = color;
+#else
+  gl_FragColor = color;
+
+#ifdef STEP_COUNT
+  // Benchmarks read back the number of steps (high byte, low byte) instead.
+  gl_FragColor = vec4(floor(float(steps)/256.0)/255.0, mod(float(steps), 256.0)/255.0, 0, 1);
+#endif
+#endif
+}
 
-  gl_FragColor = vec4(col, 1);
-}
+#endif
+#endif
@@ -9,16 +9,37 @@ to the fragment shader.
 */
 
 varying vec3 eye, dir;
+varying vec3 eye_offset;  // Eye position relative to the camera.
+varying vec2 screen;  // Position on the screen (in the view), -1..1.
+varying float view;   // Number of the view.
 
 uniform float fov_x, fov_y;  // Field of vision.
 
+// Part of the screen covered by the rectangle: (-1,-1)..(1,1) is mapped to
+// tile_offset +- tile_scale. Used to render posters in tiles.
+uniform vec2 tile_scale, tile_offset;
+
+// Multi-view (stereo): the screen is split into |views| columns, drawn as a
+// quad each with the view number in z. Every view shows the whole field of
+// vision, from eyes eye_separation apart along the x axis of the camera and
+// centered on it.
+uniform int views;
+uniform float eye_separation;
+
 float fov2scale(float fov) { return tan(radians(fov/2.0)); }
 
 // Draw an untransformed rectangle covering the whole screen.
 // Get camera position and interpolated directions from the modelview matrix.
-void main() {
-  gl_Position = gl_Vertex;
-  eye = vec3(gl_ModelViewMatrix[3]);
+void main() {
+  screen = gl_Vertex.xy * tile_scale + tile_offset;
+  gl_Position = vec4(gl_Vertex.xy, 0, 1);
+  eye_offset = vec3(0);
+  view = gl_Vertex.z;
+  if (views > 1) {
+    screen.x = (screen.x + 1.0) * float(views) - 2.0*gl_Vertex.z - 1.0;
+    eye_offset = vec3(gl_ModelViewMatrix[0]) * (gl_Vertex.z - 0.5*float(views-1)) * eye_separation;
+  }
+  eye = vec3(gl_ModelViewMatrix[3]) + eye_offset;
   dir = vec3(gl_ModelViewMatrix * vec4(
-    fov2scale(fov_x)*gl_Vertex.x, fov2scale(fov_y)*gl_Vertex.y, 1, 0) );
+    fov2scale(fov_x)*screen.x, fov2scale(fov_y)*screen.y, 1, 0) );
 }
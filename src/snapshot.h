@@ -0,0 +1,61 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+// Lock-free publication of a state from one thread to another.
+//
+// Double buffering where neither side waits: there are three copies of the
+// state. The writer fills one, the reader uses one and the third is the
+// latest published one. Publishing swaps the writer's copy with the latest
+// one; reading swaps the reader's copy with the latest one if that is newer.
+// The reader always gets a complete state, and only the newest one.
+
+#include <stdlib.h>
+
+#ifdef _MSC_VER
+#include <windows.h>
+#define atomicExchange(p, v) InterlockedExchange((p), (v))
+#else
+#define atomicExchange(p, v) __atomic_exchange_n((p), (v), __ATOMIC_ACQ_REL)
+#endif
+
+#define SNAPSHOT_FRESH 4  // flag of Snapshot.latest: not read yet
+
+typedef struct Snapshot {
+  char* buffers;         // three copies of size bytes
+  int size;
+  int write, read;       // copies used by the writer and by the reader
+  long volatile latest;  // the latest published copy, | SNAPSHOT_FRESH
+} Snapshot;
+
+// Return 0 if out of memory.
+int initSnapshot(Snapshot* s, int size) {
+  s->buffers = calloc(3, size);
+  s->size = size;
+  s->write = 0;
+  s->read = 1;
+  s->latest = 2;
+  return s->buffers != 0;
+}
+
+void releaseSnapshot(Snapshot* s) {
+  free(s->buffers);
+  s->buffers = 0;
+}
+
+// The copy to fill before publishSnapshot(). It holds an older state, so it
+// must be filled completely.
+void* getSnapshotBuffer(Snapshot* s) {
+  return s->buffers + s->write * s->size;
+}
+
+void publishSnapshot(Snapshot* s) {
+  s->write = atomicExchange(&s->latest, s->write | SNAPSHOT_FRESH) & ~SNAPSHOT_FRESH;
+}
+
+// Get the latest published state. It stays valid until the next call.
+void const* readSnapshot(Snapshot* s) {
+  if (s->latest & SNAPSHOT_FRESH) s->read = atomicExchange(&s->latest, s->read) & ~SNAPSHOT_FRESH;
+  return s->buffers + s->read * s->size;
+}
+
+#endif  // SNAPSHOT_H
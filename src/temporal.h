@@ -0,0 +1,216 @@
+#ifndef TEMPORAL_H
+#define TEMPORAL_H
+
+// Temporal reprojection for deferred rendering.
+//
+// Between frames, most of the surface stays in view. Before the marching
+// pass, every pixel of the last G-buffer is turned back into the point it has
+// hit, which is drawn as a point at its place in the current view. Where
+// points land, the starts texture gets the distance to the nearest one (as
+// 1/(1 + distance)) and its steps; a depth test keeps the nearest point, so
+// both come from the same one. Rays can start a bit closer than that instead of
+// marching through all the empty space again. The shader checks that the
+// start is outside the fractal, and newly visible parts get no points, so
+// they are marched in full. A surface that came in front of the start isn't
+// seen that way, so every frame one pixel in TEMPORAL_REFRESH is marched in
+// full, in turns (see getTemporalPhase()).
+//
+// The glow counts all steps from the camera. The points carry the steps
+// before those marched in the last frame (the G-buffer steps minus the
+// marched ones), which a full march counts again up to the start.
+//
+// Reprojection is only valid while nothing but the camera changes; call
+// resetTemporal() otherwise. Needs texture lookups in vertex shaders.
+
+#include <stdlib.h>
+#include <string.h>
+#include "shader_procs.h"
+#include "render_target.h"
+#include "gbuffer.h"
+
+// The starts texture is bound to this unit for the marching pass, after the
+// G-buffer.
+#define TEMPORAL_TEXTURE_UNIT (GBUFFER_TEXTURE_UNIT + GBUFFER_SHADE)
+
+// Every pixel is marched in full once in this many frames (as in the shader).
+#define TEMPORAL_REFRESH 8
+
+// Move the pixels of a march result (laid out as the G-buffer: distance,
+// steps, last distance estimate and the steps not to carry over) to where
+// the camera of the modelview matrix sees them.
+static char const temporal_splat_vs[] =
+  "uniform sampler2D march;"
+  "uniform mat4 march_camera;"
+  "uniform vec2 march_scale,scale;"  // tan(fov/2), of the march result and now
+  "varying vec2 value;"
+  "void main(){"
+    "vec2 uv=gl_Vertex.xy;"
+    "vec4 g=texture2DLod(march,uv,0.0);"
+    "vec2 s=uv*2.0-1.0;"
+    "vec3 dp=normalize(vec3(march_camera*vec4(s*march_scale,1,0)));"
+    "vec3 v=vec3(march_camera[3])+g.x*dp-vec3(gl_ModelViewMatrix[3]);"
+    "vec3 c=vec3(dot(v,vec3(gl_ModelViewMatrix[0])),"
+      "dot(v,vec3(gl_ModelViewMatrix[1])),"
+      "dot(v,vec3(gl_ModelViewMatrix[2])));"
+    "value=vec2(1.0/(1.0+length(v)),g.y-g.w);"
+    "gl_Position=vec4(c.xy/(c.z*scale),1.0-2.0*value.x,1);"
+    "if(c.z<=0.0||g.z>=4.0)gl_Position=vec4(2,2,0,1);"  // clipped, or background (MAX_DIST)
+  "}";
+
+static char const temporal_splat_fs[] =
+  "varying vec2 value;"
+  "void main(){gl_FragColor=vec4(value,0,0);}";
+
+typedef struct Temporal {
+  int enabled;
+  int width, height;
+  RenderTarget starts;  // 1/(1 + distance), steps to the nearest point in each pixel
+  GLuint depth;         // depth texture of starts
+  GLuint splat;
+  GLuint points;        // buffer with the texture coordinates of the pixels
+  int valid;            // the last G-buffer can be reprojected
+  float camera[16];     // of the last frame
+  float scale[2];
+  int frame;            // counts beginTemporal()
+} Temporal;
+
+// Make |target| a width x height target for starts, with a depth texture
+// |depth| for the depth test. Return 0 if it isn't supported.
+int initStartsTarget(RenderTarget* target, GLuint* depth, int width, int height) {
+  GLenum status = 0;
+
+  if (initRenderTarget(target, width, height, GL_RGBA32F, GL_NEAREST)) {
+    glGenTextures(1, depth);
+    glBindTexture(GL_TEXTURE_2D, *depth);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT24, width, height, 0, GL_DEPTH_COMPONENT, GL_UNSIGNED_INT, 0);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    glBindFramebuffer(GL_FRAMEBUFFER, target->fbo);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, *depth, 0);
+    status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+  }
+  return status == GL_FRAMEBUFFER_COMPLETE;
+}
+
+// Make a buffer with the texture coordinates of the pixels of a width x
+// height texture, to draw them as points. Return 0 if there is no memory.
+GLuint initSplatPoints(int width, int height) {
+  float* points = malloc((size_t)width * height * 2 * sizeof(float));
+  GLuint buffer = 0;
+  int x, y;
+
+  if (!points) return 0;
+  for (y=0; y<height; y++) {
+    for (x=0; x<width; x++) {
+      points[2 * (y*width + x)] = (x + 0.5f) / width;
+      points[2 * (y*width + x) + 1] = (y + 0.5f) / height;
+    }
+  }
+  glGenBuffers(1, &buffer);
+  glBindBuffer(GL_ARRAY_BUFFER, buffer);
+  glBufferData(GL_ARRAY_BUFFER, (size_t)width * height * 2 * sizeof(float), points, GL_STATIC_DRAW);
+  glBindBuffer(GL_ARRAY_BUFFER, 0);
+  free(points);
+  return buffer;
+}
+
+// Draw the |count| pixels in |points| of the march result |march|, seen by
+// |camera| with tan(fov/2) |marchScale|, with the |splat| program into the
+// bound starts target, where the current camera (with tan(fov/2) scaleX,
+// scaleY) sees them. The depth test keeps the nearest point in each pixel.
+void splatStarts(GLuint splat, GLuint points, int count, GLuint march, float const camera[16],
+                 float const marchScale[2], float scaleX, float scaleY) {
+  glUseProgram(splat);
+  glBindTexture(GL_TEXTURE_2D, march);
+  glUniform1i(glGetUniformLocation(splat, "march"), 0);
+  glUniformMatrix4fv(glGetUniformLocation(splat, "march_camera"), 1, GL_FALSE, camera);
+  glUniform2f(glGetUniformLocation(splat, "march_scale"), marchScale[0], marchScale[1]);
+  glUniform2f(glGetUniformLocation(splat, "scale"), scaleX, scaleY);
+
+  glEnable(GL_DEPTH_TEST);
+  glDepthFunc(GL_LESS);
+  glBindBuffer(GL_ARRAY_BUFFER, points);
+  glVertexPointer(2, GL_FLOAT, 0, 0);
+  glEnableClientState(GL_VERTEX_ARRAY);
+  glDrawArrays(GL_POINTS, 0, count);
+  glDisableClientState(GL_VERTEX_ARRAY);
+  glBindBuffer(GL_ARRAY_BUFFER, 0);
+  glDisable(GL_DEPTH_TEST);
+  glBindTexture(GL_TEXTURE_2D, 0);
+}
+
+void releaseTemporal(Temporal* t) {
+  if (!t->enabled) return;
+  releaseRenderTarget(&t->starts);
+  if (t->depth) glDeleteTextures(1, &t->depth);
+  glDeleteProgram(t->splat);
+  glDeleteBuffers(1, &t->points);
+  memset(t, 0, sizeof(Temporal));
+}
+
+// Set up reprojection of a width x height G-buffer. Return 0 if it isn't
+// supported (needs framebuffer objects, float and depth textures, buffer
+// objects and texture lookups in vertex shaders).
+int initTemporal(Temporal* t, int width, int height) {
+  GLint units = 0;
+
+  memset(t, 0, sizeof(Temporal));
+  glGetIntegerv(GL_MAX_VERTEX_TEXTURE_IMAGE_UNITS, &units);
+  if (units < 1 || !enableFramebufferProcs() || !enableBufferProcs()) return 0;
+
+  t->enabled = 1;
+  t->width = width;
+  t->height = height;
+
+  if (!initStartsTarget(&t->starts, &t->depth, width, height) ||
+      !(t->splat = compileProgram(temporal_splat_vs, temporal_splat_fs)) ||
+      !(t->points = initSplatPoints(width, height))) {
+    releaseTemporal(t);
+    return 0;
+  }
+  return 1;
+}
+
+// Don't reproject the last frame, for example after the parameters have changed.
+void resetTemporal(Temporal* t) {
+  t->valid = 0;
+}
+
+// Make the starts texture for the current camera (the modelview matrix) and
+// bind it, from the last G-buffer (the |gbuffer| texture). The camera and
+// tan(fov/2) are kept for the next frame, whose G-buffer will be reprojected.
+void beginTemporal(Temporal* t, GLuint gbuffer, float const camera[16], float scaleX, float scaleY) {
+  bindRenderTarget(&t->starts);
+  glClearColor(0, 0, 0, 0);
+  glClearDepth(1);
+  glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+
+  if (t->valid) splatStarts(t->splat, t->points, t->width * t->height, gbuffer, t->camera, t->scale, scaleX, scaleY);
+
+  memcpy(t->camera, camera, sizeof(t->camera));
+  t->scale[0] = scaleX;
+  t->scale[1] = scaleY;
+  t->valid = 1;
+  t->frame++;
+
+  glActiveTexture(GL_TEXTURE0 + TEMPORAL_TEXTURE_UNIT);
+  glBindTexture(GL_TEXTURE_2D, t->starts.texture);
+  glActiveTexture(GL_TEXTURE0);
+}
+
+// The pixels marched in full in this frame: those with x + 3y = phase
+// (mod TEMPORAL_REFRESH).
+int getTemporalPhase(Temporal const* t) {
+  return t->frame % TEMPORAL_REFRESH;
+}
+
+// Unbind the starts texture after the marching pass.
+void endTemporal(void) {
+  glActiveTexture(GL_TEXTURE0 + TEMPORAL_TEXTURE_UNIT);
+  glBindTexture(GL_TEXTURE_2D, 0);
+  glActiveTexture(GL_TEXTURE0);
+}
+
+#endif  // TEMPORAL_H
@@ -0,0 +1,176 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+// A pool of worker threads that run a batch of numbered jobs.
+//
+// Every worker has its own range of jobs. It takes jobs from the front of
+// its range; when the range is empty, it steals a job from the back of the
+// busiest other worker. runThreadPool() returns when all jobs are done.
+
+#include <stdlib.h>
+#include <SDL/SDL.h>
+#include <SDL/SDL_thread.h>
+
+#if (defined __WIN32__)
+  #include <windows.h>
+#else
+  #include <unistd.h>
+#endif
+
+// Return the number of processors. Return 1 if unknown.
+int getCpuCount(void) {
+#if (defined __WIN32__)
+  SYSTEM_INFO info;
+  GetSystemInfo(&info);
+  return info.dwNumberOfProcessors > 0 ? info.dwNumberOfProcessors : 1;
+#elif (defined _SC_NPROCESSORS_ONLN)
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+  return n > 0 ? n : 1;
+#else
+  return 1;
+#endif
+}
+
+typedef void (*ThreadPoolJob)(void* context, int job, int worker);
+
+typedef struct ThreadPoolWorker {
+  struct ThreadPool* pool;
+  SDL_Thread* thread;
+  SDL_mutex* lock;
+  int head, tail;  // jobs [head, tail) are waiting
+  int index;
+} ThreadPoolWorker;
+
+typedef struct ThreadPool {
+  int threads;
+  ThreadPoolWorker* workers;
+
+  SDL_mutex* run;  // one batch at a time, callers can be on different threads
+  SDL_mutex* lock;
+  SDL_cond* wake;      // signalled when a batch starts or the pool quits
+  SDL_cond* finished;  // signalled when the last worker finishes a batch
+  int batch, running, quit;
+
+  ThreadPoolJob job;
+  void* context;
+} ThreadPool;
+
+// Take a job from the front of our own range or steal one from the back of
+// the fullest other range. Return -1 if there is nothing left.
+int takeThreadPoolJob(ThreadPoolWorker* w) {
+  ThreadPool* pool = w->pool;
+  int job = -1, i;
+
+  SDL_LockMutex(w->lock);
+  if (w->head < w->tail) job = w->head++;
+  SDL_UnlockMutex(w->lock);
+
+  while (job < 0) {
+    ThreadPoolWorker* victim = 0;
+    int most = 0;
+    for (i=0; i<pool->threads; i++) {
+      ThreadPoolWorker* other = &pool->workers[i];
+      int left;
+      SDL_LockMutex(other->lock);
+      left = other->tail - other->head;
+      SDL_UnlockMutex(other->lock);
+      if (left > most) { most = left; victim = other; }
+    }
+    if (!victim) break;
+
+    SDL_LockMutex(victim->lock);
+    if (victim->head < victim->tail) job = --victim->tail;
+    SDL_UnlockMutex(victim->lock);
+  }
+  return job;
+}
+
+int threadPoolWorkerMain(void* arg) {
+  ThreadPoolWorker* w = arg;
+  ThreadPool* pool = w->pool;
+  int batch = 0;
+
+  for (;;) {
+    int job;
+
+    SDL_LockMutex(pool->lock);
+    while (!pool->quit && pool->batch == batch) SDL_CondWait(pool->wake, pool->lock);
+    if (pool->quit) { SDL_UnlockMutex(pool->lock); break; }
+    batch = pool->batch;
+    SDL_UnlockMutex(pool->lock);
+
+    while ((job = takeThreadPoolJob(w)) >= 0) pool->job(pool->context, job, w->index);
+
+    SDL_LockMutex(pool->lock);
+    if (--pool->running == 0) SDL_CondSignal(pool->finished);
+    SDL_UnlockMutex(pool->lock);
+  }
+  return 0;
+}
+
+// Start a pool of worker threads. If threads < 1, use one per processor.
+ThreadPool* createThreadPool(int threads) {
+  ThreadPool* pool = calloc(1, sizeof(ThreadPool));
+  int i;
+
+  if (threads < 1) threads = getCpuCount();
+  pool->threads = threads;
+  pool->workers = calloc(threads, sizeof(ThreadPoolWorker));
+  pool->run = SDL_CreateMutex();
+  pool->lock = SDL_CreateMutex();
+  pool->wake = SDL_CreateCond();
+  pool->finished = SDL_CreateCond();
+
+  for (i=0; i<threads; i++) {
+    ThreadPoolWorker* w = &pool->workers[i];
+    w->pool = pool;
+    w->index = i;
+    w->lock = SDL_CreateMutex();
+    w->thread = SDL_CreateThread(threadPoolWorkerMain, w);
+  }
+  return pool;
+}
+
+// Run job(context, 0..jobs-1, worker) on the pool and wait until all jobs are done.
+void runThreadPool(ThreadPool* pool, int jobs, ThreadPoolJob job, void* context) {
+  int i;
+
+  SDL_LockMutex(pool->run);
+  SDL_LockMutex(pool->lock);
+  pool->job = job;
+  pool->context = context;
+  for (i=0; i<pool->threads; i++) {
+    pool->workers[i].head = (long long)jobs * i / pool->threads;
+    pool->workers[i].tail = (long long)jobs * (i+1) / pool->threads;
+  }
+  pool->running = pool->threads;
+  pool->batch++;
+  SDL_CondBroadcast(pool->wake);
+  while (pool->running > 0) SDL_CondWait(pool->finished, pool->lock);
+  SDL_UnlockMutex(pool->lock);
+  SDL_UnlockMutex(pool->run);
+}
+
+// Stop the worker threads and free the pool.
+void destroyThreadPool(ThreadPool* pool) {
+  int i;
+  if (!pool) return;
+
+  SDL_LockMutex(pool->lock);
+  pool->quit = 1;
+  SDL_CondBroadcast(pool->wake);
+  SDL_UnlockMutex(pool->lock);
+
+  for (i=0; i<pool->threads; i++) {
+    SDL_WaitThread(pool->workers[i].thread, 0);
+    SDL_DestroyMutex(pool->workers[i].lock);
+  }
+  SDL_DestroyCond(pool->finished);
+  SDL_DestroyCond(pool->wake);
+  SDL_DestroyMutex(pool->lock);
+  SDL_DestroyMutex(pool->run);
+  free(pool->workers);
+  free(pool);
+}
+
+#endif  // THREAD_POOL_H
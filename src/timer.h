@@ -0,0 +1,27 @@
+#ifndef TIMER_H
+#define TIMER_H
+
+// High resolution time. SDL_GetTicks() has only milliseconds.
+
+#if (defined __WIN32__)
+  #include <windows.h>
+#else
+  #include <time.h>
+#endif
+
+// Return the time in seconds since an arbitrary point.
+double getTimerSeconds(void) {
+#if (defined __WIN32__)
+  static LARGE_INTEGER frequency;
+  LARGE_INTEGER t;
+  if (!frequency.QuadPart) QueryPerformanceFrequency(&frequency);
+  QueryPerformanceCounter(&t);
+  return (double)t.QuadPart / frequency.QuadPart;
+#else
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec * 1e-9;
+#endif
+}
+
+#endif  // TIMER_H
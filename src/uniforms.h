@@ -0,0 +1,109 @@
+#ifndef UNIFORMS_H
+#define UNIFORMS_H
+
+// Uniform upload cache.
+//
+// The locations of the uniforms of a program are looked up once, after it is
+// linked. Setting a uniform only stores the value and marks the uniform dirty
+// if the value differs from the one last uploaded; flushUniforms() uploads the
+// dirty ones, right before drawing. So parameters that haven't changed since
+// the last frame cost no OpenGL calls, a value that is set several times
+// before a draw is uploaded once, and uniforms that aren't in the program
+// (or were optimized out) cost nothing.
+
+#include <stdlib.h>
+#include <string.h>
+#include "shader_procs.h"
+
+#define UNIFORM_MAX_FLOATS 20  // vec2[10]
+
+enum { UNIFORM_1F, UNIFORM_1I, UNIFORM_2F, UNIFORM_3F };
+
+typedef struct Uniform {
+  GLint location;   // -1: not in the program
+  int type, count;  // of the value; count > 1 for arrays
+  int dirty;
+  GLfloat value[UNIFORM_MAX_FLOATS];     // ints are stored bit for bit
+  GLfloat uploaded[UNIFORM_MAX_FLOATS];  // the value in the program
+  int size;         // floats in uploaded, 0 if nothing has been uploaded
+} Uniform;
+
+typedef struct UniformCache {
+  GLuint program;
+  Uniform* uniforms;
+  int count;
+} UniformCache;
+
+// OpenGL calls made by all caches, for statistics.
+int uniformLookups, uniformUploads;
+
+// Look up the uniforms |names| of a linked program. Uniform i gets names[i].
+void initUniformCache(UniformCache* u, GLuint program, char const* const* names, int count) {
+  int i;
+  memset(u, 0, sizeof(UniformCache));
+  u->program = program;
+  u->count = count;
+  u->uniforms = calloc(count, sizeof(Uniform));
+  for (i=0; i<count; i++) {
+    u->uniforms[i].location = program ? glGetUniformLocation(program, names[i]) : -1;
+    uniformLookups++;
+  }
+}
+
+void releaseUniformCache(UniformCache* u) {
+  free(u->uniforms);
+  memset(u, 0, sizeof(UniformCache));
+}
+
+// Set uniform i to |count| elements of |type| (size floats in all).
+static void setUniformValue(UniformCache* u, int i, int type, int count, void const* value, int size) {
+  Uniform* x = &u->uniforms[i];
+  if (!u->uniforms || x->location < 0) return;
+  x->type = type;
+  x->count = count;
+  memcpy(x->value, value, size * sizeof(GLfloat));
+  x->dirty = x->size != size || memcmp(x->uploaded, value, size * sizeof(GLfloat));
+}
+
+void setUniform1f(UniformCache* u, int i, float v) {
+  setUniformValue(u, i, UNIFORM_1F, 1, &v, 1);
+}
+
+void setUniform1i(UniformCache* u, int i, int v) {
+  setUniformValue(u, i, UNIFORM_1I, 1, &v, 1);
+}
+
+void setUniform2f(UniformCache* u, int i, float x, float y) {
+  float v[2] = { x, y };
+  setUniformValue(u, i, UNIFORM_2F, 1, v, 2);
+}
+
+void setUniform2fv(UniformCache* u, int i, int count, float const* v) {
+  setUniformValue(u, i, UNIFORM_2F, count, v, 2 * count);
+}
+
+void setUniform3fv(UniformCache* u, int i, float const* v) {
+  setUniformValue(u, i, UNIFORM_3F, 1, v, 3);
+}
+
+// Upload the dirty uniforms. The program must be in use.
+void flushUniforms(UniformCache* u) {
+  int i;
+  for (i=0; i<u->count; i++) {
+    Uniform* x = &u->uniforms[i];
+    int size;
+    if (!x->dirty) continue;
+    switch (x->type) {
+      case UNIFORM_1F: glUniform1f(x->location, x->value[0]); size = 1; break;
+      case UNIFORM_1I: { GLint v; memcpy(&v, x->value, sizeof(v)); glUniform1i(x->location, v); size = 1; } break;
+      case UNIFORM_2F: glUniform2fv(x->location, x->count, x->value); size = 2 * x->count; break;
+      default:         glUniform3fv(x->location, x->count, x->value); size = 3 * x->count; break;
+    }
+    memcpy(x->uploaded, x->value, size * sizeof(GLfloat));
+    x->size = size;
+    x->dirty = 0;
+    uniformUploads++;
+  }
+}
+
+#endif  // UNIFORMS_H
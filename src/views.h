@@ -0,0 +1,140 @@
+#ifndef VIEWS_H
+#define VIEWS_H
+
+// Start reuse between multi-view views.
+//
+// The views of a frame see mostly the same surface, from eyes a little
+// apart. Before the main pass, the rays of the first view are marched by
+// themselves (the fragment shader compiled with VIEW_PREPASS), and the main
+// pass shades that view from the result without marching it again. Every
+// pixel of it is also turned into the point it has hit, which is drawn into
+// the other views' columns of a starts texture, as in temporal reprojection
+// (see temporal.h). Rays of those views start a bit closer than the nearest
+// point around them, unless that's inside the fractal, and only march the
+// rest of the way. Parts the first view doesn't see get no points, so they
+// are marched in full.
+//
+// The starts are for one camera and set of parameters; make them again when
+// anything changes. Needs texture lookups in vertex shaders.
+//
+// While the camera moves this doesn't pay: the cone prepass already takes all
+// views most of the way, the rest is mostly fine detail and rays grazing the
+// fractal that the first view can't vouch for, and the splat costs about as
+// much as is saved. Still frames are drawn over and over from the same starts,
+// though, and then the first view is only shaded. The main pass that uses
+// them is the fragment shader compiled with VIEW_STARTS, so the one for
+// moving frames carries none of this.
+
+#include <string.h>
+#include "shader_procs.h"
+#include "render_target.h"
+#include "gbuffer.h"
+#include "temporal.h"
+
+// Rays start this fraction of the distance closer than the surface the
+// first view has seen.
+#define VIEW_START_BACKOFF 0.01f
+
+typedef struct ViewStarts {
+  int enabled;
+  int views;
+  int width, height;    // of a view
+  RenderTarget march;   // the first view's rays, laid out as the G-buffer
+  RenderTarget starts;  // 1/(1 + distance), steps to the nearest point, views side by side
+  GLuint depth;         // depth texture of starts
+  GLuint splat;
+  GLuint points;        // buffer with the texture coordinates of the pixels of march
+  int valid;            // the starts are for the current frame
+} ViewStarts;
+
+void releaseViewStarts(ViewStarts* v) {
+  if (!v->enabled) return;
+  releaseRenderTarget(&v->march);
+  releaseRenderTarget(&v->starts);
+  if (v->depth) glDeleteTextures(1, &v->depth);
+  glDeleteProgram(v->splat);
+  glDeleteBuffers(1, &v->points);
+  memset(v, 0, sizeof(ViewStarts));
+}
+
+// Set up start reuse for |views| views of width x height pixels. Return 0 if
+// it isn't supported (needs what temporal reprojection does).
+int initViewStarts(ViewStarts* v, int views, int width, int height) {
+  GLint units = 0;
+
+  memset(v, 0, sizeof(ViewStarts));
+  glGetIntegerv(GL_MAX_VERTEX_TEXTURE_IMAGE_UNITS, &units);
+  if (units < 1 || !enableFramebufferProcs() || !enableBufferProcs()) return 0;
+
+  v->enabled = 1;
+  v->views = views;
+  v->width = width;
+  v->height = height;
+
+  if (!initRenderTarget(&v->march, width, height, GL_RGBA32F, GL_NEAREST) ||
+      !initStartsTarget(&v->starts, &v->depth, views * width, height) ||
+      !(v->splat = compileProgram(temporal_splat_vs, temporal_splat_fs)) ||
+      !(v->points = initSplatPoints(width, height))) {
+    releaseViewStarts(v);
+    return 0;
+  }
+  return 1;
+}
+
+// Get the camera of view |i| of |views|: |camera| moved along its x axis by
+// |eyeSeparation| per view, centered on it, as in the vertex shader.
+void getViewCamera(float eye[16], float const camera[16], int views, int i, float eyeSeparation) {
+  float offset = (i - 0.5f*(views-1)) * eyeSeparation;
+  int j;
+
+  memcpy(eye, camera, 16 * sizeof(float));
+  for (j=0; j<3; j++) eye[12+j] += camera[j] * offset;
+}
+
+// Make the starts texture from the march target, which has the rays of the
+// first view marched. Each other view gets the points in its column, seen
+// from its eye. |camera| is the camera of the frame, with tan(fov/2) scaleX,
+// scaleY for all views.
+void splatViewStarts(ViewStarts* v, float const camera[16], float eyeSeparation, float scaleX, float scaleY) {
+  float first[16], eye[16], scale[2];
+  int i;
+
+  scale[0] = scaleX;
+  scale[1] = scaleY;
+  getViewCamera(first, camera, v->views, 0, eyeSeparation);
+  bindRenderTarget(&v->starts);
+  glClearColor(0, 0, 0, 0);
+  glClearDepth(1);
+  glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+
+  glPushMatrix();
+  for (i=1; i<v->views; i++) {
+    getViewCamera(eye, camera, v->views, i, eyeSeparation);
+    glLoadMatrixf(eye);
+    glViewport(i * v->width, 0, v->width, v->height);
+    splatStarts(v->splat, v->points, v->width * v->height, v->march.texture, first, scale, scaleX, scaleY);
+  }
+  glPopMatrix();
+  bindRenderTarget(0);
+}
+
+// Bind the march target as the G-buffer and the starts texture for the main
+// pass.
+void bindViewStarts(ViewStarts const* v) {
+  glActiveTexture(GL_TEXTURE0 + GBUFFER_TEXTURE_UNIT + GBUFFER_MARCH);
+  glBindTexture(GL_TEXTURE_2D, v->march.texture);
+  glActiveTexture(GL_TEXTURE0 + TEMPORAL_TEXTURE_UNIT);
+  glBindTexture(GL_TEXTURE_2D, v->starts.texture);
+  glActiveTexture(GL_TEXTURE0);
+}
+
+// Unbind them after the main pass.
+void unbindViewStarts(void) {
+  glActiveTexture(GL_TEXTURE0 + GBUFFER_TEXTURE_UNIT + GBUFFER_MARCH);
+  glBindTexture(GL_TEXTURE_2D, 0);
+  glActiveTexture(GL_TEXTURE0 + TEMPORAL_TEXTURE_UNIT);
+  glBindTexture(GL_TEXTURE_2D, 0);
+  glActiveTexture(GL_TEXTURE0);
+}
+
+#endif  // VIEWS_H